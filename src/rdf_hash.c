@@ -54,6 +54,16 @@ static void librdf_delete_hash_factories(librdf_world *world);
 static void librdf_init_hash_datums(librdf_world *world);
 static void librdf_free_hash_datums(librdf_world *world);
 
+/* prototypes for the optional Bloom filter of key/value pairs */
+static char* librdf_hash_filter_file(librdf_hash* hash);
+static void librdf_hash_filter_open(librdf_hash* hash, int is_writable, int is_new, librdf_hash* options);
+static void librdf_hash_filter_remove(librdf_hash* hash);
+static int librdf_hash_filter_rebuild(librdf_hash* hash, size_t capacity);
+static void librdf_hash_filter_add(librdf_hash* hash, librdf_hash_datum *key, librdf_hash_datum *value);
+static void librdf_hash_filter_grow(librdf_hash* hash);
+static int librdf_hash_filter_sync(librdf_hash* hash);
+static void librdf_hash_filter_close(librdf_hash* hash);
+
 
 /* prototypes for iterator for getting all keys and values */
 static int librdf_hash_get_all_iterator_is_end(void* iterator);
@@ -93,6 +103,15 @@ librdf_init_hash(librdf_world *world)
   librdf_init_hash_tokyodb(world);
 #endif
 
+#ifdef HAVE_MMAP_HASH
+  librdf_init_hash_mmap(world);
+#endif
+
+  /* wraps the persistent hashes registered above */
+  librdf_init_hash_cached(world);
+
+  librdf_init_hash_memory2(world);
+
   /* Always have hash in memory implementation available */
   librdf_init_hash_memory(world);
 }
@@ -133,10 +152,144 @@ librdf_delete_hash_factories(librdf_world *world)
 
 /* hash datums structures */
 
+#ifdef WITH_THREADS
+/*
+ * With threads, each thread keeps a small private cache of free datums
+ * per world so that allocating and freeing datums during iteration does
+ * not serialise readers.  Datums beyond the cache size are spilled as a
+ * whole list onto the world overflow stack (world->hash_datums_list)
+ * which threads only ever push to or empty completely, so it can be
+ * maintained with compare and swap alone and is not subject to ABA.
+ * The world mutex is only taken when a thread cache is created or
+ * destroyed.
+ */
+typedef struct librdf_hash_datum_cache_s {
+  librdf_world* world;
+  librdf_hash_datum* list;
+  int count;
+  struct librdf_hash_datum_cache_s* next;
+} librdf_hash_datum_cache;
+
+/* maximum number of free datums kept by one thread */
+static const int librdf_hash_datum_cache_size = 64;
+
+
+/* push the list first..last onto the world overflow stack */
+static void
+librdf_hash_datums_push(librdf_world* world, 
+                        librdf_hash_datum* first, librdf_hash_datum* last)
+{
+#ifdef HAVE_SYNC_BUILTINS
+  librdf_hash_datum* head;
+
+  do {
+    head = world->hash_datums_list;
+    last->next = head;
+  } while(!__sync_bool_compare_and_swap(&world->hash_datums_list, head, first));
+#else
+  pthread_mutex_lock(world->hash_datums_mutex);
+  last->next = world->hash_datums_list;
+  world->hash_datums_list = first;
+  pthread_mutex_unlock(world->hash_datums_mutex);
+#endif
+}
+
+
+/* take the entire world overflow stack */
+static librdf_hash_datum*
+librdf_hash_datums_take_all(librdf_world* world)
+{
+  librdf_hash_datum* head;
+
+#ifdef HAVE_SYNC_BUILTINS
+  do {
+    head = world->hash_datums_list;
+    if(!head)
+      break;
+  } while(!__sync_bool_compare_and_swap(&world->hash_datums_list, head, NULL));
+#else
+  pthread_mutex_lock(world->hash_datums_mutex);
+  head = world->hash_datums_list;
+  world->hash_datums_list = NULL;
+  pthread_mutex_unlock(world->hash_datums_mutex);
+#endif
+
+  return head;
+}
+
+
+/* thread exit destructor for a thread's datum cache */
+static void
+librdf_hash_datum_cache_destroy(void* data)
+{
+  librdf_hash_datum_cache* cache = (librdf_hash_datum_cache*)data;
+  librdf_world* world = cache->world;
+  librdf_hash_datum_cache** cachep;
+  librdf_hash_datum* last;
+
+  if(cache->list) {
+    for(last = cache->list; last->next; last = last->next)
+      ;
+    librdf_hash_datums_push(world, cache->list, last);
+  }
+
+  pthread_mutex_lock(world->hash_datums_mutex);
+  for(cachep = &world->hash_datums_caches; *cachep; cachep = &(*cachep)->next) {
+    if(*cachep == cache) {
+      *cachep = cache->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(world->hash_datums_mutex);
+
+  LIBRDF_FREE(librdf_hash_datum_cache, cache);
+}
+
+
+/* get the calling thread's datum cache, creating it if needed */
+static librdf_hash_datum_cache*
+librdf_hash_datum_get_cache(librdf_world* world)
+{
+  librdf_hash_datum_cache* cache;
+
+  if(!world->hash_datums_key_created)
+    return NULL;
+
+  cache = (librdf_hash_datum_cache*)pthread_getspecific(world->hash_datums_key);
+  if(cache)
+    return cache;
+
+  cache = LIBRDF_CALLOC(librdf_hash_datum_cache*, 1, sizeof(*cache));
+  if(!cache)
+    return NULL;
+  cache->world = world;
+
+  if(pthread_setspecific(world->hash_datums_key, cache)) {
+    LIBRDF_FREE(librdf_hash_datum_cache, cache);
+    return NULL;
+  }
+
+  pthread_mutex_lock(world->hash_datums_mutex);
+  cache->next = world->hash_datums_caches;
+  world->hash_datums_caches = cache;
+  pthread_mutex_unlock(world->hash_datums_mutex);
+
+  return cache;
+}
+#endif
+
+
 static void
 librdf_init_hash_datums(librdf_world *world)
 {
   world->hash_datums_list=NULL;
+
+#ifdef WITH_THREADS
+  world->hash_datums_caches = NULL;
+  world->hash_datums_key_created = 
+    !pthread_key_create(&world->hash_datums_key,
+                        librdf_hash_datum_cache_destroy);
+#endif
 }
 
 
@@ -144,10 +297,27 @@ static void
 librdf_free_hash_datums(librdf_world *world)
 {
   librdf_hash_datum *datum, *next;
-  
 #ifdef WITH_THREADS
+  librdf_hash_datum_cache *cache, *next_cache;
+
+  /* no destructors run after this, so free all thread caches here */
+  if(world->hash_datums_key_created) {
+    pthread_key_delete(world->hash_datums_key);
+    world->hash_datums_key_created = 0;
+  }
+
   if(world->hash_datums_mutex)
     pthread_mutex_lock(world->hash_datums_mutex);
+
+  for(cache = world->hash_datums_caches; cache; cache = next_cache) {
+    next_cache = cache->next;
+    for(datum = cache->list; datum; datum = next) {
+      next = datum->next;
+      LIBRDF_FREE(librdf_hash_datum, datum);
+    }
+    LIBRDF_FREE(librdf_hash_datum_cache, cache);
+  }
+  world->hash_datums_caches = NULL;
 #endif
 
   for(datum = world->hash_datums_list; datum; datum = next) {
@@ -177,26 +347,41 @@ librdf_hash_datum*
 librdf_new_hash_datum(librdf_world *world, void *data, size_t size)
 {
   librdf_hash_datum *datum;
+#ifdef WITH_THREADS
+  librdf_hash_datum_cache *cache;
+#endif
 
   librdf_world_open(world);
 
 #ifdef WITH_THREADS
-  pthread_mutex_lock(world->hash_datums_mutex);
-#endif
-
+  /* get one from this thread's cache, refilling it from the overflow
+   * stack when empty, else allocate a new one */
+  datum = NULL;
+  cache = librdf_hash_datum_get_cache(world);
+  if(cache) {
+    if(!cache->list) {
+      cache->list = librdf_hash_datums_take_all(world);
+      cache->count = 0;
+      for(datum = cache->list; datum; datum = datum->next)
+        cache->count++;
+    }
+    if((datum = cache->list)) {
+      cache->list = datum->next;
+      cache->count--;
+    }
+  }
+#else
   /* get one from free list, or allocate new one */ 
-  if((datum = world->hash_datums_list)) {
+  if((datum = world->hash_datums_list))
     world->hash_datums_list = datum->next;
-  } else {
+#endif
+
+  if(!datum) {
     datum = LIBRDF_CALLOC(librdf_hash_datum*, 1, sizeof(*datum));
     if(datum)
       datum->world = world;
   }
 
-#ifdef WITH_THREADS
-   pthread_mutex_unlock(world->hash_datums_mutex);
-#endif
-
   if(datum) {
     datum->data = data;
     datum->size = size;
@@ -216,6 +401,11 @@ librdf_new_hash_datum(librdf_world *world, void *data, size_t size)
 void
 librdf_free_hash_datum(librdf_hash_datum *datum) 
 {
+#ifdef WITH_THREADS
+  librdf_hash_datum_cache *cache;
+  librdf_hash_datum *last;
+#endif
+
   if(!datum)
     return;
   
@@ -228,18 +418,168 @@ librdf_free_hash_datum(librdf_hash_datum *datum)
   }
 
 #ifdef WITH_THREADS
-  pthread_mutex_lock(datum->world->hash_datums_mutex);
-#endif
+  cache = librdf_hash_datum_get_cache(datum->world);
+  if(!cache) {
+    librdf_hash_datums_push(datum->world, datum, datum);
+    return;
+  }
+
+  /* spill a full cache to the overflow stack in one go */
+  if(cache->count >= librdf_hash_datum_cache_size) {
+    for(last = cache->list; last->next; last = last->next)
+      ;
+    librdf_hash_datums_push(datum->world, cache->list, last);
+    cache->list = NULL;
+    cache->count = 0;
+  }
 
+  datum->next = cache->list;
+  cache->list = datum;
+  cache->count++;
+#else
   datum->next = datum->world->hash_datums_list;
   datum->world->hash_datums_list = datum;
+#endif
+}
 
-#ifdef WITH_THREADS
-  pthread_mutex_unlock(datum->world->hash_datums_mutex);
+
+/* word at a time key hash - after wyhash by Wang Yi (public domain) */
+
+#define LIBRDF_HASH_U64(hi, lo) ((((u64)(hi)) << 32) | (u64)(lo))
+
+#define LIBRDF_HASH_WORD_P0 LIBRDF_HASH_U64(0xa0761d64UL, 0x78bd642fUL)
+#define LIBRDF_HASH_WORD_P1 LIBRDF_HASH_U64(0xe7037ed1UL, 0xa0b428dbUL)
+#define LIBRDF_HASH_WORD_P2 LIBRDF_HASH_U64(0x8ebc6af0UL, 0x9c88c6e3UL)
+#define LIBRDF_HASH_WORD_P3 LIBRDF_HASH_U64(0x589965ccUL, 0x75374cc3UL)
+
+
+/* multiply a and b to 128 bits, returning the low half in a and the
+ * high half in b */
+static void
+librdf_hash_word_mum(u64 *a, u64 *b)
+{
+#ifdef __SIZEOF_INT128__
+  __uint128_t r=*a;
+
+  r*=*b;
+  *a=(u64)r;
+  *b=(u64)(r >> 64);
+#else
+  u64 ha=*a >> 32, hb=*b >> 32;
+  u64 la=*a & 0xffffffffUL, lb=*b & 0xffffffffUL;
+  u64 rh=ha * hb, rm0=ha * lb, rm1=hb * la, rl=la * lb;
+  u64 t=rl + (rm0 << 32);
+  u64 c=(t < rl);
+  u64 lo=t + (rm1 << 32);
+
+  c+=(lo < t);
+  *a=lo;
+  *b=rh + (rm0 >> 32) + (rm1 >> 32) + c;
 #endif
 }
 
 
+static u64
+librdf_hash_word_mix(u64 a, u64 b)
+{
+  librdf_hash_word_mum(&a, &b);
+  return a ^ b;
+}
+
+
+/* unaligned native endian reads; byte order only changes hash values */
+static u64
+librdf_hash_word_read8(const unsigned char *p)
+{
+  u64 v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+
+static u64
+librdf_hash_word_read4(const unsigned char *p)
+{
+  u32 v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+
+/**
+ * librdf_hash_word_hash:
+ * @key: key data
+ * @len: key length
+ *
+ * INTERNAL - Hash a key 8 or 16 bytes at a time.
+ *
+ * A much faster alternative to ONE_AT_A_TIME_HASH for the typical
+ * 50-150 byte URI keys, used by the memory hashes when configured
+ * with --with-hash-function=word.  See LIBRDF_HASH_KEY_HASH.
+ *
+ * Return value: 32 bit hash of the key
+ **/
+u32
+librdf_hash_word_hash(const void *key, size_t len)
+{
+  const unsigned char *p=(const unsigned char*)key;
+  u64 seed;
+  u64 a, b;
+
+  seed=librdf_hash_word_mix(LIBRDF_HASH_WORD_P0, LIBRDF_HASH_WORD_P1);
+
+  if(len <= 16) {
+    if(len >= 4) {
+      size_t off=(len >> 3) << 2;
+
+      a=(librdf_hash_word_read4(p) << 32) | librdf_hash_word_read4(p + off);
+      b=(librdf_hash_word_read4(p + len - 4) << 32) |
+        librdf_hash_word_read4(p + len - 4 - off);
+    } else if(len > 0) {
+      a=(((u64)p[0]) << 16) | (((u64)p[len >> 1]) << 8) | p[len - 1];
+      b=0;
+    } else
+      a=b=0;
+  } else {
+    size_t i=len;
+
+    if(i > 48) {
+      u64 see1=seed, see2=seed;
+
+      do {
+        seed=librdf_hash_word_mix(librdf_hash_word_read8(p) ^ LIBRDF_HASH_WORD_P1,
+                                  librdf_hash_word_read8(p + 8) ^ seed);
+        see1=librdf_hash_word_mix(librdf_hash_word_read8(p + 16) ^ LIBRDF_HASH_WORD_P2,
+                                  librdf_hash_word_read8(p + 24) ^ see1);
+        see2=librdf_hash_word_mix(librdf_hash_word_read8(p + 32) ^ LIBRDF_HASH_WORD_P3,
+                                  librdf_hash_word_read8(p + 40) ^ see2);
+        p+=48;
+        i-=48;
+      } while(i > 48);
+      seed^=see1 ^ see2;
+    }
+
+    while(i > 16) {
+      seed=librdf_hash_word_mix(librdf_hash_word_read8(p) ^ LIBRDF_HASH_WORD_P1,
+                                librdf_hash_word_read8(p + 8) ^ seed);
+      p+=16;
+      i-=16;
+    }
+
+    a=librdf_hash_word_read8(p + i - 16);
+    b=librdf_hash_word_read8(p + i - 8);
+  }
+
+  a^=LIBRDF_HASH_WORD_P1;
+  b^=seed;
+  librdf_hash_word_mum(&a, &b);
+  a=librdf_hash_word_mix(a ^ LIBRDF_HASH_WORD_P0 ^ (u64)len,
+                         b ^ LIBRDF_HASH_WORD_P1);
+
+  return (u32)(a ^ (a >> 32));
+}
+
+
 /* class methods */
 
 /**
@@ -573,8 +913,16 @@ librdf_hash_open(librdf_hash* hash, const char *identifier,
   status=hash->factory->open(hash->context, identifier, 
                              mode, is_writable, is_new, 
                              options);
-  if(!status)
+  if(!status) {
     hash->is_open=1;
+
+    if(identifier && hash->factory->is_persistent) {
+      if(options && librdf_hash_get_as_boolean(options, "bloom-filter") > 0)
+        librdf_hash_filter_open(hash, is_writable, is_new, options);
+      else if(is_writable)
+        librdf_hash_filter_remove(hash);
+    }
+  }
   return status;
 }
 
@@ -591,6 +939,8 @@ int
 librdf_hash_close(librdf_hash* hash)
 {
   hash->is_open=0;
+  if(hash->bloom)
+    librdf_hash_filter_close(hash);
   if(hash->identifier) {
     LIBRDF_FREE(char*, hash->identifier);
     hash->identifier=NULL;
@@ -599,6 +949,265 @@ librdf_hash_close(librdf_hash* hash)
 }
 
 
+/*
+ * librdf_hash_filter_file - Get the name of the file the Bloom filter of a hash is saved in
+ * @hash: hash object with an identifier
+ *
+ * Return value: new file name or NULL on failure
+ **/
+static char*
+librdf_hash_filter_file(librdf_hash* hash)
+{
+  char *file;
+
+  file=LIBRDF_MALLOC(char*, strlen(hash->identifier) + 7);
+  if(file)
+    sprintf(file, "%s.bloom", hash->identifier);
+  return file;
+}
+
+
+/*
+ * librdf_hash_filter_open - Start the Bloom filter of a persistent hash
+ * @hash: hash object, opened
+ * @is_writable: is hash writable?
+ * @is_new: is hash new?
+ * @options: hash options
+ *
+ * Uses the filter saved next to the hash files when there is one,
+ * otherwise a writable hash gets a new filter filled from its
+ * current contents.  The saved file is removed before the first
+ * change and written again by sync or close, so a file left by a
+ * process that did not close the hash is never trusted.  Writable
+ * opens without the filter remove the saved file too, see
+ * librdf_hash_filter_remove().
+ *
+ * A read-only hash without a saved filter is used without one, as
+ * is any hash where the filter cannot be made.
+ **/
+static void
+librdf_hash_filter_open(librdf_hash* hash, int is_writable, int is_new,
+                        librdf_hash* options)
+{
+  char *file;
+  long capacity;
+
+  file=librdf_hash_filter_file(hash);
+  if(!file)
+    return;
+
+  if(!is_new)
+    hash->bloom=librdf_hash_bloom_load(hash->world, file);
+
+  if(!is_writable) {
+    LIBRDF_FREE(char*, file);
+    return;
+  }
+
+  hash->bloom_file=file;
+  if(hash->bloom) {
+    hash->bloom_saved=1;
+    return;
+  }
+
+  /* any old file does not match the hash contents */
+  remove(file);
+
+  capacity=librdf_hash_get_as_long(options, "bloom-filter-size");
+  if(capacity <= 0)
+    capacity=2 * (long)librdf_hash_values_count(hash);
+  if(capacity < 0)
+    capacity=0;
+
+  if(is_new)
+    hash->bloom=librdf_new_hash_bloom(hash->world, (size_t)capacity);
+  else
+    librdf_hash_filter_rebuild(hash, (size_t)capacity);
+
+  if(!hash->bloom) {
+    librdf_log(hash->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_HASH, NULL,
+               "Failed to create Bloom filter for hash %s", hash->identifier);
+    LIBRDF_FREE(char*, hash->bloom_file);
+    hash->bloom_file=NULL;
+  }
+}
+
+
+/*
+ * librdf_hash_filter_remove - Remove the saved Bloom filter of a persistent hash
+ * @hash: hash object, opened writable without a filter
+ *
+ * Pairs added while the hash is open without the filter would be
+ * missing from a saved one, which would then give false negatives
+ * the next time the filter is used.
+ **/
+static void
+librdf_hash_filter_remove(librdf_hash* hash)
+{
+  char *file;
+
+  file=librdf_hash_filter_file(hash);
+  if(!file)
+    return;
+  remove(file);
+  LIBRDF_FREE(char*, file);
+}
+
+
+/*
+ * librdf_hash_filter_rebuild - Replace the Bloom filter with one made from the hash contents
+ * @hash: hash object
+ * @capacity: number of key/value pairs for the new filter
+ *
+ * Return value: non 0 on failure, when the old filter is kept
+ **/
+static int
+librdf_hash_filter_rebuild(librdf_hash* hash, size_t capacity)
+{
+  librdf_hash_bloom* bloom;
+  librdf_hash_datum *key, *value;
+  librdf_iterator* iterator=NULL;
+  int status=0;
+
+  bloom=librdf_new_hash_bloom(hash->world, capacity);
+  if(!bloom)
+    return 1;
+
+  key=librdf_new_hash_datum(hash->world, NULL, 0);
+  value=librdf_new_hash_datum(hash->world, NULL, 0);
+  if(key && value)
+    iterator=librdf_hash_get_all(hash, key, value);
+  if(!iterator)
+    status=1;
+  else {
+    while(!librdf_iterator_end(iterator)) {
+      librdf_hash_datum* k=(librdf_hash_datum*)librdf_iterator_get_key(iterator);
+      librdf_hash_datum* v=(librdf_hash_datum*)librdf_iterator_get_value(iterator);
+
+      librdf_hash_bloom_add(bloom, k, v);
+      librdf_iterator_next(iterator);
+    }
+    librdf_free_iterator(iterator);
+  }
+
+  if(value)
+    librdf_free_hash_datum(value);
+  if(key)
+    librdf_free_hash_datum(key);
+
+  if(status) {
+    librdf_free_hash_bloom(bloom);
+    return 1;
+  }
+
+  if(hash->bloom)
+    librdf_free_hash_bloom(hash->bloom);
+  hash->bloom=bloom;
+  return 0;
+}
+
+
+/*
+ * librdf_hash_filter_add - Add a key/value pair to the Bloom filter before it is put
+ * @hash: hash object with a filter
+ * @key: key
+ * @value: value
+ **/
+static void
+librdf_hash_filter_add(librdf_hash* hash, librdf_hash_datum *key,
+                       librdf_hash_datum *value)
+{
+  if(hash->bloom_saved) {
+    /* the saved filter is about to be out of date */
+    remove(hash->bloom_file);
+    hash->bloom_saved=0;
+  }
+
+  librdf_hash_bloom_add(hash->bloom, key, value);
+}
+
+
+/*
+ * librdf_hash_filter_grow - Rebuild the Bloom filter larger once it holds more than its capacity
+ * @hash: hash object with a filter
+ *
+ * Doubling the capacity each time keeps the cost of the scans
+ * proportional to the pairs added.  If the filter cannot be rebuilt
+ * it is dropped, since a full filter only gets less useful.
+ **/
+static void
+librdf_hash_filter_grow(librdf_hash* hash)
+{
+  if(!librdf_hash_bloom_is_full(hash->bloom))
+    return;
+
+  if(librdf_hash_filter_rebuild(hash,
+                                librdf_hash_bloom_get_capacity(hash->bloom) << 1)) {
+    librdf_log(hash->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_HASH, NULL,
+               "Failed to grow Bloom filter for hash %s", hash->identifier);
+    librdf_free_hash_bloom(hash->bloom);
+    hash->bloom=NULL;
+    /* later writes will not keep a saved filter up to date */
+    if(hash->bloom_saved)
+      remove(hash->bloom_file);
+    if(hash->bloom_file) {
+      LIBRDF_FREE(char*, hash->bloom_file);
+      hash->bloom_file=NULL;
+    }
+    hash->bloom_saved=0;
+  }
+}
+
+
+/*
+ * librdf_hash_filter_sync - Save the Bloom filter if it has changed
+ * @hash: hash object with a filter
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_filter_sync(librdf_hash* hash)
+{
+  if(!hash->bloom_file || hash->bloom_saved)
+    return 0;
+
+  if(librdf_hash_bloom_save(hash->bloom, hash->bloom_file))
+    return 1;
+
+  hash->bloom_saved=1;
+  return 0;
+}
+
+
+/*
+ * librdf_hash_filter_close - Save and free the Bloom filter
+ * @hash: hash object with a filter
+ **/
+static void
+librdf_hash_filter_close(librdf_hash* hash)
+{
+#ifdef LIBRDF_DEBUG
+  unsigned long checks, negatives, false_positives;
+
+  librdf_hash_bloom_get_stats(hash->bloom, &checks, &negatives,
+                              &false_positives);
+  if(checks)
+    LIBRDF_DEBUG4("Bloom filter: %lu checks, %lu negative, %lu false positive\n",
+                  checks, negatives, false_positives);
+#endif
+
+  librdf_hash_filter_sync(hash);
+
+  librdf_free_hash_bloom(hash->bloom);
+  hash->bloom=NULL;
+  if(hash->bloom_file) {
+    LIBRDF_FREE(char*, hash->bloom_file);
+    hash->bloom_file=NULL;
+  }
+  hash->bloom_saved=0;
+}
+
+
 /**
  * librdf_hash_values_count:
  * @hash: hash object
@@ -723,6 +1332,11 @@ typedef struct {
   librdf_hash_datum next_value;
   int is_end;
   int one_key;
+
+  /* prefix iteration only */
+  unsigned char *prefix; /* owned copy of the key prefix */
+  size_t prefix_size;
+  int ordered;           /* keys are in order so stop at first mismatch */
 } librdf_hash_get_all_iterator_context;
 
 
@@ -786,6 +1400,123 @@ librdf_hash_get_all(librdf_hash* hash,
 }
 
 
+/*
+ * librdf_hash_get_all_iterator_match_prefix - Move a prefix iterator to a matching key
+ * @context: iterator context
+ * @status: result of the last cursor operation
+ *
+ * For unordered hashes non-matching keys are skipped, for ordered
+ * ones the first key without the prefix ends the iteration.
+ *
+ * Return value: non 0 if there are no more matching keys
+ **/
+static int
+librdf_hash_get_all_iterator_match_prefix(librdf_hash_get_all_iterator_context* context,
+                                          int status)
+{
+  while(!status) {
+    if(context->next_key.size >= context->prefix_size &&
+       !memcmp(context->next_key.data, context->prefix, context->prefix_size))
+      return 0;
+
+    if(context->ordered)
+      return 1;
+    
+    context->next_key.data=NULL;
+    status=librdf_hash_cursor_get_next(context->cursor, 
+                                       &context->next_key, 
+                                       &context->next_value);
+  }
+
+  return status;
+}
+
+
+/**
+ * librdf_hash_get_prefix:
+ * @hash: hash object
+ * @prefix: key prefix
+ * @key: pointer to key
+ * @value: pointer to value
+ *
+ * Retrieve all key/value pairs from hash where the key starts with a prefix.
+ *
+ * Hashes with ordered keys (see librdf_hash_has_set_range()) start
+ * at the first matching key and stop after the last one, other
+ * hashes are scanned in full.  The iterator returns #librdf_hash_datum
+ * keys and values as for librdf_hash_get_all() over all keys.
+ * 
+ * Return value: a #librdf_iterator serialization of the pairs or NULL on failure
+ **/
+librdf_iterator*
+librdf_hash_get_prefix(librdf_hash* hash, librdf_hash_datum *prefix,
+                       librdf_hash_datum *key, librdf_hash_datum *value)
+{
+  librdf_hash_get_all_iterator_context* context;
+  int status;
+  librdf_iterator* iterator;
+  
+  context = LIBRDF_CALLOC(librdf_hash_get_all_iterator_context*, 1,
+                          sizeof(*context));
+  if(!context)
+    return NULL;
+
+  context->prefix_size=prefix->size;
+  context->prefix=LIBRDF_MALLOC(unsigned char*, prefix->size ? prefix->size : 1);
+  if(!context->prefix) {
+    librdf_hash_get_all_iterator_finished(context);
+    return NULL;
+  }
+  memcpy(context->prefix, prefix->data, prefix->size);
+
+  if(!(context->cursor=librdf_new_hash_cursor(hash))) {
+    librdf_hash_get_all_iterator_finished(context);
+    return NULL;
+  }
+
+  context->hash=hash;
+  context->key=key;
+  context->value=value;
+  context->ordered=librdf_hash_has_set_range(hash);
+
+  if(context->ordered) {
+    context->next_key.data=context->prefix;
+    context->next_key.size=context->prefix_size;
+    status=librdf_hash_cursor_set_range(context->cursor, &context->next_key,
+                                        &context->next_value);
+  } else
+    status=librdf_hash_cursor_get_first(context->cursor, &context->next_key, 
+                                        &context->next_value);
+
+  context->is_end=librdf_hash_get_all_iterator_match_prefix(context, status);
+  
+  iterator=librdf_new_iterator(hash->world,
+                               (void*)context,
+                               librdf_hash_get_all_iterator_is_end,
+                               librdf_hash_get_all_iterator_next_method,
+                               librdf_hash_get_all_iterator_get_method,
+                               librdf_hash_get_all_iterator_finished);
+  if(!iterator)
+    librdf_hash_get_all_iterator_finished(context);
+  return iterator;
+}
+
+
+/**
+ * librdf_hash_has_set_range:
+ * @hash: hash object
+ *
+ * Check if the hash keeps keys in order and supports range cursors.
+ * 
+ * Return value: non 0 if LIBRDF_HASH_CURSOR_SET_RANGE is supported
+ **/
+int
+librdf_hash_has_set_range(librdf_hash* hash)
+{
+  return hash->factory->has_set_range;
+}
+
+
 static int
 librdf_hash_get_all_iterator_is_end(void* iterator)
 {
@@ -816,6 +1547,8 @@ librdf_hash_get_all_iterator_next_method(void* iterator)
     status=librdf_hash_cursor_get_next(context->cursor, 
                                        &context->next_key, 
                                        &context->next_value);
+    if(context->prefix)
+      status=librdf_hash_get_all_iterator_match_prefix(context, status);
   }
   
   if(status)
@@ -878,6 +1611,9 @@ librdf_hash_get_all_iterator_finished(void* iterator)
   if(context->value)
     context->value->data=NULL;
 
+  if(context->prefix)
+    LIBRDF_FREE(char*, context->prefix);
+
   LIBRDF_FREE(librdf_hash_get_all_iterator_context, context);
 }
 
@@ -909,47 +1645,264 @@ librdf_hash_get_del(librdf_hash* hash, const char *key)
   
   librdf_hash_delete_all(hash, &hd_key);
 
-  return s;
-}
+  return s;
+}
+
+
+
+/**
+ * librdf_hash_put:
+ * @hash: hash object
+ * @key: key 
+ * @value: value
+ *
+ * Insert key/value pairs into the hash according to flags.
+ * 
+ * The key and values are copied into the hash; the original pointers
+ * can be deleted.
+ * 
+ * Return value: non 0 on failure
+ **/
+int
+librdf_hash_put(librdf_hash* hash, librdf_hash_datum *key, 
+                librdf_hash_datum *value)
+{
+  int status;
+  
+  if(!hash->bloom)
+    return hash->factory->put(hash->context, key, value);
+
+  librdf_hash_filter_add(hash, key, value);
+  status=hash->factory->put(hash->context, key, value);
+  librdf_hash_filter_grow(hash);
+
+  return status;
+}
+
+
+/**
+ * librdf_hash_exists:
+ * @hash: hash object
+ * @key: key
+ * @value: value
+ *
+ * Check if a given key/value is in the hash.
+ * 
+ * Return value: >0 if the key/value exists in the hash, 0 if not, <0 on failure
+ **/
+int
+librdf_hash_exists(librdf_hash* hash, librdf_hash_datum *key,
+                   librdf_hash_datum *value)
+{
+  int status;
+
+  if(!hash->bloom || !value)
+    return hash->factory->exists(hash->context, key, value);
+
+  /* the filter holds key/value pairs only */
+  if(!librdf_hash_bloom_check(hash->bloom, key, value))
+    return 0;
+
+  status=hash->factory->exists(hash->context, key, value);
+  if(!status)
+    librdf_hash_bloom_false_positive(hash->bloom);
+
+  return status;
+}
+
+
+/**
+ * librdf_hash_put_many:
+ * @hash: hash object
+ * @keys: array of keys
+ * @values: array of values
+ * @count: number of key/value pairs
+ *
+ * Insert an array of key/value pairs into the hash.
+ * 
+ * As with librdf_hash_put() the keys and values are copied.  Hash
+ * types that do not have a batched put are given the pairs one at
+ * a time.
+ * 
+ * Return value: non 0 on failure
+ **/
+int
+librdf_hash_put_many(librdf_hash* hash, librdf_hash_datum *keys,
+                     librdf_hash_datum *values, int count)
+{
+  int i;
+  int status=0;
+
+  if(count <= 0)
+    return 0;
+  
+  if(hash->bloom) {
+    for(i=0; i < count; i++)
+      librdf_hash_filter_add(hash, &keys[i], &values[i]);
+  }
+  
+  if(hash->factory->put_many)
+    status=hash->factory->put_many(hash->context, keys, values, count);
+  else {
+    for(i=0; i < count; i++) {
+      if(hash->factory->put(hash->context, &keys[i], &values[i])) {
+        status=1;
+        break;
+      }
+    }
+  }
+
+  if(hash->bloom)
+    librdf_hash_filter_grow(hash);
+
+  return status;
+}
+
+
+/* check an array of key/values in the hash itself, skipping any filter */
+static int
+librdf_hash_exists_many_common(librdf_hash* hash, librdf_hash_datum *keys,
+                               librdf_hash_datum *values, int count,
+                               int *results)
+{
+  int i;
+
+  if(hash->factory->exists_many)
+    return hash->factory->exists_many(hash->context, keys, values, count,
+                                      results);
+
+  for(i=0; i < count; i++) {
+    results[i]=hash->factory->exists(hash->context, &keys[i],
+                                     values ? &values[i] : NULL);
+    if(results[i] < 0)
+      return 1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_exists_many:
+ * @hash: hash object
+ * @keys: array of keys
+ * @values: array of values or NULL to check for the keys only
+ * @count: number of keys
+ * @results: array to store the result of each check
+ *
+ * Check if each of an array of key/values is in the hash.
+ * 
+ * Each entry of @results is set to >0 if the key/value exists in the
+ * hash and 0 if not.
+ * 
+ * Return value: non 0 on failure
+ **/
+int
+librdf_hash_exists_many(librdf_hash* hash, librdf_hash_datum *keys,
+                        librdf_hash_datum *values, int count, int *results)
+{
+  librdf_hash_datum *maybe_pairs;
+  int *maybe_index;
+  int maybe_count=0;
+  int i;
+  int status;
+
+  if(count <= 0)
+    return 0;
+  
+  if(!hash->bloom || !values)
+    return librdf_hash_exists_many_common(hash, keys, values, count, results);
+
+  /* only look up the pairs the filter does not rule out */
+  maybe_pairs=LIBRDF_MALLOC(librdf_hash_datum*,
+                            sizeof(librdf_hash_datum) * 2 * (size_t)count);
+  maybe_index=LIBRDF_MALLOC(int*, sizeof(int) * 2 * (size_t)count);
+  if(!maybe_pairs || !maybe_index) {
+    if(maybe_pairs)
+      LIBRDF_FREE(librdf_hash_datum*, maybe_pairs);
+    if(maybe_index)
+      LIBRDF_FREE(int*, maybe_index);
+    return librdf_hash_exists_many_common(hash, keys, values, count, results);
+  }
+
+  for(i=0; i < count; i++) {
+    results[i]=0;
+    if(librdf_hash_bloom_check(hash->bloom, &keys[i], &values[i])) {
+      maybe_pairs[maybe_count]=keys[i];
+      maybe_pairs[count + maybe_count]=values[i];
+      maybe_index[maybe_count++]=i;
+    }
+  }
+
+  status=0;
+  if(maybe_count) {
+    int *maybe_results=maybe_index + count;
+
+    status=librdf_hash_exists_many_common(hash, maybe_pairs,
+                                          maybe_pairs + count, maybe_count,
+                                          maybe_results);
+    if(!status) {
+      for(i=0; i < maybe_count; i++) {
+        results[maybe_index[i]]=maybe_results[i];
+        if(!maybe_results[i])
+          librdf_hash_bloom_false_positive(hash->bloom);
+      }
+    }
+  }
+
+  LIBRDF_FREE(librdf_hash_datum*, maybe_pairs);
+  LIBRDF_FREE(int*, maybe_index);
 
+  return status;
+}
 
 
 /**
- * librdf_hash_put:
+ * librdf_hash_get_many:
  * @hash: hash object
- * @key: key 
- * @value: value
+ * @keys: array of keys
+ * @values: array of datums to store the values
+ * @count: number of keys
  *
- * Insert key/value pairs into the hash according to flags.
+ * Retrieve one value for each of an array of keys.
  * 
- * The key and values are copied into the hash; the original pointers
- * can be deleted.
+ * As with librdf_hash_get_one() each value found is returned in newly
+ * allocated memory that the caller must free.  Keys that are not in
+ * the hash give a value with NULL data and 0 size.
  * 
  * Return value: non 0 on failure
  **/
 int
-librdf_hash_put(librdf_hash* hash, librdf_hash_datum *key, 
-                librdf_hash_datum *value)
+librdf_hash_get_many(librdf_hash* hash, librdf_hash_datum *keys,
+                     librdf_hash_datum *values, int count)
 {
-  return hash->factory->put(hash->context, key, value);
-}
+  librdf_hash_datum *value;
+  int i;
 
+  if(count <= 0)
+    return 0;
+  
+  if(hash->factory->get_many)
+    return hash->factory->get_many(hash->context, keys, values, count);
+
+  for(i=0; i < count; i++) {
+    /* the cursor may point the key it is given at the hash's copy */
+    librdf_hash_datum key=keys[i];
+
+    value=librdf_hash_get_one(hash, &key);
+    if(value) {
+      /* take over the copied value data */
+      values[i].data=value->data;
+      values[i].size=value->size;
+      value->data=NULL;
+      librdf_free_hash_datum(value);
+    } else {
+      values[i].data=NULL;
+      values[i].size=0;
+    }
+  }
 
-/**
- * librdf_hash_exists:
- * @hash: hash object
- * @key: key
- * @value: value
- *
- * Check if a given key/value is in the hash.
- * 
- * Return value: >0 if the key/value exists in the hash, 0 if not, <0 on failure
- **/
-int
-librdf_hash_exists(librdf_hash* hash, librdf_hash_datum *key,
-                   librdf_hash_datum *value)
-{
-  return hash->factory->exists(hash->context, key, value);
+  return 0;
 }
 
 
@@ -1143,7 +2096,13 @@ librdf_hash_keys_iterator_finished(void* iterator)
 int
 librdf_hash_sync(librdf_hash* hash)
 {
-  return hash->factory->sync(hash->context);
+  int status;
+  
+  status=hash->factory->sync(hash->context);
+  if(hash->bloom && librdf_hash_filter_sync(hash))
+    status=1;
+
+  return status;
 }
 
 
@@ -1165,6 +2124,55 @@ librdf_hash_get_fd(librdf_hash* hash)
 }
 
 
+/**
+ * librdf_hash_get_footprint:
+ * @hash: hash object
+ * @allocated: pointer to store bytes of memory held by the hash
+ * @used: pointer to store bytes of that in use
+ *
+ * Get the memory footprint of an in-memory hash.
+ * 
+ * Return value: non 0 if the hash type does not report a footprint
+ **/
+int
+librdf_hash_get_footprint(librdf_hash* hash, size_t* allocated, size_t* used)
+{
+  if(!hash->factory->get_footprint)
+    return 1;
+  
+  return hash->factory->get_footprint(hash->context, allocated, used);
+}
+
+
+/**
+ * librdf_hash_get_filter_stats:
+ * @hash: hash object
+ * @checks: pointer to store the number of key/value checks made
+ * @negatives: pointer to store the number answered by the filter alone
+ * @false_positives: pointer to store the number the filter passed that were missing
+ *
+ * Get the Bloom filter counts of a hash opened with option
+ * <literal>bloom-filter</literal>.
+ * 
+ * The false positive rate is @false_positives divided by the sum of
+ * @negatives and @false_positives.  The counts start again when the
+ * filter grows.
+ * 
+ * Return value: non 0 if the hash has no filter
+ **/
+int
+librdf_hash_get_filter_stats(librdf_hash* hash, unsigned long* checks,
+                             unsigned long* negatives,
+                             unsigned long* false_positives)
+{
+  if(!hash->bloom)
+    return 1;
+
+  librdf_hash_bloom_get_stats(hash->bloom, checks, negatives, false_positives);
+  return 0;
+}
+
+
 /**
  * librdf_hash_print:
  * @hash: the hash
@@ -1873,15 +2881,282 @@ librdf_hash_interpret_template(const unsigned char* template_string,
 
 #ifdef STANDALONE
 
+#include <time.h>
+
 /* one more prototype */
 int main(int argc, char *argv[]);
 
 
+#define BENCH_HASH_ROUNDS_KEYS 2000000
+
+typedef struct {
+  unsigned char *data;
+  size_t size;
+} bench_key;
+
+
+static u32
+bench_hash_oneatatime(const void *key, size_t len)
+{
+  u32 hash;
+
+  ONE_AT_A_TIME_HASH(hash, key, len);
+  return hash;
+}
+
+
+static const struct {
+  const char *name;
+  u32 (*hash)(const void *key, size_t len);
+} bench_hash_functions[] = {
+  { "oneatatime", bench_hash_oneatatime },
+  { "word", librdf_hash_word_hash },
+  { NULL, NULL }
+};
+
+
+/*
+ * Collect the distinct encoded nodes of an RDF/XML file, as used for
+ * keys by the hashes storage, and report hashing throughput and bucket
+ * distribution for each key hash function.
+ */
+static int
+test_hash_bench(librdf_world *world, const char *program, const char *file)
+{
+  librdf_parser *parser;
+  librdf_uri *uri;
+  librdf_stream *stream;
+  librdf_hash *seen;
+  bench_key *keys=NULL;
+  int keys_count=0, keys_size=0;
+  size_t total_len=0;
+  int capacity;
+  int *buckets;
+  int f, i;
+  int status=0;
+
+  parser=librdf_new_parser(world, "rdfxml", NULL, NULL);
+  uri=librdf_new_uri_from_filename(world, file);
+  seen=librdf_new_hash(world, "memory");
+  if(!parser || !uri || !seen || librdf_hash_open(seen, NULL, 0, 1, 1, NULL)) {
+    fprintf(stderr, "%s: Failed to set up benchmark\n", program);
+    return 1;
+  }
+
+  stream=librdf_parser_parse_as_stream(parser, uri, NULL);
+  if(!stream) {
+    fprintf(stderr, "%s: Failed to parse %s\n", program, file);
+    return 1;
+  }
+
+  for(; !librdf_stream_end(stream); librdf_stream_next(stream)) {
+    librdf_statement *statement=librdf_stream_get_object(stream);
+    librdf_node *nodes[3];
+    int n;
+
+    nodes[0]=librdf_statement_get_subject(statement);
+    nodes[1]=librdf_statement_get_predicate(statement);
+    nodes[2]=librdf_statement_get_object(statement);
+
+    for(n=0; n < 3; n++) {
+      librdf_hash_datum hd_key;
+      size_t len=librdf_node_encode(nodes[n], NULL, 0);
+      unsigned char *data;
+
+      if(!len || !(data=LIBRDF_MALLOC(unsigned char*, len)))
+        continue;
+      librdf_node_encode(nodes[n], data, len);
+
+      hd_key.data=data;
+      hd_key.size=len;
+      if(librdf_hash_exists(seen, &hd_key, NULL) > 0) {
+        LIBRDF_FREE(char*, data);
+        continue;
+      }
+      librdf_hash_put(seen, &hd_key, &hd_key);
+
+      if(keys_count == keys_size) {
+        bench_key *new_keys;
+
+        keys_size=keys_size ? keys_size << 1 : 256;
+        new_keys=LIBRDF_MALLOC(bench_key*, keys_size * sizeof(bench_key));
+        if(!new_keys) {
+          LIBRDF_FREE(char*, data);
+          status=1;
+          break;
+        }
+        if(keys) {
+          memcpy(new_keys, keys, keys_count * sizeof(bench_key));
+          LIBRDF_FREE(bench_key, keys);
+        }
+        keys=new_keys;
+      }
+      keys[keys_count].data=data;
+      keys[keys_count].size=len;
+      keys_count++;
+      total_len+=len;
+    }
+  }
+  librdf_free_stream(stream);
+
+  if(!keys_count) {
+    fprintf(stderr, "%s: No keys found in %s\n", program, file);
+    status=1;
+    goto tidy;
+  }
+
+  fprintf(stdout, "%s: %d distinct keys, average length %.1f bytes\n",
+          program, keys_count, (double)total_len / keys_count);
+
+  /* same sizing as the memory hash: power of 2 at 0.75 load */
+  for(capacity=8; capacity * 3 < keys_count * 4; capacity<<=1)
+    ;
+  buckets=LIBRDF_CALLOC(int*, capacity, sizeof(int));
+  if(!buckets) {
+    status=1;
+    goto tidy;
+  }
+
+  for(f=0; bench_hash_functions[f].name; f++) {
+    u32 (*hash)(const void*, size_t)=bench_hash_functions[f].hash;
+    int rounds=BENCH_HASH_ROUNDS_KEYS / keys_count + 1;
+    u32 sum=0;
+    int used=0, longest=0;
+    clock_t start;
+    double secs;
+    int r;
+
+    start=clock();
+    for(r=0; r < rounds; r++)
+      for(i=0; i < keys_count; i++)
+        sum+=hash(keys[i].data, keys[i].size);
+    secs=(double)(clock() - start) / CLOCKS_PER_SEC;
+
+    memset(buckets, 0, capacity * sizeof(int));
+    for(i=0; i < keys_count; i++) {
+      int b=hash(keys[i].data, keys[i].size) & (capacity - 1);
+
+      if(!buckets[b]++)
+        used++;
+      if(buckets[b] > longest)
+        longest=buckets[b];
+    }
+
+    fprintf(stdout, "%s: %-10s %8.1f MB/s  %d/%d buckets used, longest chain %d (checksum %lx)\n",
+            program, bench_hash_functions[f].name,
+            secs > 0 ? ((double)total_len * rounds / (1024 * 1024)) / secs : 0.0,
+            used, capacity, longest, (unsigned long)sum);
+  }
+
+  LIBRDF_FREE(int*, buckets);
+
+  tidy:
+  for(i=0; i < keys_count; i++)
+    LIBRDF_FREE(char*, keys[i].data);
+  if(keys)
+    LIBRDF_FREE(bench_key, keys);
+  librdf_free_hash(seen);
+  librdf_free_uri(uri);
+  librdf_free_parser(parser);
+
+  return status;
+}
+
+
+#ifdef WITH_THREADS
+#define TEST_DATUM_THREADS 4
+#define TEST_DATUM_BATCH 200
+#define TEST_DATUM_ROUNDS 500
+
+typedef struct {
+  librdf_world *world;
+  int id;
+  int errors;
+} test_datum_thread;
+
+
+/*
+ * Allocate a batch of datums larger than a thread cache, mark each with
+ * the thread id and free them again, so datums move between the thread
+ * caches and the world overflow stack.  A datum handed out to two
+ * threads at once shows up as a changed mark.
+ */
+static void*
+test_datum_thread_run(void* data)
+{
+  test_datum_thread *thread=(test_datum_thread*)data;
+  librdf_hash_datum *datums[TEST_DATUM_BATCH];
+  int round, i;
+
+  for(round=0; round < TEST_DATUM_ROUNDS; round++) {
+    for(i=0; i < TEST_DATUM_BATCH; i++) {
+      datums[i]=librdf_new_hash_datum(thread->world, NULL, 0);
+      if(!datums[i]) {
+        thread->errors++;
+        break;
+      }
+      datums[i]->size=(size_t)thread->id;
+    }
+    while(i-- > 0) {
+      if(datums[i]->size != (size_t)thread->id)
+        thread->errors++;
+      librdf_free_hash_datum(datums[i]);
+    }
+  }
+
+  return NULL;
+}
+
+
+static int
+test_datum_threads(librdf_world *world, const char *program)
+{
+  pthread_t threads[TEST_DATUM_THREADS];
+  test_datum_thread args[TEST_DATUM_THREADS];
+  struct librdf_hash_datum_cache_s *caches=world->hash_datums_caches;
+  int started, i;
+  int errors=0;
+
+  fprintf(stdout, "%s: Allocating and freeing datums in %d threads\n",
+          program, TEST_DATUM_THREADS);
+  for(started=0; started < TEST_DATUM_THREADS; started++) {
+    args[started].world=world;
+    args[started].id=started + 1;
+    args[started].errors=0;
+    if(pthread_create(&threads[started], NULL, test_datum_thread_run,
+                      &args[started])) {
+      fprintf(stderr, "%s: Failed to start thread %d\n", program, started);
+      errors++;
+      break;
+    }
+  }
+
+  for(i=0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+    if(args[i].errors) {
+      fprintf(stderr, "%s: Thread %d found %d datum errors\n", program,
+              i, args[i].errors);
+      errors++;
+    }
+  }
+
+  /* exited threads give their caches back to the overflow stack */
+  if(world->hash_datums_caches != caches) {
+    fprintf(stderr, "%s: Datum caches left after threads exited\n", program);
+    errors++;
+  }
+
+  return errors;
+}
+#endif
+
+
 int
 main(int argc, char *argv[]) 
 {
   librdf_hash *h, *h2, *ch;
-  const char *test_hash_types[]={"bdb", "memory", NULL};
+  const char *test_hash_types[]={"bdb", "cached:bdb", "mmap", "memory", "memory2", NULL};
+  const char *test_bloom_types[]={"bdb", "mmap", NULL};
   const char *test_hash_values[]={"colour","yellow", /* Made in UK, can you guess? */
 			    "age", "new",
 			    "size", "large",
@@ -1899,6 +3174,23 @@ main(int argc, char *argv[])
                                  NULL};
   const char * const test_hash_string="field1='value1', field2='\\'value2', field3='\\\\', field4='\\\\\\'', field5 = 'a' ";
   const char *test_hash_delete_key="size";
+  const char *test_fanout_key="fanout";
+  const int test_fanout_count=100;
+  char test_fanout_value[16];
+  int base_count;
+  const char *test_batch_strings[]={"batch-a", "1",
+                                    "batch-a", "2",
+                                    "batch-b", "3",
+                                    "batch-missing", NULL};
+  librdf_hash_datum test_batch_keys[4], test_batch_values[4];
+  int test_batch_results[4];
+  librdf_iterator* iterator;
+  int count;
+  librdf_hash *bloom_options;
+  librdf_hash *cached_options;
+  unsigned long checks, negatives, false_positives;
+  char test_bloom_key[16];
+  size_t allocated, used;
   const unsigned char* template_string=(const unsigned char*)"the shape is %{shape} and the sides are %{sides} created by %{rubik}";
   const unsigned char* template_expected=(const unsigned char*)"the shape is cube and the sides are 6 created by ";
   const char * filter_string[] = {"field1", NULL};
@@ -1915,6 +3207,14 @@ main(int argc, char *argv[])
   world=librdf_new_world();
   librdf_world_open(world);
   
+  if(argc >= 2 && !strcmp(argv[1], "-b")) {
+    /* benchmark key hash functions */
+    int rc=test_hash_bench(world, program,
+                           (argc > 2) ? argv[2] : "../data/dc.rdf");
+    librdf_free_world(world);
+    return rc;
+  }
+
   if(argc ==2) {
     type=argv[1];
     h=librdf_new_hash(world, NULL);
@@ -1998,11 +3298,439 @@ main(int argc, char *argv[])
       fprintf(stderr, "%s: Failed to clone %s hash\n", program, type);
     }
 
+    /* many values for one key */
+    fprintf(stdout, "%s: Adding %d values for key '%s'\n", program,
+            test_fanout_count, test_fanout_key);
+    base_count=librdf_hash_values_count(h);
+    hd_key.data=(char*)test_fanout_key;
+    hd_key.size=strlen(test_fanout_key);
+    hd_value.data=test_fanout_value;
+    for(j=0; j < test_fanout_count; j++) {
+      hd_value.size=sprintf(test_fanout_value, "v%d", j);
+      librdf_hash_put(h, &hd_key, &hd_value);
+    }
+    for(j=0; j < test_fanout_count; j+=2) {
+      hd_value.size=sprintf(test_fanout_value, "v%d", j);
+      librdf_hash_delete(h, &hd_key, &hd_value);
+    }
+    for(j=0; j < test_fanout_count; j++) {
+      int expected=(j & 1);
+
+      hd_value.size=sprintf(test_fanout_value, "v%d", j);
+      if((librdf_hash_exists(h, &hd_key, &hd_value) > 0) != expected) {
+        fprintf(stderr, "%s: %s hash value '%s' exists %d, expected %d\n",
+                program, type, test_fanout_value, !expected, expected);
+        return(1);
+      }
+    }
+    /* values count is not available for all hash types */
+    if(base_count >= 0 &&
+       librdf_hash_values_count(h) != base_count + test_fanout_count / 2) {
+      fprintf(stderr, "%s: %s hash values count %d, expected %d\n",
+              program, type, librdf_hash_values_count(h),
+              base_count + test_fanout_count / 2);
+      return(1);
+    }
+    if(!librdf_hash_get_footprint(h, &allocated, &used))
+      fprintf(stdout, "%s: %s hash footprint %lu bytes allocated, %lu used\n",
+              program, type, (unsigned long)allocated, (unsigned long)used);
+    librdf_hash_delete_all(h, &hd_key);
+    if(base_count >= 0 && librdf_hash_values_count(h) != base_count) {
+      fprintf(stderr, "%s: %s hash values count %d after delete, expected %d\n",
+              program, type, librdf_hash_values_count(h), base_count);
+      return(1);
+    }
+
+    /* batched put, exists and get; the last key is not stored */
+    fprintf(stdout, "%s: Batch put/exists/get\n", program);
+    for(j=0; j < 4; j++) {
+      test_batch_keys[j].data=(char*)test_batch_strings[j*2];
+      test_batch_keys[j].size=strlen(test_batch_strings[j*2]);
+      test_batch_values[j].data=(char*)test_batch_strings[j*2+1];
+      test_batch_values[j].size=test_batch_values[j].data ? strlen(test_batch_strings[j*2+1]) : 0;
+    }
+    if(librdf_hash_put_many(h, test_batch_keys, test_batch_values, 3)) {
+      fprintf(stderr, "%s: %s hash batch put failed\n", program, type);
+      return(1);
+    }
+    if(librdf_hash_exists_many(h, test_batch_keys, NULL, 4, test_batch_results) ||
+       !test_batch_results[0] || !test_batch_results[2] ||
+       test_batch_results[3]) {
+      fprintf(stderr, "%s: %s hash batch exists failed\n", program, type);
+      return(1);
+    }
+    if(librdf_hash_get_many(h, test_batch_keys, test_batch_values, 4)) {
+      fprintf(stderr, "%s: %s hash batch get failed\n", program, type);
+      return(1);
+    }
+
+    /* all three batch pairs and nothing else start with 'batch-' */
+    hd_key.data=(char*)"batch-";
+    hd_key.size=6;
+    iterator=librdf_hash_get_prefix(h, &hd_key, &hd_key, &hd_value);
+    for(count=0; iterator && !librdf_iterator_end(iterator); count++)
+      librdf_iterator_next(iterator);
+    if(iterator)
+      librdf_free_iterator(iterator);
+    if(count != 3) {
+      fprintf(stderr, "%s: %s hash prefix scan returned %d pairs, expected 3\n",
+              program, type, count);
+      return(1);
+    }
+    for(j=0; j < 4; j++) {
+      if((test_batch_values[j].data != NULL) != (j < 3)) {
+        fprintf(stderr, "%s: %s hash batch get of key '%s' wrong\n",
+                program, type, test_batch_strings[j*2]);
+        return(1);
+      }
+      if(test_batch_values[j].data)
+        LIBRDF_FREE(char*, test_batch_values[j].data);
+      librdf_hash_delete_all(h, &test_batch_keys[j]);
+    }
+
     librdf_hash_close(h);
       
     fprintf(stdout, "%s: Freeing hash\n", program);
     librdf_free_hash(h);
   }
+  /* keys put and deleted under a cursor walking a memory2 hash; every
+   * key not deleted before it is reached is returned exactly once */
+  h=librdf_new_hash(world, "memory2");
+  if(h && !librdf_hash_open(h, "test-walk", 0644, 1, 1, NULL)) {
+    librdf_hash_cursor* cursor;
+    char test_walk_seen[200];
+    char test_walk_deleted[200];
+
+    fprintf(stdout, "%s: Changing memory2 hash while walking it\n", program);
+    memset(test_walk_seen, 0, sizeof(test_walk_seen));
+    memset(test_walk_deleted, 0, sizeof(test_walk_deleted));
+    for(j=0; j < 200; j++) {
+      sprintf(test_bloom_key, "walk%d", j);
+      librdf_hash_put_strings(h, test_bloom_key, "v");
+    }
+
+    cursor=librdf_new_hash_cursor(h);
+    count=0;
+    for(b=cursor ? librdf_hash_cursor_get_first(cursor, &hd_key, &hd_value) : 1;
+        !b; b=librdf_hash_cursor_get_next(cursor, &hd_key, &hd_value)) {
+      int n;
+
+      if(hd_key.size >= sizeof(test_bloom_key))
+        continue;
+      memcpy(test_bloom_key, hd_key.data, hd_key.size);
+      test_bloom_key[hd_key.size]='\0';
+      if(sscanf(test_bloom_key, "walk%d", &n) != 1)
+        continue;
+      if(test_walk_seen[n]++) {
+        fprintf(stderr, "%s: memory2 hash walk returned %s twice\n", program,
+                test_bloom_key);
+        return(1);
+      }
+
+      /* delete the key returned and one elsewhere, and grow the hash */
+      if(n & 1) {
+        hd_key.data=test_bloom_key;
+        hd_key.size=strlen(test_bloom_key);
+        librdf_hash_delete_all(h, &hd_key);
+      }
+      n=(n * 7 + 3) % 200;
+      if(!test_walk_deleted[n] && !test_walk_seen[n]) {
+        test_walk_deleted[n]=1;
+        sprintf(test_bloom_key, "walk%d", n);
+        hd_key.data=test_bloom_key;
+        hd_key.size=strlen(test_bloom_key);
+        librdf_hash_delete_all(h, &hd_key);
+      }
+      sprintf(test_bloom_key, "added%d", count++);
+      librdf_hash_put_strings(h, test_bloom_key, "v");
+    }
+    if(cursor)
+      librdf_free_hash_cursor(cursor);
+
+    for(j=0; j < 200; j++) {
+      if(!test_walk_deleted[j] && !test_walk_seen[j]) {
+        fprintf(stderr, "%s: memory2 hash walk missed walk%d\n", program, j);
+        return(1);
+      }
+    }
+    librdf_hash_close(h);
+  }
+  if(h)
+    librdf_free_hash(h);
+
+  /* a cursor walking a memory hash while puts grow it and move its
+   * nodes; keys may be returned again after growing but none missed */
+  h=librdf_new_hash(world, "memory");
+  if(h && !librdf_hash_open(h, "test-walk", 0644, 1, 1, NULL)) {
+    librdf_hash_cursor* cursor;
+    char test_walk_seen[200];
+
+    fprintf(stdout, "%s: Growing memory hash while walking it\n", program);
+    memset(test_walk_seen, 0, sizeof(test_walk_seen));
+    for(j=0; j < 200; j++) {
+      sprintf(test_bloom_key, "walk%d", j);
+      librdf_hash_put_strings(h, test_bloom_key, "v");
+    }
+
+    cursor=librdf_new_hash_cursor(h);
+    count=0;
+    for(b=cursor ? librdf_hash_cursor_get_first(cursor, &hd_key, &hd_value) : 1;
+        !b; b=librdf_hash_cursor_get_next(cursor, &hd_key, &hd_value)) {
+      int n;
+
+      if(hd_key.size >= sizeof(test_bloom_key))
+        continue;
+      memcpy(test_bloom_key, hd_key.data, hd_key.size);
+      test_bloom_key[hd_key.size]='\0';
+      if(sscanf(test_bloom_key, "walk%d", &n) != 1)
+        continue;
+      test_walk_seen[n]=1;
+
+      /* the key returned is no longer the cursor's so can go */
+      if(n & 1) {
+        hd_key.data=test_bloom_key;
+        hd_key.size=strlen(test_bloom_key);
+        librdf_hash_delete_all(h, &hd_key);
+      }
+      for(j=0; j < 4; j++) {
+        sprintf(test_bloom_key, "added%d", count++);
+        librdf_hash_put_strings(h, test_bloom_key, "v");
+      }
+    }
+    if(cursor)
+      librdf_free_hash_cursor(cursor);
+
+    for(j=0; j < 200; j++) {
+      if(!test_walk_seen[j]) {
+        fprintf(stderr, "%s: memory hash walk missed walk%d\n", program, j);
+        return(1);
+      }
+    }
+    librdf_hash_close(h);
+  }
+  if(h)
+    librdf_free_hash(h);
+
+  /* Bloom filter of the pairs of a persistent hash */
+  bloom_options=librdf_new_hash_from_string(world, NULL, "bloom-filter='yes'");
+  for(i=0; bloom_options && (type=test_bloom_types[i]); i++) {
+    h=librdf_new_hash(world, type);
+    if(!h)
+      continue;
+    if(librdf_hash_open(h, "test-bloom", 0644, 1, 1, bloom_options)) {
+      librdf_free_hash(h);
+      continue;
+    }
+    fprintf(stdout, "%s: Checking missing pairs through %s hash Bloom filter\n",
+            program, type);
+    hd_value.data=(char*)"yes";
+    hd_value.size=3;
+    for(j=0; j < 200; j++) {
+      hd_key.data=test_bloom_key;
+      hd_key.size=sprintf(test_bloom_key, "bloom%d", j);
+      if(j < 100)
+        librdf_hash_put(h, &hd_key, &hd_value);
+      else if(librdf_hash_exists(h, &hd_key, &hd_value)) {
+        fprintf(stderr, "%s: missing pair %s found\n", program, test_bloom_key);
+        return(1);
+      }
+    }
+    if(librdf_hash_get_filter_stats(h, &checks, &negatives, &false_positives) ||
+       checks != 100 || negatives + false_positives != 100) {
+      fprintf(stderr, "%s: Bloom filter made %lu checks, expected 100\n",
+              program, checks);
+      return(1);
+    }
+    fprintf(stdout, "%s: %lu negative, %lu false positive\n", program,
+            negatives, false_positives);
+    librdf_hash_close(h);
+
+    /* the saved filter must be loaded and still know every pair */
+    if(librdf_hash_open(h, "test-bloom", 0644, 1, 0, bloom_options)) {
+      fprintf(stderr, "%s: Failed to reopen hash with Bloom filter\n", program);
+      return(1);
+    }
+    if(!h->bloom || !h->bloom_saved) {
+      fprintf(stderr, "%s: saved Bloom filter was not loaded\n", program);
+      return(1);
+    }
+    for(j=0; j < 100; j++) {
+      hd_key.data=test_bloom_key;
+      hd_key.size=sprintf(test_bloom_key, "bloom%d", j);
+      if(librdf_hash_exists(h, &hd_key, &hd_value) <= 0) {
+        fprintf(stderr, "%s: pair %s not found after reopen\n", program,
+                test_bloom_key);
+        return(1);
+      }
+    }
+    librdf_hash_close(h);
+
+    /* pairs added without the filter must not be hidden by it later */
+    if(librdf_hash_open(h, "test-bloom", 0644, 1, 0, NULL)) {
+      fprintf(stderr, "%s: Failed to reopen hash without Bloom filter\n",
+              program);
+      return(1);
+    }
+    hd_key.data=test_bloom_key;
+    hd_key.size=sprintf(test_bloom_key, "bloom%d", 150);
+    librdf_hash_put(h, &hd_key, &hd_value);
+    librdf_hash_close(h);
+
+    if(librdf_hash_open(h, "test-bloom", 0644, 1, 0, bloom_options)) {
+      fprintf(stderr, "%s: Failed to reopen hash with Bloom filter\n", program);
+      return(1);
+    }
+    if(h->bloom_saved) {
+      fprintf(stderr, "%s: out of date Bloom filter was loaded\n", program);
+      return(1);
+    }
+    if(librdf_hash_exists(h, &hd_key, &hd_value) <= 0) {
+      fprintf(stderr, "%s: pair %s added without filter not found\n", program,
+              test_bloom_key);
+      return(1);
+    }
+    librdf_hash_close(h);
+    librdf_free_hash(h);
+  }
+  if(bloom_options)
+    librdf_free_hash(bloom_options);
+
+  /* Two bdb hashes in one directory, named two ways, share the
+   * environment of that directory but keep their own pairs */
+  h=librdf_new_hash(world, "bdb");
+  h2=librdf_new_hash(world, "bdb");
+  if(h && h2 &&
+     !librdf_hash_open(h, "test-env1", 0644, 1, 1, NULL)) {
+    if(librdf_hash_open(h2, "./test-env2", 0644, 1, 1, NULL)) {
+      fprintf(stderr, "%s: Failed to open second bdb hash in directory\n",
+              program);
+      return(1);
+    }
+    fprintf(stdout, "%s: Checking two bdb hashes in one directory\n", program);
+    librdf_hash_put_strings(h, "env", "one");
+    librdf_hash_put_strings(h2, "env", "two");
+    for(j=0; j < 2; j++) {
+      char *string;
+      
+      string=librdf_hash_get(j ? h2 : h, "env");
+      if(!string || strcmp(string, j ? "two" : "one") ||
+         librdf_hash_values_count(j ? h2 : h) != 1) {
+        fprintf(stderr, "%s: bdb hash %d in shared directory has value %s\n",
+                program, j + 1, string ? string : "(none)");
+        return(1);
+      }
+      LIBRDF_FREE(char*, string);
+    }
+    librdf_hash_close(h);
+    librdf_hash_close(h2);
+    if(world->hash_bdb_envs) {
+      fprintf(stderr, "%s: bdb environment still open after closing its hashes\n",
+              program);
+      return(1);
+    }
+  }
+  if(h)
+    librdf_free_hash(h);
+  if(h2)
+    librdf_free_hash(h2);
+
+  /* Write-back LRU cache over a persistent hash, with a budget small
+   * enough that entries are dropped and a key's values can take more
+   * than the whole budget */
+  cached_options=librdf_new_hash_from_string(world, NULL, "cache-budget='1024'");
+  h=librdf_new_hash(world, "cached:mmap");
+  if(h && cached_options &&
+     !librdf_hash_open(h, "test-cached", 0644, 1, 1, cached_options)) {
+    unsigned long hits, misses, old_hits, old_misses;
+    librdf_hash_cursor* cursor;
+    char *string;
+
+    fprintf(stdout, "%s: Checking cached hash\n", program);
+    hd_key.data=(char*)"many";
+    hd_key.size=4;
+    for(j=0; j < 60; j++) {
+      hd_value.data=(char*)"abcdefghijklmnopqrstuvwxyz" + (j % 26);
+      hd_value.size=1;
+      librdf_hash_put(h, &hd_key, &hd_value);
+    }
+    for(j=0; j < 40; j++) {
+      sprintf(test_bloom_key, "cached%d", j);
+      librdf_hash_put_strings(h, test_bloom_key, "v");
+    }
+
+    /* buffered puts are visible before they are written */
+    string=librdf_hash_get(h, "cached0");
+    if(!string || strcmp(string, "v")) {
+      fprintf(stderr, "%s: buffered cached hash value not found\n", program);
+      return(1);
+    }
+    LIBRDF_FREE(char*, string);
+    librdf_hash_close(h);
+
+    /* and are all written out by close */
+    if(librdf_hash_open(h, "test-cached", 0644, 1, 0, cached_options)) {
+      fprintf(stderr, "%s: Failed to reopen cached hash\n", program);
+      return(1);
+    }
+
+    cursor=librdf_new_hash_cursor(h);
+    hd_key.data=(char*)"many";
+    hd_key.size=4;
+    count=0;
+    if(cursor) {
+      for(b=librdf_hash_cursor_set(cursor, &hd_key, &hd_value); !b;
+          b=librdf_hash_cursor_get_next_value(cursor, &hd_key, &hd_value))
+        count++;
+      librdf_free_hash_cursor(cursor);
+    }
+    if(count != 60) {
+      fprintf(stderr, "%s: cached hash returned %d values, expected 60\n",
+              program, count);
+      return(1);
+    }
+
+    /* second lookup is a hit until enough other keys push it out */
+    librdf_hash_get_cache_stats(h, &old_hits, &old_misses);
+    for(j=0; j < 40; j++) {
+      sprintf(test_bloom_key, "cached%d", (j < 2) ? 1 : j);
+      string=librdf_hash_get(h, test_bloom_key);
+      if(!string || strcmp(string, "v")) {
+        fprintf(stderr, "%s: cached hash value of %s not found\n", program,
+                test_bloom_key);
+        return(1);
+      }
+      LIBRDF_FREE(char*, string);
+    }
+    librdf_hash_get_cache_stats(h, &hits, &misses);
+    if(hits != old_hits + 1 || misses != old_misses + 39) {
+      fprintf(stderr, "%s: cached hash made %lu hits %lu misses, expected 1 39\n",
+              program, hits - old_hits, misses - old_misses);
+      return(1);
+    }
+    string=librdf_hash_get(h, "cached1");
+    if(string)
+      LIBRDF_FREE(char*, string);
+    old_hits=hits;
+    old_misses=misses;
+    librdf_hash_get_cache_stats(h, &hits, &misses);
+    if(hits != old_hits || misses != old_misses + 1) {
+      fprintf(stderr, "%s: least recently used cached hash key was kept\n",
+              program);
+      return(1);
+    }
+
+    if(librdf_hash_get_footprint(h, &allocated, &used) || used > 1024) {
+      fprintf(stderr, "%s: cached hash uses %lu bytes, over its budget\n",
+              program, (unsigned long)used);
+      return(1);
+    }
+    librdf_hash_close(h);
+  }
+  if(h)
+    librdf_free_hash(h);
+  if(cached_options)
+    librdf_free_hash(cached_options);
+
   fprintf(stdout, "%s: Getting default hash factory\n", program);
   h2=librdf_new_hash(world, NULL);
   if(!h2) {
@@ -2141,6 +3869,10 @@ main(int argc, char *argv[])
 
   librdf_free_hash(h2);
 
+#ifdef WITH_THREADS
+  if(test_datum_threads(world, program))
+    return(1);
+#endif
    
   librdf_free_world(world);
   
@@ -35,6 +35,7 @@
 #include <stdarg.h>
 
 #include <sys/types.h>
+#include <errno.h>
 
 /* for the memory allocation functions */
 #ifdef HAVE_STDLIB_H
@@ -50,6 +51,29 @@
 #include <rdf_hash.h>
 
 
+/* With DB V4.1+ all hashes in one directory are opened inside one
+ * shared environment so that they share a single page cache */
+#if defined(HAVE_DB_CREATE) && defined(HAVE_BDB_OPEN_7_ARGS)
+#define LIBRDF_HASH_BDB_ENV 1
+
+typedef struct librdf_hash_bdb_env_s librdf_hash_bdb_env;
+
+struct librdf_hash_bdb_env_s {
+  struct librdf_hash_bdb_env_s* next;
+  /* directory holding the DB files, used as the environment home */
+  char* home;
+  DB_ENV* env;
+  /* number of open hashes using this environment */
+  int usage;
+  /* non 0 if the environment is transactional */
+  int transactions;
+};
+
+/* default size of the shared environment cache in bytes */
+#define LIBRDF_HASH_BDB_DEFAULT_CACHE_SIZE (16 * 1024 * 1024)
+#endif
+
+
 typedef struct 
 {
   librdf_hash *hash;
@@ -59,6 +83,16 @@ typedef struct
   /* for BerkeleyDB only */
   DB* db;
   char* file_name;
+  /* environment options, copied from the open options for clone */
+  long cache_size;
+  long mmap_size;
+  int transactions;
+  int no_environment;
+  /* non 0 to read cursors one item at a time */
+  int no_bulk_read;
+#ifdef LIBRDF_HASH_BDB_ENV
+  librdf_hash_bdb_env* env;
+#endif
 } librdf_hash_bdb_context;
 
 
@@ -82,9 +116,201 @@ static int librdf_hash_bdb_delete_key_value(void* context, librdf_hash_datum *ke
 static int librdf_hash_bdb_sync(void* context);
 static int librdf_hash_bdb_get_fd(void* context);
 
+/* batched operations where the BDB API allows them */
+#if defined(HAVE_BDB_DB_TXN) && defined(DB_MULTIPLE_KEY_WRITE_NEXT)
+#define LIBRDF_HASH_BDB_BULK_PUT 1
+static int librdf_hash_bdb_put_many(void* context, librdf_hash_datum *keys, librdf_hash_datum *values, int count);
+#endif
+#if defined(HAVE_BDB_CURSOR) && defined(HAVE_BDB_CURSOR_4_ARGS) && defined(DB_GET_BOTH)
+#define LIBRDF_HASH_BDB_CURSOR_MANY 1
+static int librdf_hash_bdb_exists_many(void* context, librdf_hash_datum *keys, librdf_hash_datum *values, int count, int *results);
+static int librdf_hash_bdb_get_many(void* context, librdf_hash_datum *keys, librdf_hash_datum *values, int count);
+#endif
+
 static void librdf_hash_bdb_register_factory(librdf_hash_factory *factory);
 
 
+#ifdef LIBRDF_HASH_BDB_ENV
+/*
+ * librdf_hash_bdb_env_open - Get the shared environment for a DB file
+ * @bdb_context: BerkeleyDB hash context
+ * @file: DB file name
+ *
+ * Finds the environment for the directory of @file in the world list
+ * of environments or creates and opens a new one with the cache,
+ * mmap and transaction settings of @bdb_context.  Directories are
+ * compared by their canonical path where realpath() is available, so
+ * "." and "./" or a symbolic link find the same environment.
+ * 
+ * Return value: environment or NULL on failure
+ **/
+static librdf_hash_bdb_env*
+librdf_hash_bdb_env_open(librdf_hash_bdb_context* bdb_context,
+                         const char* file)
+{
+  librdf_world* world=bdb_context->hash->world;
+  librdf_hash_bdb_env* env;
+  DB_ENV* dbenv=NULL;
+  const char* p;
+  char* home;
+  size_t home_len;
+  long cache_size;
+  u_int32_t flags;
+  int ret;
+#ifdef HAVE_REALPATH
+  char* path;
+#endif
+
+  /* the home is the directory part of the file name, "/" or "." */
+  p=strrchr(file, '/');
+  if(p)
+    home_len=(p == file) ? 1 : (size_t)(p - file);
+  else {
+    file=".";
+    home_len=1;
+  }
+
+  home=LIBRDF_MALLOC(char*, home_len + 1);
+  if(!home)
+    return NULL;
+  memcpy(home, file, home_len);
+  home[home_len]='\0';
+
+#ifdef HAVE_REALPATH
+  path=realpath(home, NULL);
+  if(path) {
+    char* canonical=LIBRDF_MALLOC(char*, strlen(path) + 1);
+    if(canonical) {
+      strcpy(canonical, path);
+      LIBRDF_FREE(char*, home);
+      home=canonical;
+    }
+    free(path);
+  }
+#endif
+
+#ifdef WITH_THREADS
+  pthread_mutex_lock(world->mutex);
+#endif
+
+  for(env=world->hash_bdb_envs; env; env=env->next) {
+    if(!strcmp(env->home, home)) {
+      env->usage++;
+      LIBRDF_FREE(char*, home);
+      goto tidy;
+    }
+  }
+
+  env=LIBRDF_CALLOC(librdf_hash_bdb_env*, 1, sizeof(*env));
+  if(!env) {
+    LIBRDF_FREE(char*, home);
+    goto tidy;
+  }
+  env->home=home;
+
+  if((ret=db_env_create(&dbenv, 0))) {
+    librdf_log(world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "BDB environment create failed - %s", db_strerror(ret));
+    goto failed;
+  }
+
+  cache_size=bdb_context->cache_size;
+  if(cache_size <= 0)
+    cache_size=LIBRDF_HASH_BDB_DEFAULT_CACHE_SIZE;
+  if((ret=dbenv->set_cachesize(dbenv,
+                               (u_int32_t)(cache_size / (1024L * 1024L * 1024L)),
+                               (u_int32_t)(cache_size % (1024L * 1024L * 1024L)),
+                               1))) {
+    librdf_log(world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "BDB environment cache size %ld failed - %s", cache_size,
+               db_strerror(ret));
+    goto failed;
+  }
+
+  /* read-only DB files up to this size are mapped rather than read
+   * into the cache */
+  if(bdb_context->mmap_size > 0)
+    dbenv->set_mp_mmapsize(dbenv, (size_t)bdb_context->mmap_size);
+
+  /* The environment regions are kept in process memory as the files
+   * are not shared with other processes, just as without one.  The
+   * log files of a transactional environment are still written to
+   * the home directory and stay there. */
+  flags=DB_CREATE | DB_INIT_MPOOL | DB_PRIVATE;
+#ifdef WITH_THREADS
+  flags |= DB_THREAD;
+#endif
+  if(bdb_context->transactions) {
+    flags |= DB_INIT_TXN | DB_INIT_LOCK | DB_INIT_LOG | DB_RECOVER;
+    env->transactions=1;
+  }
+
+  if((ret=dbenv->open(dbenv, env->home, flags, 0))) {
+    librdf_log(world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "BDB environment open in '%s' failed - %s", env->home,
+               db_strerror(ret));
+    goto failed;
+  }
+
+  env->env=dbenv;
+  env->usage=1;
+  env->next=world->hash_bdb_envs;
+  world->hash_bdb_envs=env;
+  goto tidy;
+
+  failed:
+  if(dbenv)
+    dbenv->close(dbenv, 0);
+  if(env->home)
+    LIBRDF_FREE(char*, env->home);
+  LIBRDF_FREE(librdf_hash_bdb_env, env);
+  env=NULL;
+
+  tidy:
+#ifdef WITH_THREADS
+  pthread_mutex_unlock(world->mutex);
+#endif
+
+  return env;
+}
+
+
+/*
+ * librdf_hash_bdb_env_close - Release a shared environment
+ * @world: redland world object
+ * @env: environment
+ *
+ * Closes the environment when the last hash using it is closed.
+ **/
+static void
+librdf_hash_bdb_env_close(librdf_world* world, librdf_hash_bdb_env* env)
+{
+  librdf_hash_bdb_env** envp;
+
+#ifdef WITH_THREADS
+  pthread_mutex_lock(world->mutex);
+#endif
+
+  if(!--env->usage) {
+    for(envp=&world->hash_bdb_envs; *envp; envp=&(*envp)->next) {
+      if(*envp == env) {
+        *envp=env->next;
+        break;
+      }
+    }
+
+    env->env->close(env->env, 0);
+    LIBRDF_FREE(char*, env->home);
+    LIBRDF_FREE(librdf_hash_bdb_env, env);
+  }
+
+#ifdef WITH_THREADS
+  pthread_mutex_unlock(world->mutex);
+#endif
+}
+#endif
+
+
 /* functions implementing hash api */
 
 /**
@@ -129,10 +355,19 @@ librdf_hash_bdb_destroy(void* context)
  * @mode: file creation mode
  * @is_writable: is hash writable?
  * @is_new: is hash new?
- * @options: hash options (currently unused)
+ * @options: hash options
  *
  * Open and maybe create a BerkeleyDB hash.
  * 
+ * With BDB V4.1+ the hash is opened in an environment shared by all
+ * hashes in the same directory, unless boolean option
+ * <literal>shared-environment</literal> is false.  Options
+ * <literal>cache-size</literal> and <literal>mmap-size</literal> set
+ * the bytes of shared cache and the largest read-only file to map
+ * into memory, and boolean option <literal>transactions</literal>
+ * makes the environment transactional.  They take effect when the
+ * environment is first opened.
+ * 
  * Return value: non 0 on failure.
  **/
 static int
@@ -145,6 +380,10 @@ librdf_hash_bdb_open(void* context, const char *identifier,
   char *file;
   int ret;
   u_int32_t flags = 0;
+#ifdef LIBRDF_HASH_BDB_ENV
+  DB_ENV* dbenv = NULL;
+  const char *db_file;
+#endif
 
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(identifier, cstring, 1);
   
@@ -152,33 +391,59 @@ librdf_hash_bdb_open(void* context, const char *identifier,
   DB_INFO bdb_info;
 #endif
   
-  /* NOTE: If the options parameter is ever used here, the data must be
-   * copied into a private part of the context so that the clone
-   * method can access them
+  /* NOTE: The options used here are copied into the context so that
+   * the clone method can access them
    */
   bdb_context->mode=mode;
   bdb_context->is_writable=is_writable;
   bdb_context->is_new=is_new;
+  if(options) {
+    bdb_context->cache_size=librdf_hash_get_as_long(options, "cache-size");
+    bdb_context->mmap_size=librdf_hash_get_as_long(options, "mmap-size");
+    bdb_context->transactions=(librdf_hash_get_as_boolean(options, "transactions") > 0);
+    bdb_context->no_environment=!librdf_hash_get_as_boolean(options, "shared-environment");
+    bdb_context->no_bulk_read=!librdf_hash_get_as_boolean(options, "bulk-read");
+  }
   
   file = LIBRDF_MALLOC(char*, strlen(identifier) + 4);
   if(!file)
     return 1;
   sprintf(file, "%s.db", identifier);
 
+#ifdef LIBRDF_HASH_BDB_ENV
+  db_file = file;
+  if(!bdb_context->no_environment) {
+    bdb_context->env=librdf_hash_bdb_env_open(bdb_context, file);
+    if(!bdb_context->env) {
+      LIBRDF_FREE(char*, file);
+      return 1;
+    }
+    dbenv=bdb_context->env->env;
+
+    /* file names are relative to the environment home */
+    if(strrchr(file, '/'))
+      db_file = strrchr(file, '/') + 1;
+  }
+#endif
+
 #ifdef HAVE_DB_CREATE
   /* V3 prototype:
    * int db_create(DB **dbp, DB_ENV *dbenv, u_int32_t flags);
    */
+#ifdef LIBRDF_HASH_BDB_ENV
+  ret = db_create(&bdb, dbenv, flags);
+#else
   ret = db_create(&bdb, NULL, flags);
+#endif
   if(ret) {
     LIBRDF_DEBUG2("Failed to create BDB context - %d\n", ret);
-    return 1;
+    goto failed;
   }
   
 #ifdef HAVE_BDB_SET_FLAGS
   if((ret=bdb->set_flags(bdb, DB_DUP))) {
     LIBRDF_DEBUG2("Failed to set BDB duplicate flag - %d\n", ret);
-    return 1;
+    goto failed;
   }
 #endif
   
@@ -212,12 +477,22 @@ librdf_hash_bdb_open(void* context, const char *identifier,
  * int DB->open(DB *db, DB_TXN *txnid, const char *file,
  *              const char *database, DBTYPE type, u_int32_t flags, int mode);
  */
-  ret = bdb->open(bdb, NULL, file, NULL, DB_BTREE, flags, mode);
+  if(bdb_context->env && bdb_context->env->transactions) {
+    /* DB_TRUNCATE cannot be transaction protected so remove instead */
+    if(flags & DB_TRUNCATE) {
+      flags &= ~(u_int32_t)DB_TRUNCATE;
+      dbenv->dbremove(dbenv, NULL, db_file, NULL, DB_AUTO_COMMIT);
+    }
+    flags |= DB_AUTO_COMMIT;
+  }
+
+  ret = bdb->open(bdb, NULL, db_file, NULL, DB_BTREE, flags, mode);
   if(ret) {
     librdf_log(bdb_context->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
                "BDB V4.1+ open of '%s' failed - %s", file, db_strerror(ret));
-    LIBRDF_FREE(char*, file);
-    return 1;
+    bdb->close(bdb, 0);
+    bdb = NULL;
+    goto failed;
   }
 #endif
 
@@ -276,6 +551,18 @@ ERROR - no idea how to use Berkeley DB
   bdb_context->db=bdb;
   bdb_context->file_name=file;
   return 0;
+
+#ifdef HAVE_DB_CREATE
+  failed:
+  LIBRDF_FREE(char*, file);
+#ifdef LIBRDF_HASH_BDB_ENV
+  if(bdb_context->env) {
+    librdf_hash_bdb_env_close(bdb_context->hash->world, bdb_context->env);
+    bdb_context->env=NULL;
+  }
+#endif
+  return 1;
+#endif
 }
 
 
@@ -305,6 +592,12 @@ librdf_hash_bdb_close(void* context)
   ret=db->close(db);
 #endif
   LIBRDF_FREE(char*, bdb_context->file_name);
+#ifdef LIBRDF_HASH_BDB_ENV
+  if(bdb_context->env) {
+    librdf_hash_bdb_env_close(bdb_context->hash->world, bdb_context->env);
+    bdb_context->env=NULL;
+  }
+#endif
   return ret;
 }
 
@@ -336,8 +629,12 @@ librdf_hash_bdb_clone(librdf_hash *hash, void* context, char *new_identifier,
   /* copy data fields that might change */
   hcontext->hash=hash;
 
-  /* Note: The options are not used at present, so no need to make a copy 
-   */
+  /* the options are not passed again so copy the ones used */
+  hcontext->cache_size=old_hcontext->cache_size;
+  hcontext->mmap_size=old_hcontext->mmap_size;
+  hcontext->transactions=old_hcontext->transactions;
+  hcontext->no_environment=old_hcontext->no_environment;
+  hcontext->no_bulk_read=old_hcontext->no_bulk_read;
   if(librdf_hash_bdb_open(context, new_identifier,
                           old_hcontext->mode, old_hcontext->is_writable,
                           old_hcontext->is_new, NULL))
@@ -389,6 +686,23 @@ librdf_hash_bdb_values_count(void *context)
 
 
 
+/* Cursors read values for one key, or all key/value pairs, into a
+ * bulk buffer many at a time where BDB supports it */
+#if defined(HAVE_BDB_CURSOR) && defined(DB_MULTIPLE_KEY) && defined(DB_MULTIPLE_KEY_NEXT) && defined(DB_NEXT_DUP)
+#define LIBRDF_HASH_BDB_BULK_GET 1
+
+/* initial bulk buffer size; BDB needs a multiple of 1024 bytes */
+#define LIBRDF_HASH_BDB_BULK_BUFFER_SIZE (64 * 1024)
+
+typedef enum {
+  LIBRDF_HASH_BDB_BULK_NONE,
+  /* values of one key from DB_SET / DB_NEXT_DUP with DB_MULTIPLE */
+  LIBRDF_HASH_BDB_BULK_VALUES,
+  /* key/value pairs from DB_FIRST / DB_NEXT with DB_MULTIPLE_KEY */
+  LIBRDF_HASH_BDB_BULK_PAIRS
+} librdf_hash_bdb_bulk_mode;
+#endif
+
 typedef struct {
   librdf_hash_bdb_context* hash;
   void *last_key;
@@ -396,6 +710,18 @@ typedef struct {
 #ifdef HAVE_BDB_CURSOR
   DBC* cursor;
 #endif
+#ifdef LIBRDF_HASH_BDB_BULK_GET
+  librdf_hash_bdb_bulk_mode bulk_mode;
+  DBT bulk;
+  void *bulk_buffer;
+  u_int32_t bulk_buffer_len;
+  /* position of the next item in the bulk buffer, NULL at the end */
+  void *bulk_p;
+  /* size of last_key, which is a copy of the current key */
+  size_t last_key_size;
+  /* position of the current value among the values of its key */
+  u_int32_t bulk_dup_index;
+#endif
 } librdf_hash_bdb_cursor_context;
 
 
@@ -439,6 +765,254 @@ librdf_hash_bdb_cursor_init(void *cursor_context, void *hash_context)
 }
 
 
+#ifdef LIBRDF_HASH_BDB_BULK_GET
+/*
+ * librdf_hash_bdb_cursor_bulk_fill - Read the next items into the bulk buffer
+ * @cursor: BerkeleyDB hash cursor context
+ * @bdb_key: key to use
+ * @flags: BDB c_get flags including DB_MULTIPLE or DB_MULTIPLE_KEY
+ *
+ * The buffer is grown and the read retried if one item does not fit.
+ *
+ * Return value: 0 on success or BDB error such as DB_NOTFOUND
+ **/
+static int
+librdf_hash_bdb_cursor_bulk_fill(librdf_hash_bdb_cursor_context* cursor,
+                                 DBT* bdb_key, u_int32_t flags)
+{
+  DBC *bdb_cursor=cursor->cursor;
+  u_int32_t len;
+  int ret;
+
+  while(1) {
+    if(!cursor->bulk_buffer) {
+      if(!cursor->bulk_buffer_len)
+        cursor->bulk_buffer_len=LIBRDF_HASH_BDB_BULK_BUFFER_SIZE;
+      cursor->bulk_buffer=LIBRDF_MALLOC(void*, cursor->bulk_buffer_len);
+      if(!cursor->bulk_buffer) {
+        cursor->bulk_buffer_len=0;
+        return 1;
+      }
+    }
+
+    memset(&cursor->bulk, 0, sizeof(DBT));
+    cursor->bulk.data=cursor->bulk_buffer;
+    cursor->bulk.ulen=cursor->bulk_buffer_len;
+    cursor->bulk.flags=DB_DBT_USERMEM;
+
+    ret=bdb_cursor->c_get(bdb_cursor, bdb_key, &cursor->bulk, flags);
+#ifdef DB_BUFFER_SMALL
+    if(ret != DB_BUFFER_SMALL && ret != ENOMEM)
+      break;
+#else
+    if(ret != ENOMEM)
+      break;
+#endif
+
+    /* an item is larger than the buffer */
+    len=(cursor->bulk.size + 1023) & ~(u_int32_t)1023;
+    if(len <= cursor->bulk_buffer_len)
+      len=cursor->bulk_buffer_len << 1;
+    LIBRDF_FREE(void*, cursor->bulk_buffer);
+    cursor->bulk_buffer=NULL;
+    cursor->bulk_buffer_len=len;
+  }
+
+  if(ret)
+    cursor->bulk_p=NULL;
+  else
+    DB_MULTIPLE_INIT(cursor->bulk_p, &cursor->bulk);
+
+  return ret;
+}
+
+
+/*
+ * librdf_hash_bdb_cursor_bulk_get - Get the next item from the bulk buffer
+ * @cursor: BerkeleyDB hash cursor context
+ * @key: pointer to key to use
+ * @value: pointer to value to use
+ * @flags: flags
+ * @handled: pointer to store 0 if the request must be done without bulk reads
+ *
+ * LIBRDF_HASH_CURSOR_SET and LIBRDF_HASH_CURSOR_FIRST with a value
+ * start bulk reading, after which LIBRDF_HASH_CURSOR_NEXT_VALUE and
+ * LIBRDF_HASH_CURSOR_NEXT are served from the buffer.  Any other
+ * request ends bulk reading and puts the BDB cursor back on the
+ * current item so that it can carry on one item at a time.
+ *
+ * The returned key is held by the cursor and the value points into
+ * the bulk buffer; both are valid until the next cursor request.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_bdb_cursor_bulk_get(librdf_hash_bdb_cursor_context* cursor,
+                                librdf_hash_datum *key,
+                                librdf_hash_datum *value,
+                                unsigned int flags, int *handled)
+{
+  DBT bdb_key;
+  void *key_data=NULL;
+  void *value_data;
+  u_int32_t key_size=0;
+  u_int32_t value_size;
+  int new_key;
+  int ret=0;
+
+  *handled=1;
+  memset(&bdb_key, 0, sizeof(DBT));
+
+  switch(flags) {
+    case LIBRDF_HASH_CURSOR_SET:
+      bdb_key.data = (char*)key->data;
+      bdb_key.size = LIBRDF_BAD_CAST(u_int32_t, key->size);
+      cursor->bulk_mode=LIBRDF_HASH_BDB_BULK_NONE;
+      ret=librdf_hash_bdb_cursor_bulk_fill(cursor, &bdb_key,
+                                           DB_SET | DB_MULTIPLE);
+      if(ret)
+        break;
+
+      /* remember the key for all the values */
+      if(cursor->last_key)
+        LIBRDF_FREE(char*, cursor->last_key);
+      cursor->last_key=LIBRDF_MALLOC(void*, key->size ? key->size : 1);
+      if(!cursor->last_key)
+        return 1;
+      memcpy(cursor->last_key, key->data, key->size);
+      cursor->last_key_size=key->size;
+      cursor->bulk_mode=LIBRDF_HASH_BDB_BULK_VALUES;
+      break;
+
+    case LIBRDF_HASH_CURSOR_FIRST:
+      cursor->bulk_mode=LIBRDF_HASH_BDB_BULK_NONE;
+      /* walking keys only is done with DB_NEXT_NODUP */
+      if(!value) {
+        *handled=0;
+        return 0;
+      }
+      ret=librdf_hash_bdb_cursor_bulk_fill(cursor, &bdb_key,
+                                           DB_FIRST | DB_MULTIPLE_KEY);
+      if(!ret)
+        cursor->bulk_mode=LIBRDF_HASH_BDB_BULK_PAIRS;
+      break;
+
+    case LIBRDF_HASH_CURSOR_SET_RANGE:
+      cursor->bulk_mode=LIBRDF_HASH_BDB_BULK_NONE;
+      if(!value) {
+        *handled=0;
+        return 0;
+      }
+      bdb_key.data = (char*)key->data;
+      bdb_key.size = LIBRDF_BAD_CAST(u_int32_t, key->size);
+      ret=librdf_hash_bdb_cursor_bulk_fill(cursor, &bdb_key,
+                                           DB_SET_RANGE | DB_MULTIPLE_KEY);
+      if(!ret)
+        cursor->bulk_mode=LIBRDF_HASH_BDB_BULK_PAIRS;
+      break;
+
+    case LIBRDF_HASH_CURSOR_NEXT_VALUE:
+      if(cursor->bulk_mode != LIBRDF_HASH_BDB_BULK_NONE)
+        break;
+      *handled=0;
+      return 0;
+
+    case LIBRDF_HASH_CURSOR_NEXT:
+      if(cursor->bulk_mode == LIBRDF_HASH_BDB_BULK_PAIRS && value)
+        break;
+      /* FALLTHROUGH */
+    default:
+      if(cursor->bulk_mode != LIBRDF_HASH_BDB_BULK_NONE) {
+        DBT bdb_value;
+        u_int32_t i;
+        
+        /* Move the BDB cursor back to the current item.  Values of a
+         * key may repeat so DB_GET_BOTH could find an earlier copy;
+         * count along the duplicates instead */
+        memset(&bdb_value, 0, sizeof(DBT));
+        bdb_key.data = cursor->last_key;
+        bdb_key.size = LIBRDF_BAD_CAST(u_int32_t, cursor->last_key_size);
+        cursor->bulk_mode=LIBRDF_HASH_BDB_BULK_NONE;
+        if(cursor->cursor->c_get(cursor->cursor, &bdb_key, &bdb_value,
+                                 DB_SET))
+          return 1;
+        for(i=0; i < cursor->bulk_dup_index; i++) {
+          if(cursor->cursor->c_get(cursor->cursor, &bdb_key, &bdb_value,
+                                   DB_NEXT_DUP))
+            return 1;
+        }
+      }
+      *handled=0;
+      return 0;
+  }
+
+  while(!ret) {
+    if(cursor->bulk_mode == LIBRDF_HASH_BDB_BULK_VALUES) {
+      DB_MULTIPLE_NEXT(cursor->bulk_p, &cursor->bulk, value_data, value_size);
+    } else {
+      DB_MULTIPLE_KEY_NEXT(cursor->bulk_p, &cursor->bulk,
+                           key_data, key_size, value_data, value_size);
+    }
+    if(cursor->bulk_p)
+      break;
+
+    /* buffer used up, read the next items */
+    memset(&bdb_key, 0, sizeof(DBT));
+    if(cursor->bulk_mode == LIBRDF_HASH_BDB_BULK_VALUES)
+      ret=librdf_hash_bdb_cursor_bulk_fill(cursor, &bdb_key,
+                                           DB_NEXT_DUP | DB_MULTIPLE);
+    else
+      ret=librdf_hash_bdb_cursor_bulk_fill(cursor, &bdb_key,
+                                           DB_NEXT | DB_MULTIPLE_KEY);
+  }
+
+  new_key=(flags != LIBRDF_HASH_CURSOR_NEXT &&
+           flags != LIBRDF_HASH_CURSOR_NEXT_VALUE);
+  if(!ret && cursor->bulk_mode == LIBRDF_HASH_BDB_BULK_PAIRS &&
+     (!cursor->last_key || cursor->last_key_size != key_size ||
+      memcmp(cursor->last_key, key_data, key_size))) {
+    new_key=1;
+    /* the key has changed, so end when only wanting its values */
+    if(flags == LIBRDF_HASH_CURSOR_NEXT_VALUE && cursor->last_key)
+      ret=DB_NOTFOUND;
+    else {
+      if(cursor->last_key)
+        LIBRDF_FREE(char*, cursor->last_key);
+      cursor->last_key=LIBRDF_MALLOC(void*, key_size ? key_size : 1);
+      if(!cursor->last_key)
+        return 1;
+      memcpy(cursor->last_key, key_data, key_size);
+      cursor->last_key_size=key_size;
+    }
+  }
+
+  if(cursor->last_value) {
+    LIBRDF_FREE(char*, cursor->last_value);
+    cursor->last_value=NULL;
+  }
+
+  if(ret) {
+    cursor->bulk_mode=LIBRDF_HASH_BDB_BULK_NONE;
+    key->data=NULL;
+    return ret;
+  }
+
+  key->data=cursor->last_key;
+  key->size=cursor->last_key_size;
+  if(new_key)
+    cursor->bulk_dup_index=0;
+  else
+    cursor->bulk_dup_index++;
+  if(value) {
+    value->data=value_data;
+    value->size=value_size;
+  }
+
+  return 0;
+}
+#endif
+
+
 /**
  * librdf_hash_bdb_cursor_get:
  * @context: BerkeleyDB hash cursor context
@@ -465,6 +1039,15 @@ librdf_hash_bdb_cursor_get(void* context,
   DBT bdb_key;
   DBT bdb_value;
   int ret;
+#ifdef LIBRDF_HASH_BDB_BULK_GET
+  int handled;
+
+  if(!cursor->hash->no_bulk_read) {
+    ret=librdf_hash_bdb_cursor_bulk_get(cursor, key, value, flags, &handled);
+    if(handled)
+      return ret;
+  }
+#endif
 
   /* docs say you must zero DBT's before use */
   memset(&bdb_key, 0, sizeof(DBT));
@@ -511,6 +1094,18 @@ librdf_hash_bdb_cursor_get(void* context,
 #endif
       break;
       
+    case LIBRDF_HASH_CURSOR_SET_RANGE:
+      if(!key->data)
+        return 1;
+#ifdef HAVE_BDB_CURSOR
+      /* V2/V3 - smallest key >= given key in the btree */
+      ret=bdb_cursor->c_get(bdb_cursor, &bdb_key, &bdb_value, DB_SET_RANGE);
+#else
+      /* V1 */
+      ret=db->seq(db, &bdb_key, &bdb_value, R_CURSOR);
+#endif
+      break;
+      
     case LIBRDF_HASH_CURSOR_NEXT_VALUE:
 #ifdef HAVE_BDB_CURSOR
       /* V2/V3 */
@@ -664,6 +1259,10 @@ librdf_hash_bdb_cursor_finish(void* context)
     
   if(cursor->last_value)
     LIBRDF_FREE(char*, cursor->last_value);
+#ifdef LIBRDF_HASH_BDB_BULK_GET
+  if(cursor->bulk_buffer)
+    LIBRDF_FREE(void*, cursor->bulk_buffer);
+#endif
 }
 
 
@@ -718,6 +1317,79 @@ librdf_hash_bdb_put(void* context, librdf_hash_datum *key,
 }
 
 
+#ifdef LIBRDF_HASH_BDB_BULK_PUT
+/**
+ * librdf_hash_bdb_put_many:
+ * @context: BerkeleyDB hash context
+ * @keys: array of keys to store
+ * @values: array of values to store
+ * @count: number of key/value pairs
+ *
+ * Store an array of key/value pairs in the hash with one bulk
+ * DB_MULTIPLE_KEY put.
+ * 
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_bdb_put_many(void* context, librdf_hash_datum *keys,
+                         librdf_hash_datum *values, int count)
+{
+  librdf_hash_bdb_context* bdb_context=(librdf_hash_bdb_context*)context;
+  DB* db=bdb_context->db;
+  DBT bdb_bulk;
+  DBT bdb_unused;
+  void *buffer;
+  void *p;
+  size_t len;
+  int i;
+  int ret;
+
+  /* each pair needs offset and length slots for key and data, plus
+   * the terminator; keep the buffer a multiple of 4 bytes */
+  len=(4 * (size_t)count + 1) * sizeof(u_int32_t);
+  for(i=0; i < count; i++)
+    len += keys[i].size + values[i].size;
+  len=(len + 3) & ~(size_t)3;
+
+  buffer=LIBRDF_MALLOC(void*, len);
+  if(!buffer)
+    return 1;
+
+  memset(&bdb_bulk, 0, sizeof(DBT));
+  memset(&bdb_unused, 0, sizeof(DBT));
+  bdb_bulk.data=buffer;
+  bdb_bulk.ulen=LIBRDF_BAD_CAST(u_int32_t, len);
+  bdb_bulk.flags=DB_DBT_USERMEM;
+
+  DB_MULTIPLE_WRITE_INIT(p, &bdb_bulk);
+  for(i=0; i < count && p; i++) {
+    DB_MULTIPLE_KEY_WRITE_NEXT(p, &bdb_bulk,
+                               keys[i].data,
+                               LIBRDF_BAD_CAST(u_int32_t, keys[i].size),
+                               values[i].data,
+                               LIBRDF_BAD_CAST(u_int32_t, values[i].size));
+  }
+
+  if(p)
+    ret=db->put(db, NULL, &bdb_bulk, &bdb_unused, DB_MULTIPLE_KEY);
+  else {
+    /* buffer sized wrongly; store the pairs one by one */
+    ret=0;
+    for(i=0; i < count && !ret; i++)
+      ret=librdf_hash_bdb_put(context, &keys[i], &values[i]);
+  }
+#ifdef LIBRDF_DEBUG
+  if(ret)
+    LIBRDF_DEBUG2("BDB bulk put failed - %d\n", ret);
+#endif
+
+  LIBRDF_FREE(void*, buffer);
+
+  return (ret != 0);
+}
+#endif
+
+
 /**
  * librdf_hash_bdb_exists:
  * @context: BerkeleyDB hash context
@@ -865,6 +1537,133 @@ librdf_hash_bdb_exists(void* context, librdf_hash_datum *key,
 }
 
 
+#ifdef LIBRDF_HASH_BDB_CURSOR_MANY
+/**
+ * librdf_hash_bdb_exists_many:
+ * @context: BerkeleyDB hash context
+ * @keys: array of keys
+ * @values: array of values (optional)
+ * @count: number of keys
+ * @results: array to store the result of each test
+ *
+ * Test the existence of an array of keys or key/values in the hash
+ * using one cursor for all the lookups.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_bdb_exists_many(void* context, librdf_hash_datum *keys,
+                            librdf_hash_datum *values, int count,
+                            int *results)
+{
+  librdf_hash_bdb_context* bdb_context=(librdf_hash_bdb_context*)context;
+  DB* db=bdb_context->db;
+  DBC* dbc=NULL;
+  DBT bdb_key;
+  DBT bdb_value;
+  int i;
+  int ret=0;
+
+  if(db->cursor(db, NULL, &dbc, 0))
+    return 1;
+
+  for(i=0; i < count; i++) {
+    memset(&bdb_key, 0, sizeof(DBT));
+    memset(&bdb_value, 0, sizeof(DBT));
+    bdb_key.data = (char*)keys[i].data;
+    bdb_key.size = LIBRDF_BAD_CAST(u_int32_t, keys[i].size);
+    if(values) {
+      bdb_value.data = (char*)values[i].data;
+      bdb_value.size = LIBRDF_BAD_CAST(u_int32_t, values[i].size);
+    }
+
+    ret=dbc->c_get(dbc, &bdb_key, &bdb_value, values ? DB_GET_BOTH : DB_SET);
+    if(ret == DB_NOTFOUND) {
+      results[i]=0;
+      ret=0;
+    } else if(ret) /* failed */
+      break;
+    else
+      results[i]=1;
+  }
+
+  dbc->c_close(dbc);
+
+  return (ret != 0);
+}
+
+
+/**
+ * librdf_hash_bdb_get_many:
+ * @context: BerkeleyDB hash context
+ * @keys: array of keys
+ * @values: array of datums to store the values
+ * @count: number of keys
+ *
+ * Get one value for each of an array of keys using one cursor.
+ * 
+ * The values are copied into newly allocated memory; missing keys
+ * give NULL data.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_bdb_get_many(void* context, librdf_hash_datum *keys,
+                         librdf_hash_datum *values, int count)
+{
+  librdf_hash_bdb_context* bdb_context=(librdf_hash_bdb_context*)context;
+  DB* db=bdb_context->db;
+  DBC* dbc=NULL;
+  DBT bdb_key;
+  DBT bdb_value;
+  int i;
+  int ret=0;
+
+  if(db->cursor(db, NULL, &dbc, 0))
+    return 1;
+
+  for(i=0; i < count; i++) {
+    values[i].data=NULL;
+    values[i].size=0;
+
+    memset(&bdb_key, 0, sizeof(DBT));
+    memset(&bdb_value, 0, sizeof(DBT));
+    bdb_key.data = (char*)keys[i].data;
+    bdb_key.size = LIBRDF_BAD_CAST(u_int32_t, keys[i].size);
+
+    ret=dbc->c_get(dbc, &bdb_key, &bdb_value, DB_SET);
+    if(ret == DB_NOTFOUND) {
+      ret=0;
+      continue;
+    } else if(ret) /* failed */
+      break;
+
+    /* bdb_value.data points to BDB memory, so copy it */
+    values[i].data=LIBRDF_MALLOC(char*, bdb_value.size ? bdb_value.size : 1);
+    if(!values[i].data) {
+      ret=1;
+      break;
+    }
+    memcpy(values[i].data, bdb_value.data, bdb_value.size);
+    values[i].size=bdb_value.size;
+  }
+
+  dbc->c_close(dbc);
+
+  if(ret) {
+    while(i-- > 0) {
+      if(values[i].data) {
+        LIBRDF_FREE(char*, values[i].data);
+        values[i].data=NULL;
+      }
+    }
+  }
+
+  return (ret != 0);
+}
+#endif
+
+
 /**
  * librdf_hash_bdb_delete_key:
  * @context: BerkeleyDB hash context
@@ -1072,6 +1871,17 @@ librdf_hash_bdb_register_factory(librdf_hash_factory *factory)
   factory->delete_key_value  = librdf_hash_bdb_delete_key_value;
   factory->sync    = librdf_hash_bdb_sync;
   factory->get_fd  = librdf_hash_bdb_get_fd;
+#ifdef LIBRDF_HASH_BDB_BULK_PUT
+  factory->put_many = librdf_hash_bdb_put_many;
+#endif
+#ifdef LIBRDF_HASH_BDB_CURSOR_MANY
+  factory->exists_many = librdf_hash_bdb_exists_many;
+  factory->get_many    = librdf_hash_bdb_get_many;
+#endif
+
+  /* keys are kept in a btree so can be scanned by range */
+  factory->has_set_range = 1;
+  factory->is_persistent = 1;
 
   factory->cursor_init   = librdf_hash_bdb_cursor_init;
   factory->cursor_get    = librdf_hash_bdb_cursor_get;
@@ -0,0 +1,406 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_hash_bloom.c - RDF Hash Bloom filter for key/value pair checks
+ *
+ * Copyright (C) 2000-2008, David Beckett http://www.dajobe.org/
+ * Copyright (C) 2000-2004, University of Bristol, UK http://www.bristol.ac.uk/
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+/*
+ * A Bloom filter over the key/value pairs put into a persistent hash
+ * so that checking for a pair that was never added does not need a
+ * disk lookup.  Bits are never cleared so deleted pairs only add to
+ * the false positives, which are counted along with the checks made.
+ *
+ * The bit positions are derived from one 64 bit FNV-1a hash of the
+ * pair split into two halves (Kirsch-Mitzenmacher double hashing).
+ * With 10 bits per pair and 7 hashes the false positive rate is
+ * below 1% until the filter holds more than its capacity.
+ *
+ * The filter can be saved to a file, written in host byte order
+ * since it sits next to the hash files of the same machine.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <rdf_config.h>
+#endif
+
+#ifdef WIN32
+#include <win32_rdf_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <redland.h>
+#include <rdf_types.h>
+#include <rdf_hash.h>
+
+
+#define LIBRDF_HASH_BLOOM_BITS_PER_ITEM 10
+#define LIBRDF_HASH_BLOOM_HASHES 7
+#define LIBRDF_HASH_BLOOM_MIN_CAPACITY 65536
+
+#define LIBRDF_HASH_BLOOM_MAGIC "RDFBLOOM"
+#define LIBRDF_HASH_BLOOM_MAGIC_LEN 8
+#define LIBRDF_HASH_BLOOM_VERSION 1
+
+#define FNV1A_64_OFFSET ((u64)0xcbf29ce4U << 32 | (u64)0x84222325U)
+#define FNV1A_64_PRIME ((u64)0x100U << 32 | (u64)0x000001b3U)
+
+
+struct librdf_hash_bloom_s {
+  librdf_world* world;
+  unsigned char* bits;
+  u64 bits_count;      /* power of 2 */
+  u64 capacity;        /* pairs held before the filter should grow */
+  u64 count;           /* pairs added */
+
+  /* statistics since the filter was created or loaded */
+  unsigned long checks;
+  unsigned long negatives;
+  unsigned long false_positives;
+};
+
+
+/* header of a saved filter, followed by the bits */
+typedef struct {
+  char magic[LIBRDF_HASH_BLOOM_MAGIC_LEN];
+  u32 version;
+  u32 hashes;
+  u64 bits_count;
+  u64 capacity;
+  u64 count;
+} librdf_hash_bloom_header;
+
+
+static librdf_hash_bloom*
+librdf_hash_bloom_alloc(librdf_world* world, u64 capacity)
+{
+  librdf_hash_bloom* bloom;
+  u64 bits_count=8;
+
+  if(capacity < LIBRDF_HASH_BLOOM_MIN_CAPACITY)
+    capacity=LIBRDF_HASH_BLOOM_MIN_CAPACITY;
+  while(bits_count < capacity * LIBRDF_HASH_BLOOM_BITS_PER_ITEM)
+    bits_count <<= 1;
+
+  if((size_t)(bits_count >> 3) != (bits_count >> 3))
+    return NULL;
+
+  bloom=LIBRDF_CALLOC(librdf_hash_bloom*, 1, sizeof(*bloom));
+  if(!bloom)
+    return NULL;
+
+  bloom->bits=LIBRDF_CALLOC(unsigned char*, 1, (size_t)(bits_count >> 3));
+  if(!bloom->bits) {
+    LIBRDF_FREE(librdf_hash_bloom, bloom);
+    return NULL;
+  }
+
+  bloom->world=world;
+  bloom->bits_count=bits_count;
+  bloom->capacity=capacity;
+
+  return bloom;
+}
+
+
+/**
+ * librdf_new_hash_bloom:
+ * @world: redland world object
+ * @capacity: number of key/value pairs expected
+ *
+ * INTERNAL - Create an empty Bloom filter.
+ *
+ * Return value: new filter or NULL on failure
+ **/
+librdf_hash_bloom*
+librdf_new_hash_bloom(librdf_world* world, size_t capacity)
+{
+  return librdf_hash_bloom_alloc(world, (u64)capacity);
+}
+
+
+/**
+ * librdf_free_hash_bloom:
+ * @bloom: Bloom filter
+ *
+ * INTERNAL - Destroy a Bloom filter.
+ **/
+void
+librdf_free_hash_bloom(librdf_hash_bloom* bloom)
+{
+  if(!bloom)
+    return;
+
+  if(bloom->bits)
+    LIBRDF_FREE(char*, bloom->bits);
+  LIBRDF_FREE(librdf_hash_bloom, bloom);
+}
+
+
+static u64
+librdf_hash_bloom_hash(librdf_hash_datum* key, librdf_hash_datum* value)
+{
+  const unsigned char* p;
+  u64 h=FNV1A_64_OFFSET;
+  size_t i;
+
+  for(p=(const unsigned char*)key->data, i=0; i < key->size; i++) {
+    h ^= p[i];
+    h *= FNV1A_64_PRIME;
+  }
+
+  /* mix in the key length so the key/value split counts */
+  h ^= (u64)key->size;
+  h *= FNV1A_64_PRIME;
+
+  for(p=(const unsigned char*)value->data, i=0; i < value->size; i++) {
+    h ^= p[i];
+    h *= FNV1A_64_PRIME;
+  }
+
+  return h;
+}
+
+
+/**
+ * librdf_hash_bloom_add:
+ * @bloom: Bloom filter
+ * @key: key
+ * @value: value
+ *
+ * INTERNAL - Add a key/value pair to a Bloom filter.
+ **/
+void
+librdf_hash_bloom_add(librdf_hash_bloom* bloom,
+                      librdf_hash_datum* key, librdf_hash_datum* value)
+{
+  u64 h=librdf_hash_bloom_hash(key, value);
+  u64 h1=h & 0xffffffffU;
+  u64 h2=(h >> 32) | 1;
+  u64 mask=bloom->bits_count - 1;
+  int i;
+
+  for(i=0; i < LIBRDF_HASH_BLOOM_HASHES; i++) {
+    u64 bit=(h1 + (u64)i * h2) & mask;
+    bloom->bits[bit >> 3] |= (unsigned char)(1 << (bit & 7));
+  }
+
+  bloom->count++;
+}
+
+
+/**
+ * librdf_hash_bloom_check:
+ * @bloom: Bloom filter
+ * @key: key
+ * @value: value
+ *
+ * INTERNAL - Check if a key/value pair may have been added to a Bloom filter.
+ *
+ * Return value: 0 if the pair was never added, non 0 if it may have been
+ **/
+int
+librdf_hash_bloom_check(librdf_hash_bloom* bloom,
+                        librdf_hash_datum* key, librdf_hash_datum* value)
+{
+  u64 h=librdf_hash_bloom_hash(key, value);
+  u64 h1=h & 0xffffffffU;
+  u64 h2=(h >> 32) | 1;
+  u64 mask=bloom->bits_count - 1;
+  int i;
+
+  bloom->checks++;
+
+  for(i=0; i < LIBRDF_HASH_BLOOM_HASHES; i++) {
+    u64 bit=(h1 + (u64)i * h2) & mask;
+    if(!(bloom->bits[bit >> 3] & (1 << (bit & 7)))) {
+      bloom->negatives++;
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+
+/**
+ * librdf_hash_bloom_false_positive:
+ * @bloom: Bloom filter
+ *
+ * INTERNAL - Record that a pair passing librdf_hash_bloom_check() was not found.
+ **/
+void
+librdf_hash_bloom_false_positive(librdf_hash_bloom* bloom)
+{
+  bloom->false_positives++;
+}
+
+
+/**
+ * librdf_hash_bloom_is_full:
+ * @bloom: Bloom filter
+ *
+ * INTERNAL - Check if a Bloom filter holds more pairs than it was sized for.
+ *
+ * Return value: non 0 if the filter should be rebuilt larger
+ **/
+int
+librdf_hash_bloom_is_full(librdf_hash_bloom* bloom)
+{
+  return bloom->count > bloom->capacity;
+}
+
+
+/**
+ * librdf_hash_bloom_get_capacity:
+ * @bloom: Bloom filter
+ *
+ * INTERNAL - Get the number of pairs a Bloom filter was sized for.
+ *
+ * Return value: capacity
+ **/
+size_t
+librdf_hash_bloom_get_capacity(librdf_hash_bloom* bloom)
+{
+  return (size_t)bloom->capacity;
+}
+
+
+/**
+ * librdf_hash_bloom_get_stats:
+ * @bloom: Bloom filter
+ * @checks: pointer to store the number of checks made
+ * @negatives: pointer to store the number of checks that were negative
+ * @false_positives: pointer to store the number of positive checks of missing pairs
+ *
+ * INTERNAL - Get the counts of Bloom filter checks.
+ *
+ * The false positive rate is @false_positives divided by the sum of
+ * @negatives and @false_positives.
+ **/
+void
+librdf_hash_bloom_get_stats(librdf_hash_bloom* bloom, unsigned long* checks,
+                            unsigned long* negatives,
+                            unsigned long* false_positives)
+{
+  *checks=bloom->checks;
+  *negatives=bloom->negatives;
+  *false_positives=bloom->false_positives;
+}
+
+
+/**
+ * librdf_hash_bloom_load:
+ * @world: redland world object
+ * @filename: file written by librdf_hash_bloom_save()
+ *
+ * INTERNAL - Read a saved Bloom filter.
+ *
+ * Return value: new filter or NULL if the file is missing or not valid
+ **/
+librdf_hash_bloom*
+librdf_hash_bloom_load(librdf_world* world, const char* filename)
+{
+  FILE* fh;
+  librdf_hash_bloom_header header;
+  librdf_hash_bloom* bloom=NULL;
+
+  fh=fopen(filename, "rb");
+  if(!fh)
+    return NULL;
+
+  if(fread(&header, sizeof(header), 1, fh) != 1 ||
+     memcmp(header.magic, LIBRDF_HASH_BLOOM_MAGIC,
+            LIBRDF_HASH_BLOOM_MAGIC_LEN) ||
+     header.version != LIBRDF_HASH_BLOOM_VERSION ||
+     header.hashes != LIBRDF_HASH_BLOOM_HASHES)
+    goto done;
+
+  bloom=librdf_hash_bloom_alloc(world, header.capacity);
+  if(!bloom)
+    goto done;
+
+  if(bloom->bits_count != header.bits_count ||
+     fread(bloom->bits, (size_t)(bloom->bits_count >> 3), 1, fh) != 1) {
+    librdf_free_hash_bloom(bloom);
+    bloom=NULL;
+    goto done;
+  }
+  bloom->count=header.count;
+
+  done:
+  fclose(fh);
+  return bloom;
+}
+
+
+/**
+ * librdf_hash_bloom_save:
+ * @bloom: Bloom filter
+ * @filename: file to write
+ *
+ * INTERNAL - Write a Bloom filter to a file.
+ *
+ * Return value: non 0 on failure
+ **/
+int
+librdf_hash_bloom_save(librdf_hash_bloom* bloom, const char* filename)
+{
+  FILE* fh;
+  librdf_hash_bloom_header header;
+  int rc=0;
+
+  fh=fopen(filename, "wb");
+  if(!fh) {
+    librdf_log(bloom->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+               "Failed to open Bloom filter file %s for writing", filename);
+    return 1;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, LIBRDF_HASH_BLOOM_MAGIC, LIBRDF_HASH_BLOOM_MAGIC_LEN);
+  header.version=LIBRDF_HASH_BLOOM_VERSION;
+  header.hashes=LIBRDF_HASH_BLOOM_HASHES;
+  header.bits_count=bloom->bits_count;
+  header.capacity=bloom->capacity;
+  header.count=bloom->count;
+
+  if(fwrite(&header, sizeof(header), 1, fh) != 1 ||
+     fwrite(bloom->bits, (size_t)(bloom->bits_count >> 3), 1, fh) != 1)
+    rc=1;
+  if(fclose(fh))
+    rc=1;
+
+  if(rc) {
+    librdf_log(bloom->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+               "Failed to write Bloom filter file %s", filename);
+    remove(filename);
+  }
+
+  return rc;
+}
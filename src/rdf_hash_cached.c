@@ -0,0 +1,1386 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_hash_cached.c - RDF Hash write-back LRU cache over a persistent hash
+ *
+ * Copyright (C) 2000-2008, David Beckett http://www.dajobe.org/
+ * Copyright (C) 2000-2004, University of Bristol, UK http://www.bristol.ac.uk/
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+/*
+ * Hash type "cached:NAME" wraps a hash of persistent type NAME with
+ * an in-memory cache, one for each persistent type registered.
+ *
+ * The cache holds an entry per recently used key with the values of
+ * that key.  An entry read from the wrapped hash is complete and can
+ * answer any lookup of its key, including that the key or a value is
+ * absent.  Puts are buffered and written to the wrapped hash as one
+ * batch when the buffer fills, on sync and on close.  Each put is also
+ * added to the entry of its key, creating an incomplete entry if the
+ * key is not cached, so lookups see buffered values.
+ *
+ * Entries are kept in least recently used order.  When the cache and
+ * the write buffer are over the memory budget the buffer is written
+ * out and entries are dropped from the least recently used end,
+ * skipping those whose values are being returned by a cursor.
+ *
+ * Deletes, counts and cursors scanning the whole hash write out the
+ * buffer first and then go to the wrapped hash.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <rdf_config.h>
+#endif
+
+#ifdef WIN32
+#include <win32_rdf_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <sys/types.h>
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <redland.h>
+#include <rdf_types.h>
+#include <rdf_hash.h>
+
+
+#define LIBRDF_HASH_CACHED_PREFIX "cached:"
+#define LIBRDF_HASH_CACHED_PREFIX_LEN 7
+
+/* default memory budget in bytes; option cache-budget */
+#define LIBRDF_HASH_CACHED_DEFAULT_BUDGET (8L * 1024L * 1024L)
+
+/* most puts buffered before they are written */
+#define LIBRDF_HASH_CACHED_MAX_PENDING 4096
+
+#define LIBRDF_HASH_CACHED_INITIAL_BUCKETS 1024
+
+
+typedef struct librdf_hash_cached_entry_s librdf_hash_cached_entry;
+
+struct librdf_hash_cached_entry_s {
+  librdf_hash_cached_entry* bucket_next;
+  librdf_hash_cached_entry* lru_prev; /* towards most recently used */
+  librdf_hash_cached_entry* lru_next;
+  u32 hash_key;
+  int usage;      /* cursors returning values of this entry */
+  int complete;   /* values are all the values of the key */
+  int detached;   /* removed from the cache, freed when usage is 0 */
+  librdf_hash_datum key;
+  librdf_hash_datum* values;
+  int values_count;
+  int values_size;
+  size_t bytes;
+};
+
+
+typedef struct {
+  librdf_hash* hash;
+  librdf_hash* inner;   /* the wrapped persistent hash */
+
+  librdf_hash_cached_entry** buckets;
+  int buckets_count;    /* power of 2 */
+  int entries_count;
+  librdf_hash_cached_entry* lru_head;
+  librdf_hash_cached_entry* lru_tail;
+
+  /* buffered puts, owned copies */
+  librdf_hash_datum* pending_keys;
+  librdf_hash_datum* pending_values;
+  int pending_count;
+  int pending_size;
+
+  size_t bytes;         /* held by entries and buffered puts */
+  size_t budget;
+
+  unsigned long hits;
+  unsigned long misses;
+} librdf_hash_cached_context;
+
+
+typedef struct {
+  librdf_hash_cached_context* hash;
+  librdf_hash_cursor* inner;       /* cursor over the wrapped hash */
+  librdf_hash_cached_entry* entry; /* entry values are returned from */
+  int index;                       /* next value of entry */
+} librdf_hash_cached_cursor_context;
+
+
+/* prototypes for local functions */
+static int librdf_hash_cached_create(librdf_hash* hash, void* context);
+static int librdf_hash_cached_destroy(void* context);
+static int librdf_hash_cached_open(void* context, const char *identifier, int mode, int is_writable, int is_new, librdf_hash* options);
+static int librdf_hash_cached_close(void* context);
+static int librdf_hash_cached_clone(librdf_hash* new_hash, void *new_context, char *new_identifier, void* old_context);
+static int librdf_hash_cached_values_count(void *context);
+static int librdf_hash_cached_put(void* context, librdf_hash_datum *key, librdf_hash_datum *data);
+static int librdf_hash_cached_exists(void* context, librdf_hash_datum *key, librdf_hash_datum *value);
+static int librdf_hash_cached_delete_key(void* context, librdf_hash_datum *key);
+static int librdf_hash_cached_delete_key_value(void* context, librdf_hash_datum *key, librdf_hash_datum *value);
+static int librdf_hash_cached_sync(void* context);
+static int librdf_hash_cached_get_fd(void* context);
+static int librdf_hash_cached_get_footprint(void* context, size_t* allocated, size_t* used);
+static int librdf_hash_cached_put_many(void* context, librdf_hash_datum *keys, librdf_hash_datum *values, int count);
+static int librdf_hash_cached_exists_many(void* context, librdf_hash_datum *keys, librdf_hash_datum *values, int count, int *results);
+static int librdf_hash_cached_get_many(void* context, librdf_hash_datum *keys, librdf_hash_datum *values, int count);
+
+/* cursor methods */
+static int librdf_hash_cached_cursor_init(void *cursor_context, void* hash_context);
+static int librdf_hash_cached_cursor_get(void *cursor_context, librdf_hash_datum* key, librdf_hash_datum* value, unsigned int flags);
+static void librdf_hash_cached_cursor_finish(void *context);
+
+static void librdf_hash_cached_register_factory(librdf_hash_factory *factory);
+
+
+/* cache entries */
+
+static librdf_hash_cached_entry*
+librdf_hash_cached_find(librdf_hash_cached_context* context,
+                        librdf_hash_datum *key, u32 hash_key)
+{
+  librdf_hash_cached_entry* entry;
+
+  if(!context->buckets)
+    return NULL;
+
+  for(entry=context->buckets[hash_key & (u32)(context->buckets_count - 1)];
+      entry; entry=entry->bucket_next) {
+    if(entry->hash_key == hash_key && entry->key.size == key->size &&
+       !memcmp(entry->key.data, key->data, key->size))
+      return entry;
+  }
+
+  return NULL;
+}
+
+
+/* move an entry to the most recently used end */
+static void
+librdf_hash_cached_touch(librdf_hash_cached_context* context,
+                         librdf_hash_cached_entry* entry)
+{
+  if(context->lru_head == entry)
+    return;
+
+  /* unlink */
+  if(entry->lru_prev)
+    entry->lru_prev->lru_next=entry->lru_next;
+  if(entry->lru_next)
+    entry->lru_next->lru_prev=entry->lru_prev;
+  if(context->lru_tail == entry)
+    context->lru_tail=entry->lru_prev;
+
+  /* link at head */
+  entry->lru_prev=NULL;
+  entry->lru_next=context->lru_head;
+  if(context->lru_head)
+    context->lru_head->lru_prev=entry;
+  context->lru_head=entry;
+  if(!context->lru_tail)
+    context->lru_tail=entry;
+}
+
+
+static int
+librdf_hash_cached_grow_buckets(librdf_hash_cached_context* context)
+{
+  librdf_hash_cached_entry** buckets;
+  int buckets_count;
+  int i;
+
+  buckets_count=context->buckets_count ? (context->buckets_count << 1)
+                                       : LIBRDF_HASH_CACHED_INITIAL_BUCKETS;
+  buckets=LIBRDF_CALLOC(librdf_hash_cached_entry**, (size_t)buckets_count,
+                        sizeof(librdf_hash_cached_entry*));
+  if(!buckets)
+    return 1;
+
+  for(i=0; i < context->buckets_count; i++) {
+    librdf_hash_cached_entry* entry;
+    librdf_hash_cached_entry* next;
+
+    for(entry=context->buckets[i]; entry; entry=next) {
+      int b=(int)(entry->hash_key & (u32)(buckets_count - 1));
+      next=entry->bucket_next;
+      entry->bucket_next=buckets[b];
+      buckets[b]=entry;
+    }
+  }
+
+  if(context->buckets)
+    LIBRDF_FREE(librdf_hash_cached_entry**, context->buckets);
+  context->buckets=buckets;
+  context->buckets_count=buckets_count;
+
+  return 0;
+}
+
+
+static librdf_hash_cached_entry*
+librdf_hash_cached_new_entry(librdf_hash_cached_context* context,
+                             librdf_hash_datum *key, u32 hash_key)
+{
+  librdf_hash_cached_entry* entry;
+  int b;
+
+  if(context->entries_count >= context->buckets_count &&
+     librdf_hash_cached_grow_buckets(context))
+    return NULL;
+
+  /* key bytes follow the entry */
+  entry=(librdf_hash_cached_entry*)LIBRDF_CALLOC(char*, 1,
+                                                 sizeof(*entry) + key->size);
+  if(!entry)
+    return NULL;
+
+  entry->hash_key=hash_key;
+  entry->key.data=(char*)(entry + 1);
+  entry->key.size=key->size;
+  memcpy(entry->key.data, key->data, key->size);
+  entry->bytes=sizeof(*entry) + key->size;
+
+  b=(int)(hash_key & (u32)(context->buckets_count - 1));
+  entry->bucket_next=context->buckets[b];
+  context->buckets[b]=entry;
+  context->entries_count++;
+
+  librdf_hash_cached_touch(context, entry);
+  context->bytes += entry->bytes;
+
+  return entry;
+}
+
+
+static void
+librdf_hash_cached_free_entry(librdf_hash_cached_entry* entry)
+{
+  int i;
+
+  for(i=0; i < entry->values_count; i++)
+    LIBRDF_FREE(char*, entry->values[i].data);
+  if(entry->values)
+    LIBRDF_FREE(librdf_hash_datum*, entry->values);
+  LIBRDF_FREE(char*, entry);
+}
+
+
+/* remove an entry from the cache, freeing it unless a cursor uses it */
+static void
+librdf_hash_cached_detach(librdf_hash_cached_context* context,
+                          librdf_hash_cached_entry* entry)
+{
+  librdf_hash_cached_entry** p;
+
+  for(p=&context->buckets[entry->hash_key & (u32)(context->buckets_count - 1)];
+      *p != entry; p=&(*p)->bucket_next)
+    ;
+  *p=entry->bucket_next;
+  context->entries_count--;
+
+  if(entry->lru_prev)
+    entry->lru_prev->lru_next=entry->lru_next;
+  else
+    context->lru_head=entry->lru_next;
+  if(entry->lru_next)
+    entry->lru_next->lru_prev=entry->lru_prev;
+  else
+    context->lru_tail=entry->lru_prev;
+
+  context->bytes -= entry->bytes;
+
+  if(entry->usage)
+    entry->detached=1;
+  else
+    librdf_hash_cached_free_entry(entry);
+}
+
+
+static int
+librdf_hash_cached_entry_add(librdf_hash_cached_context* context,
+                             librdf_hash_cached_entry* entry,
+                             librdf_hash_datum *value)
+{
+  void *data;
+
+  if(entry->values_count == entry->values_size) {
+    int size=entry->values_size ? (entry->values_size << 1) : 4;
+    librdf_hash_datum* values;
+
+    values=LIBRDF_MALLOC(librdf_hash_datum*, sizeof(librdf_hash_datum) * (size_t)size);
+    if(!values)
+      return 1;
+    if(entry->values) {
+      memcpy(values, entry->values,
+             sizeof(librdf_hash_datum) * (size_t)entry->values_count);
+      LIBRDF_FREE(librdf_hash_datum*, entry->values);
+    }
+    entry->values=values;
+    entry->bytes += sizeof(librdf_hash_datum) * (size_t)(size - entry->values_size);
+    context->bytes += sizeof(librdf_hash_datum) * (size_t)(size - entry->values_size);
+    entry->values_size=size;
+  }
+
+  data=LIBRDF_MALLOC(void*, value->size ? value->size : 1);
+  if(!data)
+    return 1;
+  memcpy(data, value->data, value->size);
+
+  entry->values[entry->values_count].data=data;
+  entry->values[entry->values_count].size=value->size;
+  entry->values_count++;
+  entry->bytes += value->size;
+  context->bytes += value->size;
+
+  return 0;
+}
+
+
+/* write out the buffered puts */
+static int
+librdf_hash_cached_flush(librdf_hash_cached_context* context)
+{
+  int status=0;
+  int i;
+
+  if(!context->pending_count)
+    return 0;
+
+  if(librdf_hash_put_many(context->inner, context->pending_keys,
+                          context->pending_values, context->pending_count)) {
+    librdf_log(context->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH,
+               NULL, "Failed to write %d buffered values to hash",
+               context->pending_count);
+    status=1;
+  }
+
+  for(i=0; i < context->pending_count; i++) {
+    context->bytes -= context->pending_keys[i].size + context->pending_values[i].size;
+    LIBRDF_FREE(char*, context->pending_keys[i].data);
+    LIBRDF_FREE(char*, context->pending_values[i].data);
+  }
+  context->pending_count=0;
+
+  if(status) {
+    /* entries may hold values that were not written */
+    while(context->lru_head)
+      librdf_hash_cached_detach(context, context->lru_head);
+  }
+
+  return status;
+}
+
+
+/*
+ * librdf_hash_cached_load - Read all values of a key into a complete entry
+ * @context: cached hash context
+ * @key: key
+ *
+ * The entry holds the values in the wrapped hash followed by those
+ * of the key still buffered.  An incomplete entry of the key is
+ * replaced, since some of its values may have been written since.
+ * Keys with values taking more than a sixteenth of the budget are
+ * not cached; the buffer is written out so that their lookups can go
+ * to the wrapped hash.
+ *
+ * Return value: complete entry or NULL if the key is not cached
+ **/
+static librdf_hash_cached_entry*
+librdf_hash_cached_load(librdf_hash_cached_context* context,
+                        librdf_hash_datum *key, u32 hash_key)
+{
+  librdf_hash_cached_entry* entry;
+  librdf_hash_cursor* cursor;
+  librdf_hash_datum search_key, next_key, value; /* on stack */
+  size_t limit=context->budget >> 4;
+  size_t loaded=0;
+  int status;
+  int i;
+
+  entry=librdf_hash_cached_find(context, key, hash_key);
+  if(entry)
+    librdf_hash_cached_detach(context, entry);
+
+  entry=librdf_hash_cached_new_entry(context, key, hash_key);
+  if(!entry) {
+    librdf_hash_cached_flush(context);
+    return NULL;
+  }
+
+  cursor=librdf_new_hash_cursor(context->inner);
+  if(!cursor) {
+    librdf_hash_cached_detach(context, entry);
+    librdf_hash_cached_flush(context);
+    return NULL;
+  }
+
+  /* read as librdf_hash_get_all() does, the cursor may change the key */
+  search_key.data=key->data;
+  search_key.size=key->size;
+  next_key.data=NULL;
+  next_key.size=0;
+  value.data=NULL;
+  value.size=0;
+
+  status=librdf_hash_cursor_set(cursor, &search_key, &value);
+  while(!status) {
+    loaded += value.size;
+    if(loaded > limit || librdf_hash_cached_entry_add(context, entry, &value))
+      break;
+    status=librdf_hash_cursor_get_next_value(cursor, &next_key, &value);
+  }
+  librdf_free_hash_cursor(cursor);
+
+  /* add the buffered values */
+  for(i=0; status && i < context->pending_count; i++) {
+    if(context->pending_keys[i].size != key->size ||
+       memcmp(context->pending_keys[i].data, key->data, key->size))
+      continue;
+    loaded += context->pending_values[i].size;
+    if(loaded > limit ||
+       librdf_hash_cached_entry_add(context, entry, &context->pending_values[i]))
+      status=0;
+  }
+
+  if(!status) {
+    /* too large or out of memory */
+    librdf_hash_cached_detach(context, entry);
+    librdf_hash_cached_flush(context);
+    return NULL;
+  }
+
+  entry->complete=1;
+  return entry;
+}
+
+
+/*
+ * librdf_hash_cached_lookup - Get the complete entry of a key
+ * @context: cached hash context
+ * @key: key
+ *
+ * Return value: complete entry or NULL if the key cannot be cached
+ **/
+static librdf_hash_cached_entry*
+librdf_hash_cached_lookup(librdf_hash_cached_context* context,
+                          librdf_hash_datum *key)
+{
+  librdf_hash_cached_entry* entry;
+  u32 hash_key;
+
+  LIBRDF_HASH_KEY_HASH(hash_key, key->data, key->size);
+
+  entry=librdf_hash_cached_find(context, key, hash_key);
+  if(entry && entry->complete) {
+    context->hits++;
+    librdf_hash_cached_touch(context, entry);
+    return entry;
+  }
+
+  context->misses++;
+  return librdf_hash_cached_load(context, key, hash_key);
+}
+
+
+/* keep within the budget by writing out puts and dropping old entries */
+static int
+librdf_hash_cached_trim(librdf_hash_cached_context* context)
+{
+  librdf_hash_cached_entry* entry;
+  librdf_hash_cached_entry* prev;
+  int status;
+
+  if(context->bytes <= context->budget)
+    return 0;
+
+  status=librdf_hash_cached_flush(context);
+
+  /* drop to three quarters of the budget so trimming is not constant */
+  for(entry=context->lru_tail;
+      entry && context->bytes > context->budget - (context->budget >> 2);
+      entry=prev) {
+    prev=entry->lru_prev;
+    if(!entry->usage)
+      librdf_hash_cached_detach(context, entry);
+  }
+
+  return status;
+}
+
+
+/* functions implementing hash api */
+
+/**
+ * librdf_hash_cached_create:
+ * @hash: #librdf_hash hash that this implements
+ * @context: cached hash context
+ *
+ * Create a cached hash over a new hash of the type named after the
+ * "cached:" prefix of the factory name.
+ *
+ * Return value: non 0 on failure.
+ **/
+static int
+librdf_hash_cached_create(librdf_hash* hash, void* context)
+{
+  librdf_hash_cached_context* hcontext=(librdf_hash_cached_context*)context;
+
+  hcontext->hash=hash;
+  hcontext->budget=LIBRDF_HASH_CACHED_DEFAULT_BUDGET;
+
+  hcontext->inner=librdf_new_hash(hash->world, hash->factory->name +
+                                  LIBRDF_HASH_CACHED_PREFIX_LEN);
+  if(!hcontext->inner)
+    return 1;
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_cached_destroy:
+ * @context: cached hash context
+ *
+ * Destroy a cached hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_cached_destroy(void* context)
+{
+  librdf_hash_cached_context* hcontext=(librdf_hash_cached_context*)context;
+
+  if(hcontext->inner)
+    librdf_free_hash(hcontext->inner);
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_cached_open:
+ * @context: cached hash context
+ * @identifier: identifier passed to the wrapped hash
+ * @mode: file creation mode
+ * @is_writable: is hash writable?
+ * @is_new: is hash new?
+ * @options: hash options, also passed to the wrapped hash
+ *
+ * Open the wrapped hash.  Option <literal>cache-budget</literal> sets
+ * the bytes of memory the cache and write buffer may use.
+ *
+ * Return value: non 0 on failure.
+ **/
+static int
+librdf_hash_cached_open(void* context, const char *identifier,
+                        int mode, int is_writable, int is_new,
+                        librdf_hash* options)
+{
+  librdf_hash_cached_context* hcontext=(librdf_hash_cached_context*)context;
+
+  if(options) {
+    long budget=librdf_hash_get_as_long(options, "cache-budget");
+    if(budget > 0)
+      hcontext->budget=(size_t)budget;
+  }
+
+  return librdf_hash_open(hcontext->inner, identifier, mode, is_writable,
+                          is_new, options);
+}
+
+
+/**
+ * librdf_hash_cached_close:
+ * @context: cached hash context
+ *
+ * Write out buffered puts, empty the cache and close the wrapped hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_cached_close(void* context)
+{
+  librdf_hash_cached_context* hcontext=(librdf_hash_cached_context*)context;
+  int status;
+
+  status=librdf_hash_cached_flush(hcontext);
+
+  while(hcontext->lru_head)
+    librdf_hash_cached_detach(hcontext, hcontext->lru_head);
+
+  if(hcontext->buckets) {
+    LIBRDF_FREE(librdf_hash_cached_entry**, hcontext->buckets);
+    hcontext->buckets=NULL;
+    hcontext->buckets_count=0;
+  }
+
+  if(hcontext->pending_keys) {
+    LIBRDF_FREE(librdf_hash_datum*, hcontext->pending_keys);
+    LIBRDF_FREE(librdf_hash_datum*, hcontext->pending_values);
+    hcontext->pending_keys=NULL;
+    hcontext->pending_values=NULL;
+    hcontext->pending_size=0;
+  }
+
+  if(librdf_hash_close(hcontext->inner))
+    status=1;
+
+  return status;
+}
+
+
+/**
+ * librdf_hash_cached_clone:
+ * @hash: new #librdf_hash that this implements
+ * @context: new cached hash context
+ * @new_identifier: new identifier for this hash
+ * @old_context: old cached hash context
+ *
+ * Clone the cached hash by cloning the wrapped hash, with an empty cache.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_cached_clone(librdf_hash *hash, void* context,
+                         char *new_identifier, void *old_context)
+{
+  librdf_hash_cached_context* hcontext=(librdf_hash_cached_context*)context;
+  librdf_hash_cached_context* old_hcontext=(librdf_hash_cached_context*)old_context;
+
+  hcontext->hash=hash;
+  hcontext->budget=old_hcontext->budget;
+
+  if(librdf_hash_cached_flush(old_hcontext))
+    return 1;
+
+  /* new_identifier is generated again by the wrapped hash clone */
+  hcontext->inner=librdf_new_hash_from_hash(old_hcontext->inner);
+  if(!hcontext->inner)
+    return 1;
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_cached_values_count:
+ * @context: cached hash context
+ *
+ * Get the number of values in the hash.
+ *
+ * Return value: number of values in the hash or <0 if not available
+ **/
+static int
+librdf_hash_cached_values_count(void *context)
+{
+  librdf_hash_cached_context* hcontext=(librdf_hash_cached_context*)context;
+
+  if(librdf_hash_cached_flush(hcontext))
+    return -1;
+
+  return librdf_hash_values_count(hcontext->inner);
+}
+
+
+/**
+ * librdf_hash_cached_put:
+ * @context: cached hash context
+ * @key: pointer to key to store
+ * @value: pointer to value to store
+ *
+ * Buffer a key/value pair to be written to the wrapped hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_cached_put(void* context, librdf_hash_datum *key,
+                       librdf_hash_datum *value)
+{
+  librdf_hash_cached_context* hcontext=(librdf_hash_cached_context*)context;
+  librdf_hash_cached_entry* entry;
+  librdf_hash_datum* pending;
+  u32 hash_key;
+  int i;
+
+  if(hcontext->pending_count == hcontext->pending_size) {
+    int size=hcontext->pending_size ? (hcontext->pending_size << 1) : 64;
+    librdf_hash_datum* keys;
+    librdf_hash_datum* values;
+
+    keys=LIBRDF_MALLOC(librdf_hash_datum*, sizeof(librdf_hash_datum) * (size_t)size);
+    values=LIBRDF_MALLOC(librdf_hash_datum*, sizeof(librdf_hash_datum) * (size_t)size);
+    if(!keys || !values) {
+      if(keys)
+        LIBRDF_FREE(librdf_hash_datum*, keys);
+      if(values)
+        LIBRDF_FREE(librdf_hash_datum*, values);
+      return 1;
+    }
+    if(hcontext->pending_keys) {
+      memcpy(keys, hcontext->pending_keys,
+             sizeof(librdf_hash_datum) * (size_t)hcontext->pending_count);
+      memcpy(values, hcontext->pending_values,
+             sizeof(librdf_hash_datum) * (size_t)hcontext->pending_count);
+      LIBRDF_FREE(librdf_hash_datum*, hcontext->pending_keys);
+      LIBRDF_FREE(librdf_hash_datum*, hcontext->pending_values);
+    }
+    hcontext->pending_keys=keys;
+    hcontext->pending_values=values;
+    hcontext->pending_size=size;
+  }
+
+  /* copy key and value into the buffer */
+  for(i=0; i < 2; i++) {
+    librdf_hash_datum* from=i ? value : key;
+
+    pending=i ? &hcontext->pending_values[hcontext->pending_count]
+              : &hcontext->pending_keys[hcontext->pending_count];
+    pending->data=LIBRDF_MALLOC(void*, from->size ? from->size : 1);
+    if(!pending->data) {
+      if(i)
+        LIBRDF_FREE(char*, hcontext->pending_keys[hcontext->pending_count].data);
+      return 1;
+    }
+    memcpy(pending->data, from->data, from->size);
+    pending->size=from->size;
+  }
+  hcontext->pending_count++;
+  hcontext->bytes += key->size + value->size;
+
+  /* make the value visible to lookups of the key */
+  LIBRDF_HASH_KEY_HASH(hash_key, key->data, key->size);
+  entry=librdf_hash_cached_find(hcontext, key, hash_key);
+  if(!entry)
+    entry=librdf_hash_cached_new_entry(hcontext, key, hash_key);
+  if(!entry || librdf_hash_cached_entry_add(hcontext, entry, value)) {
+    /* cannot track it, so write it out now */
+    if(entry)
+      librdf_hash_cached_detach(hcontext, entry);
+    return librdf_hash_cached_flush(hcontext);
+  }
+
+  if(hcontext->pending_count >= LIBRDF_HASH_CACHED_MAX_PENDING &&
+     librdf_hash_cached_flush(hcontext))
+    return 1;
+
+  return librdf_hash_cached_trim(hcontext);
+}
+
+
+/* search the values of an entry */
+static int
+librdf_hash_cached_entry_has_value(librdf_hash_cached_entry* entry,
+                                   librdf_hash_datum *value)
+{
+  int i;
+
+  for(i=0; i < entry->values_count; i++) {
+    if(entry->values[i].size == value->size &&
+       !memcmp(entry->values[i].data, value->data, value->size))
+      return 1;
+  }
+
+  return 0;
+}
+
+
+/*
+ * librdf_hash_cached_exists_cached - Answer an exists check from the cache if possible
+ * @context: cached hash context
+ * @key: key
+ * @value: value or NULL
+ *
+ * Return value: >0 if present, 0 if absent, <0 if the wrapped hash must be checked
+ **/
+static int
+librdf_hash_cached_exists_cached(librdf_hash_cached_context* context,
+                                 librdf_hash_datum *key,
+                                 librdf_hash_datum *value)
+{
+  librdf_hash_cached_entry* entry;
+  u32 hash_key;
+
+  LIBRDF_HASH_KEY_HASH(hash_key, key->data, key->size);
+  entry=librdf_hash_cached_find(context, key, hash_key);
+  if(entry) {
+    if(value ? librdf_hash_cached_entry_has_value(entry, value)
+             : (entry->values_count > 0)) {
+      context->hits++;
+      librdf_hash_cached_touch(context, entry);
+      return 1;
+    }
+    if(entry->complete) {
+      context->hits++;
+      librdf_hash_cached_touch(context, entry);
+      return 0;
+    }
+  }
+
+  context->misses++;
+  return -1;
+}
+
+
+/**
+ * librdf_hash_cached_exists:
+ * @context: cached hash context
+ * @key: pointer to key
+ * @value: pointer to value (optional)
+ *
+ * Test the existence of a key or key/value in the hash.
+ *
+ * Only keys already in the cache are answered without the wrapped
+ * hash; an exists check does not read the values of a key.
+ *
+ * Return value: >0 if the key/value exists in the hash, 0 if not, <0 on failure
+ **/
+static int
+librdf_hash_cached_exists(void* context, librdf_hash_datum *key,
+                          librdf_hash_datum *value)
+{
+  librdf_hash_cached_context* hcontext=(librdf_hash_cached_context*)context;
+  int status;
+
+  status=librdf_hash_cached_exists_cached(hcontext, key, value);
+  if(status >= 0)
+    return status;
+
+  return librdf_hash_exists(hcontext->inner, key, value);
+}
+
+
+/**
+ * librdf_hash_cached_delete_key:
+ * @context: cached hash context
+ * @key: pointer to key to delete
+ *
+ * Delete a key and all its values from the hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_cached_delete_key(void* context, librdf_hash_datum *key)
+{
+  librdf_hash_cached_context* hcontext=(librdf_hash_cached_context*)context;
+  librdf_hash_cached_entry* entry;
+  u32 hash_key;
+
+  if(librdf_hash_cached_flush(hcontext))
+    return 1;
+
+  LIBRDF_HASH_KEY_HASH(hash_key, key->data, key->size);
+  entry=librdf_hash_cached_find(hcontext, key, hash_key);
+  if(entry)
+    librdf_hash_cached_detach(hcontext, entry);
+
+  return librdf_hash_delete_all(hcontext->inner, key);
+}
+
+
+/**
+ * librdf_hash_cached_delete_key_value:
+ * @context: cached hash context
+ * @key: pointer to key to delete
+ * @value: pointer to value to delete
+ *
+ * Delete a key/value pair from the hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_cached_delete_key_value(void* context, librdf_hash_datum *key,
+                                   librdf_hash_datum *value)
+{
+  librdf_hash_cached_context* hcontext=(librdf_hash_cached_context*)context;
+  librdf_hash_cached_entry* entry;
+  u32 hash_key;
+
+  if(librdf_hash_cached_flush(hcontext))
+    return 1;
+
+  LIBRDF_HASH_KEY_HASH(hash_key, key->data, key->size);
+  entry=librdf_hash_cached_find(hcontext, key, hash_key);
+  if(entry)
+    librdf_hash_cached_detach(hcontext, entry);
+
+  return librdf_hash_delete(hcontext->inner, key, value);
+}
+
+
+/**
+ * librdf_hash_cached_sync:
+ * @context: cached hash context
+ *
+ * Write out buffered puts and flush the wrapped hash to disk.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_cached_sync(void* context)
+{
+  librdf_hash_cached_context* hcontext=(librdf_hash_cached_context*)context;
+  int status;
+
+  status=librdf_hash_cached_flush(hcontext);
+  if(librdf_hash_sync(hcontext->inner))
+    status=1;
+
+  return status;
+}
+
+
+/**
+ * librdf_hash_cached_get_fd:
+ * @context: cached hash context
+ *
+ * Get the file description of the wrapped hash.
+ *
+ * Return value: the file descriptor value
+ **/
+static int
+librdf_hash_cached_get_fd(void* context)
+{
+  librdf_hash_cached_context* hcontext=(librdf_hash_cached_context*)context;
+
+  return librdf_hash_get_fd(hcontext->inner);
+}
+
+
+/**
+ * librdf_hash_cached_get_footprint:
+ * @context: cached hash context
+ * @allocated: pointer to store bytes of memory held
+ * @used: pointer to store bytes of that in use
+ *
+ * Get the memory held by the cache and buffered puts.
+ *
+ * Return value: 0
+ **/
+static int
+librdf_hash_cached_get_footprint(void* context, size_t* allocated,
+                                 size_t* used)
+{
+  librdf_hash_cached_context* hcontext=(librdf_hash_cached_context*)context;
+
+  *allocated=hcontext->bytes +
+    sizeof(librdf_hash_cached_entry*) * (size_t)hcontext->buckets_count +
+    2 * sizeof(librdf_hash_datum) * (size_t)hcontext->pending_size;
+  *used=hcontext->bytes;
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_cached_put_many:
+ * @context: cached hash context
+ * @keys: array of keys
+ * @values: array of values
+ * @count: number of key/value pairs
+ *
+ * Buffer an array of key/value pairs.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_cached_put_many(void* context, librdf_hash_datum *keys,
+                            librdf_hash_datum *values, int count)
+{
+  int i;
+
+  for(i=0; i < count; i++) {
+    if(librdf_hash_cached_put(context, &keys[i], &values[i]))
+      return 1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_cached_exists_many:
+ * @context: cached hash context
+ * @keys: array of keys
+ * @values: array of values or NULL
+ * @count: number of keys
+ * @results: array to store the result of each check
+ *
+ * Check an array of keys or key/values, passing those the cache
+ * cannot answer to the wrapped hash as one batch.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_cached_exists_many(void* context, librdf_hash_datum *keys,
+                               librdf_hash_datum *values, int count,
+                               int *results)
+{
+  librdf_hash_cached_context* hcontext=(librdf_hash_cached_context*)context;
+  librdf_hash_datum *miss_pairs;
+  int *miss_index;
+  int miss_count=0;
+  int status=0;
+  int i;
+
+  miss_pairs=LIBRDF_MALLOC(librdf_hash_datum*,
+                           sizeof(librdf_hash_datum) * 2 * (size_t)count);
+  miss_index=LIBRDF_MALLOC(int*, sizeof(int) * 2 * (size_t)count);
+  if(!miss_pairs || !miss_index) {
+    status=1;
+    goto tidy;
+  }
+
+  for(i=0; i < count; i++) {
+    results[i]=librdf_hash_cached_exists_cached(hcontext, &keys[i],
+                                                values ? &values[i] : NULL);
+    if(results[i] < 0) {
+      miss_pairs[miss_count]=keys[i];
+      if(values)
+        miss_pairs[count + miss_count]=values[i];
+      miss_index[miss_count++]=i;
+    }
+  }
+
+  if(miss_count) {
+    int *miss_results=miss_index + count;
+
+    status=librdf_hash_exists_many(hcontext->inner, miss_pairs,
+                                   values ? miss_pairs + count : NULL,
+                                   miss_count, miss_results);
+    if(!status) {
+      for(i=0; i < miss_count; i++)
+        results[miss_index[i]]=miss_results[i];
+    }
+  }
+
+  tidy:
+  if(miss_pairs)
+    LIBRDF_FREE(librdf_hash_datum*, miss_pairs);
+  if(miss_index)
+    LIBRDF_FREE(int*, miss_index);
+
+  return status;
+}
+
+
+/**
+ * librdf_hash_cached_get_many:
+ * @context: cached hash context
+ * @keys: array of keys
+ * @values: array of datums to store the values
+ * @count: number of keys
+ *
+ * Retrieve one value for each of an array of keys, reading the
+ * values of keys that are not cached into the cache.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_cached_get_many(void* context, librdf_hash_datum *keys,
+                            librdf_hash_datum *values, int count)
+{
+  librdf_hash_cached_context* hcontext=(librdf_hash_cached_context*)context;
+  librdf_hash_cached_entry* entry;
+  int i;
+
+  for(i=0; i < count; i++) {
+    values[i].data=NULL;
+    values[i].size=0;
+
+    entry=librdf_hash_cached_lookup(hcontext, &keys[i]);
+    if(!entry) {
+      /* not cacheable, ask the wrapped hash */
+      if(librdf_hash_get_many(hcontext->inner, &keys[i], &values[i], 1))
+        return 1;
+      continue;
+    }
+
+    if(entry->values_count) {
+      values[i].data=LIBRDF_MALLOC(void*, entry->values[0].size ? entry->values[0].size : 1);
+      if(!values[i].data)
+        return 1;
+      memcpy(values[i].data, entry->values[0].data, entry->values[0].size);
+      values[i].size=entry->values[0].size;
+    }
+  }
+
+  return librdf_hash_cached_trim(hcontext);
+}
+
+
+/* cursor */
+
+/**
+ * librdf_hash_cached_cursor_init:
+ * @cursor_context: hash cursor context
+ * @hash_context: hash to operate over
+ *
+ * Initialise a new cached hash cursor.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_cached_cursor_init(void *cursor_context, void *hash_context)
+{
+  librdf_hash_cached_cursor_context* cursor=(librdf_hash_cached_cursor_context*)cursor_context;
+
+  cursor->hash=(librdf_hash_cached_context*)hash_context;
+
+  return 0;
+}
+
+
+static void
+librdf_hash_cached_cursor_release(librdf_hash_cached_cursor_context* cursor)
+{
+  librdf_hash_cached_entry* entry=cursor->entry;
+
+  if(!entry)
+    return;
+
+  cursor->entry=NULL;
+  entry->usage--;
+  if(!entry->usage && entry->detached)
+    librdf_hash_cached_free_entry(entry);
+}
+
+
+/**
+ * librdf_hash_cached_cursor_get:
+ * @context: cached hash cursor context
+ * @key: pointer to key to use
+ * @value: pointer to value to use
+ * @flags: flags
+ *
+ * Retrieve a hash value for the given key.
+ *
+ * The values of one key, wanted by LIBRDF_HASH_CURSOR_SET or a first
+ * LIBRDF_HASH_CURSOR_NEXT with a key, are returned from the cache
+ * and the cursor then ends after the last value of the key.  Other
+ * requests write out buffered puts and use a cursor over the wrapped
+ * hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_cached_cursor_get(void* context,
+                              librdf_hash_datum *key,
+                              librdf_hash_datum *value,
+                              unsigned int flags)
+{
+  librdf_hash_cached_cursor_context* cursor=(librdf_hash_cached_cursor_context*)context;
+  librdf_hash_cached_context* hcontext=cursor->hash;
+  librdf_hash_cached_entry* entry;
+
+  switch(flags) {
+    case LIBRDF_HASH_CURSOR_NEXT:
+      if(cursor->entry)
+        return 1;
+      if(cursor->inner || !key->data)
+        break;
+      /* FALLTHROUGH - first value of a key */
+    case LIBRDF_HASH_CURSOR_SET:
+      librdf_hash_cached_cursor_release(cursor);
+
+      entry=librdf_hash_cached_lookup(hcontext, key);
+      if(!entry)
+        break;
+
+      /* use the entry before trimming so that it is not dropped */
+      entry->usage++;
+      cursor->entry=entry;
+      cursor->index=0;
+      librdf_hash_cached_trim(hcontext);
+      if(!entry->values_count) {
+        librdf_hash_cached_cursor_release(cursor);
+        return 1;
+      }
+      /* FALLTHROUGH */
+
+    case LIBRDF_HASH_CURSOR_NEXT_VALUE:
+      if(!cursor->entry)
+        break;
+
+      entry=cursor->entry;
+      if(cursor->index >= entry->values_count)
+        return 1;
+
+      key->data=entry->key.data;
+      key->size=entry->key.size;
+      if(value) {
+        value->data=entry->values[cursor->index].data;
+        value->size=entry->values[cursor->index].size;
+      }
+      cursor->index++;
+      return 0;
+
+    default:
+      librdf_hash_cached_cursor_release(cursor);
+      break;
+  }
+
+  /* go to the wrapped hash */
+  if(!cursor->inner) {
+    if(librdf_hash_cached_flush(hcontext))
+      return 1;
+    cursor->inner=librdf_new_hash_cursor(hcontext->inner);
+    if(!cursor->inner)
+      return 1;
+  }
+
+  switch(flags) {
+    case LIBRDF_HASH_CURSOR_SET:
+      return librdf_hash_cursor_set(cursor->inner, key, value);
+    case LIBRDF_HASH_CURSOR_NEXT_VALUE:
+      return librdf_hash_cursor_get_next_value(cursor->inner, key, value);
+    case LIBRDF_HASH_CURSOR_FIRST:
+      return librdf_hash_cursor_get_first(cursor->inner, key, value);
+    case LIBRDF_HASH_CURSOR_NEXT:
+      return librdf_hash_cursor_get_next(cursor->inner, key, value);
+    case LIBRDF_HASH_CURSOR_SET_RANGE:
+      return librdf_hash_cursor_set_range(cursor->inner, key, value);
+    default:
+      librdf_log(hcontext->hash->world,
+                 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+                 "Unknown hash method flag %d", flags);
+      return 1;
+  }
+}
+
+
+/**
+ * librdf_hash_cached_cursor_finish:
+ * @context: cached hash cursor context
+ *
+ * Finish the cursor.
+ **/
+static void
+librdf_hash_cached_cursor_finish(void* context)
+{
+  librdf_hash_cached_cursor_context* cursor=(librdf_hash_cached_cursor_context*)context;
+
+  librdf_hash_cached_cursor_release(cursor);
+
+  if(cursor->inner)
+    librdf_free_hash_cursor(cursor->inner);
+}
+
+
+/**
+ * librdf_hash_get_cache_stats:
+ * @hash: hash object
+ * @hits: pointer to store the number of lookups answered by the cache
+ * @misses: pointer to store the number of lookups that were not
+ *
+ * Get the cache counts of a "cached:" hash.
+ *
+ * Return value: non 0 if the hash is not a cached hash
+ **/
+int
+librdf_hash_get_cache_stats(librdf_hash* hash, unsigned long* hits,
+                            unsigned long* misses)
+{
+  librdf_hash_cached_context* hcontext;
+
+  if(strncmp(hash->factory->name, LIBRDF_HASH_CACHED_PREFIX,
+             LIBRDF_HASH_CACHED_PREFIX_LEN))
+    return 1;
+
+  hcontext=(librdf_hash_cached_context*)hash->context;
+  *hits=hcontext->hits;
+  *misses=hcontext->misses;
+
+  return 0;
+}
+
+
+/* local function to register cached hash functions */
+
+static void
+librdf_hash_cached_register_factory(librdf_hash_factory *factory)
+{
+  factory->context_length = sizeof(librdf_hash_cached_context);
+  factory->cursor_context_length = sizeof(librdf_hash_cached_cursor_context);
+
+  factory->create  = librdf_hash_cached_create;
+  factory->destroy = librdf_hash_cached_destroy;
+
+  factory->open    = librdf_hash_cached_open;
+  factory->close   = librdf_hash_cached_close;
+  factory->clone   = librdf_hash_cached_clone;
+
+  factory->values_count = librdf_hash_cached_values_count;
+
+  factory->put     = librdf_hash_cached_put;
+  factory->exists  = librdf_hash_cached_exists;
+  factory->delete_key  = librdf_hash_cached_delete_key;
+  factory->delete_key_value  = librdf_hash_cached_delete_key_value;
+  factory->sync    = librdf_hash_cached_sync;
+  factory->get_fd  = librdf_hash_cached_get_fd;
+  factory->get_footprint = librdf_hash_cached_get_footprint;
+  factory->put_many    = librdf_hash_cached_put_many;
+  factory->exists_many = librdf_hash_cached_exists_many;
+  factory->get_many    = librdf_hash_cached_get_many;
+
+  factory->cursor_init   = librdf_hash_cached_cursor_init;
+  factory->cursor_get    = librdf_hash_cached_cursor_get;
+  factory->cursor_finish = librdf_hash_cached_cursor_finish;
+}
+
+
+/**
+ * librdf_init_hash_cached:
+ * @world: redland world object
+ *
+ * Register a "cached:NAME" hash for each persistent hash type
+ * registered so far.
+ **/
+void
+librdf_init_hash_cached(librdf_world *world)
+{
+  librdf_hash_factory *factory;
+  librdf_hash_factory *cached;
+  char *name;
+
+  /* new factories go in front of the list so are not visited */
+  for(factory=world->hashes; factory; factory=factory->next) {
+    if(!factory->is_persistent)
+      continue;
+
+    name=LIBRDF_MALLOC(char*, LIBRDF_HASH_CACHED_PREFIX_LEN +
+                       strlen(factory->name) + 1);
+    if(!name)
+      return;
+    strcpy(name, LIBRDF_HASH_CACHED_PREFIX);
+    strcpy(name + LIBRDF_HASH_CACHED_PREFIX_LEN, factory->name);
+
+    librdf_hash_register_factory(world, name,
+                                 &librdf_hash_cached_register_factory);
+    cached=librdf_get_hash_factory(world, name);
+    if(cached)
+      cached->has_set_range=factory->has_set_range;
+
+    LIBRDF_FREE(char*, name);
+  }
+}
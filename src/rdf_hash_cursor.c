@@ -141,3 +141,27 @@ librdf_hash_cursor_get_next(librdf_hash_cursor *cursor, librdf_hash_datum *key,
   return cursor->hash->factory->cursor_get(cursor->context, key, value, 
                                            LIBRDF_HASH_CURSOR_NEXT);
 }
+
+
+/*
+ * librdf_hash_cursor_set_range - Position a cursor at the first key not less than a key
+ * @cursor: hash cursor
+ * @key: key to start at; updated with the key found
+ * @value: value found (or NULL)
+ *
+ * Only available for hashes with ordered keys, see
+ * librdf_hash_has_set_range().  Following keys are returned by
+ * librdf_hash_cursor_get_next() in key order.
+ *
+ * Return value: non 0 on failure or if no key is not less than @key
+ **/
+int
+librdf_hash_cursor_set_range(librdf_hash_cursor *cursor,
+                             librdf_hash_datum *key, librdf_hash_datum *value)
+{
+  if(!cursor->hash->factory->has_set_range)
+    return 1;
+  
+  return cursor->hash->factory->cursor_get(cursor->context, key, value, 
+                                           LIBRDF_HASH_CURSOR_SET_RANGE);
+}
@@ -26,6 +26,8 @@
 #ifndef LIBRDF_HASH_INTERNAL_H
 #define LIBRDF_HASH_INTERNAL_H
 
+#include <rdf_types.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -48,6 +50,8 @@ void librdf_free_hash_datum(librdf_hash_datum *ptr);
 
 
 /** A hash object */
+typedef struct librdf_hash_bloom_s librdf_hash_bloom;
+
 struct librdf_hash_s
 {
   librdf_world* world;
@@ -55,6 +59,11 @@ struct librdf_hash_s
   void* context;
   int   is_open;
   struct librdf_hash_factory_s* factory;
+
+  /* optional filter of the key/value pairs of a persistent hash */
+  librdf_hash_bloom* bloom;
+  char* bloom_file;  /* where the filter is saved or NULL if read-only */
+  int bloom_saved;   /* bloom_file is up to date */
 };
 
 
@@ -100,6 +109,21 @@ struct librdf_hash_factory_s {
   /* get the file descriptor for the hash, if it is file based (for locking) */
   int (*get_fd)(void* context);
 
+  /* get bytes of memory held and used by the hash (optional) */
+  int (*get_footprint)(void* context, size_t* allocated, size_t* used);
+
+  /* batched put / exists / get of count keys and values (optional) */
+  int (*put_many)(void* context, librdf_hash_datum *keys, librdf_hash_datum *values, int count);
+  int (*exists_many)(void* context, librdf_hash_datum *keys, librdf_hash_datum *values, int count, int *results);
+  int (*get_many)(void* context, librdf_hash_datum *keys, librdf_hash_datum *values, int count);
+
+  /* non-0 if keys are kept in order and cursor_get supports
+   * LIBRDF_HASH_CURSOR_SET_RANGE */
+  int has_set_range;
+
+  /* non-0 if the hash is kept in files so exists() may need disk reads */
+  int is_persistent;
+
   /* create a cursor and operate on it */
   int (*cursor_init)(void *cursor_context, void* hash_context);
   int (*cursor_get)(void *cursor, librdf_hash_datum *key, librdf_hash_datum *value, unsigned int flags);
@@ -123,6 +147,46 @@ void librdf_finish_hash(librdf_world *world);
 #define LIBRDF_HASH_CURSOR_NEXT_VALUE 1
 #define LIBRDF_HASH_CURSOR_FIRST 2
 #define LIBRDF_HASH_CURSOR_NEXT 3
+/* position at the first key >= the given key (ordered hashes only) */
+#define LIBRDF_HASH_CURSOR_SET_RANGE 4
+
+
+/*
+ * perldelta 5.8.0 says under *Performance Enhancements*
+ *
+ *   Hashes now use Bob Jenkins "One-at-a-Time" hashing key algorithm
+ *   http://burtleburtle.net/bob/hash/doobs.html  This algorithm is
+ *   reasonably fast while producing a much better spread of values
+ *   than the old hashing algorithm ...
+ *
+ * Changed here to hash the string backwards to help do URIs better
+ *
+ */
+
+#define ONE_AT_A_TIME_HASH(hash,str,len) \
+     do { \
+        register const unsigned char *c_oneat = (unsigned char*)str+len-1; \
+        register size_t i_oneat = len; \
+        register u32 hash_oneat = 0; \
+        while (i_oneat--) { \
+            hash_oneat += *c_oneat--; \
+            hash_oneat += (hash_oneat << 10); \
+            hash_oneat ^= (hash_oneat >> 6); \
+        } \
+        hash_oneat += (hash_oneat << 3); \
+        hash_oneat ^= (hash_oneat >> 11); \
+        (hash) = (hash_oneat + (hash_oneat << 15)); \
+    } while(0)
+
+u32 librdf_hash_word_hash(const void *key, size_t len);
+
+/* Key hash function used by the memory hashes */
+#ifdef LIBRDF_HASH_WORD_HASH
+#define LIBRDF_HASH_KEY_HASH(hash,str,len) \
+     do { (hash) = librdf_hash_word_hash(str, len); } while(0)
+#else
+#define LIBRDF_HASH_KEY_HASH(hash,str,len) ONE_AT_A_TIME_HASH(hash,str,len)
+#endif
 
 
 /* constructors */
@@ -150,14 +214,28 @@ int librdf_hash_put(librdf_hash* hash, librdf_hash_datum *key, librdf_hash_datum
   /* returns true if key exists in hash, without returning value */
 int librdf_hash_exists(librdf_hash* hash, librdf_hash_datum *key, librdf_hash_datum *value);
 
+/* batched versions of put, exists and get_one over arrays of datums */
+int librdf_hash_put_many(librdf_hash* hash, librdf_hash_datum *keys, librdf_hash_datum *values, int count);
+int librdf_hash_exists_many(librdf_hash* hash, librdf_hash_datum *keys, librdf_hash_datum *values, int count, int *results);
+int librdf_hash_get_many(librdf_hash* hash, librdf_hash_datum *keys, librdf_hash_datum *values, int count);
+
 int librdf_hash_delete(librdf_hash* hash, librdf_hash_datum *key, librdf_hash_datum *value);
 int librdf_hash_delete_all(librdf_hash* hash, librdf_hash_datum *key);
 librdf_iterator* librdf_hash_keys(librdf_hash* hash, librdf_hash_datum *key);
+/* retrieve all key/value pairs whose key starts with a prefix */
+librdf_iterator* librdf_hash_get_prefix(librdf_hash* hash, librdf_hash_datum *prefix, librdf_hash_datum *key, librdf_hash_datum *value);
+int librdf_hash_has_set_range(librdf_hash* hash);
 
 /* flush any cached information to disk */
 int librdf_hash_sync(librdf_hash* hash);
 /* get the file descriptor for the hash, if it is file based (for locking) */
 int librdf_hash_get_fd(librdf_hash* hash);
+/* get bytes of memory held and used by an in-memory hash */
+int librdf_hash_get_footprint(librdf_hash* hash, size_t* allocated, size_t* used);
+/* get the Bloom filter check counts of a hash opened with bloom-filter */
+int librdf_hash_get_filter_stats(librdf_hash* hash, unsigned long* checks, unsigned long* negatives, unsigned long* false_positives);
+/* get the cache hit and miss counts of a cached: hash */
+int librdf_hash_get_cache_stats(librdf_hash* hash, unsigned long* hits, unsigned long* misses);
 
 /* init a hash from an array of strings */
 int librdf_hash_from_array_of_strings(librdf_hash* hash, const char *array[]);
@@ -171,6 +249,20 @@ int librdf_hash_cursor_set(librdf_hash_cursor *cursor, librdf_hash_datum *key,li
 int librdf_hash_cursor_get_next_value(librdf_hash_cursor *cursor, librdf_hash_datum *key,librdf_hash_datum *value);
 int librdf_hash_cursor_get_first(librdf_hash_cursor *cursor, librdf_hash_datum *key, librdf_hash_datum *value);
 int librdf_hash_cursor_get_next(librdf_hash_cursor *cursor, librdf_hash_datum *key, librdf_hash_datum *value);
+int librdf_hash_cursor_set_range(librdf_hash_cursor *cursor, librdf_hash_datum *key, librdf_hash_datum *value);
+
+/* Bloom filter methods from rdf_hash_bloom.c */
+
+librdf_hash_bloom* librdf_new_hash_bloom(librdf_world* world, size_t capacity);
+void librdf_free_hash_bloom(librdf_hash_bloom* bloom);
+void librdf_hash_bloom_add(librdf_hash_bloom* bloom, librdf_hash_datum* key, librdf_hash_datum* value);
+int librdf_hash_bloom_check(librdf_hash_bloom* bloom, librdf_hash_datum* key, librdf_hash_datum* value);
+void librdf_hash_bloom_false_positive(librdf_hash_bloom* bloom);
+int librdf_hash_bloom_is_full(librdf_hash_bloom* bloom);
+size_t librdf_hash_bloom_get_capacity(librdf_hash_bloom* bloom);
+void librdf_hash_bloom_get_stats(librdf_hash_bloom* bloom, unsigned long* checks, unsigned long* negatives, unsigned long* false_positives);
+librdf_hash_bloom* librdf_hash_bloom_load(librdf_world* world, const char* filename);
+int librdf_hash_bloom_save(librdf_hash_bloom* bloom, const char* filename);
 
 #ifdef HAVE_BDB_HASH
 void librdf_init_hash_bdb(librdf_world *world);
@@ -179,7 +271,13 @@ void librdf_init_hash_bdb(librdf_world *world);
 #ifdef HAVE_TOKYODB_HASH
 void librdf_init_hash_tokyodb(librdf_world *world);
 #endif
+
+#ifdef HAVE_MMAP_HASH
+void librdf_init_hash_mmap(librdf_world *world);
+#endif
 void librdf_init_hash_memory(librdf_world *world);
+void librdf_init_hash_memory2(librdf_world *world);
+void librdf_init_hash_cached(librdf_world *world);
 
 
 #ifdef __cplusplus
@@ -48,8 +48,11 @@
 struct librdf_hash_memory_node_value_s
 {
   struct librdf_hash_memory_node_value_s* next;
+  struct librdf_hash_memory_node_value_s* prev;
   void *value;
   size_t value_len;
+  /* hash of value - only set when the node has a value set */
+  u32 hash_value;
 };
 typedef struct librdf_hash_memory_node_value_s librdf_hash_memory_node_value;
 
@@ -62,14 +65,72 @@ struct librdf_hash_memory_node_s
   u32 hash_key;
   librdf_hash_memory_node_value *values;
   int values_count;
+  /* Open addressing set of the values when there are many of them,
+   * for constant time value lookup; NULL if not used */
+  librdf_hash_memory_node_value **value_set;
+  /* size of value_set array - always a power of 2 */
+  int value_set_capacity;
 };
 typedef struct librdf_hash_memory_node_s librdf_hash_memory_node;
 
 
+/* Arena allocator for the nodes, value nodes and key and value copies
+ * of one hash.  Small pieces are carved from large blocks and recycled
+ * through free lists by size; larger ones are allocated individually
+ * but still tracked so everything is freed at once on destroy.
+ */
+
+/* allocation granularity and alignment */
+#define LIBRDF_HASH_MEMORY_ARENA_ALIGN 8
+/* largest piece carved from a block */
+#define LIBRDF_HASH_MEMORY_ARENA_SMALL_MAX 256
+#define LIBRDF_HASH_MEMORY_ARENA_CLASSES (LIBRDF_HASH_MEMORY_ARENA_SMALL_MAX / LIBRDF_HASH_MEMORY_ARENA_ALIGN)
+#define LIBRDF_HASH_MEMORY_ARENA_BLOCK_SIZE 65536
+
+#define LIBRDF_HASH_MEMORY_ARENA_ROUND(size) \
+  (((size) + LIBRDF_HASH_MEMORY_ARENA_ALIGN - 1) & ~((size_t)LIBRDF_HASH_MEMORY_ARENA_ALIGN - 1))
+
+struct librdf_hash_memory_arena_block_s
+{
+  struct librdf_hash_memory_arena_block_s* next;
+  size_t used;
+};
+typedef struct librdf_hash_memory_arena_block_s librdf_hash_memory_arena_block;
+
+/* header before each large piece */
+struct librdf_hash_memory_arena_large_s
+{
+  struct librdf_hash_memory_arena_large_s* prev;
+  struct librdf_hash_memory_arena_large_s* next;
+};
+typedef struct librdf_hash_memory_arena_large_s librdf_hash_memory_arena_large;
+
+#define LIBRDF_HASH_MEMORY_ARENA_BLOCK_HEADER \
+  LIBRDF_HASH_MEMORY_ARENA_ROUND(sizeof(librdf_hash_memory_arena_block))
+#define LIBRDF_HASH_MEMORY_ARENA_LARGE_HEADER \
+  LIBRDF_HASH_MEMORY_ARENA_ROUND(sizeof(librdf_hash_memory_arena_large))
+
+typedef struct
+{
+  /* blocks, most recent (the one being carved) first */
+  librdf_hash_memory_arena_block* blocks;
+  /* free pieces by size class; a free piece holds the next pointer */
+  void* free_lists[LIBRDF_HASH_MEMORY_ARENA_CLASSES];
+  /* large pieces */
+  librdf_hash_memory_arena_large* large;
+  /* bytes obtained from the system */
+  size_t allocated;
+  /* bytes handed out and not freed */
+  size_t used;
+} librdf_hash_memory_arena;
+
+
 typedef struct
 {
   /* the hash object */
   librdf_hash* hash;
+  /* allocator for everything hanging off nodes */
+  librdf_hash_memory_arena arena;
   /* An array pointing to a list of nodes (buckets) */
   librdf_hash_memory_node** nodes;
   /* this many buckets used */
@@ -81,6 +142,13 @@ typedef struct
   /* total array size */
   int capacity;
 
+  /* Previous array while a resize is incrementally moving its nodes
+   * into nodes, otherwise NULL.  Buckets before rehash_bucket have
+   * already been moved.  capacity is always twice old_capacity. */
+  librdf_hash_memory_node** old_nodes;
+  int old_capacity;
+  int rehash_bucket;
+
   /* array load factor expressed out of 1000.
    * Always true: (size/capacity * 1000) < load_factor,
    * or in the code: size * 1000 < load_factor * capacity
@@ -96,11 +164,26 @@ static const int librdf_hash_default_load_factor=750;
 /* starting capacity - MUST BE POWER OF 2 */
 static const int librdf_hash_initial_capacity=8;
 
+/* old buckets moved per write operation while resizing */
+static const int librdf_hash_rehash_buckets=8;
+
+/* number of values of a key above which a value set is used */
+static const int librdf_hash_value_set_threshold=16;
+
 
 /* prototypes for local functions */
-static librdf_hash_memory_node* librdf_hash_memory_find_node(librdf_hash_memory_context* hash, void *key, size_t key_len, int *bucket, librdf_hash_memory_node** prev);
-static void librdf_free_hash_memory_node(librdf_hash_memory_node* node);
+static void* librdf_hash_memory_arena_alloc(librdf_hash_memory_arena* arena, size_t size);
+static void librdf_hash_memory_arena_free(librdf_hash_memory_arena* arena, void* ptr, size_t size);
+static void librdf_hash_memory_arena_finish(librdf_hash_memory_arena* arena);
+static librdf_hash_memory_node* librdf_hash_memory_find_node(librdf_hash_memory_context* hash, void *key, size_t key_len, librdf_hash_memory_node*** bucket, librdf_hash_memory_node** prev);
+static void librdf_free_hash_memory_node(librdf_hash_memory_context* hash, librdf_hash_memory_node* node);
 static int librdf_hash_memory_expand_size(librdf_hash_memory_context* hash);
+static void librdf_hash_memory_rehash(librdf_hash_memory_context* hash, int buckets);
+static u32 librdf_hash_memory_reverse_bits(u32 v);
+static int librdf_hash_memory_value_set_build(librdf_hash_memory_context* hash, librdf_hash_memory_node* node, int capacity);
+static int librdf_hash_memory_value_set_add(librdf_hash_memory_context* hash, librdf_hash_memory_node* node, librdf_hash_memory_node_value* vnode);
+static void librdf_hash_memory_value_set_remove(librdf_hash_memory_node* node, int slot);
+static librdf_hash_memory_node_value* librdf_hash_memory_find_value(librdf_hash_memory_node* node, void *value, size_t value_len, int *user_slot);
 
 /* Implementing the hash cursor */
 static int librdf_hash_memory_cursor_init(void *cursor_context, void *hash_context);
@@ -124,42 +207,152 @@ static int librdf_hash_memory_delete_key(void* context, librdf_hash_datum *key);
 static int librdf_hash_memory_delete_key_value(void* context, librdf_hash_datum *key, librdf_hash_datum *value);
 static int librdf_hash_memory_sync(void* context);
 static int librdf_hash_memory_get_fd(void* context);
+static int librdf_hash_memory_get_footprint(void* context, size_t* allocated, size_t* used);
+static int librdf_hash_memory_put_many(void* context, librdf_hash_datum *keys, librdf_hash_datum *values, int count);
+static int librdf_hash_memory_exists_many(void* context, librdf_hash_datum *keys, librdf_hash_datum *values, int count, int *results);
+static int librdf_hash_memory_get_many(void* context, librdf_hash_datum *keys, librdf_hash_datum *values, int count);
 
 static void librdf_hash_memory_register_factory(librdf_hash_factory *factory);
 
 
+/* helper functions */
 
 
-/*
- * perldelta 5.8.0 says under *Performance Enhancements*
+/**
+ * librdf_hash_memory_arena_alloc:
+ * @arena: arena
+ * @size: size in bytes
  *
- *   Hashes now use Bob Jenkins "One-at-a-Time" hashing key algorithm
- *   http://burtleburtle.net/bob/hash/doobs.html  This algorithm is
- *   reasonably fast while producing a much better spread of values
- *   than the old hashing algorithm ...
+ * Allocate memory from the arena.  It is not initialised.
  *
- * Changed here to hash the string backwards to help do URIs better
+ * Return value: pointer to memory or NULL on failure
+ **/
+static void*
+librdf_hash_memory_arena_alloc(librdf_hash_memory_arena* arena, size_t size)
+{
+  librdf_hash_memory_arena_block* block;
+  size_t rounded;
+  void* ptr;
+  int size_class;
+
+  if(size > LIBRDF_HASH_MEMORY_ARENA_SMALL_MAX) {
+    librdf_hash_memory_arena_large* large;
+
+    large=LIBRDF_MALLOC(librdf_hash_memory_arena_large*,
+                        LIBRDF_HASH_MEMORY_ARENA_LARGE_HEADER + size);
+    if(!large)
+      return NULL;
+    large->prev=NULL;
+    large->next=arena->large;
+    if(arena->large)
+      arena->large->prev=large;
+    arena->large=large;
+
+    arena->allocated+=LIBRDF_HASH_MEMORY_ARENA_LARGE_HEADER + size;
+    arena->used+=size;
+    return (char*)large + LIBRDF_HASH_MEMORY_ARENA_LARGE_HEADER;
+  }
+
+  rounded=size ? LIBRDF_HASH_MEMORY_ARENA_ROUND(size) : LIBRDF_HASH_MEMORY_ARENA_ALIGN;
+  size_class=(int)(rounded / LIBRDF_HASH_MEMORY_ARENA_ALIGN) - 1;
+
+  /* reuse a freed piece of the same size */
+  if((ptr=arena->free_lists[size_class])) {
+    arena->free_lists[size_class]=*(void**)ptr;
+    arena->used+=rounded;
+    return ptr;
+  }
+
+  block=arena->blocks;
+  if(!block ||
+     LIBRDF_HASH_MEMORY_ARENA_BLOCK_HEADER + block->used + rounded > LIBRDF_HASH_MEMORY_ARENA_BLOCK_SIZE) {
+    /* start a new block; the tail of the old one is not used */
+    block=LIBRDF_MALLOC(librdf_hash_memory_arena_block*,
+                        LIBRDF_HASH_MEMORY_ARENA_BLOCK_SIZE);
+    if(!block)
+      return NULL;
+    block->used=0;
+    block->next=arena->blocks;
+    arena->blocks=block;
+    arena->allocated+=LIBRDF_HASH_MEMORY_ARENA_BLOCK_SIZE;
+  }
+
+  ptr=(char*)block + LIBRDF_HASH_MEMORY_ARENA_BLOCK_HEADER + block->used;
+  block->used+=rounded;
+  arena->used+=rounded;
+
+  return ptr;
+}
+
+
+/**
+ * librdf_hash_memory_arena_free:
+ * @arena: arena
+ * @ptr: pointer returned by librdf_hash_memory_arena_alloc() or NULL
+ * @size: size it was allocated with
  *
- */
+ * Return memory to the arena for reuse.
+ **/
+static void
+librdf_hash_memory_arena_free(librdf_hash_memory_arena* arena, void* ptr,
+                              size_t size)
+{
+  size_t rounded;
+  int size_class;
+
+  if(!ptr)
+    return;
+
+  if(size > LIBRDF_HASH_MEMORY_ARENA_SMALL_MAX) {
+    librdf_hash_memory_arena_large* large;
+
+    large=(librdf_hash_memory_arena_large*)((char*)ptr - LIBRDF_HASH_MEMORY_ARENA_LARGE_HEADER);
+    if(large->prev)
+      large->prev->next=large->next;
+    else
+      arena->large=large->next;
+    if(large->next)
+      large->next->prev=large->prev;
+    LIBRDF_FREE(librdf_hash_memory_arena_large, large);
+
+    arena->allocated-=LIBRDF_HASH_MEMORY_ARENA_LARGE_HEADER + size;
+    arena->used-=size;
+    return;
+  }
 
-#define ONE_AT_A_TIME_HASH(hash,str,len) \
-     do { \
-        register const unsigned char *c_oneat = (unsigned char*)str+len-1; \
-        register size_t i_oneat = len; \
-        register u32 hash_oneat = 0; \
-        while (i_oneat--) { \
-            hash_oneat += *c_oneat--; \
-            hash_oneat += (hash_oneat << 10); \
-            hash_oneat ^= (hash_oneat >> 6); \
-        } \
-        hash_oneat += (hash_oneat << 3); \
-        hash_oneat ^= (hash_oneat >> 11); \
-        (hash) = (hash_oneat + (hash_oneat << 15)); \
-    } while(0)
+  rounded=size ? LIBRDF_HASH_MEMORY_ARENA_ROUND(size) : LIBRDF_HASH_MEMORY_ARENA_ALIGN;
+  size_class=(int)(rounded / LIBRDF_HASH_MEMORY_ARENA_ALIGN) - 1;
 
+  *(void**)ptr=arena->free_lists[size_class];
+  arena->free_lists[size_class]=ptr;
+  arena->used-=rounded;
+}
 
 
-/* helper functions */
+/**
+ * librdf_hash_memory_arena_finish:
+ * @arena: arena
+ *
+ * Free all memory held by the arena.
+ **/
+static void
+librdf_hash_memory_arena_finish(librdf_hash_memory_arena* arena)
+{
+  librdf_hash_memory_arena_block *block, *next_block;
+  librdf_hash_memory_arena_large *large, *next_large;
+
+  for(block=arena->blocks; block; block=next_block) {
+    next_block=block->next;
+    LIBRDF_FREE(librdf_hash_memory_arena_block, block);
+  }
+
+  for(large=arena->large; large; large=next_large) {
+    next_large=large->next;
+    LIBRDF_FREE(librdf_hash_memory_arena_large, large);
+  }
+
+  memset(arena, 0, sizeof(*arena));
+}
 
 
 /**
@@ -170,89 +363,334 @@ static void librdf_hash_memory_register_factory(librdf_hash_factory *factory);
  * @user_bucket: pointer to store bucket
  * @prev: pointer to store previous node
  *
- * Find the node for the given key or value.
+ * Find the node for the given key.
  * 
- * If value is not NULL and value_len is non 0, the value will also be
- * compared in the search.
+ * While a resize is in progress the key may still be in the old
+ * table, so that is searched too.
  *
- * If user_bucket is not NULL, the bucket used will be returned.  if
- * prev is no NULL, the previous node in the list will be returned.
+ * If user_bucket is not NULL, a pointer to the head of the bucket list
+ * holding the node will be returned.  if prev is no NULL, the previous
+ * node in the list will be returned.
  * 
  * Return value: #librdf_hash_memory_node of content or NULL on failure
  **/
 static librdf_hash_memory_node*
 librdf_hash_memory_find_node(librdf_hash_memory_context* hash, 
 			     void *key, size_t key_len,
-			     int *user_bucket,
+			     librdf_hash_memory_node*** user_bucket,
 			     librdf_hash_memory_node** prev) 
 {
+  librdf_hash_memory_node** bucket;
   librdf_hash_memory_node* node;
-  int bucket;
   u32 hash_key;
+  int pass;
 
   /* empty hash */
   if(!hash->capacity)
     return NULL;
   
-  ONE_AT_A_TIME_HASH(hash_key, key, key_len);
-
-  if(prev)
-    *prev=NULL;
-
-  /* find slot in table */
-  bucket=hash_key & (hash->capacity - 1);
-  if(user_bucket)
-    *user_bucket=bucket;
+  LIBRDF_HASH_KEY_HASH(hash_key, key, key_len);
+
+  for(pass=0; pass < 2; pass++) {
+    if(!pass)
+      /* find slot in table */
+      bucket=&hash->nodes[hash_key & (hash->capacity - 1)];
+    else {
+      int old_bucket;
+
+      /* not found - while resizing, the key may be in an old bucket
+       * that has not been moved yet */
+      if(!hash->old_nodes)
+        break;
+      old_bucket=hash_key & (hash->old_capacity - 1);
+      if(old_bucket < hash->rehash_bucket)
+        break;
+      bucket=&hash->old_nodes[old_bucket];
+    }
 
-  /* check if there is a list present */ 
-  node=hash->nodes[bucket];
-  if(!node)
-    /* no list there */
-    return NULL;
-    
-  /* walk the list */
-  while(node) {
-    if(key_len == node->key_len && !memcmp(key, node->key, key_len))
-      break;
     if(prev)
-      *prev=node;
-    node=node->next;
+      *prev=NULL;
+
+    /* walk the list */
+    for(node=*bucket; node; node=node->next) {
+      if(hash_key == node->hash_key && key_len == node->key_len &&
+         !memcmp(key, node->key, key_len)) {
+        if(user_bucket)
+          *user_bucket=bucket;
+        return node;
+      }
+      if(prev)
+        *prev=node;
+    }
   }
 
-  return node;
+  return NULL;
 }
 
 
 static void
-librdf_free_hash_memory_node(librdf_hash_memory_node* node) 
+librdf_free_hash_memory_node(librdf_hash_memory_context* hash,
+                             librdf_hash_memory_node* node) 
 {
-  if(node->key)
-    LIBRDF_FREE(char*, node->key);
+  librdf_hash_memory_arena* arena=&hash->arena;
+
+  librdf_hash_memory_arena_free(arena, node->key, node->key_len);
   if(node->values) {
     librdf_hash_memory_node_value *vnode, *next;
 
     /* Empty the list of values */
     for(vnode=node->values; vnode; vnode=next) {
       next=vnode->next;
-      if(vnode->value)
-        LIBRDF_FREE(char*, vnode->value);
-      LIBRDF_FREE(librdf_hash_memory_node_value, vnode);
+      librdf_hash_memory_arena_free(arena, vnode->value, vnode->value_len);
+      librdf_hash_memory_arena_free(arena, vnode, sizeof(*vnode));
+    }
+  }
+  librdf_hash_memory_arena_free(arena, node->value_set,
+                                node->value_set_capacity * sizeof(librdf_hash_memory_node_value*));
+  librdf_hash_memory_arena_free(arena, node, sizeof(*node));
+}
+
+
+/**
+ * librdf_hash_memory_value_set_build:
+ * @hash: the memory hash context
+ * @node: hash node
+ * @capacity: size of value set - MUST BE POWER OF 2
+ *
+ * (Re)build the value set of a node from its list of values.
+ *
+ * On failure the node is left without a value set, which is still
+ * correct since the list of values is always complete.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_value_set_build(librdf_hash_memory_context* hash,
+                                   librdf_hash_memory_node* node,
+                                   int capacity)
+{
+  librdf_hash_memory_node_value *vnode;
+  int had_set=(node->value_set != NULL);
+  size_t size=capacity * sizeof(librdf_hash_memory_node_value*);
+
+  if(node->value_set) {
+    librdf_hash_memory_arena_free(&hash->arena, node->value_set,
+                                  node->value_set_capacity * sizeof(librdf_hash_memory_node_value*));
+    node->value_set=NULL;
+  }
+
+  node->value_set=(librdf_hash_memory_node_value**)librdf_hash_memory_arena_alloc(&hash->arena, size);
+  if(!node->value_set)
+    return 1;
+  memset(node->value_set, 0, size);
+  node->value_set_capacity=capacity;
+
+  for(vnode=node->values; vnode; vnode=vnode->next) {
+    int i;
+
+    /* hashes are already valid if the set is being grown */
+    if(!had_set)
+      LIBRDF_HASH_KEY_HASH(vnode->hash_value, vnode->value, vnode->value_len);
+
+    for(i=vnode->hash_value & (capacity - 1); node->value_set[i];
+        i=(i + 1) & (capacity - 1))
+      ;
+    node->value_set[i]=vnode;
+  }
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory_value_set_add:
+ * @hash: the memory hash context
+ * @node: hash node
+ * @vnode: value node, already added to the node's list of values
+ *
+ * Add a value to the value set of a node, growing the set if needed.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_value_set_add(librdf_hash_memory_context* hash,
+                                 librdf_hash_memory_node* node,
+                                 librdf_hash_memory_node_value* vnode)
+{
+  int mask;
+  int i;
+
+  LIBRDF_HASH_KEY_HASH(vnode->hash_value, vnode->value, vnode->value_len);
+
+  /* keep set at most half full; values_count already includes vnode */
+  if((node->values_count << 1) > node->value_set_capacity)
+    return librdf_hash_memory_value_set_build(hash, node,
+                                              node->value_set_capacity << 1);
+
+  mask=node->value_set_capacity - 1;
+  for(i=vnode->hash_value & mask; node->value_set[i]; i=(i + 1) & mask)
+    ;
+  node->value_set[i]=vnode;
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory_value_set_remove:
+ * @node: hash node
+ * @slot: value set slot to empty
+ *
+ * Remove a value from the value set of a node, moving back any
+ * following values in the same probe run so no tombstone is needed.
+ **/
+static void
+librdf_hash_memory_value_set_remove(librdf_hash_memory_node* node, int slot)
+{
+  int mask=node->value_set_capacity - 1;
+  int i;
+
+  node->value_set[slot]=NULL;
+
+  for(i=(slot + 1) & mask; node->value_set[i]; i=(i + 1) & mask) {
+    int home=node->value_set[i]->hash_value & mask;
+
+    /* move back if the home slot is not cyclically within (slot, i] */
+    if((slot <= i) ? (home <= slot || home > i) : (home <= slot && home > i)) {
+      node->value_set[slot]=node->value_set[i];
+      node->value_set[i]=NULL;
+      slot=i;
+    }
+  }
+}
+
+
+/**
+ * librdf_hash_memory_find_value:
+ * @node: hash node
+ * @value: value data
+ * @value_len: value length
+ * @user_slot: pointer to store value set slot (or NULL)
+ *
+ * Find a value of a node, using the value set if there is one.
+ *
+ * Return value: value node or NULL if not found
+ **/
+static librdf_hash_memory_node_value*
+librdf_hash_memory_find_value(librdf_hash_memory_node* node,
+                              void *value, size_t value_len,
+                              int *user_slot)
+{
+  librdf_hash_memory_node_value *vnode;
+
+  if(node->value_set) {
+    int mask=node->value_set_capacity - 1;
+    u32 hash_value;
+    int i;
+
+    LIBRDF_HASH_KEY_HASH(hash_value, value, value_len);
+
+    for(i=hash_value & mask; (vnode=node->value_set[i]); i=(i + 1) & mask) {
+      if(vnode->hash_value == hash_value && value_len == vnode->value_len &&
+         !memcmp(value, vnode->value, value_len)) {
+        if(user_slot)
+          *user_slot=i;
+        return vnode;
+      }
+    }
+    return NULL;
+  }
+
+  for(vnode=node->values; vnode; vnode=vnode->next) {
+    if(value_len == vnode->value_len &&
+       !memcmp(value, vnode->value, value_len))
+      break;
+  }
+
+  return vnode;
+}
+
+
+/**
+ * librdf_hash_memory_rehash:
+ * @hash: the memory hash context
+ * @buckets: maximum number of old buckets to move
+ *
+ * Move the nodes of some old table buckets left by a resize into the
+ * current table, freeing the old table once it is empty.
+ *
+ * An old bucket splits into the two current buckets with the same low
+ * bits.  Its nodes are appended in order to the ends of their new
+ * lists, so a cursor walking a current bucket meets the same nodes in
+ * the same order whether or not they have been moved yet.
+ **/
+static void
+librdf_hash_memory_rehash(librdf_hash_memory_context* hash, int buckets)
+{
+  if(!hash->old_nodes)
+    return;
+
+  while(buckets-- > 0 && hash->rehash_bucket < hash->old_capacity) {
+    librdf_hash_memory_node *node=hash->old_nodes[hash->rehash_bucket];
+
+    if(node) {
+      librdf_hash_memory_node **tails[2];
+      int half;
+
+      hash->old_nodes[hash->rehash_bucket]=NULL;
+      hash->size--;
+
+      for(half=0; half < 2; half++) {
+        tails[half]=&hash->nodes[hash->rehash_bucket + half * hash->old_capacity];
+        while(*tails[half])
+          tails[half]=&(*tails[half])->next;
+      }
+
+      while(node) {
+        librdf_hash_memory_node *next=node->next;
+
+        half=(node->hash_key & hash->old_capacity) ? 1 : 0;
+        if(tails[half] == &hash->nodes[hash->rehash_bucket + half * hash->old_capacity])
+          hash->size++;
+        node->next=NULL;
+        *tails[half]=node;
+        tails[half]=&node->next;
+
+        node=next;
+      }
     }
+
+    hash->rehash_bucket++;
+  }
+
+  if(hash->rehash_bucket == hash->old_capacity) {
+    LIBRDF_FREE(librdf_hash_memory_nodes, hash->old_nodes);
+    hash->old_nodes=NULL;
+    hash->old_capacity=0;
+    hash->rehash_bucket=0;
   }
-  LIBRDF_FREE(librdf_hash_memory_node, node);
 }
 
 
+/*
+ * Grow the table when it is over the load factor.  The nodes are not
+ * moved here but a few buckets at a time by librdf_hash_memory_rehash()
+ * on later writes, so no single put pays for rehashing the whole hash.
+ */
 static int
 librdf_hash_memory_expand_size(librdf_hash_memory_context* hash) {
   int required_capacity=0;
   librdf_hash_memory_node **new_nodes;
-  int i;
 
   if (hash->capacity) {
     /* big enough */
     if((1000 * hash->keys) < (hash->load_factor * hash->capacity))
       return 0;
+
+    /* last resize not finished: finish moving the nodes */
+    if(hash->old_nodes)
+      librdf_hash_memory_rehash(hash, hash->old_capacity);
+
     /* grow hash (keeping it a power of two) */
     required_capacity=hash->capacity << 1;
   } else {
@@ -266,35 +704,12 @@ librdf_hash_memory_expand_size(librdf_hash_memory_context* hash) {
   if(!new_nodes)
     return 1;
 
-
-  /* it is a new hash empty hash - we are done */
-  if(!hash->size) {
-    hash->capacity=required_capacity;
-    hash->nodes=new_nodes;
-    return 0;
+  /* keep the current table as the old one to move nodes from */
+  if(hash->nodes) {
+    hash->old_nodes=hash->nodes;
+    hash->old_capacity=hash->capacity;
+    hash->rehash_bucket=0;
   }
-  
-
-  for(i=0; i<hash->capacity; i++) {
-    librdf_hash_memory_node *node=hash->nodes[i];
-      
-    /* walk all attached nodes */
-    while(node) {
-      librdf_hash_memory_node *next;
-      int bucket;
-
-      next=node->next;
-      /* find slot in new table */
-      bucket=node->hash_key & (required_capacity - 1);
-      node->next=new_nodes[bucket];
-      new_nodes[bucket]=node;
-
-      node=next;
-    }
-  }
-
-  /* now free old table */
-  LIBRDF_FREE(librdf_hash_memory_nodes, hash->nodes);
 
   /* attach new one */
   hash->capacity=required_capacity;
@@ -340,25 +755,13 @@ librdf_hash_memory_destroy(void* context)
 {
   librdf_hash_memory_context* hcontext=(librdf_hash_memory_context*)context;
 
-  if(hcontext->nodes) {
-    int i;
-  
-    for(i=0; i<hcontext->capacity; i++) {
-      librdf_hash_memory_node *node=hcontext->nodes[i];
-      
-      /* this entry is used */
-      if(node) {
-        librdf_hash_memory_node *next;
-        /* free all attached nodes */
-        while(node) {
-          next=node->next;
-          librdf_free_hash_memory_node(node);
-          node=next;
-        }
-      }
-    }
+  if(hcontext->nodes)
     LIBRDF_FREE(librdf_hash_memory_nodes, hcontext->nodes);
-  }
+  if(hcontext->old_nodes)
+    LIBRDF_FREE(librdf_hash_memory_nodes, hcontext->old_nodes);
+
+  /* all nodes, values and copies are in the arena */
+  librdf_hash_memory_arena_finish(&hcontext->arena);
 
   return 0;
 }
@@ -468,12 +871,91 @@ librdf_hash_memory_values_count(void *context)
 
 typedef struct {
   librdf_hash_memory_context* hash;
-  int current_bucket;
+  /* current table bucket being walked and the capacity it is in */
+  u32 current_bucket;
+  int current_capacity;
+  /* non 0 once the walk of current_bucket has gone on from the
+   * current table list to its old bucket */
+  int in_old;
   librdf_hash_memory_node* current_node;
   librdf_hash_memory_node_value *current_value;
+  /* non 0 if walking all keys */
+  int is_walking;
 } librdf_hash_memory_cursor_context;
 
 
+/*
+ * librdf_hash_memory_reverse_bits:
+ * @v: 32 bit value
+ *
+ * Reverse the order of the bits of a value.
+ *
+ * Walking cursors go through the buckets in reverse binary order, so
+ * when the table doubles the buckets already walked are those that
+ * come before the first of the two buckets each old one splits into.
+ *
+ * Return value: the reversed value
+ */
+static u32
+librdf_hash_memory_reverse_bits(u32 v)
+{
+  v=((v >> 1) & 0x55555555) | ((v & 0x55555555) << 1);
+  v=((v >> 2) & 0x33333333) | ((v & 0x33333333) << 2);
+  v=((v >> 4) & 0x0F0F0F0F) | ((v & 0x0F0F0F0F) << 4);
+  v=((v >> 8) & 0x00FF00FF) | ((v & 0x00FF00FF) << 8);
+  return (v >> 16) | (v << 16);
+}
+
+
+/*
+ * librdf_hash_memory_cursor_walk:
+ * @cursor: memory hash cursor context
+ * @node: node of the current bucket to look from or NULL
+ *
+ * Make the first node from @node on in the walk the current node, or
+ * none at the end.  Each current table bucket is walked as its list
+ * followed by the nodes of its old bucket, if not moved yet, that
+ * belong in it; moving nodes keeps this order.
+ */
+static void
+librdf_hash_memory_cursor_walk(librdf_hash_memory_cursor_context* cursor,
+                               librdf_hash_memory_node* node)
+{
+  librdf_hash_memory_context* hash=cursor->hash;
+  u32 mask=hash->capacity - 1;
+
+  while(1) {
+    for(; node; node=node->next) {
+      if((node->hash_key & mask) == cursor->current_bucket) {
+        cursor->current_node=node;
+        cursor->current_value=node->values;
+        return;
+      }
+    }
+
+    if(!cursor->in_old) {
+      cursor->in_old=1;
+      if(hash->old_nodes) {
+        int old_bucket=cursor->current_bucket & (hash->old_capacity - 1);
+
+        if(old_bucket >= hash->rehash_bucket) {
+          node=hash->old_nodes[old_bucket];
+          continue;
+        }
+      }
+    }
+
+    /* next bucket in reverse binary order; back to 0 after the last */
+    cursor->current_bucket=librdf_hash_memory_reverse_bits(librdf_hash_memory_reverse_bits(cursor->current_bucket | ~mask) + 1);
+    cursor->in_old=0;
+    if(!cursor->current_bucket) {
+      cursor->current_node=NULL;
+      return;
+    }
+    node=hash->nodes[cursor->current_bucket];
+  }
+}
+
 
 /**
  * librdf_hash_memory_cursor_init:
@@ -502,6 +984,12 @@ librdf_hash_memory_cursor_init(void *cursor_context, void *hash_context)
  * @flags: flags
  *
  * Retrieve a hash value for the given key.
+ *
+ * A cursor walking all keys carries on while the nodes of a resize are
+ * being moved and returns each key once.  If the table doubles during
+ * the walk, the walk restarts the bucket it was in, so the keys of
+ * that one bucket already returned may be returned again; no key is
+ * missed.
  * 
  * Return value: non 0 on failure
  **/
@@ -512,6 +1000,7 @@ librdf_hash_memory_cursor_get(void* context,
                               unsigned int flags)
 {
   librdf_hash_memory_cursor_context *cursor=(librdf_hash_memory_cursor_context*)context;
+  librdf_hash_memory_context* hash=cursor->hash;
   librdf_hash_memory_node_value *vnode=NULL;
   librdf_hash_memory_node *node;
   
@@ -521,30 +1010,44 @@ librdf_hash_memory_cursor_get(void* context,
 
   /* Move to start of hash if necessary  */
   if(flags == LIBRDF_HASH_CURSOR_FIRST) {
-    int i;
-    
-    cursor->current_node=NULL;
-    /* find first used bucket (with keys) */
+    cursor->is_walking=1;
     cursor->current_bucket=0;
-
-    for(i=0; i< cursor->hash->capacity; i++)
-      if((cursor->current_node=cursor->hash->nodes[i])) {
-        cursor->current_bucket=i;
-        break;
-      }
-
-    if(cursor->current_node)
-      cursor->current_value=cursor->current_node->values;
+    cursor->current_capacity=hash->capacity;
+    cursor->in_old=0;
+    librdf_hash_memory_cursor_walk(cursor, hash->nodes[0]);
+  } else if(cursor->is_walking && cursor->current_node &&
+            cursor->current_capacity != hash->capacity) {
+    /* the table doubled; the buckets walked so far are all before
+     * current_bucket in the bigger table but the keys moved between
+     * lists so this bucket is walked again from its start */
+    cursor->current_capacity=hash->capacity;
+    cursor->in_old=0;
+    librdf_hash_memory_cursor_walk(cursor, hash->nodes[cursor->current_bucket]);
   }
 
-  /* If still have no current node, try to find it from the key */
-  if(!cursor->current_node && key && key->data) {
-    cursor->current_node=librdf_hash_memory_find_node(cursor->hash,
+  /* If still have no current node, try to find it from the key,
+   * unless a walk has reached its end */
+  if(!cursor->current_node && key && key->data &&
+     !(cursor->is_walking && flags == LIBRDF_HASH_CURSOR_NEXT)) {
+    librdf_hash_memory_node** bucket;
+
+    cursor->is_walking=0;
+    cursor->current_node=librdf_hash_memory_find_node(hash,
                                                       (char*)key->data,
                                                       key->size,
-                                                      NULL, NULL);
-    if(cursor->current_node)
+                                                      &bucket, NULL);
+    if(cursor->current_node) {
       cursor->current_value=cursor->current_node->values;
+
+      /* walking on from this key */
+      if(flags == LIBRDF_HASH_CURSOR_NEXT) {
+        cursor->is_walking=1;
+        cursor->current_bucket=cursor->current_node->hash_key & (hash->capacity - 1);
+        cursor->current_capacity=hash->capacity;
+        cursor->in_old=(bucket < hash->nodes ||
+                        bucket >= hash->nodes + hash->capacity);
+      }
+    }
   }
 
 
@@ -567,13 +1070,10 @@ librdf_hash_memory_cursor_get(void* context,
       
     case LIBRDF_HASH_CURSOR_FIRST:
     case LIBRDF_HASH_CURSOR_NEXT:
-      /* If have reached last bucket, end */
-      if(cursor->current_bucket >= cursor->hash->capacity)
-        return 1;
-      
       break;
+
     default:
-      librdf_log(cursor->hash->hash->world,
+      librdf_log(hash->hash->world,
                  0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
                  "Unknown hash method flag %d", flags);
       return 1;
@@ -623,25 +1123,12 @@ librdf_hash_memory_cursor_get(void* context,
           break;
       }
       
-      /* move on to next node in current bucket */
-      if(!(node=cursor->current_node->next)) {
-        int i;
-        
-        /* end of list - move to next used bucket */
-        for(i=cursor->current_bucket+1; i< cursor->hash->capacity; i++)
-          if((node=cursor->hash->nodes[i])) {
-            cursor->current_bucket=i;
-            break;
-          }
-        
-      }
-      
-      if((cursor->current_node=node))
-        cursor->current_value=node->values;
+      /* move on to the next node of this bucket or the next bucket */
+      librdf_hash_memory_cursor_walk(cursor, node->next);
       
       break;
     default:
-      librdf_log(cursor->hash->hash->world,
+      librdf_log(hash->hash->world,
                  0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
                  "Unknown hash method flag %d", flags);
       return 1;
@@ -667,21 +1154,24 @@ librdf_hash_memory_cursor_finish(void* context)
 }
 
 
-/**
- * librdf_hash_memory_put:
- * @context: memory hash context
+/*
+ * librdf_hash_memory_put_node - Store a key/value pair, reusing a node
+ * @hash: memory hash context
  * @key: pointer to key to store
  * @value: pointer to value to store
+ * @last_node: pointer to the node the previous key was stored in or NULL
  *
- * - Store a key/value pair in the hash.
+ * If *@last_node holds the same key it is used without a lookup.
+ * Nodes are never moved in memory so this remains valid across
+ * resizes.  On success *@last_node is set to the node used.
  * 
  * Return value: non 0 on failure
- **/
+ */
 static int
-librdf_hash_memory_put(void* context, librdf_hash_datum *key, 
-		       librdf_hash_datum *value) 
+librdf_hash_memory_put_node(librdf_hash_memory_context* hash,
+                            librdf_hash_datum *key, librdf_hash_datum *value,
+                            librdf_hash_memory_node** last_node)
 {
-  librdf_hash_memory_context* hash=(librdf_hash_memory_context*)context;
   librdf_hash_memory_node *node;
   librdf_hash_memory_node_value *vnode;
   u32 hash_key;
@@ -690,34 +1180,41 @@ librdf_hash_memory_put(void* context, librdf_hash_datum *key,
   int bucket= (-1);
   int is_new_node;
 
+  /* move on any resize in progress */
+  librdf_hash_memory_rehash(hash, librdf_hash_rehash_buckets);
+
   /* ensure there is enough space in the hash */
   if (librdf_hash_memory_expand_size(hash))
     return 1;
   
   /* find node for key */
-  node=librdf_hash_memory_find_node(hash,
-				    key->data, key->size,
-				    NULL, NULL);
+  node=(last_node) ? *last_node : NULL;
+  if(!node || node->key_len != key->size ||
+     memcmp(node->key, key->data, key->size))
+    node=librdf_hash_memory_find_node(hash,
+                                      key->data, key->size,
+                                      NULL, NULL);
 
   is_new_node=(node == NULL);
   
   /* not found - new key */
   if(is_new_node) {
-    ONE_AT_A_TIME_HASH(hash_key, key->data, key->size);
+    LIBRDF_HASH_KEY_HASH(hash_key, key->data, key->size);
 
     bucket=hash_key & (hash->capacity - 1);
 
     /* allocate new node */
-    node = LIBRDF_CALLOC(librdf_hash_memory_node*, 1, sizeof(*node));
+    node = (librdf_hash_memory_node*)librdf_hash_memory_arena_alloc(&hash->arena, sizeof(*node));
     if(!node)
       return 1;
+    memset(node, 0, sizeof(*node));
 
     node->hash_key=hash_key;
     
     /* allocate key for new node */
-    new_key = LIBRDF_MALLOC(void*, key->size);
+    new_key = librdf_hash_memory_arena_alloc(&hash->arena, key->size);
     if(!new_key) {
-      LIBRDF_FREE(librdf_hash_memory_node, node);
+      librdf_hash_memory_arena_free(&hash->arena, node, sizeof(*node));
       return 1;
     }
 
@@ -729,31 +1226,34 @@ librdf_hash_memory_put(void* context, librdf_hash_datum *key,
   
   
   /* always allocate new value */
-  new_value = LIBRDF_MALLOC(void*, value->size);
+  new_value = librdf_hash_memory_arena_alloc(&hash->arena, value->size);
   if(!new_value) {
     if(is_new_node) {
-      LIBRDF_FREE(char*, new_key);
-      LIBRDF_FREE(librdf_hash_memory_node, node);
+      librdf_hash_memory_arena_free(&hash->arena, new_key, key->size);
+      librdf_hash_memory_arena_free(&hash->arena, node, sizeof(*node));
     }
     return 1;
   }
 
   /* always allocate new librdf_hash_memory_node_value */
-  vnode = LIBRDF_CALLOC(librdf_hash_memory_node_value*, 1, sizeof(*vnode));
+  vnode = (librdf_hash_memory_node_value*)librdf_hash_memory_arena_alloc(&hash->arena, sizeof(*vnode));
   if(!vnode) {
-    LIBRDF_FREE(char*, new_value);
+    librdf_hash_memory_arena_free(&hash->arena, new_value, value->size);
     if(is_new_node) {
-      LIBRDF_FREE(char*, new_key);
-      LIBRDF_FREE(librdf_hash_memory_node, node);
+      librdf_hash_memory_arena_free(&hash->arena, new_key, key->size);
+      librdf_hash_memory_arena_free(&hash->arena, node, sizeof(*node));
     }
     return 1;
   }
+  memset(vnode, 0, sizeof(*vnode));
 
   /* if we get here, all allocations succeeded */
 
 
   /* put new value node in list */
   vnode->next=node->values;
+  if(node->values)
+    node->values->prev=vnode;
   node->values=vnode;
 
   /* note that in counter */
@@ -764,9 +1264,28 @@ librdf_hash_memory_put(void* context, librdf_hash_datum *key,
   vnode->value=new_value;
   vnode->value_len=value->size;
 
+  /* Index the values once there are many.  Failing to do so is not
+   * an error, the set is dropped and lookups fall back to walking the
+   * list */
+  if(node->value_set)
+    librdf_hash_memory_value_set_add(hash, node, vnode);
+  else if(node->values_count > librdf_hash_value_set_threshold) {
+    /* size from the count since an earlier failed build or grow may
+     * have left many more values than the threshold */
+    int capacity=librdf_hash_value_set_threshold << 2;
+
+    while(capacity < (node->values_count << 1))
+      capacity <<= 1;
+    librdf_hash_memory_value_set_build(hash, node, capacity);
+  }
+
 
   /* now update buckets and hash counts */
   if(is_new_node) {
+    /* Only increase bucket count use when previous value was NULL */
+    if(!hash->nodes[bucket])
+      hash->size++;
+
     node->next=hash->nodes[bucket];
     hash->nodes[bucket]=node;
   
@@ -776,9 +1295,58 @@ librdf_hash_memory_put(void* context, librdf_hash_datum *key,
 
   hash->values++;
 
-  /* Only increase bucket count use when previous value was NULL */
-  if(!node->next)
-    hash->size++;
+  if(last_node)
+    *last_node=node;
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory_put:
+ * @context: memory hash context
+ * @key: pointer to key to store
+ * @value: pointer to value to store
+ *
+ * - Store a key/value pair in the hash.
+ * 
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_put(void* context, librdf_hash_datum *key, 
+		       librdf_hash_datum *value) 
+{
+  librdf_hash_memory_context* hash=(librdf_hash_memory_context*)context;
+
+  return librdf_hash_memory_put_node(hash, key, value, NULL);
+}
+
+
+/**
+ * librdf_hash_memory_put_many:
+ * @context: memory hash context
+ * @keys: array of keys to store
+ * @values: array of values to store
+ * @count: number of key/value pairs
+ *
+ * - Store an array of key/value pairs in the hash.
+ * 
+ * Runs of pairs with the same key are stored under one lookup.
+ * 
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_put_many(void* context, librdf_hash_datum *keys,
+                            librdf_hash_datum *values, int count)
+{
+  librdf_hash_memory_context* hash=(librdf_hash_memory_context*)context;
+  librdf_hash_memory_node *node=NULL;
+  int i;
+
+  for(i=0; i < count; i++) {
+    if(librdf_hash_memory_put_node(hash, &keys[i], &values[i], &node))
+      return 1;
+  }
 
   return 0;
 }
@@ -813,17 +1381,104 @@ librdf_hash_memory_exists(void* context,
   if(!value)
     return 1;
 
-  /* search for value in list of values */
-  for(vnode=node->values; vnode; vnode=vnode->next) {
-    if(value->size == vnode->value_len && 
-       !memcmp(value->data, vnode->value, value->size))
-      break;
-  }
+  vnode=librdf_hash_memory_find_value(node, value->data, value->size, NULL);
 
   return (vnode != NULL);
 }
 
 
+/**
+ * librdf_hash_memory_exists_many:
+ * @context: memory hash context
+ * @keys: array of keys
+ * @values: array of values or NULL
+ * @count: number of keys
+ * @results: array to store the result of each test
+ *
+ * Test the existence of an array of keys or key/values in the hash.
+ * 
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_exists_many(void* context, librdf_hash_datum *keys,
+                               librdf_hash_datum *values, int count,
+                               int *results)
+{
+  librdf_hash_memory_context* hash=(librdf_hash_memory_context*)context;
+  librdf_hash_memory_node* node=NULL;
+  int i;
+
+  for(i=0; i < count; i++) {
+    /* reuse the last node for a run of the same key */
+    if(!node || node->key_len != keys[i].size ||
+       memcmp(node->key, keys[i].data, keys[i].size))
+      node=librdf_hash_memory_find_node(hash,
+                                        (char*)keys[i].data, keys[i].size,
+                                        NULL, NULL);
+    if(!node)
+      results[i]=0;
+    else if(!values)
+      results[i]=1;
+    else
+      results[i]=(librdf_hash_memory_find_value(node, values[i].data,
+                                                values[i].size, NULL) != NULL);
+  }
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory_get_many:
+ * @context: memory hash context
+ * @keys: array of keys
+ * @values: array of datums to store the values
+ * @count: number of keys
+ *
+ * Get one value for each of an array of keys.
+ * 
+ * The values are copied into newly allocated memory; missing keys
+ * give NULL data.
+ * 
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_get_many(void* context, librdf_hash_datum *keys,
+                            librdf_hash_datum *values, int count)
+{
+  librdf_hash_memory_context* hash=(librdf_hash_memory_context*)context;
+  librdf_hash_memory_node* node;
+  librdf_hash_memory_node_value *vnode;
+  int i;
+
+  for(i=0; i < count; i++) {
+    values[i].data=NULL;
+    values[i].size=0;
+
+    node=librdf_hash_memory_find_node(hash,
+                                      (char*)keys[i].data, keys[i].size,
+                                      NULL, NULL);
+    if(!node || !(vnode=node->values))
+      continue;
+
+    values[i].data=LIBRDF_MALLOC(char*, vnode->value_len ? vnode->value_len : 1);
+    if(!values[i].data) {
+      while(i-- > 0) {
+        if(values[i].data) {
+          LIBRDF_FREE(char*, values[i].data);
+          values[i].data=NULL;
+        }
+      }
+      return 1;
+    }
+    memcpy(values[i].data, vnode->value, vnode->value_len);
+    values[i].size=vnode->value_len;
+  }
+
+  return 0;
+}
+
+
 
 /**
  * librdf_hash_memory_delete_key_value:
@@ -840,10 +1495,14 @@ librdf_hash_memory_delete_key_value(void* context, librdf_hash_datum *key,
                                     librdf_hash_datum *value)
 {
   librdf_hash_memory_context* hash=(librdf_hash_memory_context*)context;
-  librdf_hash_memory_node *node, *prev, *next;
-  librdf_hash_memory_node_value *vnode, *vprev;
-  int bucket;
+  librdf_hash_memory_node *node, *prev;
+  librdf_hash_memory_node_value *vnode;
+  librdf_hash_memory_node** bucket;
+  int slot= -1;
   
+  /* move on any resize in progress */
+  librdf_hash_memory_rehash(hash, librdf_hash_rehash_buckets);
+
   node=librdf_hash_memory_find_node(hash, 
 				    (char*)key->data, key->size,
 				    &bucket, &prev);
@@ -851,32 +1510,28 @@ librdf_hash_memory_delete_key_value(void* context, librdf_hash_datum *key,
   if(!node)
     return 1;
 
-  /* search for value in list of values */
-  vnode=node->values;
-  vprev=NULL;
-  while(vnode) {
-    if(value->size == vnode->value_len && 
-       !memcmp(value->data, vnode->value, value->size))
-      break;
-    vprev=vnode;
-    vnode=vnode->next;
-  }
+  vnode=librdf_hash_memory_find_value(node, value->data, value->size, &slot);
 
   /* key/value combination not found */
   if(!vnode)
     return 1;
 
-  /* found - delete it from list */
-  if(!vprev) {
+  /* found - delete it from set and list */
+  if(node->value_set)
+    librdf_hash_memory_value_set_remove(node, slot);
+
+  if(!vnode->prev) {
     /* at start of list so delete from there */
     node->values=vnode->next;
   } else
-    vprev->next=vnode->next;
+    vnode->prev->next=vnode->next;
+  if(vnode->next)
+    vnode->next->prev=vnode->prev;
+  node->values_count--;
 
   /* free value and value node */
-  if(vnode->value)
-    LIBRDF_FREE(librdf_hash_memory_node_value, vnode->value);
-  LIBRDF_FREE(librdf_hash_memory_node_value, vnode);
+  librdf_hash_memory_arena_free(&hash->arena, vnode->value, vnode->value_len);
+  librdf_hash_memory_arena_free(&hash->arena, vnode, sizeof(*vnode));
 
   /* update hash counts */
   hash->values--;
@@ -891,36 +1546,17 @@ librdf_hash_memory_delete_key_value(void* context, librdf_hash_datum *key,
 
   if(!prev) {
     /* is at start of list, so delete from there */
-    if(!(hash->nodes[bucket]=node->next))
+    if(!(*bucket=node->next))
       /* hash bucket occupancy is one less if bucket is now empty */
       hash->size--;
-    next=NULL;
   } else
-    next=prev->next=node->next;
+    prev->next=node->next;
   
   /* free node */
-  librdf_free_hash_memory_node(node);
+  librdf_free_hash_memory_node(hash, node);
   
-  /* see if there are remaining values for this key */
-  if(!next) {
-    /* no - so was last value for that key, reduce key count */
-    hash->keys--;
-  } else {
-    int found=0;
-    
-    node=next;
-    while(node) {
-      if(key->size == node->key_len && !memcmp(key, node->key, key->size)){
-        found=1;
-        break;
-      }
-      node=node->next;
-    }
-    
-    /* no further key values found - so was last value for that key */
-    if(!found)
-      hash->keys--;
-  }
+  /* keys are unique so this was the last value for that key */
+  hash->keys--;
 
   return 0;
 }
@@ -940,8 +1576,11 @@ librdf_hash_memory_delete_key(void* context, librdf_hash_datum *key)
 {
   librdf_hash_memory_context* hash=(librdf_hash_memory_context*)context;
   librdf_hash_memory_node *node, *prev;
-  int bucket;
+  librdf_hash_memory_node** bucket;
   
+  /* move on any resize in progress */
+  librdf_hash_memory_rehash(hash, librdf_hash_rehash_buckets);
+
   node=librdf_hash_memory_find_node(hash, 
 				    (char*)key->data, key->size,
 				    &bucket, &prev);
@@ -952,7 +1591,7 @@ librdf_hash_memory_delete_key(void* context, librdf_hash_datum *key)
   /* search list from here */
   if(!prev) {
     /* is at start of list, so delete from there */
-    if(!(hash->nodes[bucket]=node->next))
+    if(!(*bucket=node->next))
       /* hash bucket occupancy is one less if bucket is now empty */
       hash->size--;
   } else
@@ -963,7 +1602,7 @@ librdf_hash_memory_delete_key(void* context, librdf_hash_datum *key)
   hash->values-= node->values_count;
   
   /* free node */
-  librdf_free_hash_memory_node(node);
+  librdf_free_hash_memory_node(hash, node);
   return 0;
 }
 
@@ -1004,6 +1643,31 @@ librdf_hash_memory_get_fd(void* context)
 }
 
 
+/**
+ * librdf_hash_memory_get_footprint:
+ * @context: memory hash context
+ * @allocated: pointer to store bytes held by the hash
+ * @used: pointer to store bytes of that in use
+ *
+ * Get the memory footprint of the hash: the arena plus bucket arrays.
+ * 
+ * Return value: 0
+ **/
+static int
+librdf_hash_memory_get_footprint(void* context, size_t* allocated,
+                                 size_t* used)
+{
+  librdf_hash_memory_context* hash=(librdf_hash_memory_context*)context;
+  size_t buckets;
+
+  buckets=(hash->capacity + hash->old_capacity) * sizeof(librdf_hash_memory_node*);
+
+  *allocated=hash->arena.allocated + buckets;
+  *used=hash->arena.used + buckets;
+  return 0;
+}
+
+
 /* local function to register memory hash functions */
 
 /**
@@ -1034,6 +1698,10 @@ librdf_hash_memory_register_factory(librdf_hash_factory *factory)
   factory->delete_key_value  = librdf_hash_memory_delete_key_value;
   factory->sync    = librdf_hash_memory_sync;
   factory->get_fd  = librdf_hash_memory_get_fd;
+  factory->get_footprint = librdf_hash_memory_get_footprint;
+  factory->put_many    = librdf_hash_memory_put_many;
+  factory->exists_many = librdf_hash_memory_exists_many;
+  factory->get_many    = librdf_hash_memory_get_many;
 
   factory->cursor_init   = librdf_hash_memory_cursor_init;
   factory->cursor_get    = librdf_hash_memory_cursor_get;
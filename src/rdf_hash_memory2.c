@@ -0,0 +1,1133 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_hash_memory2.c - RDF Hash In Memory Open Addressing Implementation
+ *
+ * Copyright (C) 2000-2008, David Beckett http://www.dajobe.org/
+ * Copyright (C) 2000-2004, University of Bristol, UK http://www.bristol.ac.uk/
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+/*
+ * An alternative to the "memory" hash that keeps all keys in one flat
+ * slot array using open addressing with Robin Hood linear probing
+ * instead of per-bucket linked lists.
+ *
+ * Each slot holds the full 32 bit hash of its key, the probe distance
+ * (+1, 0 means empty) and a pointer to the entry.  Lookups compare the
+ * stored hash before touching the entry so a probe sequence is mostly a
+ * linear scan over one array.  Deletion uses backward shifting so no
+ * tombstones are ever left behind.
+ *
+ * An entry is allocated in one block with its key bytes and keeps all
+ * the values for that key in a growable array.  Entries never move in
+ * memory, only the slots pointing to them do.
+ *
+ * The home slot of a key is taken from the top bits of its hash and
+ * entries with the same home slot are kept in hash order, so the slots
+ * hold the keys sorted by hash (apart from the few that wrap round
+ * past the last slot to the first).  Inserting, backward shifting and
+ * growing the table all keep that order, which lets a cursor walking
+ * the keys find its place again by hash after the hash is changed.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <rdf_config.h>
+#endif
+
+#ifdef WIN32
+#include <win32_rdf_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <sys/types.h>
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <redland.h>
+#include <rdf_types.h>
+
+
+/* private structures */
+typedef struct
+{
+  void *value;
+  size_t value_len;
+} librdf_hash_memory2_value;
+
+
+typedef struct
+{
+  size_t key_len;
+  /* values array of size values_capacity with values_count used */
+  librdf_hash_memory2_value *values;
+  int values_count;
+  int values_capacity;
+  /* key bytes follow this structure */
+} librdf_hash_memory2_entry;
+
+#define LIBRDF_HASH_MEMORY2_ENTRY_KEY(entry) ((unsigned char*)((entry) + 1))
+
+/* home slot of a hash in a table indexed by its top 32-shift bits */
+#define LIBRDF_HASH_MEMORY2_HOME(hash_key, shift) ((int)((hash_key) >> (shift)))
+
+/* true if the entry in slot i wrapped round from a home slot near the
+ * end of the table */
+#define LIBRDF_HASH_MEMORY2_WRAPPED(slots, i) ((int)(slots)[i].distance - 1 > (i))
+
+
+typedef struct
+{
+  u32 hash_key;
+  /* probe distance from home slot plus 1; 0 if slot is empty */
+  u32 distance;
+  librdf_hash_memory2_entry *entry;
+} librdf_hash_memory2_slot;
+
+
+typedef struct
+{
+  /* the hash object */
+  librdf_hash* hash;
+  /* array of capacity slots */
+  librdf_hash_memory2_slot* slots;
+  /* this many keys (used slots) */
+  int keys;
+  /* this many values */
+  int values;
+  /* total array size - always a power of 2 */
+  int capacity;
+  /* 32 - log2(capacity), to take home slots from the top hash bits */
+  int shift;
+  /* count of changes that move slots or free entries */
+  unsigned long modifications;
+
+  /* array load factor expressed out of 1000.
+   * Always true: keys * 1000 < load_factor * capacity
+   */
+  int load_factor;
+} librdf_hash_memory2_context;
+
+
+typedef struct {
+  librdf_hash_memory2_context* hash;
+  /* place of current_entry in key order: its slot, plus capacity if
+   * the entry wrapped round to the start of the slots */
+  int current_index;
+  librdf_hash_memory2_entry* current_entry;
+  /* hash of current_entry, to find its place again */
+  u32 current_hash_key;
+  /* index of next value of current_entry to return */
+  int current_value;
+  /* hash modifications when current_index was found */
+  unsigned long modifications;
+  /* walking all keys started by LIBRDF_HASH_CURSOR_FIRST or NEXT */
+  int walking;
+} librdf_hash_memory2_cursor_context;
+
+
+
+/* default load_factor out of 1000.  Robin Hood probing keeps probe
+ * lengths short at high loads so this can be higher than the chained
+ * memory hash default */
+static const int librdf_hash_memory2_default_load_factor=875;
+
+/* starting capacity - MUST BE POWER OF 2 */
+static const int librdf_hash_memory2_initial_capacity=16;
+
+/* starting size of a value array */
+static const int librdf_hash_memory2_initial_values=2;
+
+
+/* prototypes for local functions */
+static int librdf_hash_memory2_find_slot(librdf_hash_memory2_context* hash, const void *key, size_t key_len);
+static int librdf_hash_memory2_find_entry(librdf_hash_memory2_context* hash, u32 hash_key, librdf_hash_memory2_entry* entry);
+static void librdf_hash_memory2_insert_slot(librdf_hash_memory2_slot* slots, int capacity, int shift, u32 hash_key, librdf_hash_memory2_entry* entry);
+static void librdf_hash_memory2_remove_slot(librdf_hash_memory2_context* hash, int slot);
+static void librdf_free_hash_memory2_entry(librdf_hash_memory2_entry* entry);
+static int librdf_hash_memory2_expand_size(librdf_hash_memory2_context* hash);
+
+/* Implementing the hash cursor */
+static void librdf_hash_memory2_cursor_set_slot(librdf_hash_memory2_cursor_context* cursor, int slot);
+static void librdf_hash_memory2_cursor_move(librdf_hash_memory2_cursor_context* cursor, int index);
+static int librdf_hash_memory2_cursor_sync(librdf_hash_memory2_cursor_context* cursor);
+static int librdf_hash_memory2_cursor_init(void *cursor_context, void *hash_context);
+static int librdf_hash_memory2_cursor_get(void* context, librdf_hash_datum* key, librdf_hash_datum* value, unsigned int flags);
+static void librdf_hash_memory2_cursor_finish(void* context);
+
+
+/* functions implementing the API */
+
+static int librdf_hash_memory2_create(librdf_hash* new_hash, void* context);
+static int librdf_hash_memory2_destroy(void* context);
+static int librdf_hash_memory2_open(void* context, const char *identifier, int mode, int is_writable, int is_new, librdf_hash* options);
+static int librdf_hash_memory2_close(void* context);
+static int librdf_hash_memory2_clone(librdf_hash* new_hash, void *new_context, char *new_identifier, void* old_context);
+static int librdf_hash_memory2_values_count(void *context);
+static int librdf_hash_memory2_put(void* context, librdf_hash_datum *key, librdf_hash_datum *data);
+static int librdf_hash_memory2_exists(void* context, librdf_hash_datum *key, librdf_hash_datum *value);
+static int librdf_hash_memory2_delete_key(void* context, librdf_hash_datum *key);
+static int librdf_hash_memory2_delete_key_value(void* context, librdf_hash_datum *key, librdf_hash_datum *value);
+static int librdf_hash_memory2_sync(void* context);
+static int librdf_hash_memory2_get_fd(void* context);
+
+static void librdf_hash_memory2_register_factory(librdf_hash_factory *factory);
+
+
+
+/* helper functions */
+
+
+/**
+ * librdf_hash_memory2_find_slot:
+ * @hash: the memory2 hash context
+ * @key: key string
+ * @key_len: key string length
+ *
+ * Find the slot holding a given key.
+ *
+ * The probe stops early as soon as it meets a slot whose entry is
+ * closer to its home slot than the key being searched would be, since
+ * Robin Hood insertion would have placed the key there.
+ *
+ * Return value: slot index or <0 if not found
+ **/
+static int
+librdf_hash_memory2_find_slot(librdf_hash_memory2_context* hash,
+                              const void *key, size_t key_len)
+{
+  u32 hash_key;
+  u32 distance=1;
+  int mask=hash->capacity - 1;
+  int i;
+
+  if(!hash->keys)
+    return -1;
+
+  LIBRDF_HASH_KEY_HASH(hash_key, key, key_len);
+
+  for(i=LIBRDF_HASH_MEMORY2_HOME(hash_key, hash->shift); 1;
+      i=(i + 1) & mask, distance++) {
+    librdf_hash_memory2_slot* slot=&hash->slots[i];
+
+    if(slot->distance < distance)
+      /* empty slot or a richer entry - key is not present */
+      return -1;
+
+    if(slot->hash_key == hash_key &&
+       slot->entry->key_len == key_len &&
+       !memcmp(key, LIBRDF_HASH_MEMORY2_ENTRY_KEY(slot->entry), key_len))
+      return i;
+  }
+
+  return -1;
+}
+
+
+/**
+ * librdf_hash_memory2_find_entry:
+ * @hash: the memory2 hash context
+ * @hash_key: hash of the entry key
+ * @entry: entry to find
+ *
+ * Find the slot pointing to an entry that may have been freed; @entry
+ * is only compared, never read.
+ *
+ * Return value: slot index or <0 if not found
+ **/
+static int
+librdf_hash_memory2_find_entry(librdf_hash_memory2_context* hash,
+                               u32 hash_key, librdf_hash_memory2_entry* entry)
+{
+  u32 distance=1;
+  int mask=hash->capacity - 1;
+  int i;
+
+  for(i=LIBRDF_HASH_MEMORY2_HOME(hash_key, hash->shift); 1;
+      i=(i + 1) & mask, distance++) {
+    librdf_hash_memory2_slot* slot=&hash->slots[i];
+
+    if(slot->distance < distance)
+      return -1;
+
+    if(slot->entry == entry)
+      return i;
+  }
+
+  return -1;
+}
+
+
+/**
+ * librdf_hash_memory2_insert_slot:
+ * @slots: slot array
+ * @capacity: size of slot array
+ * @shift: 32 - log2(@capacity)
+ * @hash_key: hash of entry key
+ * @entry: entry to insert
+ *
+ * Insert an entry known not to be present into a slot array with at
+ * least one free slot, displacing entries nearer their home slot or
+ * with the same home slot and a greater hash.
+ **/
+static void
+librdf_hash_memory2_insert_slot(librdf_hash_memory2_slot* slots, int capacity,
+                                int shift, u32 hash_key,
+                                librdf_hash_memory2_entry* entry)
+{
+  librdf_hash_memory2_slot current;
+  int mask=capacity - 1;
+  int i;
+
+  current.hash_key=hash_key;
+  current.distance=1;
+  current.entry=entry;
+
+  for(i=LIBRDF_HASH_MEMORY2_HOME(hash_key, shift); 1;
+      i=(i + 1) & mask, current.distance++) {
+    librdf_hash_memory2_slot* slot=&slots[i];
+
+    if(!slot->distance) {
+      *slot=current;
+      return;
+    }
+
+    if(slot->distance < current.distance ||
+       (slot->distance == current.distance &&
+        slot->hash_key > current.hash_key)) {
+      /* take from the rich: swap and carry on inserting the old one */
+      librdf_hash_memory2_slot tmp=*slot;
+      *slot=current;
+      current=tmp;
+    }
+  }
+}
+
+
+/**
+ * librdf_hash_memory2_remove_slot:
+ * @hash: the memory2 hash context
+ * @slot: index of slot to empty
+ *
+ * Empty a slot and shift following displaced entries back by one.
+ * Does not free the entry.
+ **/
+static void
+librdf_hash_memory2_remove_slot(librdf_hash_memory2_context* hash, int slot)
+{
+  int mask=hash->capacity - 1;
+  int next=(slot + 1) & mask;
+
+  hash->modifications++;
+
+  while(hash->slots[next].distance > 1) {
+    hash->slots[slot]=hash->slots[next];
+    hash->slots[slot].distance--;
+    slot=next;
+    next=(next + 1) & mask;
+  }
+
+  hash->slots[slot].distance=0;
+  hash->slots[slot].hash_key=0;
+  hash->slots[slot].entry=NULL;
+}
+
+
+static void
+librdf_free_hash_memory2_entry(librdf_hash_memory2_entry* entry)
+{
+  if(entry->values) {
+    int i;
+
+    for(i=0; i < entry->values_count; i++) {
+      if(entry->values[i].value)
+        LIBRDF_FREE(char*, entry->values[i].value);
+    }
+    LIBRDF_FREE(librdf_hash_memory2_value, entry->values);
+  }
+  LIBRDF_FREE(librdf_hash_memory2_entry, entry);
+}
+
+
+static int
+librdf_hash_memory2_expand_size(librdf_hash_memory2_context* hash)
+{
+  int required_capacity;
+  int required_shift;
+  librdf_hash_memory2_slot *new_slots;
+  int i;
+
+  if(hash->capacity) {
+    /* big enough for one more key */
+    if((1000 * (hash->keys + 1)) < (hash->load_factor * hash->capacity))
+      return 0;
+    /* grow hash (keeping it a power of two) */
+    required_capacity=hash->capacity << 1;
+    required_shift=hash->shift - 1;
+  } else {
+    required_capacity=librdf_hash_memory2_initial_capacity;
+    for(required_shift=32; (1 << (32 - required_shift)) < required_capacity; )
+      required_shift--;
+  }
+
+  /* allocate new table */
+  new_slots=LIBRDF_CALLOC(librdf_hash_memory2_slot*, required_capacity,
+                          sizeof(librdf_hash_memory2_slot));
+  if(!new_slots)
+    return 1;
+
+  /* move all entries over; the stored hash saves recomputing it */
+  for(i=0; i < hash->capacity; i++) {
+    librdf_hash_memory2_slot* slot=&hash->slots[i];
+
+    if(slot->distance)
+      librdf_hash_memory2_insert_slot(new_slots, required_capacity,
+                                      required_shift, slot->hash_key,
+                                      slot->entry);
+  }
+
+  if(hash->slots)
+    LIBRDF_FREE(librdf_hash_memory2_slot, hash->slots);
+
+  hash->capacity=required_capacity;
+  hash->shift=required_shift;
+  hash->slots=new_slots;
+  hash->modifications++;
+
+  return 0;
+}
+
+
+
+/* functions implementing hash api */
+
+/**
+ * librdf_hash_memory2_create:
+ * @hash: #librdf_hash hash
+ * @context: memory2 hash contxt
+ *
+ * Create a new memory2 hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory2_create(librdf_hash* hash, void* context)
+{
+  librdf_hash_memory2_context* hcontext=(librdf_hash_memory2_context*)context;
+
+  hcontext->hash=hash;
+  hcontext->load_factor=librdf_hash_memory2_default_load_factor;
+  return librdf_hash_memory2_expand_size(hcontext);
+}
+
+
+/**
+ * librdf_hash_memory2_destroy:
+ * @context: memory2 hash context
+ *
+ * Destroy a memory2 hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory2_destroy(void* context)
+{
+  librdf_hash_memory2_context* hcontext=(librdf_hash_memory2_context*)context;
+
+  if(hcontext->slots) {
+    int i;
+
+    for(i=0; i < hcontext->capacity; i++) {
+      if(hcontext->slots[i].distance)
+        librdf_free_hash_memory2_entry(hcontext->slots[i].entry);
+    }
+    LIBRDF_FREE(librdf_hash_memory2_slot, hcontext->slots);
+  }
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory2_open:
+ * @context: memory2 hash context
+ * @identifier: identifier - not used
+ * @mode: access mode - not used
+ * @is_writable: is hash writable? - not used
+ * @is_new: is hash new? - not used
+ * @options: #librdf_hash of options - not used
+ *
+ * Open memory2 hash with given parameters.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory2_open(void* context, const char *identifier,
+                         int mode, int is_writable, int is_new,
+                         librdf_hash* options)
+{
+  /* NOP */
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory2_close:
+ * @context: memory2 hash context
+ *
+ * Close the hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory2_close(void* context)
+{
+  /* NOP */
+  return 0;
+}
+
+
+static int
+librdf_hash_memory2_clone(librdf_hash *hash, void* context,
+                          char *new_identifer, void *old_context)
+{
+  librdf_hash_memory2_context* hcontext=(librdf_hash_memory2_context*)context;
+  librdf_hash_memory2_context* old_hcontext=(librdf_hash_memory2_context*)old_context;
+  librdf_hash_datum key, value;
+  int i;
+
+  /* copy data fields that might change */
+  hcontext->hash=hash;
+  hcontext->load_factor=old_hcontext->load_factor;
+
+  /* Don't need to deal with new_identifier - not used for memory hashes */
+
+  key.world=value.world=hash->world;
+  key.next=value.next=NULL;
+
+  for(i=0; i < old_hcontext->capacity; i++) {
+    librdf_hash_memory2_entry* entry=old_hcontext->slots[i].entry;
+    int j;
+
+    if(!old_hcontext->slots[i].distance)
+      continue;
+
+    key.data=LIBRDF_HASH_MEMORY2_ENTRY_KEY(entry);
+    key.size=entry->key_len;
+
+    for(j=0; j < entry->values_count; j++) {
+      value.data=entry->values[j].value;
+      value.size=entry->values[j].value_len;
+
+      if(librdf_hash_memory2_put(hcontext, &key, &value))
+        return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory2_values_count:
+ * @context: memory2 hash cursor context
+ *
+ * Get the number of values in the hash.
+ *
+ * Return value: number of values in the hash or <0 on failure
+ **/
+static int
+librdf_hash_memory2_values_count(void *context)
+{
+  librdf_hash_memory2_context* hash=(librdf_hash_memory2_context*)context;
+
+  return hash->values;
+}
+
+
+/**
+ * librdf_hash_memory2_cursor_set_slot:
+ * @cursor: memory2 hash cursor context
+ * @slot: slot of the new current entry
+ *
+ * Make the entry in a slot the current entry, from its first value.
+ **/
+static void
+librdf_hash_memory2_cursor_set_slot(librdf_hash_memory2_cursor_context* cursor,
+                                    int slot)
+{
+  librdf_hash_memory2_context* hash=cursor->hash;
+
+  cursor->current_index=slot;
+  if(LIBRDF_HASH_MEMORY2_WRAPPED(hash->slots, slot))
+    cursor->current_index+=hash->capacity;
+  cursor->current_entry=hash->slots[slot].entry;
+  cursor->current_hash_key=hash->slots[slot].hash_key;
+  cursor->current_value=0;
+  cursor->modifications=hash->modifications;
+}
+
+
+/**
+ * librdf_hash_memory2_cursor_move:
+ * @cursor: memory2 hash cursor context
+ * @index: place in key order to start looking from
+ *
+ * Make the first entry at or after @index in key order the current
+ * entry, or none at the end.  Places 0 to capacity-1 are the slots
+ * without wrapped entries and the wrapped entries at the start of the
+ * slots come after them.
+ **/
+static void
+librdf_hash_memory2_cursor_move(librdf_hash_memory2_cursor_context* cursor,
+                                int index)
+{
+  librdf_hash_memory2_context* hash=cursor->hash;
+  int mask=hash->capacity - 1;
+
+  cursor->current_entry=NULL;
+  cursor->current_value=0;
+  cursor->modifications=hash->modifications;
+
+  for(; index < (hash->capacity << 1); index++) {
+    int i=index & mask;
+    librdf_hash_memory2_slot* slot=&hash->slots[i];
+
+    if(index >= hash->capacity) {
+      /* past the last slot only the wrapped entries are left */
+      if(!slot->distance || !LIBRDF_HASH_MEMORY2_WRAPPED(hash->slots, i))
+        break;
+    } else if(!slot->distance || LIBRDF_HASH_MEMORY2_WRAPPED(hash->slots, i))
+      continue;
+
+    cursor->current_index=index;
+    cursor->current_entry=slot->entry;
+    cursor->current_hash_key=slot->hash_key;
+    return;
+  }
+}
+
+
+/**
+ * librdf_hash_memory2_cursor_sync:
+ * @cursor: memory2 hash cursor context
+ *
+ * Find the place of the current entry again if the hash has been
+ * changed since it was found.
+ *
+ * Return value: non 0 if the current entry has been deleted
+ **/
+static int
+librdf_hash_memory2_cursor_sync(librdf_hash_memory2_cursor_context* cursor)
+{
+  librdf_hash_memory2_context* hash=cursor->hash;
+  int i;
+
+  if(!cursor->current_entry || cursor->modifications == hash->modifications)
+    return 0;
+
+  cursor->modifications=hash->modifications;
+
+  i=librdf_hash_memory2_find_entry(hash, cursor->current_hash_key,
+                                   cursor->current_entry);
+  if(i < 0) {
+    cursor->current_entry=NULL;
+    cursor->current_value=0;
+    return 1;
+  }
+
+  cursor->current_index=i;
+  if(LIBRDF_HASH_MEMORY2_WRAPPED(hash->slots, i))
+    cursor->current_index+=hash->capacity;
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory2_cursor_init:
+ * @cursor_context: hash cursor context
+ * @hash_context: hash to operate over
+ *
+ * Initialise a new hash cursor.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory2_cursor_init(void *cursor_context, void *hash_context)
+{
+  librdf_hash_memory2_cursor_context *cursor=(librdf_hash_memory2_cursor_context*)cursor_context;
+
+  cursor->hash=(librdf_hash_memory2_context*)hash_context;
+  cursor->current_index= -1;
+  cursor->current_entry=NULL;
+  cursor->current_value=0;
+  cursor->walking=0;
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory2_cursor_get:
+ * @context: memory2 hash cursor context
+ * @key: pointer to key to use
+ * @value: pointer to value to use
+ * @flags: flags
+ *
+ * Retrieve a hash value for the given key.
+ *
+ * A cursor may be kept while the hash is changed.  A cursor walking all
+ * keys goes on in hash order from where it was, so every key present
+ * for the whole walk is returned once whatever other keys are put or
+ * deleted and however the table grows; only a key with the same 32 bit
+ * hash as a deleted key can be returned twice.  Keys put during the
+ * walk are returned if they sort after the cursor.  Deleting values of
+ * the current key may make the cursor miss one of its other values.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory2_cursor_get(void* context,
+                               librdf_hash_datum *key,
+                               librdf_hash_datum *value,
+                               unsigned int flags)
+{
+  librdf_hash_memory2_cursor_context *cursor=(librdf_hash_memory2_cursor_context*)context;
+  librdf_hash_memory2_context* hash=cursor->hash;
+  librdf_hash_memory2_entry *entry;
+  librdf_hash_memory2_value *v;
+  int i;
+
+  switch(flags) {
+    case LIBRDF_HASH_CURSOR_SET:
+      /* always (re)locate the key */
+      cursor->current_entry=NULL;
+      cursor->walking=0;
+      /* FALLTHROUGH */
+
+    case LIBRDF_HASH_CURSOR_NEXT_VALUE:
+      if(!cursor->current_entry) {
+        if(!key || !key->data)
+          return 1;
+        i=librdf_hash_memory2_find_slot(hash, key->data, key->size);
+        if(i < 0)
+          return 1;
+        librdf_hash_memory2_cursor_set_slot(cursor, i);
+      } else if(librdf_hash_memory2_cursor_sync(cursor))
+        /* key deleted since */
+        return 1;
+
+      entry=cursor->current_entry;
+      /* end of values for this key */
+      if(cursor->current_value >= entry->values_count)
+        return 1;
+
+      v=&entry->values[cursor->current_value++];
+      value->data=v->value;
+      value->size=v->value_len;
+      break;
+
+    case LIBRDF_HASH_CURSOR_FIRST:
+      cursor->walking=1;
+      librdf_hash_memory2_cursor_move(cursor, 0);
+      /* FALLTHROUGH */
+
+    case LIBRDF_HASH_CURSOR_NEXT:
+      if(!cursor->walking) {
+        cursor->walking=1;
+
+        /* no key yet - try to start from the given one */
+        if(!cursor->current_entry && key && key->data) {
+          i=librdf_hash_memory2_find_slot(hash, key->data, key->size);
+          if(i >= 0)
+            librdf_hash_memory2_cursor_set_slot(cursor, i);
+        }
+      }
+
+      if(librdf_hash_memory2_cursor_sync(cursor)) {
+        /* the key that was next is gone; go on from the first key
+         * not before it in hash order */
+        u32 hash_key=cursor->current_hash_key;
+
+        librdf_hash_memory2_cursor_move(cursor,
+                                        LIBRDF_HASH_MEMORY2_HOME(hash_key, hash->shift));
+        while(cursor->current_entry && cursor->current_hash_key < hash_key)
+          librdf_hash_memory2_cursor_move(cursor, cursor->current_index + 1);
+      }
+
+      /* skip keys whose values were deleted past the cursor */
+      while(value && cursor->current_entry &&
+            cursor->current_value >= cursor->current_entry->values_count)
+        librdf_hash_memory2_cursor_move(cursor, cursor->current_index + 1);
+
+      /* reached end of hash */
+      if(!(entry=cursor->current_entry))
+        return 1;
+
+      /* get key */
+      key->data=LIBRDF_HASH_MEMORY2_ENTRY_KEY(entry);
+      key->size=entry->key_len;
+
+      /* if want values, walk through them */
+      if(value) {
+        v=&entry->values[cursor->current_value++];
+        value->data=v->value;
+        value->size=v->value_len;
+
+        /* stop here if there are more values, otherwise move to the
+         * next key */
+        if(cursor->current_value < entry->values_count)
+          break;
+      }
+
+      librdf_hash_memory2_cursor_move(cursor, cursor->current_index + 1);
+      break;
+
+    default:
+      librdf_log(hash->hash->world,
+                 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+                 "Unknown hash method flag %d", flags);
+      return 1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory2_cursor_finished:
+ * @context: hash memory2 get iterator context
+ *
+ * Finish the serialisation of the hash memory2 get.
+ *
+ **/
+static void
+librdf_hash_memory2_cursor_finish(void* context)
+{
+/* librdf_hash_memory2_cursor_context *cursor=(librdf_hash_memory2_cursor_context*)context; */
+
+}
+
+
+/**
+ * librdf_hash_memory2_put:
+ * @context: memory2 hash context
+ * @key: pointer to key to store
+ * @value: pointer to value to store
+ *
+ * - Store a key/value pair in the hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory2_put(void* context, librdf_hash_datum *key,
+                        librdf_hash_datum *value)
+{
+  librdf_hash_memory2_context* hash=(librdf_hash_memory2_context*)context;
+  librdf_hash_memory2_entry *entry=NULL;
+  librdf_hash_memory2_value *v;
+  void *new_value;
+  int slot;
+  int is_new_entry;
+
+  slot=librdf_hash_memory2_find_slot(hash, key->data, key->size);
+  is_new_entry=(slot < 0);
+
+  if(is_new_entry) {
+    /* ensure there is room for one more key */
+    if(librdf_hash_memory2_expand_size(hash))
+      return 1;
+
+    /* allocate new entry with key */
+    entry=LIBRDF_MALLOC(librdf_hash_memory2_entry*,
+                        sizeof(*entry) + key->size);
+    if(!entry)
+      return 1;
+    entry->key_len=key->size;
+    entry->values_count=0;
+    entry->values_capacity=librdf_hash_memory2_initial_values;
+    entry->values=LIBRDF_MALLOC(librdf_hash_memory2_value*,
+                                entry->values_capacity * sizeof(*v));
+    if(!entry->values) {
+      LIBRDF_FREE(librdf_hash_memory2_entry, entry);
+      return 1;
+    }
+    memcpy(LIBRDF_HASH_MEMORY2_ENTRY_KEY(entry), key->data, key->size);
+  } else {
+    entry=hash->slots[slot].entry;
+
+    /* grow values array if necessary */
+    if(entry->values_count == entry->values_capacity) {
+      int new_capacity=entry->values_capacity << 1;
+      librdf_hash_memory2_value *new_values;
+
+      new_values=LIBRDF_MALLOC(librdf_hash_memory2_value*,
+                               new_capacity * sizeof(*v));
+      if(!new_values)
+        return 1;
+      memcpy(new_values, entry->values,
+             entry->values_count * sizeof(*v));
+      LIBRDF_FREE(librdf_hash_memory2_value, entry->values);
+      entry->values=new_values;
+      entry->values_capacity=new_capacity;
+    }
+  }
+
+  /* always allocate new value */
+  new_value=LIBRDF_MALLOC(void*, value->size ? value->size : 1);
+  if(!new_value) {
+    if(is_new_entry)
+      librdf_free_hash_memory2_entry(entry);
+    return 1;
+  }
+  memcpy(new_value, value->data, value->size);
+
+  /* if we get here, all allocations succeeded */
+
+  v=&entry->values[entry->values_count++];
+  v->value=new_value;
+  v->value_len=value->size;
+
+  if(is_new_entry) {
+    u32 hash_key;
+
+    LIBRDF_HASH_KEY_HASH(hash_key, key->data, key->size);
+    librdf_hash_memory2_insert_slot(hash->slots, hash->capacity, hash->shift,
+                                    hash_key, entry);
+    hash->modifications++;
+    hash->keys++;
+  }
+
+  hash->values++;
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory2_exists:
+ * @context: memory2 hash context
+ * @key: key
+ * @value: value
+ *
+ * Test the existence of a key in the hash.
+ *
+ * Return value: >0 if the key/value exists in the hash, 0 if not, <0 on failure
+ **/
+static int
+librdf_hash_memory2_exists(void* context,
+                           librdf_hash_datum *key, librdf_hash_datum *value)
+{
+  librdf_hash_memory2_context* hash=(librdf_hash_memory2_context*)context;
+  librdf_hash_memory2_entry *entry;
+  int slot;
+  int i;
+
+  slot=librdf_hash_memory2_find_slot(hash, key->data, key->size);
+  /* key not found */
+  if(slot < 0)
+    return 0;
+
+  /* no value wanted */
+  if(!value)
+    return 1;
+
+  entry=hash->slots[slot].entry;
+  for(i=0; i < entry->values_count; i++) {
+    if(value->size == entry->values[i].value_len &&
+       !memcmp(value->data, entry->values[i].value, value->size))
+      return 1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory2_delete_key_value:
+ * @context: memory2 hash context
+ * @key: pointer to key to delete
+ * @value: pointer to value to delete
+ *
+ * - Delete a key/value pair from the hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory2_delete_key_value(void* context, librdf_hash_datum *key,
+                                     librdf_hash_datum *value)
+{
+  librdf_hash_memory2_context* hash=(librdf_hash_memory2_context*)context;
+  librdf_hash_memory2_entry *entry;
+  int slot;
+  int i;
+
+  slot=librdf_hash_memory2_find_slot(hash, key->data, key->size);
+  /* key not found anywhere */
+  if(slot < 0)
+    return 1;
+
+  entry=hash->slots[slot].entry;
+  for(i=0; i < entry->values_count; i++) {
+    if(value->size == entry->values[i].value_len &&
+       !memcmp(value->data, entry->values[i].value, value->size))
+      break;
+  }
+
+  /* key/value combination not found */
+  if(i == entry->values_count)
+    return 1;
+
+  /* free value and fill the gap from the end of the array */
+  if(entry->values[i].value)
+    LIBRDF_FREE(char*, entry->values[i].value);
+  entry->values[i]=entry->values[--entry->values_count];
+
+  hash->values--;
+
+  /* all values gone so delete the entire key */
+  if(!entry->values_count) {
+    librdf_hash_memory2_remove_slot(hash, slot);
+    librdf_free_hash_memory2_entry(entry);
+    hash->keys--;
+  }
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory2_delete_key:
+ * @context: memory2 hash context
+ * @key: pointer to key to delete
+ *
+ * - Delete a key and all its values from the hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory2_delete_key(void* context, librdf_hash_datum *key)
+{
+  librdf_hash_memory2_context* hash=(librdf_hash_memory2_context*)context;
+  librdf_hash_memory2_entry *entry;
+  int slot;
+
+  slot=librdf_hash_memory2_find_slot(hash, key->data, key->size);
+  /* not found anywhere */
+  if(slot < 0)
+    return 1;
+
+  entry=hash->slots[slot].entry;
+  librdf_hash_memory2_remove_slot(hash, slot);
+
+  /* update hash counts */
+  hash->keys--;
+  hash->values-= entry->values_count;
+
+  librdf_free_hash_memory2_entry(entry);
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory2_sync:
+ * @context: memory2 hash context
+ *
+ * Flush the hash to disk.
+ *
+ * Not used
+ *
+ * Return value: 0
+ **/
+static int
+librdf_hash_memory2_sync(void* context)
+{
+  /* Not applicable */
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory2_get_fd:
+ * @context: memory2 hash context
+ *
+ * Get the file descriptor representing the hash.
+ *
+ * Not used
+ *
+ * Return value: -1
+ **/
+static int
+librdf_hash_memory2_get_fd(void* context)
+{
+  /* Not applicable */
+  return -1;
+}
+
+
+/* local function to register memory2 hash functions */
+
+/**
+ * librdf_hash_memory2_register_factory:
+ * @factory: hash factory prototype
+ *
+ * Register the memory2 hash module with the hash factory.
+ *
+ **/
+static void
+librdf_hash_memory2_register_factory(librdf_hash_factory *factory)
+{
+  factory->context_length = sizeof(librdf_hash_memory2_context);
+  factory->cursor_context_length = sizeof(librdf_hash_memory2_cursor_context);
+
+  factory->create  = librdf_hash_memory2_create;
+  factory->destroy = librdf_hash_memory2_destroy;
+
+  factory->open    = librdf_hash_memory2_open;
+  factory->close   = librdf_hash_memory2_close;
+  factory->clone   = librdf_hash_memory2_clone;
+
+  factory->values_count = librdf_hash_memory2_values_count;
+
+  factory->put     = librdf_hash_memory2_put;
+  factory->exists  = librdf_hash_memory2_exists;
+  factory->delete_key  = librdf_hash_memory2_delete_key;
+  factory->delete_key_value  = librdf_hash_memory2_delete_key_value;
+  factory->sync    = librdf_hash_memory2_sync;
+  factory->get_fd  = librdf_hash_memory2_get_fd;
+
+  factory->cursor_init   = librdf_hash_memory2_cursor_init;
+  factory->cursor_get    = librdf_hash_memory2_cursor_get;
+  factory->cursor_finish = librdf_hash_memory2_cursor_finish;
+}
+
+/**
+ * librdf_init_hash_memory2:
+ * @world: redland world object
+ *
+ * Initialise the memory2 open addressing hash module.
+ **/
+void
+librdf_init_hash_memory2(librdf_world *world)
+{
+  librdf_hash_register_factory(world,
+                               "memory2", &librdf_hash_memory2_register_factory);
+}
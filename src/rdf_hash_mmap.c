@@ -0,0 +1,1251 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_hash_mmap.c - RDF hash memory mapped file implementation
+ *
+ * Copyright (C) 2000-2008, David Beckett http://www.dajobe.org/
+ * Copyright (C) 2000-2004, University of Bristol, UK http://www.bristol.ac.uk/
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+/*
+ * The hash is one file, IDENTIFIER.mmap, mapped into memory and used
+ * in place so opening it does not read it.  All positions in the file
+ * are byte offsets so the file can be mapped again at any address
+ * when it grows.
+ *
+ * The file starts with a header, followed by a heap that is only
+ * ever appended to.  The heap holds:
+ *
+ *   - bucket tables: open addressing with linear probing, each bucket
+ *     holding the offset of a key record and the hash of the key.
+ *     A larger table is built when the table gets 70% full and the
+ *     header is switched to it; the old table is left unused.
+ *   - key records: the offset of the newest value record of the key,
+ *     the key size and the key bytes.
+ *   - value records: the offset of the next older value record of the
+ *     same key, the value size and the value bytes.
+ *
+ * Every change writes new records at the end of the heap, moves the
+ * end of the heap past them and only then links them in with a single
+ * aligned 8 byte store, so a process that dies part way through leaves
+ * at worst some unused space.  Deletes unlink records or mark buckets
+ * deleted the same way; their space is not reused.  The key and value
+ * counts in the header are recounted if the file was not closed
+ * cleanly.
+ *
+ * Files use the byte order of the machine that created them.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <rdf_config.h>
+#endif
+
+#ifdef WIN32
+#include <win32_rdf_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <sys/types.h>
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#include <sys/mman.h>
+
+#include <redland.h>
+#include <rdf_types.h>
+#include <rdf_hash.h>
+
+
+#define LIBRDF_HASH_MMAP_MAGIC "RDFMMAPH"
+#define LIBRDF_HASH_MMAP_VERSION 1
+#define LIBRDF_HASH_MMAP_BYTE_ORDER 0x01020304U
+
+/* size of a new file and buckets in its table */
+#define LIBRDF_HASH_MMAP_INITIAL_SIZE (64 * 1024)
+#define LIBRDF_HASH_MMAP_INITIAL_BUCKETS 1024
+
+/* bucket key offsets that are not key records */
+#define LIBRDF_HASH_MMAP_EMPTY 0
+#define LIBRDF_HASH_MMAP_DELETED 1
+
+#define LIBRDF_HASH_MMAP_ALIGN(n) (((n) + 7) & ~((size_t)7))
+
+#define LIBRDF_HASH_MMAP_AT(context, type, offset) \
+  ((type*)((context)->map + (size_t)(offset)))
+#define LIBRDF_HASH_MMAP_HEADER(context) \
+  LIBRDF_HASH_MMAP_AT(context, librdf_hash_mmap_header, 0)
+
+
+typedef struct {
+  char magic[8];
+  u32 version;
+  u32 byte_order;
+  u32 clean;         /* 0 while open for writing */
+  u32 reserved;
+  u64 table;         /* offset of the bucket table in use */
+  u64 heap_end;      /* offset of the first unused byte */
+  u64 keys_count;
+  u64 values_count;
+} librdf_hash_mmap_header;
+
+typedef struct {
+  u64 buckets_count; /* power of 2 */
+  u64 used;          /* buckets not empty, including deleted ones */
+} librdf_hash_mmap_table;
+
+typedef struct {
+  u64 key;           /* offset of key record or EMPTY or DELETED */
+  u32 hash;
+  u32 reserved;
+} librdf_hash_mmap_bucket;
+
+typedef struct {
+  u64 values;        /* offset of newest value record, 0 if none */
+  u32 key_size;
+  u32 reserved;
+  /* key bytes follow */
+} librdf_hash_mmap_key;
+
+typedef struct {
+  u64 next;          /* offset of next older value record or 0 */
+  u32 value_size;
+  u32 reserved;
+  /* value bytes follow */
+} librdf_hash_mmap_value;
+
+
+typedef struct
+{
+  librdf_hash *hash;
+  int mode;
+  int is_writable;
+  int is_new;
+  /* for mmap only */
+  char* file_name;
+  int fd;
+  char* map;
+  size_t map_size;   /* also the file size */
+} librdf_hash_mmap_context;
+
+
+typedef struct {
+  librdf_hash_mmap_context* hash;
+  int started;       /* positioned by a SET, FIRST or NEXT */
+  u64 table;         /* table being walked */
+  u64 bucket;        /* bucket of key */
+  u64 key;           /* offset of key record, 0 at the end */
+  u64 value;         /* offset of the next value record to return */
+  /* copies returned to the caller since the map may move */
+  char* key_buffer;
+  size_t key_buffer_size;
+  char* value_buffer;
+  size_t value_buffer_size;
+} librdf_hash_mmap_cursor_context;
+
+
+/* Implementing the hash cursor */
+static int librdf_hash_mmap_cursor_init(void *cursor_context, void *hash_context);
+static int librdf_hash_mmap_cursor_get(void *context, librdf_hash_datum* key, librdf_hash_datum* value, unsigned int flags);
+static void librdf_hash_mmap_cursor_finish(void* context);
+
+/* prototypes for local functions */
+static int librdf_hash_mmap_create(librdf_hash* hash, void* context);
+static int librdf_hash_mmap_destroy(void* context);
+static int librdf_hash_mmap_open(void* context, const char *identifier, int mode, int is_writable, int is_new, librdf_hash* options);
+static int librdf_hash_mmap_close(void* context);
+static int librdf_hash_mmap_clone(librdf_hash* new_hash, void *new_context, char *new_identifier, void* old_context);
+static int librdf_hash_mmap_values_count(void *context);
+static int librdf_hash_mmap_put(void* context, librdf_hash_datum *key, librdf_hash_datum *data);
+static int librdf_hash_mmap_exists(void* context, librdf_hash_datum *key, librdf_hash_datum *value);
+static int librdf_hash_mmap_delete_key(void* context, librdf_hash_datum *key);
+static int librdf_hash_mmap_delete_key_value(void* context, librdf_hash_datum *key, librdf_hash_datum *value);
+static int librdf_hash_mmap_sync(void* context);
+static int librdf_hash_mmap_get_fd(void* context);
+
+static void librdf_hash_mmap_register_factory(librdf_hash_factory *factory);
+
+
+/* FNV-1a; fixed here rather than LIBRDF_HASH_KEY_HASH since it is
+ * stored in the file
+ */
+static u32
+librdf_hash_mmap_hash_key(librdf_hash_datum *key)
+{
+  const unsigned char *p=(const unsigned char*)key->data;
+  u32 hash=2166136261U;
+  size_t i;
+
+  for(i=0; i < key->size; i++) {
+    hash ^= p[i];
+    hash *= 16777619U;
+  }
+
+  return hash;
+}
+
+
+static librdf_hash_mmap_bucket*
+librdf_hash_mmap_buckets(librdf_hash_mmap_context* context, u64 table)
+{
+  return LIBRDF_HASH_MMAP_AT(context, librdf_hash_mmap_bucket,
+                             table + sizeof(librdf_hash_mmap_table));
+}
+
+
+/*
+ * librdf_hash_mmap_map - Map the file with a size, growing the file if needed
+ * @context: mmap hash context
+ * @size: bytes to map
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_map(librdf_hash_mmap_context* context, size_t size)
+{
+  void* map;
+  int prot=PROT_READ;
+
+  if(context->is_writable) {
+    prot |= PROT_WRITE;
+    if(size > context->map_size && ftruncate(context->fd, (off_t)size)) {
+      librdf_log(context->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH,
+                 NULL, "Failed to grow hash file %s to %lu bytes",
+                 context->file_name, (unsigned long)size);
+      return 1;
+    }
+  }
+
+  map=mmap(NULL, size, prot, MAP_SHARED, context->fd, 0);
+  if(map == MAP_FAILED) {
+    librdf_log(context->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH,
+               NULL, "Failed to map hash file %s", context->file_name);
+    return 1;
+  }
+
+  if(context->map)
+    munmap(context->map, context->map_size);
+  context->map=(char*)map;
+  context->map_size=size;
+
+  return 0;
+}
+
+
+/*
+ * librdf_hash_mmap_alloc - Take space at the end of the heap
+ * @context: mmap hash context
+ * @size: bytes wanted
+ *
+ * The end of the heap is moved before the caller writes the space,
+ * which it must link in after writing.  The file may be mapped again
+ * so pointers into the map must be found again afterwards.
+ *
+ * Return value: offset of the space or 0 on failure
+ **/
+static u64
+librdf_hash_mmap_alloc(librdf_hash_mmap_context* context, size_t size)
+{
+  u64 offset=LIBRDF_HASH_MMAP_HEADER(context)->heap_end;
+  size_t needed;
+
+  size=LIBRDF_HASH_MMAP_ALIGN(size);
+  needed=(size_t)offset + size;
+
+  if(needed > context->map_size) {
+    size_t map_size=context->map_size;
+
+    while(map_size < needed)
+      map_size <<= 1;
+    if(librdf_hash_mmap_map(context, map_size))
+      return 0;
+  }
+
+  LIBRDF_HASH_MMAP_HEADER(context)->heap_end=offset + size;
+
+  return offset;
+}
+
+
+/*
+ * librdf_hash_mmap_new_table - Build a bucket table holding the keys of the current one
+ * @context: mmap hash context
+ * @buckets_count: buckets in the new table, a power of 2
+ *
+ * Return value: offset of the new table or 0 on failure
+ **/
+static u64
+librdf_hash_mmap_new_table(librdf_hash_mmap_context* context,
+                           u64 buckets_count)
+{
+  librdf_hash_mmap_header* header;
+  librdf_hash_mmap_table* table;
+  librdf_hash_mmap_bucket* buckets;
+  u64 offset;
+  u64 old_table;
+  u64 i;
+
+  offset=librdf_hash_mmap_alloc(context, sizeof(librdf_hash_mmap_table) +
+                                (size_t)buckets_count * sizeof(librdf_hash_mmap_bucket));
+  if(!offset)
+    return 0;
+
+  header=LIBRDF_HASH_MMAP_HEADER(context);
+  table=LIBRDF_HASH_MMAP_AT(context, librdf_hash_mmap_table, offset);
+  buckets=librdf_hash_mmap_buckets(context, offset);
+
+  /* space may be left from a write that did not finish */
+  memset(buckets, 0, (size_t)buckets_count * sizeof(librdf_hash_mmap_bucket));
+  table->buckets_count=buckets_count;
+  table->used=0;
+
+  old_table=header->table;
+  if(old_table) {
+    librdf_hash_mmap_table* old=LIBRDF_HASH_MMAP_AT(context, librdf_hash_mmap_table, old_table);
+    librdf_hash_mmap_bucket* old_buckets=librdf_hash_mmap_buckets(context, old_table);
+
+    for(i=0; i < old->buckets_count; i++) {
+      librdf_hash_mmap_bucket* old_bucket=&old_buckets[i];
+      u64 b;
+
+      if(old_bucket->key <= LIBRDF_HASH_MMAP_DELETED ||
+         !LIBRDF_HASH_MMAP_AT(context, librdf_hash_mmap_key, old_bucket->key)->values)
+        continue;
+
+      for(b=old_bucket->hash & (buckets_count - 1); buckets[b].key;
+          b=(b + 1) & (buckets_count - 1))
+        ;
+      buckets[b].hash=old_bucket->hash;
+      buckets[b].key=old_bucket->key;
+      table->used++;
+    }
+  }
+
+  return offset;
+}
+
+
+/*
+ * librdf_hash_mmap_find - Find the key record of a key
+ * @context: mmap hash context
+ * @table: offset of bucket table
+ * @key: key
+ * @hash: hash of key
+ * @bucket_p: pointer to store the bucket of the key or, if it is not
+ *   found, the bucket to put it in
+ *
+ * Return value: offset of the key record or 0 if not found
+ **/
+static u64
+librdf_hash_mmap_find(librdf_hash_mmap_context* context, u64 table,
+                      librdf_hash_datum *key, u32 hash, u64 *bucket_p)
+{
+  u64 buckets_count=LIBRDF_HASH_MMAP_AT(context, librdf_hash_mmap_table, table)->buckets_count;
+  librdf_hash_mmap_bucket* buckets=librdf_hash_mmap_buckets(context, table);
+  u64 free_bucket=buckets_count;
+  u64 b;
+  u64 i;
+
+  for(b=hash & (buckets_count - 1), i=0; i < buckets_count;
+      b=(b + 1) & (buckets_count - 1), i++) {
+    u64 key_offset=buckets[b].key;
+
+    if(key_offset == LIBRDF_HASH_MMAP_EMPTY)
+      break;
+
+    if(key_offset == LIBRDF_HASH_MMAP_DELETED) {
+      if(free_bucket == buckets_count)
+        free_bucket=b;
+    } else if(buckets[b].hash == hash) {
+      librdf_hash_mmap_key* k=LIBRDF_HASH_MMAP_AT(context, librdf_hash_mmap_key, key_offset);
+
+      if(k->key_size == key->size &&
+         !memcmp((char*)(k + 1), key->data, key->size)) {
+        if(bucket_p)
+          *bucket_p=b;
+        return key_offset;
+      }
+    }
+  }
+
+  if(bucket_p)
+    *bucket_p=(free_bucket < buckets_count) ? free_bucket : b;
+
+  return 0;
+}
+
+
+/* count keys and values after the file was not closed cleanly */
+static void
+librdf_hash_mmap_recount(librdf_hash_mmap_context* context)
+{
+  librdf_hash_mmap_header* header=LIBRDF_HASH_MMAP_HEADER(context);
+  librdf_hash_mmap_table* table=LIBRDF_HASH_MMAP_AT(context, librdf_hash_mmap_table, header->table);
+  librdf_hash_mmap_bucket* buckets=librdf_hash_mmap_buckets(context, header->table);
+  u64 keys_count=0;
+  u64 values_count=0;
+  u64 i;
+
+  for(i=0; i < table->buckets_count; i++) {
+    u64 value;
+
+    if(buckets[i].key <= LIBRDF_HASH_MMAP_DELETED)
+      continue;
+
+    value=LIBRDF_HASH_MMAP_AT(context, librdf_hash_mmap_key, buckets[i].key)->values;
+    if(value)
+      keys_count++;
+    for(; value; value=LIBRDF_HASH_MMAP_AT(context, librdf_hash_mmap_value, value)->next)
+      values_count++;
+  }
+
+  header->keys_count=keys_count;
+  header->values_count=values_count;
+}
+
+
+/* check the header and table of an existing file are usable */
+static int
+librdf_hash_mmap_check(librdf_hash_mmap_context* context)
+{
+  librdf_hash_mmap_header* header=LIBRDF_HASH_MMAP_HEADER(context);
+  librdf_hash_mmap_table* table;
+
+  if(memcmp(header->magic, LIBRDF_HASH_MMAP_MAGIC, 8) ||
+     header->version != LIBRDF_HASH_MMAP_VERSION ||
+     header->byte_order != LIBRDF_HASH_MMAP_BYTE_ORDER)
+    return 1;
+
+  if(header->heap_end > context->map_size ||
+     header->table < sizeof(librdf_hash_mmap_header) ||
+     header->table + sizeof(librdf_hash_mmap_table) > header->heap_end)
+    return 1;
+
+  table=LIBRDF_HASH_MMAP_AT(context, librdf_hash_mmap_table, header->table);
+  if(!table->buckets_count ||
+     (table->buckets_count & (table->buckets_count - 1)) ||
+     header->table + sizeof(librdf_hash_mmap_table) +
+     table->buckets_count * sizeof(librdf_hash_mmap_bucket) > header->heap_end)
+    return 1;
+
+  return 0;
+}
+
+
+/* functions implementing hash api */
+
+/**
+ * librdf_hash_mmap_create:
+ * @hash: #librdf_hash hash that this implements
+ * @context: mmap hash context
+ *
+ * Create a mmap hash.
+ *
+ * Return value: non 0 on failure.
+ **/
+static int
+librdf_hash_mmap_create(librdf_hash* hash, void* context)
+{
+  librdf_hash_mmap_context* hcontext=(librdf_hash_mmap_context*)context;
+
+  hcontext->hash=hash;
+  hcontext->fd=-1;
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_mmap_destroy:
+ * @context: mmap hash context
+ *
+ * Destroy a mmap hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_destroy(void* context)
+{
+  /* NOP */
+  return 0;
+}
+
+
+/**
+ * librdf_hash_mmap_open:
+ * @context: mmap hash context
+ * @identifier: filename to use for the hash file, without the .mmap suffix
+ * @mode: file creation mode
+ * @is_writable: is hash writable?
+ * @is_new: is hash new?
+ * @options: hash options (currently unused)
+ *
+ * Open and map a hash file, creating it if needed.
+ *
+ * Return value: non 0 on failure.
+ **/
+static int
+librdf_hash_mmap_open(void* context, const char *identifier,
+                      int mode, int is_writable, int is_new,
+                      librdf_hash* options)
+{
+  librdf_hash_mmap_context* hcontext=(librdf_hash_mmap_context*)context;
+  librdf_hash_mmap_header* header;
+  struct stat st;
+  int flags;
+  char *file;
+
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(identifier, cstring, 1);
+
+  hcontext->mode=mode;
+  hcontext->is_writable=is_writable;
+  hcontext->is_new=is_new;
+
+  file=LIBRDF_MALLOC(char*, strlen(identifier) + 6);
+  if(!file)
+    return 1;
+  sprintf(file, "%s.mmap", identifier);
+  hcontext->file_name=file;
+
+  if(is_writable) {
+    flags=O_RDWR | O_CREAT;
+    if(is_new)
+      flags |= O_TRUNC;
+  } else
+    flags=O_RDONLY;
+
+  hcontext->fd=open(file, flags, mode);
+  if(hcontext->fd < 0 || fstat(hcontext->fd, &st)) {
+    librdf_log(hcontext->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH,
+               NULL, "Failed to open hash file %s", file);
+    goto failed;
+  }
+  hcontext->map_size=(size_t)st.st_size;
+
+  if(!hcontext->map_size && is_writable) {
+    /* empty file: lay out the header and first table */
+    if(librdf_hash_mmap_map(hcontext, LIBRDF_HASH_MMAP_INITIAL_SIZE))
+      goto failed;
+
+    header=LIBRDF_HASH_MMAP_HEADER(hcontext);
+    memcpy(header->magic, LIBRDF_HASH_MMAP_MAGIC, 8);
+    header->version=LIBRDF_HASH_MMAP_VERSION;
+    header->byte_order=LIBRDF_HASH_MMAP_BYTE_ORDER;
+    header->heap_end=LIBRDF_HASH_MMAP_ALIGN(sizeof(librdf_hash_mmap_header));
+    header->table=librdf_hash_mmap_new_table(hcontext,
+                                             LIBRDF_HASH_MMAP_INITIAL_BUCKETS);
+    if(!header->table)
+      goto failed;
+    header->clean=1;
+  } else {
+    if(hcontext->map_size < sizeof(librdf_hash_mmap_header) ||
+       librdf_hash_mmap_map(hcontext, hcontext->map_size))
+      goto bad_file;
+    if(librdf_hash_mmap_check(hcontext))
+      goto bad_file;
+  }
+
+  if(is_writable) {
+    header=LIBRDF_HASH_MMAP_HEADER(hcontext);
+    if(!header->clean)
+      librdf_hash_mmap_recount(hcontext);
+    header->clean=0;
+  }
+
+  return 0;
+
+  bad_file:
+  librdf_log(hcontext->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH,
+             NULL, "Hash file %s is not a mmap hash file", file);
+
+  failed:
+  if(hcontext->map) {
+    munmap(hcontext->map, hcontext->map_size);
+    hcontext->map=NULL;
+  }
+  if(hcontext->fd >= 0) {
+    close(hcontext->fd);
+    hcontext->fd=-1;
+  }
+  LIBRDF_FREE(char*, hcontext->file_name);
+  hcontext->file_name=NULL;
+
+  return 1;
+}
+
+
+/**
+ * librdf_hash_mmap_close:
+ * @context: mmap hash context
+ *
+ * Mark the file closed cleanly, write it to disk and unmap it.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_close(void* context)
+{
+  librdf_hash_mmap_context* hcontext=(librdf_hash_mmap_context*)context;
+  int status=0;
+
+  if(hcontext->map) {
+    if(hcontext->is_writable) {
+      LIBRDF_HASH_MMAP_HEADER(hcontext)->clean=1;
+      if(msync(hcontext->map, hcontext->map_size, MS_SYNC))
+        status=1;
+    }
+    munmap(hcontext->map, hcontext->map_size);
+    hcontext->map=NULL;
+  }
+
+  if(hcontext->fd >= 0) {
+    close(hcontext->fd);
+    hcontext->fd=-1;
+  }
+
+  if(hcontext->file_name) {
+    LIBRDF_FREE(char*, hcontext->file_name);
+    hcontext->file_name=NULL;
+  }
+
+  return status;
+}
+
+
+/**
+ * librdf_hash_mmap_clone:
+ * @hash: new #librdf_hash that this implements
+ * @context: new mmap hash context
+ * @new_identifier: new identifier for this hash
+ * @old_context: old mmap hash context
+ *
+ * Clone a mmap hash by copying its pairs into a new file.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_clone(librdf_hash *hash, void* context, char *new_identifier,
+                       void *old_context)
+{
+  librdf_hash_mmap_context* hcontext=(librdf_hash_mmap_context*)context;
+  librdf_hash_mmap_context* old_hcontext=(librdf_hash_mmap_context*)old_context;
+  librdf_hash_datum *key, *value;
+  librdf_iterator *iterator;
+  int status=0;
+
+  /* copy data fields that might change */
+  hcontext->hash=hash;
+  hcontext->fd=-1;
+
+  if(librdf_hash_mmap_open(context, new_identifier,
+                           old_hcontext->mode, old_hcontext->is_writable,
+                           old_hcontext->is_new, NULL))
+    return 1;
+
+  key=librdf_new_hash_datum(hash->world, NULL, 0);
+  value=librdf_new_hash_datum(hash->world, NULL, 0);
+
+  iterator=librdf_hash_get_all(old_hcontext->hash, key, value);
+  while(!librdf_iterator_end(iterator)) {
+    librdf_hash_datum* k= (librdf_hash_datum*)librdf_iterator_get_key(iterator);
+    librdf_hash_datum* v= (librdf_hash_datum*)librdf_iterator_get_value(iterator);
+
+    if(librdf_hash_mmap_put(hcontext, k, v)) {
+      status=1;
+      break;
+    }
+    librdf_iterator_next(iterator);
+  }
+  if(iterator)
+    librdf_free_iterator(iterator);
+
+  librdf_free_hash_datum(value);
+  librdf_free_hash_datum(key);
+
+  return status;
+}
+
+
+/**
+ * librdf_hash_mmap_values_count:
+ * @context: mmap hash context
+ *
+ * Get the number of values in the hash.
+ *
+ * Return value: number of values in the hash or <0 if not available
+ **/
+static int
+librdf_hash_mmap_values_count(void *context)
+{
+  librdf_hash_mmap_context* hcontext=(librdf_hash_mmap_context*)context;
+
+  return (int)LIBRDF_HASH_MMAP_HEADER(hcontext)->values_count;
+}
+
+
+static int
+librdf_hash_mmap_check_writable(librdf_hash_mmap_context* context)
+{
+  if(context->is_writable)
+    return 0;
+
+  librdf_log(context->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH,
+             NULL, "Hash file %s is not open for writing", context->file_name);
+  return 1;
+}
+
+
+/**
+ * librdf_hash_mmap_put:
+ * @context: mmap hash context
+ * @key: pointer to key to store
+ * @value: pointer to value to store
+ *
+ * Store a key/value pair in the hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_put(void* context, librdf_hash_datum *key,
+                     librdf_hash_datum *value)
+{
+  librdf_hash_mmap_context* hcontext=(librdf_hash_mmap_context*)context;
+  librdf_hash_mmap_header* header=LIBRDF_HASH_MMAP_HEADER(hcontext);
+  librdf_hash_mmap_table* table;
+  librdf_hash_mmap_value* v;
+  librdf_hash_mmap_bucket* bucket;
+  u32 hash;
+  u64 key_offset;
+  u64 value_offset;
+  u64 b;
+
+  if(librdf_hash_mmap_check_writable(hcontext))
+    return 1;
+
+  hash=librdf_hash_mmap_hash_key(key);
+  key_offset=librdf_hash_mmap_find(hcontext, header->table, key, hash, &b);
+
+  /* keep the table under 70% full so probes stay short */
+  table=LIBRDF_HASH_MMAP_AT(hcontext, librdf_hash_mmap_table, header->table);
+  if(!key_offset && (table->used + 1) * 10 > table->buckets_count * 7) {
+    u64 buckets_count=table->buckets_count;
+    u64 new_table;
+
+    /* double unless most used buckets are deleted keys */
+    while((header->keys_count + 1) * 2 > buckets_count)
+      buckets_count <<= 1;
+    new_table=librdf_hash_mmap_new_table(hcontext, buckets_count);
+    if(!new_table)
+      return 1;
+    header=LIBRDF_HASH_MMAP_HEADER(hcontext);
+    header->table=new_table;
+    librdf_hash_mmap_find(hcontext, new_table, key, hash, &b);
+  }
+
+  value_offset=librdf_hash_mmap_alloc(hcontext, sizeof(librdf_hash_mmap_value) +
+                                      value->size);
+  if(!value_offset)
+    return 1;
+  header=LIBRDF_HASH_MMAP_HEADER(hcontext);
+  v=LIBRDF_HASH_MMAP_AT(hcontext, librdf_hash_mmap_value, value_offset);
+  v->value_size=(u32)value->size;
+  v->reserved=0;
+  memcpy((char*)(v + 1), value->data, value->size);
+
+  if(key_offset) {
+    librdf_hash_mmap_key* k=LIBRDF_HASH_MMAP_AT(hcontext, librdf_hash_mmap_key, key_offset);
+
+    v->next=k->values;
+    k->values=value_offset;
+  } else {
+    librdf_hash_mmap_key* k;
+
+    key_offset=librdf_hash_mmap_alloc(hcontext, sizeof(librdf_hash_mmap_key) +
+                                      key->size);
+    if(!key_offset)
+      return 1;
+    header=LIBRDF_HASH_MMAP_HEADER(hcontext);
+    k=LIBRDF_HASH_MMAP_AT(hcontext, librdf_hash_mmap_key, key_offset);
+    k->key_size=(u32)key->size;
+    k->reserved=0;
+    memcpy((char*)(k + 1), key->data, key->size);
+    LIBRDF_HASH_MMAP_AT(hcontext, librdf_hash_mmap_value, value_offset)->next=0;
+    k->values=value_offset;
+
+    bucket=&librdf_hash_mmap_buckets(hcontext, header->table)[b];
+    if(bucket->key == LIBRDF_HASH_MMAP_EMPTY)
+      LIBRDF_HASH_MMAP_AT(hcontext, librdf_hash_mmap_table, header->table)->used++;
+    bucket->hash=hash;
+    bucket->key=key_offset;
+    header->keys_count++;
+  }
+
+  header->values_count++;
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_mmap_exists:
+ * @context: mmap hash context
+ * @key: pointer to key
+ * @value: pointer to value (optional)
+ *
+ * Test the existence of a key or key/value in the hash.
+ *
+ * Return value: >0 if the key/value exists in the hash, 0 if not, <0 on failure
+ **/
+static int
+librdf_hash_mmap_exists(void* context, librdf_hash_datum *key,
+                        librdf_hash_datum *value)
+{
+  librdf_hash_mmap_context* hcontext=(librdf_hash_mmap_context*)context;
+  u64 key_offset;
+  u64 v;
+
+  key_offset=librdf_hash_mmap_find(hcontext,
+                                   LIBRDF_HASH_MMAP_HEADER(hcontext)->table,
+                                   key, librdf_hash_mmap_hash_key(key), NULL);
+  if(!key_offset)
+    return 0;
+
+  v=LIBRDF_HASH_MMAP_AT(hcontext, librdf_hash_mmap_key, key_offset)->values;
+  if(!value)
+    return (v != 0);
+
+  for(; v; v=LIBRDF_HASH_MMAP_AT(hcontext, librdf_hash_mmap_value, v)->next) {
+    librdf_hash_mmap_value* vr=LIBRDF_HASH_MMAP_AT(hcontext, librdf_hash_mmap_value, v);
+
+    if(vr->value_size == value->size &&
+       !memcmp((char*)(vr + 1), value->data, value->size))
+      return 1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_mmap_delete_key:
+ * @context: mmap hash context
+ * @key: pointer to key to delete
+ *
+ * Delete a key and all its values from the hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_delete_key(void* context, librdf_hash_datum *key)
+{
+  librdf_hash_mmap_context* hcontext=(librdf_hash_mmap_context*)context;
+  librdf_hash_mmap_header* header=LIBRDF_HASH_MMAP_HEADER(hcontext);
+  u64 key_offset;
+  u64 v;
+  u64 b;
+
+  if(librdf_hash_mmap_check_writable(hcontext))
+    return 1;
+
+  key_offset=librdf_hash_mmap_find(hcontext, header->table, key,
+                                   librdf_hash_mmap_hash_key(key), &b);
+  if(!key_offset)
+    return 1;
+
+  librdf_hash_mmap_buckets(hcontext, header->table)[b].key=LIBRDF_HASH_MMAP_DELETED;
+
+  v=LIBRDF_HASH_MMAP_AT(hcontext, librdf_hash_mmap_key, key_offset)->values;
+  if(v)
+    header->keys_count--;
+  for(; v; v=LIBRDF_HASH_MMAP_AT(hcontext, librdf_hash_mmap_value, v)->next)
+    header->values_count--;
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_mmap_delete_key_value:
+ * @context: mmap hash context
+ * @key: pointer to key to delete
+ * @value: pointer to value to delete
+ *
+ * Delete a key/value pair from the hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_delete_key_value(void* context, librdf_hash_datum *key,
+                                  librdf_hash_datum *value)
+{
+  librdf_hash_mmap_context* hcontext=(librdf_hash_mmap_context*)context;
+  librdf_hash_mmap_header* header=LIBRDF_HASH_MMAP_HEADER(hcontext);
+  librdf_hash_mmap_key* k;
+  u64 key_offset;
+  u64 *link;
+  u64 b;
+
+  if(librdf_hash_mmap_check_writable(hcontext))
+    return 1;
+
+  key_offset=librdf_hash_mmap_find(hcontext, header->table, key,
+                                   librdf_hash_mmap_hash_key(key), &b);
+  if(!key_offset)
+    return 1;
+
+  k=LIBRDF_HASH_MMAP_AT(hcontext, librdf_hash_mmap_key, key_offset);
+  for(link=&k->values; *link;
+      link=&LIBRDF_HASH_MMAP_AT(hcontext, librdf_hash_mmap_value, *link)->next) {
+    librdf_hash_mmap_value* vr=LIBRDF_HASH_MMAP_AT(hcontext, librdf_hash_mmap_value, *link);
+
+    if(vr->value_size != value->size ||
+       memcmp((char*)(vr + 1), value->data, value->size))
+      continue;
+
+    *link=vr->next;
+    header->values_count--;
+    if(!k->values) {
+      librdf_hash_mmap_buckets(hcontext, header->table)[b].key=LIBRDF_HASH_MMAP_DELETED;
+      header->keys_count--;
+    }
+    return 0;
+  }
+
+  return 1;
+}
+
+
+/**
+ * librdf_hash_mmap_sync:
+ * @context: mmap hash context
+ *
+ * Write the mapped file to disk.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_sync(void* context)
+{
+  librdf_hash_mmap_context* hcontext=(librdf_hash_mmap_context*)context;
+
+  if(!hcontext->is_writable)
+    return 0;
+
+  return msync(hcontext->map, hcontext->map_size, MS_SYNC) != 0;
+}
+
+
+/**
+ * librdf_hash_mmap_get_fd:
+ * @context: mmap hash context
+ *
+ * Get the file descriptor representing the hash.
+ *
+ * Return value: the file descriptor value
+ **/
+static int
+librdf_hash_mmap_get_fd(void* context)
+{
+  librdf_hash_mmap_context* hcontext=(librdf_hash_mmap_context*)context;
+
+  return hcontext->fd;
+}
+
+
+/* cursor */
+
+/**
+ * librdf_hash_mmap_cursor_init:
+ * @cursor_context: hash cursor context
+ * @hash_context: hash to operate over
+ *
+ * Initialise a new mmap hash cursor.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_cursor_init(void *cursor_context, void *hash_context)
+{
+  librdf_hash_mmap_cursor_context* cursor=(librdf_hash_mmap_cursor_context*)cursor_context;
+
+  cursor->hash=(librdf_hash_mmap_context*)hash_context;
+
+  return 0;
+}
+
+
+/* position a cursor at the first key with values from a bucket */
+static void
+librdf_hash_mmap_cursor_seek(librdf_hash_mmap_cursor_context* cursor,
+                             u64 bucket)
+{
+  librdf_hash_mmap_context* hcontext=cursor->hash;
+  u64 buckets_count=LIBRDF_HASH_MMAP_AT(hcontext, librdf_hash_mmap_table, cursor->table)->buckets_count;
+  librdf_hash_mmap_bucket* buckets=librdf_hash_mmap_buckets(hcontext, cursor->table);
+
+  for(; bucket < buckets_count; bucket++) {
+    u64 key_offset=buckets[bucket].key;
+
+    if(key_offset > LIBRDF_HASH_MMAP_DELETED) {
+      u64 v=LIBRDF_HASH_MMAP_AT(hcontext, librdf_hash_mmap_key, key_offset)->values;
+
+      if(v) {
+        cursor->bucket=bucket;
+        cursor->key=key_offset;
+        cursor->value=v;
+        return;
+      }
+    }
+  }
+
+  cursor->bucket=buckets_count;
+  cursor->key=0;
+  cursor->value=0;
+}
+
+
+/* copy bytes from the map into a cursor buffer returned in a datum */
+static int
+librdf_hash_mmap_cursor_copy(char** buffer, size_t* buffer_size,
+                             const char* data, size_t size,
+                             librdf_hash_datum* datum)
+{
+  if(size >= *buffer_size) {
+    size_t new_size=*buffer_size ? *buffer_size : 64;
+
+    while(new_size <= size)
+      new_size <<= 1;
+    if(*buffer)
+      LIBRDF_FREE(char*, *buffer);
+    *buffer=LIBRDF_MALLOC(char*, new_size);
+    if(!*buffer) {
+      *buffer_size=0;
+      return 1;
+    }
+    *buffer_size=new_size;
+  }
+
+  memcpy(*buffer, data, size);
+  datum->data=*buffer;
+  datum->size=size;
+
+  return 0;
+}
+
+
+/* return the next value of the cursor key */
+static int
+librdf_hash_mmap_cursor_get_value(librdf_hash_mmap_cursor_context* cursor,
+                                  librdf_hash_datum* value)
+{
+  librdf_hash_mmap_value* vr=LIBRDF_HASH_MMAP_AT(cursor->hash, librdf_hash_mmap_value, cursor->value);
+
+  cursor->value=vr->next;
+  return librdf_hash_mmap_cursor_copy(&cursor->value_buffer,
+                                      &cursor->value_buffer_size,
+                                      (const char*)(vr + 1), vr->value_size,
+                                      value);
+}
+
+
+/**
+ * librdf_hash_mmap_cursor_get:
+ * @context: mmap hash cursor context
+ * @key: pointer to key to use
+ * @value: pointer to value to use
+ * @flags: flags
+ *
+ * Retrieve a hash value for the given key.
+ *
+ * Keys and values returned are copies owned by the cursor, valid
+ * until the next call.  Changes to the hash while a cursor walks
+ * over all keys may or may not be seen by it.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_cursor_get(void* context,
+                            librdf_hash_datum *key,
+                            librdf_hash_datum *value,
+                            unsigned int flags)
+{
+  librdf_hash_mmap_cursor_context* cursor=(librdf_hash_mmap_cursor_context*)context;
+  librdf_hash_mmap_context* hcontext=cursor->hash;
+  u64 table=LIBRDF_HASH_MMAP_HEADER(hcontext)->table;
+  librdf_hash_mmap_key* k;
+  u64 key_offset;
+  u64 b;
+
+  switch(flags) {
+    case LIBRDF_HASH_CURSOR_SET:
+      key_offset=librdf_hash_mmap_find(hcontext, table, key,
+                                       librdf_hash_mmap_hash_key(key), &b);
+      if(!key_offset)
+        return 1;
+
+      cursor->started=1;
+      cursor->table=table;
+      cursor->bucket=b;
+      cursor->key=key_offset;
+      cursor->value=LIBRDF_HASH_MMAP_AT(hcontext, librdf_hash_mmap_key, key_offset)->values;
+      /* FALLTHROUGH */
+
+    case LIBRDF_HASH_CURSOR_NEXT_VALUE:
+      if(!cursor->key || !cursor->value)
+        return 1;
+      return librdf_hash_mmap_cursor_get_value(cursor, value);
+
+    case LIBRDF_HASH_CURSOR_FIRST:
+      cursor->started=1;
+      cursor->table=table;
+      librdf_hash_mmap_cursor_seek(cursor, 0);
+      break;
+
+    case LIBRDF_HASH_CURSOR_NEXT:
+      if(cursor->started)
+        break;
+
+      /* start at a given key, which is returned unchanged */
+      if(!key->data)
+        return 1;
+      key_offset=librdf_hash_mmap_find(hcontext, table, key,
+                                       librdf_hash_mmap_hash_key(key), &b);
+      if(!key_offset)
+        return 1;
+      cursor->started=1;
+      cursor->table=table;
+      cursor->bucket=b;
+      cursor->key=key_offset;
+      cursor->value=LIBRDF_HASH_MMAP_AT(hcontext, librdf_hash_mmap_key, key_offset)->values;
+      if(!cursor->value)
+        return 1;
+
+      if(value) {
+        if(librdf_hash_mmap_cursor_get_value(cursor, value))
+          return 1;
+        if(cursor->value)
+          return 0;
+      }
+      librdf_hash_mmap_cursor_seek(cursor, cursor->bucket + 1);
+      return 0;
+
+    default:
+      librdf_log(hcontext->hash->world,
+                 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+                 "Unknown hash method flag %d", flags);
+      return 1;
+  }
+
+  /* walking all keys: return the current key and value and move on */
+  if(!cursor->key)
+    return 1;
+
+  k=LIBRDF_HASH_MMAP_AT(hcontext, librdf_hash_mmap_key, cursor->key);
+  if(librdf_hash_mmap_cursor_copy(&cursor->key_buffer,
+                                  &cursor->key_buffer_size,
+                                  (const char*)(k + 1), k->key_size, key))
+    return 1;
+
+  if(value) {
+    if(librdf_hash_mmap_cursor_get_value(cursor, value))
+      return 1;
+    /* stop here if there are more values of this key */
+    if(cursor->value)
+      return 0;
+  }
+
+  librdf_hash_mmap_cursor_seek(cursor, cursor->bucket + 1);
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_mmap_cursor_finish:
+ * @context: mmap hash cursor context
+ *
+ * Finish the cursor.
+ **/
+static void
+librdf_hash_mmap_cursor_finish(void* context)
+{
+  librdf_hash_mmap_cursor_context* cursor=(librdf_hash_mmap_cursor_context*)context;
+
+  if(cursor->key_buffer)
+    LIBRDF_FREE(char*, cursor->key_buffer);
+  if(cursor->value_buffer)
+    LIBRDF_FREE(char*, cursor->value_buffer);
+}
+
+
+/* local function to register mmap hash functions */
+
+static void
+librdf_hash_mmap_register_factory(librdf_hash_factory *factory)
+{
+  factory->context_length = sizeof(librdf_hash_mmap_context);
+  factory->cursor_context_length = sizeof(librdf_hash_mmap_cursor_context);
+
+  factory->create  = librdf_hash_mmap_create;
+  factory->destroy = librdf_hash_mmap_destroy;
+
+  factory->open    = librdf_hash_mmap_open;
+  factory->close   = librdf_hash_mmap_close;
+  factory->clone   = librdf_hash_mmap_clone;
+
+  factory->values_count = librdf_hash_mmap_values_count;
+
+  factory->put     = librdf_hash_mmap_put;
+  factory->exists  = librdf_hash_mmap_exists;
+  factory->delete_key  = librdf_hash_mmap_delete_key;
+  factory->delete_key_value  = librdf_hash_mmap_delete_key_value;
+  factory->sync    = librdf_hash_mmap_sync;
+  factory->get_fd  = librdf_hash_mmap_get_fd;
+
+  factory->is_persistent = 1;
+
+  factory->cursor_init   = librdf_hash_mmap_cursor_init;
+  factory->cursor_get    = librdf_hash_mmap_cursor_get;
+  factory->cursor_finish = librdf_hash_mmap_cursor_finish;
+}
+
+
+/**
+ * librdf_init_hash_mmap:
+ * @world: redland world object
+ *
+ * Initialise the mmap hash module.
+ **/
+void
+librdf_init_hash_mmap(librdf_world *world)
+{
+  librdf_hash_register_factory(world, "mmap",
+                               &librdf_hash_mmap_register_factory);
+}
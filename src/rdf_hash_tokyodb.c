@@ -57,6 +57,14 @@ typedef struct
   /* for Tokyo DB only */
   TCBDB *db;
   char* file_name;
+  /* tuning options, <=0 for the Tokyo Cabinet default */
+  long leaf_members;
+  long nonleaf_members;
+  long buckets;
+  int compression;   /* BDBTDEFLATE, BDBTBZIP, BDBTTCBS or 0 */
+  long leaf_cache;
+  long nonleaf_cache;
+  int no_batch_transactions;
 } librdf_hash_tokyodb_context;
 
 /* internal function */
@@ -82,6 +90,9 @@ static int librdf_hash_tokyodb_delete_key(void* context, librdf_hash_datum *key)
 static int librdf_hash_tokyodb_delete_key_value(void* context, librdf_hash_datum *key, librdf_hash_datum *value);
 static int librdf_hash_tokyodb_sync(void* context);
 static int librdf_hash_tokyodb_get_fd(void* context);
+static int librdf_hash_tokyodb_put_many(void* context, librdf_hash_datum *keys, librdf_hash_datum *values, int count);
+static int librdf_hash_tokyodb_exists_many(void* context, librdf_hash_datum *keys, librdf_hash_datum *values, int count, int *results);
+static int librdf_hash_tokyodb_get_many(void* context, librdf_hash_datum *keys, librdf_hash_datum *values, int count);
 
 static void librdf_hash_tokyodb_register_factory(librdf_hash_factory *factory);
 
@@ -130,10 +141,21 @@ librdf_hash_tokyodb_destroy(void* context)
  * @mode: file creation mode
  * @is_writable: is hash writable?
  * @is_new: is hash new?
- * @options: hash options (currently unused)
+ * @options: hash options
  *
  * Open and maybe create a Tokyo DB hash.
  *
+ * Options <literal>leaf-members</literal>,
+ * <literal>nonleaf-members</literal> and <literal>buckets</literal>
+ * tune the B+ tree when the file is created and
+ * <literal>compression</literal> picks the page compression,
+ * one of <literal>deflate</literal>, <literal>bzip</literal>,
+ * <literal>tcbs</literal> or <literal>none</literal>.  Options
+ * <literal>leaf-cache</literal> and <literal>nonleaf-cache</literal>
+ * set the number of pages cached in memory.  Batched puts are done
+ * inside a transaction unless boolean option
+ * <literal>batch-transactions</literal> is false.
+ *
  * Return value: non 0 on failure.
  **/
 static int
@@ -151,13 +173,37 @@ librdf_hash_tokyodb_open(void* context, const char *identifier,
   }
   sprintf(file, "%s.db", identifier);
 
-  /* NOTE: If the options parameter is ever used here, the data must be
-   * copied into a private part of the context so that the clone
-   * method can access them
+  /* NOTE: The options used here are copied into the context so that
+   * the clone method can access them
    */
   db_context->mode=mode;
   db_context->is_writable=is_writable;
   db_context->is_new=is_new;
+  if(options) {
+    char *compression;
+
+    db_context->leaf_members=librdf_hash_get_as_long(options, "leaf-members");
+    db_context->nonleaf_members=librdf_hash_get_as_long(options, "nonleaf-members");
+    db_context->buckets=librdf_hash_get_as_long(options, "buckets");
+    db_context->leaf_cache=librdf_hash_get_as_long(options, "leaf-cache");
+    db_context->nonleaf_cache=librdf_hash_get_as_long(options, "nonleaf-cache");
+    db_context->no_batch_transactions=!librdf_hash_get_as_boolean(options, "batch-transactions");
+
+    db_context->compression=0;
+    compression=librdf_hash_get(options, "compression");
+    if(compression) {
+      if(!strcmp(compression, "deflate"))
+        db_context->compression=BDBTDEFLATE;
+      else if(!strcmp(compression, "bzip"))
+        db_context->compression=BDBTBZIP;
+      else if(!strcmp(compression, "tcbs"))
+        db_context->compression=BDBTTCBS;
+      else if(strcmp(compression, "none"))
+        librdf_log(db_context->hash->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
+            "%s: unknown compression '%s' ignored", __FUNCTION__, compression);
+      LIBRDF_FREE(char*, compression);
+    }
+  }
 
   int omode;
   if (is_writable)
@@ -176,6 +222,22 @@ librdf_hash_tokyodb_open(void* context, const char *identifier,
     return -1;
   }
 
+  /* tuning is stored in the file when it is created, the cache
+   * sizes apply each time it is opened
+   */
+  if(!tcbdbtune(db_context->db,
+                (db_context->leaf_members > 0) ? LIBRDF_BAD_CAST(int32_t, db_context->leaf_members) : 0,
+                (db_context->nonleaf_members > 0) ? LIBRDF_BAD_CAST(int32_t, db_context->nonleaf_members) : 0,
+                (db_context->buckets > 0) ? (int64_t)db_context->buckets : 0,
+                -1, -1, (uint8_t)db_context->compression) ||
+     !tcbdbsetcache(db_context->db,
+                    (db_context->leaf_cache > 0) ? LIBRDF_BAD_CAST(int32_t, db_context->leaf_cache) : 0,
+                    (db_context->nonleaf_cache > 0) ? LIBRDF_BAD_CAST(int32_t, db_context->nonleaf_cache) : 0)) {
+    int ecode = tcbdbecode(db_context->db);
+    librdf_log(db_context->hash->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
+        "%s: tuning of '%s' failed - %s", __FUNCTION__, file, tcbdberrmsg(ecode));
+  }
+
   if(!tcbdbopen(db_context->db, file, omode)){
     int ecode = tcbdbecode(db_context->db);
     librdf_log(db_context->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
@@ -251,8 +313,15 @@ librdf_hash_tokyodb_clone(librdf_hash *hash, void* context, char *new_identifier
   /* copy data fields that might change */
   hcontext->hash = hash;
 
-  /* Note: The options are not used at present, so no need to make a copy
-   */
+  /* copy the options since open is called without them */
+  hcontext->leaf_members = old_hcontext->leaf_members;
+  hcontext->nonleaf_members = old_hcontext->nonleaf_members;
+  hcontext->buckets = old_hcontext->buckets;
+  hcontext->compression = old_hcontext->compression;
+  hcontext->leaf_cache = old_hcontext->leaf_cache;
+  hcontext->nonleaf_cache = old_hcontext->nonleaf_cache;
+  hcontext->no_batch_transactions = old_hcontext->no_batch_transactions;
+
   if(librdf_hash_tokyodb_open(context, new_identifier,
       old_hcontext->mode, old_hcontext->is_writable,
       old_hcontext->is_new, NULL))
@@ -511,6 +580,30 @@ librdf_hash_tokyodb_cursor_get(void* context,
     cursor->cursor_set_to_first = true;
     break;
 
+  case LIBRDF_HASH_CURSOR_SET_RANGE:
+    if (key->data == NULL) {
+      librdf_log(cursor->hash_context->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+          "%s: LIBRDF_HASH_CURSOR_SET_RANGE and key is NULL, we do not support such use case !!!", __FUNCTION__);
+      return -1;
+    }
+
+    /* jump goes to the first record with a key >= key->data */
+    if (!tcbdbcurjump(cursor->cur, key->data, LIBRDF_BAD_CAST(int, key->size)))
+      return -1;
+
+    /* start afresh so the record at the cursor is returned below */
+    if (cursor->last_key) {
+      LIBRDF_FREE(char*, cursor->last_key);
+      cursor->last_key = NULL;
+    }
+    if (cursor->last_value) {
+      LIBRDF_FREE(char*, cursor->last_value);
+      cursor->last_value = NULL;
+    }
+
+    cursor->cursor_set_to_first = true;
+    break;
+
   case LIBRDF_HASH_CURSOR_NEXT_VALUE:
     break;
 
@@ -756,6 +849,158 @@ librdf_hash_tokyodb_exists(void* context, librdf_hash_datum *key,
   return ret;
 }
 
+/**
+ * librdf_hash_tokyodb_put_many:
+ * @context: Tokyo DB hash context
+ * @keys: array of keys to store
+ * @values: array of values to store
+ * @count: number of key/value pairs
+ *
+ * Store an array of key/value pairs in the hash.
+ *
+ * Each run of pairs with the same key is stored with a single
+ * tcbdbputdup3 call.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_tokyodb_put_many(void* context, librdf_hash_datum *keys,
+    librdf_hash_datum *values, int count)
+{
+  librdf_hash_tokyodb_context* db_context=(librdf_hash_tokyodb_context*)context;
+  TCLIST *list;
+  int i, j;
+  bool in_transaction = false;
+
+  list = tclistnew();
+
+  /* one transaction per batch so the pages are written once */
+  if(!db_context->no_batch_transactions && count > 1) {
+    if(!tcbdbtranbegin(db_context->db)) {
+      int ecode = tcbdbecode(db_context->db);
+      librdf_log(db_context->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+          "%s: transaction begin failed - %s", __FUNCTION__, tcbdberrmsg(ecode));
+      tclistdel(list);
+      return -1;
+    }
+    in_transaction = true;
+  }
+
+  for(i = 0; i < count; i = j) {
+    /* collect the values of a run of the same key */
+    tclistclear(list);
+    for(j = i; j < count; j++) {
+      if(keys[j].size != keys[i].size ||
+         memcmp(keys[j].data, keys[i].data, keys[i].size))
+        break;
+      tclistpush(list, values[j].data, LIBRDF_BAD_CAST(int, values[j].size));
+    }
+
+    if(!tcbdbputdup3(db_context->db, keys[i].data, LIBRDF_BAD_CAST(int, keys[i].size), list)) {
+      int ecode = tcbdbecode(db_context->db);
+      librdf_log(db_context->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+          "%s: put of %d values failed - %s", __FUNCTION__, j - i, tcbdberrmsg(ecode));
+      if(in_transaction)
+        tcbdbtranabort(db_context->db);
+      tclistdel(list);
+      return -1;
+    }
+  }
+
+  tclistdel(list);
+
+  if(in_transaction && !tcbdbtrancommit(db_context->db)) {
+    int ecode = tcbdbecode(db_context->db);
+    librdf_log(db_context->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+        "%s: transaction commit failed - %s", __FUNCTION__, tcbdberrmsg(ecode));
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_tokyodb_exists_many:
+ * @context: Tokyo DB hash context
+ * @keys: array of keys
+ * @values: array of values (optional)
+ * @count: number of keys
+ * @results: array to store the result of each test
+ *
+ * Test the existence of an array of keys or key/values in the hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_tokyodb_exists_many(void* context, librdf_hash_datum *keys,
+    librdf_hash_datum *values, int count, int *results)
+{
+  librdf_hash_tokyodb_context* db_context=(librdf_hash_tokyodb_context*)context;
+  int i;
+
+  for(i = 0; i < count; i++) {
+    if(values)
+      results[i] = librdf_hash_tokyodb_exists(context, &keys[i], &values[i]);
+    else
+      /* key only - count the values without building a list of them */
+      results[i] = (tcbdbvnum(db_context->db, keys[i].data, LIBRDF_BAD_CAST(int, keys[i].size)) > 0);
+  }
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_tokyodb_get_many:
+ * @context: Tokyo DB hash context
+ * @keys: array of keys
+ * @values: array of datums to store the values
+ * @count: number of keys
+ *
+ * Get the first value for each of an array of keys.
+ *
+ * The values are copied into newly allocated memory; missing keys
+ * give NULL data.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_tokyodb_get_many(void* context, librdf_hash_datum *keys,
+    librdf_hash_datum *values, int count)
+{
+  librdf_hash_tokyodb_context* db_context=(librdf_hash_tokyodb_context*)context;
+  const void *value;
+  int value_size;
+  int i;
+
+  for(i = 0; i < count; i++) {
+    values[i].data = NULL;
+    values[i].size = 0;
+
+    /* value points into the Tokyo DB cache, so copy it */
+    value = tcbdbget3(db_context->db, keys[i].data, LIBRDF_BAD_CAST(int, keys[i].size), &value_size);
+    if(!value)
+      continue;
+
+    values[i].data = LIBRDF_MALLOC(char*, value_size ? value_size : 1);
+    if(!values[i].data) {
+      while(i-- > 0) {
+        if(values[i].data) {
+          LIBRDF_FREE(char*, values[i].data);
+          values[i].data = NULL;
+        }
+      }
+      return 1;
+    }
+    memcpy(values[i].data, value, value_size);
+    values[i].size = value_size;
+  }
+
+  return 0;
+}
+
+
 /**
  * librdf_hash_tokyodb_delete_key:
  * @context: Tokyo DB hash context
@@ -898,6 +1143,13 @@ librdf_hash_tokyodb_register_factory(librdf_hash_factory *factory)
   factory->delete_key_value  = librdf_hash_tokyodb_delete_key_value;
   factory->sync    = librdf_hash_tokyodb_sync;
   factory->get_fd  = librdf_hash_tokyodb_get_fd;
+  factory->put_many    = librdf_hash_tokyodb_put_many;
+  factory->exists_many = librdf_hash_tokyodb_exists_many;
+  factory->get_many    = librdf_hash_tokyodb_get_many;
+
+  /* B+ tree keys are ordered so can be scanned by range */
+  factory->has_set_range = 1;
+  factory->is_persistent = 1;
 
   factory->cursor_init   = librdf_hash_tokyodb_cursor_init;
   factory->cursor_get    = librdf_hash_tokyodb_cursor_get;
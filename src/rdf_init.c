@@ -457,7 +457,20 @@ librdf_world_set_digest(librdf_world* world, const char *name)
 librdf_node*
 librdf_world_get_feature(librdf_world* world, librdf_uri *feature) 
 {
-  return NULL; /* none retrievable */
+  librdf_uri* node_interning;
+  librdf_node* value = NULL;
+
+  node_interning = librdf_new_uri(world,
+                                  (const unsigned char*)LIBRDF_WORLD_FEATURE_NODE_INTERNING);
+
+  if(librdf_uri_equals(feature, node_interning))
+    value = librdf_new_node_from_typed_literal(world,
+                                               (const unsigned char*)(world->nodes_interning ? "1" : "0"),
+                                               NULL, NULL);
+
+  librdf_free_uri(node_interning);
+
+  return value; /* other features are not retrievable */
 }
 
 
@@ -477,12 +490,15 @@ librdf_world_set_feature(librdf_world* world, librdf_uri* feature,
 {
   librdf_uri* genid_base;
   librdf_uri* genid_counter;
+  librdf_uri* node_interning;
   int rc= -1;
 
   genid_counter = librdf_new_uri(world,
                                  (const unsigned char*)LIBRDF_WORLD_FEATURE_GENID_COUNTER);
   genid_base = librdf_new_uri(world,
                               (const unsigned char*)LIBRDF_WORLD_FEATURE_GENID_BASE);
+  node_interning = librdf_new_uri(world,
+                                  (const unsigned char*)LIBRDF_WORLD_FEATURE_NODE_INTERNING);
 
   if(librdf_uri_equals(feature, genid_base)) {
     if(!librdf_node_is_resource(value))
@@ -518,10 +534,19 @@ librdf_world_set_feature(librdf_world* world, librdf_uri* feature,
 #endif
       rc = 0;
     }
+  } else if(librdf_uri_equals(feature, node_interning)) {
+    if(!librdf_node_is_literal(value))
+      rc = 1;
+    else {
+      librdf_node_set_interning(world,
+                                atoi((const char*)librdf_node_get_literal_value(value)) != 0);
+      rc = 0;
+    }
   }
 
   librdf_free_uri(genid_base);
   librdf_free_uri(genid_counter);
+  librdf_free_uri(node_interning);
 
   return rc;
 }
@@ -101,6 +101,22 @@ void* librdf_calloc_memory(size_t nmemb, size_t size);
  */
 #define LIBRDF_WORLD_FEATURE_GENID_COUNTER "http://feature.librdf.org/genid-counter"
 
+/**
+ * LIBRDF_WORLD_FEATURE_NODE_INTERNING:
+ *
+ * World feature to share nodes between equal terms.
+ *
+ * When set to the literal "1", the node constructors return a new
+ * reference to an existing equal node if there is one, so parsed
+ * statements share their nodes and equal nodes are usually the
+ * same pointer.  Off ("0") by default.
+ *
+ * Only set this when one thread at a time uses the world.  Node
+ * reference counts are not locked, so threads that free or copy
+ * nodes which interning made shared can race and free them twice.
+ */
+#define LIBRDF_WORLD_FEATURE_NODE_INTERNING "http://feature.librdf.org/node-interning"
+
 REDLAND_API
 librdf_node* librdf_world_get_feature(librdf_world* world, librdf_uri *feature);
 REDLAND_API
@@ -65,8 +65,12 @@ struct librdf_world_s
   librdf_hash* uris_hash;
   int uris_hash_allocated_here;
 
-  /* Node interning */
-  librdf_hash* nodes_hash[3]; /* resource, literal, blank */
+  /* Node interning, enabled by LIBRDF_WORLD_FEATURE_NODE_INTERNING.
+   * Open addressed table of nodes each holding one reference. */
+  int nodes_interning;
+  librdf_node** nodes_table;
+  int nodes_table_size; /* power of 2 */
+  int nodes_table_count;
 
   /* Sequence of model factories */
   raptor_sequence* models;
@@ -89,12 +93,16 @@ struct librdf_world_s
   /* list of hash factories */
   librdf_hash_factory* hashes;
 
-  /* list of free librdf_hash_datums is kept */
+  /* list of free librdf_hash_datums is kept; with threads this is
+   * the overflow stack shared between the per-thread caches */
   librdf_hash_datum* hash_datums_list;
 
    /* hash load_factor out of 1000 */
   int hash_load_factor;
 
+  /* shared Berkeley DB environments (see rdf_hash_bdb.c) */
+  struct librdf_hash_bdb_env_s* hash_bdb_envs;
+
   /* ID base from startup time */
   unsigned long genid_base;
 
@@ -113,12 +121,20 @@ struct librdf_world_s
 
   /* mutex to lock the hash_datums class */
   pthread_mutex_t* hash_datums_mutex;
+
+  /* per-thread free librdf_hash_datum caches */
+  pthread_key_t hash_datums_key;
+  int hash_datums_key_created;
+  struct librdf_hash_datum_cache_s* hash_datums_caches;
 #else
   /* !WITH_THREADS - pad structure to same size */
   void* mutex_fake;
   void* nodes_mutex_fake;
   void* statements_mutex_fake;
   void* hash_datums_mutex_fake;
+  unsigned int hash_datums_key_fake;
+  int hash_datums_key_created_fake;
+  void* hash_datums_caches_fake;
 #endif
 
   /* non-0 if librdf_world_open() has been called */
@@ -247,6 +247,24 @@ librdf_list_remove(librdf_list* list, void *data)
     /* not found */
     return NULL;
 
+  return librdf_list_remove_node(list, node);
+}
+
+
+/*
+ * librdf_list_remove_node:
+ * @list: #librdf_list object
+ * @node: node of @list to remove
+ *
+ * INTERNAL - Remove a node found by other means from a list
+ *
+ * Return value: the data stored in the node
+ */
+void*
+librdf_list_remove_node(librdf_list* list, librdf_list_node* node)
+{
+  void *data;
+
   librdf_list_iterators_replace_node(list, node, node->next);
   
   if(node == list->first)
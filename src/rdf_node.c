@@ -44,6 +44,9 @@
 
 #ifndef STANDALONE
 
+static void librdf_node_table_free(librdf_world* world);
+
+
 /**
  * librdf_init_node:
  * @world: redland world object
@@ -67,6 +70,215 @@ librdf_init_node(librdf_world* world)
 void
 librdf_finish_node(librdf_world* world)
 {
+  librdf_node_table_free(world);
+}
+
+
+/**
+ * librdf_node_hash:
+ * @node: #librdf_node object or NULL
+ *
+ * INTERNAL - Get a hash of the string form of a node
+ *
+ * Equal nodes have the same hash.  The literal language and datatype
+ * are not included.
+ *
+ * Return value: hash value
+ **/
+u32
+librdf_node_hash(librdf_node* node)
+{
+  const unsigned char* string = NULL;
+  size_t length = 0;
+  u32 hash = 0;
+
+  if(!node)
+    return 0;
+
+  switch(node->type) {
+    case RAPTOR_TERM_TYPE_URI:
+      string = librdf_uri_as_counted_string(node->value.uri, &length);
+      break;
+
+    case RAPTOR_TERM_TYPE_LITERAL:
+      string = node->value.literal.string;
+      length = node->value.literal.string_len;
+      break;
+
+    case RAPTOR_TERM_TYPE_BLANK:
+      string = node->value.blank.string;
+      length = node->value.blank.string_len;
+      break;
+
+    case RAPTOR_TERM_TYPE_UNKNOWN:
+    default:
+      break;
+  }
+
+  if(string)
+    LIBRDF_HASH_KEY_HASH(hash, string, length);
+
+  return hash + (u32)node->type;
+}
+
+
+/* give back the references held by the node interning table */
+static void
+librdf_node_table_free(librdf_world* world)
+{
+  int i;
+
+  if(!world->nodes_table)
+    return;
+
+  for(i = 0; i < world->nodes_table_size; i++) {
+    if(world->nodes_table[i])
+      raptor_free_term(world->nodes_table[i]);
+  }
+  LIBRDF_FREE(librdf_node**, world->nodes_table);
+  world->nodes_table = NULL;
+  world->nodes_table_size = 0;
+  world->nodes_table_count = 0;
+}
+
+
+/*
+ * Rebuild the node interning table without the nodes it alone holds,
+ * sized so it is at most a quarter full.  Returns non 0 on failure.
+ */
+static int
+librdf_node_table_rebuild(librdf_world* world)
+{
+  librdf_node** table;
+  int live = 0;
+  int size = 64;
+  int i;
+
+  for(i = 0; i < world->nodes_table_size; i++) {
+    if(world->nodes_table[i] && world->nodes_table[i]->usage > 1)
+      live++;
+  }
+
+  while(size < 4 * (live + 1))
+    size *= 2;
+
+  table = LIBRDF_CALLOC(librdf_node**, size, sizeof(*table));
+  if(!table)
+    return 1;
+
+  for(i = 0; i < world->nodes_table_size; i++) {
+    librdf_node* node = world->nodes_table[i];
+    int slot;
+
+    if(!node)
+      continue;
+
+    if(node->usage == 1) {
+      raptor_free_term(node);
+      continue;
+    }
+
+    slot = LIBRDF_GOOD_CAST(int, librdf_node_hash(node) & (size - 1));
+    while(table[slot])
+      slot = (slot + 1) & (size - 1);
+    table[slot] = node;
+  }
+
+  if(world->nodes_table)
+    LIBRDF_FREE(librdf_node**, world->nodes_table);
+  world->nodes_table = table;
+  world->nodes_table_size = size;
+  world->nodes_table_count = live;
+
+  return 0;
+}
+
+
+/*
+ * librdf_node_intern:
+ * @world: redland world object
+ * @node: new #librdf_node object or NULL
+ *
+ * INTERNAL - Swap a new node for an equal interned one
+ *
+ * With LIBRDF_WORLD_FEATURE_NODE_INTERNING set, takes ownership of
+ * @node and returns a new reference to an equal node already in the
+ * interning table, or adds @node to the table.
+ *
+ * Return value: the node to use
+ */
+static librdf_node*
+librdf_node_intern(librdf_world* world, librdf_node* node)
+{
+  librdf_node* interned;
+  int slot;
+
+  if(!node || !world->nodes_interning)
+    return node;
+
+#ifdef WITH_THREADS
+  pthread_mutex_lock(world->nodes_mutex);
+#endif
+
+  if(2 * (world->nodes_table_count + 1) > world->nodes_table_size &&
+     librdf_node_table_rebuild(world)) {
+    /* carry on without sharing this one */
+    interned = node;
+    goto unlock;
+  }
+
+  slot = LIBRDF_GOOD_CAST(int, librdf_node_hash(node) & (world->nodes_table_size - 1));
+  while((interned = world->nodes_table[slot])) {
+    if(interned == node || raptor_term_equals(interned, node))
+      break;
+    slot = (slot + 1) & (world->nodes_table_size - 1);
+  }
+
+  if(!interned) {
+    world->nodes_table[slot] = raptor_term_copy(node);
+    world->nodes_table_count++;
+    interned = node;
+  } else if(interned != node) {
+    raptor_term_copy(interned);
+    raptor_free_term(node);
+  }
+
+  unlock:
+#ifdef WITH_THREADS
+  pthread_mutex_unlock(world->nodes_mutex);
+#endif
+
+  return interned;
+}
+
+
+/**
+ * librdf_node_set_interning:
+ * @world: redland world object
+ * @interning: non 0 to share nodes between equal terms
+ *
+ * INTERNAL - Set LIBRDF_WORLD_FEATURE_NODE_INTERNING
+ *
+ * Turning interning off gives back the table's references; nodes
+ * already shared stay valid.
+ *
+ * The mutex only guards the table.  Shared nodes are copied and freed
+ * without it, so interning is for worlds used by one thread at a time.
+ **/
+void
+librdf_node_set_interning(librdf_world* world, int interning)
+{
+#ifdef WITH_THREADS
+  pthread_mutex_lock(world->nodes_mutex);
+#endif
+
+  world->nodes_interning = interning;
+  if(!interning)
+    librdf_node_table_free(world);
+
+#ifdef WITH_THREADS
+  pthread_mutex_unlock(world->nodes_mutex);
+#endif
 }
 
 
@@ -112,7 +324,9 @@ librdf_new_node_from_uri_string(librdf_world *world,
 
   librdf_world_open(world);
 
-  return raptor_new_term_from_uri_string(world->raptor_world_ptr, uri_string);
+  return librdf_node_intern(world,
+                            raptor_new_term_from_uri_string(world->raptor_world_ptr,
+                                                            uri_string));
 }
 
 
@@ -135,8 +349,9 @@ librdf_new_node_from_counted_uri_string(librdf_world *world,
 
   librdf_world_open(world);
 
-  return raptor_new_term_from_counted_uri_string(world->raptor_world_ptr, 
-                                                 uri_string, len);
+  return librdf_node_intern(world,
+                            raptor_new_term_from_counted_uri_string(world->raptor_world_ptr, 
+                                                                    uri_string, len));
 }
 
 
@@ -158,7 +373,8 @@ librdf_new_node_from_uri(librdf_world *world, librdf_uri *uri)
 
   librdf_world_open(world);
 
-  return raptor_new_term_from_uri(world->raptor_world_ptr, uri);
+  return librdf_node_intern(world,
+                            raptor_new_term_from_uri(world->raptor_world_ptr, uri));
 }
 
 
@@ -194,7 +410,7 @@ librdf_new_node_from_uri_local_name(librdf_world *world,
 
   node = raptor_new_term_from_uri(world->raptor_world_ptr, new_uri);
   raptor_free_uri(new_uri);
-  return node;
+  return librdf_node_intern(world, node);
 }
 
 
@@ -229,7 +445,7 @@ librdf_new_node_from_normalised_uri_string(librdf_world *world,
 
   node = raptor_new_term_from_uri(world->raptor_world_ptr, new_uri);
   raptor_free_uri(new_uri);
-  return node;
+  return librdf_node_intern(world, node);
 }
 
 
@@ -363,7 +579,7 @@ librdf_new_node_from_literal(librdf_world *world,
   n = raptor_new_term_from_literal(world->raptor_world_ptr,
                                    string, datatype_uri,
                                    (const unsigned char*)xml_language);
-  return librdf_node_normalize(world, n);
+  return librdf_node_intern(world, librdf_node_normalize(world, n));
 }
 
 
@@ -397,7 +613,7 @@ librdf_new_node_from_typed_literal(librdf_world *world,
   n = raptor_new_term_from_literal(world->raptor_world_ptr,
                                    value, datatype_uri,
                                    (const unsigned char*)xml_language);
-  return librdf_node_normalize(world, n);
+  return librdf_node_intern(world, librdf_node_normalize(world, n));
 }
 
 
@@ -439,7 +655,7 @@ librdf_new_node_from_typed_counted_literal(librdf_world *world,
                                            datatype_uri,
                                            (const unsigned char*)xml_language,
                                            (unsigned char)xml_language_len);
-  return librdf_node_normalize(world, n);
+  return librdf_node_intern(world, librdf_node_normalize(world, n));
 }
 
 
@@ -465,8 +681,15 @@ librdf_new_node_from_counted_blank_identifier(librdf_world *world,
   
   librdf_world_open(world);
 
-  return raptor_new_term_from_counted_blank(world->raptor_world_ptr,
-                                            identifier, identifier_len);
+  if(!identifier)
+    /* a new identifier is never shared */
+    return raptor_new_term_from_counted_blank(world->raptor_world_ptr,
+                                              identifier, identifier_len);
+
+  return librdf_node_intern(world,
+                            raptor_new_term_from_counted_blank(world->raptor_world_ptr,
+                                                               identifier,
+                                                               identifier_len));
 }
 
 
@@ -500,6 +723,8 @@ librdf_new_node_from_blank_identifier(librdf_world *world,
 
   if(!identifier)
     LIBRDF_FREE(char*, (char*)blank);
+  else
+    node = librdf_node_intern(world, node);
 
   return node;
 }
@@ -511,6 +736,8 @@ librdf_new_node_from_blank_identifier(librdf_world *world,
  *
  * Copy constructor - create a new librdf_node object from an existing librdf_node object.
  * 
+ * A borrowed node is copied with librdf_node_materialise().
+ *
  * Return value: a new #librdf_node object or NULL on failure
  **/
 librdf_node*
@@ -518,10 +745,60 @@ librdf_new_node_from_node(librdf_node *node)
 {
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(node, librdf_node, NULL);
 
+  /* borrowed nodes cannot be shared */
+  if(!node->usage)
+    return librdf_node_materialise(node);
+
   return raptor_term_copy(node);
 }
 
 
+/**
+ * librdf_node_materialise:
+ * @node: #librdf_node object to copy
+ *
+ * Copy constructor - create a librdf_node object that owns its strings.
+ *
+ * Iterators over storage may return borrowed nodes that point into
+ * the iterator's own buffers, only valid until the iterator moves.
+ * This makes a new node holding copies of the borrowed strings.  For
+ * any other node it returns a new reference, as
+ * librdf_new_node_from_node() does.
+ *
+ * Return value: a new #librdf_node object or NULL on failure
+ **/
+librdf_node*
+librdf_node_materialise(librdf_node *node)
+{
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(node, librdf_node, NULL);
+
+  if(node->usage)
+    return raptor_term_copy(node);
+
+  switch(node->type) {
+    case RAPTOR_TERM_TYPE_URI:
+      return raptor_new_term_from_uri(node->world, node->value.uri);
+
+    case RAPTOR_TERM_TYPE_BLANK:
+      return raptor_new_term_from_counted_blank(node->world,
+                                                node->value.blank.string,
+                                                LIBRDF_GOOD_CAST(size_t, node->value.blank.string_len));
+
+    case RAPTOR_TERM_TYPE_LITERAL:
+      return raptor_new_term_from_counted_literal(node->world,
+                                                  node->value.literal.string,
+                                                  node->value.literal.string_len,
+                                                  node->value.literal.datatype,
+                                                  node->value.literal.language,
+                                                  node->value.literal.language_len);
+
+    case RAPTOR_TERM_TYPE_UNKNOWN:
+    default:
+      return NULL;
+  }
+}
+
+
 /**
  * librdf_free_node:
  * @node: #librdf_node object
@@ -532,7 +809,8 @@ librdf_new_node_from_node(librdf_node *node)
 void
 librdf_free_node(librdf_node *node)
 {
-  if(!node)
+  /* borrowed nodes belong to the iterator that decoded them */
+  if(!node || !node->usage)
     return;
 
   raptor_free_term(node);
@@ -846,78 +1124,497 @@ librdf_node_is_blank(librdf_node *node)
 }
 
 
-/**
- * librdf_node_encode:
+/*
+ * Node encoding version 2
+ *
+ * A header byte with the top bit set, so that it never collides with
+ * the version 1 type letters, holding the node type and literal flags.
+ * Lengths are unsigned LEB128 with no upper limit.  Strings are
+ * followed by a NUL so that decoders can use them in place.
+ *
+ *   URI:     0x80 length string NUL
+ *   blank:   0x90 length string NUL
+ *   literal: 0xA0|flags length string NUL [datatype] [language]
+ *
+ * where datatype and language are either a length, string and NUL or,
+ * with the matching _REF flag, an index into the dictionaries below.
+ */
+#define LIBRDF_NODE_ENCODE2_TYPE_MASK    0xF0
+#define LIBRDF_NODE_ENCODE2_URI          0x80
+#define LIBRDF_NODE_ENCODE2_BLANK        0x90
+#define LIBRDF_NODE_ENCODE2_LITERAL      0xA0
+#define LIBRDF_NODE_ENCODE2_LANGUAGE     0x01
+#define LIBRDF_NODE_ENCODE2_LANGUAGE_REF 0x02
+#define LIBRDF_NODE_ENCODE2_DATATYPE     0x04
+#define LIBRDF_NODE_ENCODE2_DATATYPE_REF 0x08
+
+typedef struct {
+  const char *string;
+  size_t length;
+} librdf_node_encode2_entry;
+
+#define LIBRDF_NODE_ENCODE2_ENTRY(s) { s, sizeof(s) - 1 }
+#define LIBRDF_NODE_ENCODE2_XSD(name) \
+  LIBRDF_NODE_ENCODE2_ENTRY("http://www.w3.org/2001/XMLSchema#" name)
+#define LIBRDF_NODE_ENCODE2_RDF(name) \
+  LIBRDF_NODE_ENCODE2_ENTRY("http://www.w3.org/1999/02/22-rdf-syntax-ns#" name)
+
+/* Dictionaries of common literal datatypes and languages.  The index
+ * of an entry is stored in encoded nodes, so only ever append.
+ */
+static const librdf_node_encode2_entry librdf_node_encode2_datatypes[] = {
+  LIBRDF_NODE_ENCODE2_XSD("string"),
+  LIBRDF_NODE_ENCODE2_XSD("boolean"),
+  LIBRDF_NODE_ENCODE2_XSD("decimal"),
+  LIBRDF_NODE_ENCODE2_XSD("integer"),
+  LIBRDF_NODE_ENCODE2_XSD("double"),
+  LIBRDF_NODE_ENCODE2_XSD("float"),
+  LIBRDF_NODE_ENCODE2_XSD("date"),
+  LIBRDF_NODE_ENCODE2_XSD("time"),
+  LIBRDF_NODE_ENCODE2_XSD("dateTime"),
+  LIBRDF_NODE_ENCODE2_XSD("duration"),
+  LIBRDF_NODE_ENCODE2_XSD("gYear"),
+  LIBRDF_NODE_ENCODE2_XSD("gYearMonth"),
+  LIBRDF_NODE_ENCODE2_XSD("gMonth"),
+  LIBRDF_NODE_ENCODE2_XSD("gMonthDay"),
+  LIBRDF_NODE_ENCODE2_XSD("gDay"),
+  LIBRDF_NODE_ENCODE2_XSD("long"),
+  LIBRDF_NODE_ENCODE2_XSD("int"),
+  LIBRDF_NODE_ENCODE2_XSD("short"),
+  LIBRDF_NODE_ENCODE2_XSD("byte"),
+  LIBRDF_NODE_ENCODE2_XSD("nonNegativeInteger"),
+  LIBRDF_NODE_ENCODE2_XSD("positiveInteger"),
+  LIBRDF_NODE_ENCODE2_XSD("nonPositiveInteger"),
+  LIBRDF_NODE_ENCODE2_XSD("negativeInteger"),
+  LIBRDF_NODE_ENCODE2_XSD("unsignedLong"),
+  LIBRDF_NODE_ENCODE2_XSD("unsignedInt"),
+  LIBRDF_NODE_ENCODE2_XSD("unsignedShort"),
+  LIBRDF_NODE_ENCODE2_XSD("unsignedByte"),
+  LIBRDF_NODE_ENCODE2_XSD("anyURI"),
+  LIBRDF_NODE_ENCODE2_XSD("hexBinary"),
+  LIBRDF_NODE_ENCODE2_XSD("base64Binary"),
+  LIBRDF_NODE_ENCODE2_XSD("normalizedString"),
+  LIBRDF_NODE_ENCODE2_XSD("token"),
+  LIBRDF_NODE_ENCODE2_XSD("language"),
+  LIBRDF_NODE_ENCODE2_RDF("XMLLiteral"),
+  LIBRDF_NODE_ENCODE2_RDF("HTML"),
+  LIBRDF_NODE_ENCODE2_RDF("langString")
+};
+
+static const librdf_node_encode2_entry librdf_node_encode2_languages[] = {
+  LIBRDF_NODE_ENCODE2_ENTRY("en"),
+  LIBRDF_NODE_ENCODE2_ENTRY("de"),
+  LIBRDF_NODE_ENCODE2_ENTRY("fr"),
+  LIBRDF_NODE_ENCODE2_ENTRY("es"),
+  LIBRDF_NODE_ENCODE2_ENTRY("it"),
+  LIBRDF_NODE_ENCODE2_ENTRY("pt"),
+  LIBRDF_NODE_ENCODE2_ENTRY("nl"),
+  LIBRDF_NODE_ENCODE2_ENTRY("ru"),
+  LIBRDF_NODE_ENCODE2_ENTRY("pl"),
+  LIBRDF_NODE_ENCODE2_ENTRY("sv"),
+  LIBRDF_NODE_ENCODE2_ENTRY("ja"),
+  LIBRDF_NODE_ENCODE2_ENTRY("zh"),
+  LIBRDF_NODE_ENCODE2_ENTRY("ko"),
+  LIBRDF_NODE_ENCODE2_ENTRY("ar"),
+  LIBRDF_NODE_ENCODE2_ENTRY("en-us"),
+  LIBRDF_NODE_ENCODE2_ENTRY("en-gb")
+};
+
+#define LIBRDF_NODE_ENCODE2_DATATYPES_COUNT \
+  (int)(sizeof(librdf_node_encode2_datatypes) / sizeof(librdf_node_encode2_entry))
+#define LIBRDF_NODE_ENCODE2_LANGUAGES_COUNT \
+  (int)(sizeof(librdf_node_encode2_languages) / sizeof(librdf_node_encode2_entry))
+
+
+static int
+librdf_node_encode2_lookup(const librdf_node_encode2_entry* entries,
+                           int count,
+                           const unsigned char *string, size_t length)
+{
+  int i;
+
+  for(i = 0; i < count; i++) {
+    if(entries[i].length == length &&
+       !memcmp(entries[i].string, string, length))
+      return i;
+  }
+
+  return -1;
+}
+
+
+static size_t
+librdf_node_varint_length(size_t value)
+{
+  size_t length = 1;
+
+  while(value >= 0x80) {
+    value >>= 7;
+    length++;
+  }
+
+  return length;
+}
+
+
+static size_t
+librdf_node_varint_write(unsigned char *buffer, size_t value)
+{
+  size_t length = 0;
+
+  while(value >= 0x80) {
+    buffer[length++] = LIBRDF_GOOD_CAST(unsigned char, (value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  buffer[length++] = LIBRDF_GOOD_CAST(unsigned char, value);
+
+  return length;
+}
+
+
+/* Return value: bytes used or 0 if the varint is truncated or too big */
+static size_t
+librdf_node_varint_read(const unsigned char *buffer, size_t length,
+                        size_t *value_p)
+{
+  size_t value = 0;
+  unsigned int shift = 0;
+  size_t i;
+
+  for(i = 0; i < length && shift < sizeof(size_t) * 8; i++, shift += 7) {
+    value |= LIBRDF_GOOD_CAST(size_t, buffer[i] & 0x7f) << shift;
+    if(!(buffer[i] & 0x80)) {
+      *value_p = value;
+      return i + 1;
+    }
+  }
+
+  return 0;
+}
+
+
+static size_t
+librdf_node_encode2_string_length(size_t length)
+{
+  return librdf_node_varint_length(length) + length + 1;
+}
+
+
+static size_t
+librdf_node_encode2_string(unsigned char *buffer,
+                           const unsigned char *string, size_t length)
+{
+  size_t offset = librdf_node_varint_write(buffer, length);
+
+  memcpy(buffer + offset, string, length);
+  offset += length;
+  buffer[offset++] = '\0';
+
+  return offset;
+}
+
+
+/* Return value: non 0 if the string at *offset_p overruns the buffer */
+static int
+librdf_node_decode2_string(unsigned char *buffer, size_t length,
+                           size_t *offset_p,
+                           unsigned char **string_p, size_t *length_p)
+{
+  size_t offset = *offset_p;
+  size_t string_length;
+  size_t used;
+
+  used = librdf_node_varint_read(buffer + offset, length - offset,
+                                 &string_length);
+  if(!used)
+    return 1;
+  offset += used;
+
+  if(string_length >= length - offset || buffer[offset + string_length])
+    return 1;
+
+  *string_p = buffer + offset;
+  *length_p = string_length;
+  *offset_p = offset + string_length + 1;
+
+  return 0;
+}
+
+
+/*
+ * librdf_node_encode2:
  * @node: the node to serialise
- * @buffer: the buffer to use
+ * @buffer: the buffer to use or NULL
  * @length: buffer size
  *
- * Serialise a node into a buffer.
- * 
- * Encodes the given node in the buffer, which must be of sufficient
- * size.  If buffer is NULL, no work is done but the size of buffer
- * required is returned.
- * 
- * If the node cannot be encoded due to restrictions of the encoding
- * format, a redland error is generated
+ * INTERNAL - Serialise a node into a buffer with encoding version 2
  *
  * Return value: the number of bytes written or 0 on failure.
- **/
-size_t
-librdf_node_encode(librdf_node *node,
-                   unsigned char *buffer, size_t length)
+ */
+static size_t
+librdf_node_encode2(librdf_node *node, unsigned char *buffer, size_t length)
 {
-  size_t total_length = 0;
-  unsigned char *string;
+  unsigned char header;
+  const unsigned char *string;
   size_t string_length;
-  size_t language_length = 0;
-  unsigned char *datatype_uri_string = NULL;
+  const unsigned char *datatype_uri_string = NULL;
   size_t datatype_uri_length = 0;
-  
-  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(node, librdf_node, 0);
+  const unsigned char *language = NULL;
+  size_t language_length = 0;
+  int datatype_index = -1;
+  int language_index = -1;
+  size_t total_length;
+  unsigned char *p;
 
   switch(node->type) {
     case RAPTOR_TERM_TYPE_URI:
-      string = (unsigned char*)librdf_uri_as_counted_string(node->value.uri,
-                                                            &string_length);
-      
-      total_length = 3 + string_length + 1; /* +1 for \0 at end */
-      
-      if(length && total_length > length)
-        return 0;    
-
-      if(string_length > 0xFFFF)
-        return 0;
+      header = LIBRDF_NODE_ENCODE2_URI;
+      string = librdf_uri_as_counted_string(node->value.uri, &string_length);
+      break;
 
-      if(buffer) {
-        buffer[0] = 'R';
-        buffer[1] = (string_length & 0xff00) >> 8;
-        buffer[2] = (string_length & 0x00ff);
-        memcpy((char*)buffer + 3, string, string_length + 1);
-      }
+    case RAPTOR_TERM_TYPE_BLANK:
+      header = LIBRDF_NODE_ENCODE2_BLANK;
+      string = node->value.blank.string;
+      string_length = node->value.blank.string_len;
       break;
-      
+
     case RAPTOR_TERM_TYPE_LITERAL:
-      string = (unsigned char*)node->value.literal.string;
+      header = LIBRDF_NODE_ENCODE2_LITERAL;
+      string = node->value.literal.string;
       string_length = node->value.literal.string_len;
-      if(node->value.literal.language)
-        language_length = LIBRDF_GOOD_CAST(size_t, node->value.literal.language_len);
 
       if(node->value.literal.datatype) {
-        datatype_uri_string = librdf_uri_as_counted_string(node->value.literal.datatype, &datatype_uri_length);
+        datatype_uri_string = librdf_uri_as_counted_string(node->value.literal.datatype,
+                                                           &datatype_uri_length);
+        datatype_index = librdf_node_encode2_lookup(librdf_node_encode2_datatypes,
+                                                    LIBRDF_NODE_ENCODE2_DATATYPES_COUNT,
+                                                    datatype_uri_string,
+                                                    datatype_uri_length);
+        header |= (datatype_index < 0) ? LIBRDF_NODE_ENCODE2_DATATYPE :
+                                         LIBRDF_NODE_ENCODE2_DATATYPE_REF;
       }
-      
-      total_length = 6 + string_length + 1; /* +1 for \0 at end */
-      if(string_length > 0xFFFF) /* for long literal - type 'N' */
-        total_length += 2;
 
-      if(language_length)
-        total_length += language_length + 1;
+      if(node->value.literal.language) {
+        language = node->value.literal.language;
+        language_length = LIBRDF_GOOD_CAST(size_t, node->value.literal.language_len);
+        language_index = librdf_node_encode2_lookup(librdf_node_encode2_languages,
+                                                    LIBRDF_NODE_ENCODE2_LANGUAGES_COUNT,
+                                                    language, language_length);
+        header |= (language_index < 0) ? LIBRDF_NODE_ENCODE2_LANGUAGE :
+                                         LIBRDF_NODE_ENCODE2_LANGUAGE_REF;
+      }
+      break;
 
-      if(datatype_uri_length)
-        total_length += datatype_uri_length + 1;
-      
-      if(length && total_length > length)
+    case RAPTOR_TERM_TYPE_UNKNOWN:
+    default:
+      return 0;
+  }
+
+  total_length = 1 + librdf_node_encode2_string_length(string_length);
+
+  if(datatype_index >= 0)
+    total_length += librdf_node_varint_length(LIBRDF_GOOD_CAST(size_t, datatype_index));
+  else if(datatype_uri_string)
+    total_length += librdf_node_encode2_string_length(datatype_uri_length);
+
+  if(language_index >= 0)
+    total_length += librdf_node_varint_length(LIBRDF_GOOD_CAST(size_t, language_index));
+  else if(language)
+    total_length += librdf_node_encode2_string_length(language_length);
+
+  if(length && total_length > length)
+    return 0;
+
+  if(!buffer)
+    return total_length;
+
+  p = buffer;
+  *p++ = header;
+  p += librdf_node_encode2_string(p, string, string_length);
+
+  if(datatype_index >= 0)
+    p += librdf_node_varint_write(p, LIBRDF_GOOD_CAST(size_t, datatype_index));
+  else if(datatype_uri_string)
+    p += librdf_node_encode2_string(p, datatype_uri_string, datatype_uri_length);
+
+  if(language_index >= 0)
+    librdf_node_varint_write(p, LIBRDF_GOOD_CAST(size_t, language_index));
+  else if(language)
+    librdf_node_encode2_string(p, language, language_length);
+
+  return total_length;
+}
+
+
+/* Parts of an encoded node, pointing into the encoding buffer */
+typedef struct {
+  raptor_term_type type;
+  unsigned char *string;
+  size_t string_length;
+  const unsigned char *datatype_uri_string;
+  size_t datatype_uri_length;
+  int is_wf_xml;
+  unsigned char *language;
+  size_t language_length;
+  size_t total_length;
+} librdf_node_decode_fields;
+
+
+/*
+ * librdf_node_decode2:
+ * @buffer: the buffer to use
+ * @length: buffer size
+ * @fields: the node parts to fill in
+ *
+ * INTERNAL - Find the parts of a node with encoding version 2
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_node_decode2(unsigned char *buffer, size_t length,
+                    librdf_node_decode_fields* fields)
+{
+  unsigned char header = buffer[0];
+  size_t offset = 1;
+  size_t index;
+  size_t used;
+
+  if(librdf_node_decode2_string(buffer, length, &offset,
+                                &fields->string, &fields->string_length))
+    return 1;
+
+  switch(header & LIBRDF_NODE_ENCODE2_TYPE_MASK) {
+    case LIBRDF_NODE_ENCODE2_URI:
+      fields->type = RAPTOR_TERM_TYPE_URI;
+      break;
+
+    case LIBRDF_NODE_ENCODE2_BLANK:
+      fields->type = RAPTOR_TERM_TYPE_BLANK;
+      break;
+
+    case LIBRDF_NODE_ENCODE2_LITERAL:
+      fields->type = RAPTOR_TERM_TYPE_LITERAL;
+
+      if(header & LIBRDF_NODE_ENCODE2_DATATYPE_REF) {
+        used = librdf_node_varint_read(buffer + offset, length - offset,
+                                       &index);
+        if(!used || index >= (size_t)LIBRDF_NODE_ENCODE2_DATATYPES_COUNT)
+          return 1;
+        offset += used;
+        fields->datatype_uri_string = (const unsigned char*)librdf_node_encode2_datatypes[index].string;
+        fields->datatype_uri_length = librdf_node_encode2_datatypes[index].length;
+      } else if(header & LIBRDF_NODE_ENCODE2_DATATYPE) {
+        unsigned char *datatype_uri_string;
+
+        if(librdf_node_decode2_string(buffer, length, &offset,
+                                      &datatype_uri_string,
+                                      &fields->datatype_uri_length))
+          return 1;
+        fields->datatype_uri_string = datatype_uri_string;
+      }
+
+      if(header & LIBRDF_NODE_ENCODE2_LANGUAGE_REF) {
+        used = librdf_node_varint_read(buffer + offset, length - offset,
+                                       &index);
+        if(!used || index >= (size_t)LIBRDF_NODE_ENCODE2_LANGUAGES_COUNT)
+          return 1;
+        offset += used;
+        fields->language = (unsigned char*)librdf_node_encode2_languages[index].string;
+        fields->language_length = librdf_node_encode2_languages[index].length;
+      } else if(header & LIBRDF_NODE_ENCODE2_LANGUAGE) {
+        if(librdf_node_decode2_string(buffer, length, &offset,
+                                      &fields->language,
+                                      &fields->language_length) ||
+           fields->language_length > 0xFF)
+          return 1;
+      }
+      break;
+
+    default:
+      return 1;
+  }
+
+  fields->total_length = offset;
+
+  return 0;
+}
+
+
+/**
+ * librdf_node_encode:
+ * @node: the node to serialise
+ * @buffer: the buffer to use
+ * @length: buffer size
+ *
+ * Serialise a node into a buffer.
+ * 
+ * Encodes the given node in the buffer, which must be of sufficient
+ * size.  If buffer is NULL, no work is done but the size of buffer
+ * required is returned.
+ * 
+ * If the node cannot be encoded due to restrictions of the encoding
+ * format, a redland error is generated
+ *
+ * This writes node encoding version 1 which limits URIs and literal
+ * datatype URIs to 65535 bytes; see librdf_node_encode_version().
+ *
+ * Return value: the number of bytes written or 0 on failure.
+ **/
+size_t
+librdf_node_encode(librdf_node *node,
+                   unsigned char *buffer, size_t length)
+{
+  size_t total_length = 0;
+  unsigned char *string;
+  size_t string_length;
+  size_t language_length = 0;
+  unsigned char *datatype_uri_string = NULL;
+  size_t datatype_uri_length = 0;
+  
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(node, librdf_node, 0);
+
+  switch(node->type) {
+    case RAPTOR_TERM_TYPE_URI:
+      string = (unsigned char*)librdf_uri_as_counted_string(node->value.uri,
+                                                            &string_length);
+      
+      total_length = 3 + string_length + 1; /* +1 for \0 at end */
+      
+      if(length && total_length > length)
+        return 0;    
+
+      if(string_length > 0xFFFF)
+        return 0;
+
+      if(buffer) {
+        buffer[0] = 'R';
+        buffer[1] = (string_length & 0xff00) >> 8;
+        buffer[2] = (string_length & 0x00ff);
+        memcpy((char*)buffer + 3, string, string_length + 1);
+      }
+      break;
+      
+    case RAPTOR_TERM_TYPE_LITERAL:
+      string = (unsigned char*)node->value.literal.string;
+      string_length = node->value.literal.string_len;
+      if(node->value.literal.language)
+        language_length = LIBRDF_GOOD_CAST(size_t, node->value.literal.language_len);
+
+      if(node->value.literal.datatype) {
+        datatype_uri_string = librdf_uri_as_counted_string(node->value.literal.datatype, &datatype_uri_length);
+      }
+      
+      total_length = 6 + string_length + 1; /* +1 for \0 at end */
+      if(string_length > 0xFFFF) /* for long literal - type 'N' */
+        total_length += 2;
+
+      if(language_length)
+        total_length += language_length + 1;
+
+      if(datatype_uri_length)
+        total_length += datatype_uri_length + 1;
+      
+      if(length && total_length > length)
         return 0;    
 
       if(datatype_uri_length > 0xFFFF)
@@ -990,175 +1687,353 @@ librdf_node_encode(librdf_node *node,
 
 
 /**
- * librdf_node_decode:
- * @world: librdf_world
- * @size_p: pointer to bytes used or NULL
+ * librdf_node_encode_version:
+ * @node: the node to serialise
  * @buffer: the buffer to use
  * @length: buffer size
+ * @version: node encoding version 1 or 2
  *
- * Deserialise a node from a buffer.
- * 
- * Decodes the serialised node (as created by librdf_node_encode() )
- * from the given buffer.
+ * Serialise a node into a buffer with a given encoding version.
  * 
- * Return value: new node or NULL on failure (bad encoding, allocation failure)
+ * As librdf_node_encode() which writes @version 1.  Version 2 uses
+ * variable length sizes without a 64K limit, a one byte header and
+ * short references to common literal datatypes and languages so is
+ * usually smaller.  Both versions are read by librdf_node_decode().
+ *
+ * Return value: the number of bytes written or 0 on failure.
  **/
-librdf_node*
-librdf_node_decode(librdf_world *world, size_t *size_p,
-                   unsigned char *buffer, size_t length)
+size_t
+librdf_node_encode_version(librdf_node *node,
+                           unsigned char *buffer, size_t length,
+                           int version)
 {
-  int is_wf_xml;
-  size_t string_length;
-  size_t total_length;
-  size_t language_length;
-  unsigned char *datatype_uri_string = NULL;
-  size_t datatype_uri_length;
-  librdf_uri* datatype_uri = NULL;
-  unsigned char *language = NULL;
-  int status = 0;
-  librdf_node* node = NULL;
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(node, librdf_node, 0);
 
-  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(world, librdf_world, NULL);
+  switch(version) {
+    case 1:
+      return librdf_node_encode(node, buffer, length);
 
-  librdf_world_open(world);
+    case 2:
+      return librdf_node_encode2(node, buffer, length);
 
-  /* absolute minimum - first byte is type */
-  if (length < 1)
-    return NULL;
+    default:
+      return 0;
+  }
+}
+
+
+/*
+ * librdf_node_decode1:
+ * @buffer: the buffer to use
+ * @length: buffer size
+ * @fields: the node parts to fill in
+ *
+ * INTERNAL - Find the parts of a node with encoding version 1
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_node_decode1(unsigned char *buffer, size_t length,
+                    librdf_node_decode_fields* fields)
+{
+  size_t total_length;
 
   switch(buffer[0]) {
     case 'R': /* URI / Resource */
       /* min */
       if(length < 3)
-        return NULL;
-
-      string_length = LIBRDF_GOOD_CAST(size_t, (buffer[1] << 8) | buffer[2]);
-      total_length = 3 + string_length + 1;
-      
-      node = librdf_new_node_from_uri_string(world, buffer + 3);
+        return 1;
 
+      fields->type = RAPTOR_TERM_TYPE_URI;
+      fields->string_length = LIBRDF_GOOD_CAST(size_t, (buffer[1] << 8) | buffer[2]);
+      fields->string = buffer + 3;
+      total_length = 3 + fields->string_length + 1;
       break;
 
     case 'L': /* Old encoding form for Literal */
       /* min */
       if(length < 6)
-        return NULL;
+        return 1;
       
-      is_wf_xml = (buffer[1] & 0xf0)>>8;
-      string_length = LIBRDF_GOOD_CAST(size_t, (buffer[2] << 8) | buffer[3]);
-      language_length = LIBRDF_GOOD_CAST(size_t, buffer[5]);
-
-      total_length = 6 + string_length + 1; /* +1 for \0 at end */
-      if(language_length) {
-        language = buffer + total_length;
-        total_length += language_length + 1;
+      fields->type = RAPTOR_TERM_TYPE_LITERAL;
+      fields->is_wf_xml = (buffer[1] & 0xf0)>>8;
+      fields->string_length = LIBRDF_GOOD_CAST(size_t, (buffer[2] << 8) | buffer[3]);
+      fields->string = buffer + 6;
+      fields->language_length = LIBRDF_GOOD_CAST(size_t, buffer[5]);
+
+      total_length = 6 + fields->string_length + 1; /* +1 for \0 at end */
+      if(fields->language_length) {
+        fields->language = buffer + total_length;
+        total_length += fields->language_length + 1;
       }
-      
-      node = librdf_new_node_from_typed_counted_literal(world,
-                                                        buffer + 6,
-                                                        string_length,
-                                                        (const char*)language,
-                                                        LIBRDF_GOOD_CAST(unsigned char, language_length),
-                                                        is_wf_xml ? LIBRDF_RS_XMLLiteral_URI(world) : NULL);
-    
-    break;
+      break;
 
     case 'M': /* Literal for Redland 0.9.12+ */
       /* min */
       if(length < 6)
-        return NULL;
+        return 1;
       
-      string_length = LIBRDF_GOOD_CAST(size_t, (buffer[1] << 8) | buffer[2]);
-      datatype_uri_length = LIBRDF_GOOD_CAST(size_t, (buffer[3] << 8) | buffer[4]);
-      language_length = buffer[5];
-
-      total_length = 6 + string_length + 1; /* +1 for \0 at end */
-      if(datatype_uri_length) {
-        datatype_uri_string = buffer + total_length;
-        total_length += datatype_uri_length + 1;
+      fields->type = RAPTOR_TERM_TYPE_LITERAL;
+      fields->string_length = LIBRDF_GOOD_CAST(size_t, (buffer[1] << 8) | buffer[2]);
+      fields->string = buffer + 6;
+      fields->datatype_uri_length = LIBRDF_GOOD_CAST(size_t, (buffer[3] << 8) | buffer[4]);
+      fields->language_length = buffer[5];
+
+      total_length = 6 + fields->string_length + 1; /* +1 for \0 at end */
+      if(fields->datatype_uri_length) {
+        fields->datatype_uri_string = buffer + total_length;
+        total_length += fields->datatype_uri_length + 1;
       }
-      if(language_length) {
-        language = buffer + total_length;
-        total_length += language_length + 1;
+      if(fields->language_length) {
+        fields->language = buffer + total_length;
+        total_length += fields->language_length + 1;
       }
-
-      if(datatype_uri_string)
-        datatype_uri = librdf_new_uri(world, datatype_uri_string);
-      
-      node = librdf_new_node_from_typed_counted_literal(world,
-                                                        buffer + 6,
-                                                        string_length,
-                                                        (const char*)language,
-                                                        LIBRDF_GOOD_CAST(unsigned char, language_length),
-                                                        datatype_uri);
-      if(datatype_uri)
-        librdf_free_uri(datatype_uri);
-      
-      if(status)
-        return NULL;
-      
-    break;
+      break;
 
     case 'N': /* Literal for redland 1.0.5+ (long literal) */
       /* min */
       if(length < 8)
-        return NULL;
+        return 1;
       
-      string_length = LIBRDF_GOOD_CAST(size_t, (buffer[1] << 24) | (buffer[2] << 16) | (buffer[3] << 8) | buffer[4]);
-      datatype_uri_length = LIBRDF_GOOD_CAST(size_t, (buffer[5] << 8) | buffer[6]);
-      language_length = buffer[7];
-
-      total_length = 8 + string_length + 1; /* +1 for \0 at end */
-      if(datatype_uri_length) {
-        datatype_uri_string = buffer + total_length;
-        total_length += datatype_uri_length + 1;
+      fields->type = RAPTOR_TERM_TYPE_LITERAL;
+      fields->string_length = LIBRDF_GOOD_CAST(size_t, (buffer[1] << 24) | (buffer[2] << 16) | (buffer[3] << 8) | buffer[4]);
+      fields->string = buffer + 8;
+      fields->datatype_uri_length = LIBRDF_GOOD_CAST(size_t, (buffer[5] << 8) | buffer[6]);
+      fields->language_length = buffer[7];
+
+      total_length = 8 + fields->string_length + 1; /* +1 for \0 at end */
+      if(fields->datatype_uri_length) {
+        fields->datatype_uri_string = buffer + total_length;
+        total_length += fields->datatype_uri_length + 1;
       }
-      if(language_length) {
-        language = buffer + total_length;
-        total_length += language_length + 1;
+      if(fields->language_length) {
+        fields->language = buffer + total_length;
+        total_length += fields->language_length + 1;
       }
-
-      if(datatype_uri_string)
-        datatype_uri = librdf_new_uri(world, datatype_uri_string);
-      
-      node = librdf_new_node_from_typed_counted_literal(world,
-                                                        buffer + 8,
-                                                        string_length,
-                                                        (const char*)language,
-                                                        LIBRDF_GOOD_CAST(size_t, language_length),
-                                                        datatype_uri);
-      if(datatype_uri)
-        librdf_free_uri(datatype_uri);
-      
-      if(status)
-        return NULL;
-      
-    break;
+      break;
 
     case 'B': /* RAPTOR_TERM_TYPE_BLANK */
       /* min */
       if(length < 3)
-        return NULL;
+        return 1;
       
-      string_length = LIBRDF_GOOD_CAST(size_t, (buffer[1] << 8) | buffer[2]);
-
-      total_length = 3 + string_length + 1; /* +1 for \0 at end */
-      
-      node = librdf_new_node_from_blank_identifier(world, buffer+3);
-    
-    break;
+      fields->type = RAPTOR_TERM_TYPE_BLANK;
+      fields->string_length = LIBRDF_GOOD_CAST(size_t, (buffer[1] << 8) | buffer[2]);
+      fields->string = buffer + 3;
+      total_length = 3 + fields->string_length + 1; /* +1 for \0 at end */
+      break;
 
   default:
+    return 1;
+  }
+
+  if(total_length > length)
+    return 1;
+
+  fields->total_length = total_length;
+
+  return 0;
+}
+
+
+/*
+ * librdf_node_decode_parts:
+ * @buffer: the buffer to use
+ * @length: buffer size
+ * @fields: the node parts to fill in
+ *
+ * INTERNAL - Find the parts of an encoded node of either version
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_node_decode_parts(unsigned char *buffer, size_t length,
+                         librdf_node_decode_fields* fields)
+{
+  memset(fields, 0, sizeof(*fields));
+
+  /* absolute minimum - first byte is type */
+  if(length < 1)
+    return 1;
+
+  /* version 2 headers have the top bit set */
+  if(buffer[0] & 0x80)
+    return librdf_node_decode2(buffer, length, fields);
+
+  return librdf_node_decode1(buffer, length, fields);
+}
+
+
+/**
+ * librdf_node_decode:
+ * @world: librdf_world
+ * @size_p: pointer to bytes used or NULL
+ * @buffer: the buffer to use
+ * @length: buffer size
+ *
+ * Deserialise a node from a buffer.
+ * 
+ * Decodes the serialised node (as created by librdf_node_encode() or
+ * librdf_node_encode_version() with any version) from the given buffer.
+ * 
+ * Return value: new node or NULL on failure (bad encoding, allocation failure)
+ **/
+librdf_node*
+librdf_node_decode(librdf_world *world, size_t *size_p,
+                   unsigned char *buffer, size_t length)
+{
+  librdf_node_decode_fields fields;
+  librdf_uri* datatype_uri = NULL;
+  librdf_node* node = NULL;
+
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(world, librdf_world, NULL);
+
+  librdf_world_open(world);
+
+  if(librdf_node_decode_parts(buffer, length, &fields))
     return NULL;
+
+  switch(fields.type) {
+    case RAPTOR_TERM_TYPE_URI:
+      node = librdf_new_node_from_counted_uri_string(world, fields.string,
+                                                     fields.string_length);
+      break;
+
+    case RAPTOR_TERM_TYPE_BLANK:
+      node = librdf_new_node_from_counted_blank_identifier(world,
+                                                           fields.string,
+                                                           fields.string_length);
+      break;
+
+    case RAPTOR_TERM_TYPE_LITERAL:
+      if(fields.datatype_uri_string) {
+        datatype_uri = librdf_new_uri2(world, fields.datatype_uri_string,
+                                       fields.datatype_uri_length);
+        if(!datatype_uri)
+          return NULL;
+      } else if(fields.is_wf_xml)
+        datatype_uri = librdf_new_uri_from_uri(LIBRDF_RS_XMLLiteral_URI(world));
+
+      node = librdf_new_node_from_typed_counted_literal(world,
+                                                        fields.string,
+                                                        fields.string_length,
+                                                        (const char*)fields.language,
+                                                        fields.language_length,
+                                                        datatype_uri);
+      if(datatype_uri)
+        librdf_free_uri(datatype_uri);
+      break;
+
+    case RAPTOR_TERM_TYPE_UNKNOWN:
+    default:
+      return NULL;
   }
   
   if(size_p)
-    *size_p = total_length;
+    *size_p = fields.total_length;
 
   return node;
 }
 
 
+/**
+ * librdf_node_decode_borrowed:
+ * @world: librdf_world
+ * @node: the node to fill in
+ * @size_p: pointer to bytes used or NULL
+ * @buffer: the buffer to use
+ * @length: buffer size
+ *
+ * INTERNAL - Deserialise a node in place without copying its strings
+ *
+ * Fills in @node as a borrowed node whose strings point into @buffer,
+ * so only URIs are allocated.  The node is valid only while @buffer
+ * is unchanged and must be released with librdf_node_clear_borrowed().
+ * librdf_new_node_from_node() and librdf_node_materialise() make
+ * owned copies of it.
+ *
+ * Return value: non 0 on failure
+ **/
+int
+librdf_node_decode_borrowed(librdf_world *world, librdf_node *node,
+                            size_t *size_p,
+                            unsigned char *buffer, size_t length)
+{
+  librdf_node_decode_fields fields;
+
+  memset(node, 0, sizeof(*node));
+
+  librdf_world_open(world);
+
+  if(librdf_node_decode_parts(buffer, length, &fields))
+    return 1;
+
+  switch(fields.type) {
+    case RAPTOR_TERM_TYPE_URI:
+      node->value.uri = librdf_new_uri2(world, fields.string,
+                                        fields.string_length);
+      if(!node->value.uri)
+        return 1;
+      break;
+
+    case RAPTOR_TERM_TYPE_BLANK:
+      node->value.blank.string = fields.string;
+      node->value.blank.string_len = LIBRDF_GOOD_CAST(int, fields.string_length);
+      break;
+
+    case RAPTOR_TERM_TYPE_LITERAL:
+      if(fields.datatype_uri_string) {
+        node->value.literal.datatype = librdf_new_uri2(world,
+                                                       fields.datatype_uri_string,
+                                                       fields.datatype_uri_length);
+        if(!node->value.literal.datatype)
+          return 1;
+      } else if(fields.is_wf_xml)
+        node->value.literal.datatype = librdf_new_uri_from_uri(LIBRDF_RS_XMLLiteral_URI(world));
+
+      node->value.literal.string = fields.string;
+      node->value.literal.string_len = LIBRDF_GOOD_CAST(unsigned int, fields.string_length);
+      node->value.literal.language = fields.language;
+      node->value.literal.language_len = LIBRDF_GOOD_CAST(unsigned char, fields.language_length);
+      break;
+
+    case RAPTOR_TERM_TYPE_UNKNOWN:
+    default:
+      return 1;
+  }
+
+  node->world = world->raptor_world_ptr;
+  node->type = fields.type;
+  /* a usage count of 0 marks a borrowed node */
+  node->usage = 0;
+
+  if(size_p)
+    *size_p = fields.total_length;
+
+  return 0;
+}
+
+
+/**
+ * librdf_node_clear_borrowed:
+ * @node: node filled in by librdf_node_decode_borrowed() or all 0
+ *
+ * INTERNAL - Release a borrowed node
+ *
+ **/
+void
+librdf_node_clear_borrowed(librdf_node *node)
+{
+  if(node->type == RAPTOR_TERM_TYPE_URI && node->value.uri)
+    librdf_free_uri(node->value.uri);
+  else if(node->type == RAPTOR_TERM_TYPE_LITERAL &&
+          node->value.literal.datatype)
+    librdf_free_uri(node->value.literal.datatype);
+
+  memset(node, 0, sizeof(*node));
+}
+
+
 #ifndef REDLAND_DISABLE_DEPRECATED
 /**
  * librdf_node_to_string:
@@ -1290,6 +2165,10 @@ librdf_node_print(librdf_node *node, FILE *fh)
 int
 librdf_node_equals(librdf_node *first_node, librdf_node *second_node)
 {
+  /* usual with interned nodes */
+  if(first_node && first_node == second_node)
+    return 1;
+
   return raptor_term_equals(first_node, second_node);
 }
 
@@ -1454,6 +2333,176 @@ static const unsigned char datatyped_literal_M_encoded[61] = {0x4d, 0x00, 0x17,
 const unsigned char big_literal_N_encoded[32] = {0x4e, 0x00, 0x01, 0x86, 0xa0, 0x00, 0x00, 0x00, 0x58, 0x58, 0x58, 0x58, 0x58, 0x58, 0x58, 0x58, 0x58, 0x58, 0x58, 0x58, 0x58, 0x58, 0x58, 0x58, 0x58, 0x58, 0x58, 0x58, 0x58, 0x58, 0x58, 0x58};
 
 
+/* Check nodes round trip through encoding version 2, owned and borrowed */
+static int
+test_node_encode_version(librdf_world* world, const char *program)
+{
+  static const unsigned char hp_uri_v2_header[3] = {0x80, 0x1b, 0x68};
+  librdf_node* nodes[6];
+  librdf_node borrowed;
+  librdf_uri* datatype_uri;
+  unsigned char *long_uri;
+  size_t long_uri_length = 70000;
+  size_t size, size2;
+  unsigned char *buffer;
+  int rc = 0;
+  int i;
+
+  long_uri = LIBRDF_MALLOC(unsigned char*, long_uri_length + 1);
+  memcpy(long_uri, "http://example.org/", 19);
+  memset(long_uri + 19, 'X', long_uri_length - 19);
+  long_uri[long_uri_length] = '\0';
+
+  datatype_uri = librdf_new_uri(world,
+                                (const unsigned char*)"http://www.w3.org/2001/XMLSchema#integer");
+  nodes[0] = librdf_new_node_from_uri_string(world, (const unsigned char*)hp_string1);
+  nodes[1] = librdf_new_node_from_blank_identifier(world, (const unsigned char*)genid);
+  nodes[2] = librdf_new_node_from_literal(world, (const unsigned char*)lit_string, "en", 0);
+  nodes[3] = librdf_new_node_from_literal(world, (const unsigned char*)lit_string, "en-AU", 0);
+  nodes[4] = librdf_new_node_from_typed_literal(world, (const unsigned char*)"42",
+                                                NULL, datatype_uri);
+  nodes[5] = librdf_new_node_from_counted_uri_string(world, long_uri,
+                                                     long_uri_length);
+  librdf_free_uri(datatype_uri);
+  LIBRDF_FREE(char*, long_uri);
+
+  if(librdf_node_encode(nodes[5], NULL, 0)) {
+    fprintf(stderr, "%s: Unexpected success encoding a %d byte URI with version 1\n",
+            program, (int)long_uri_length);
+    rc = 1;
+  }
+
+  for(i = 0; i < 6; i++) {
+    librdf_node* node2;
+
+    size = librdf_node_encode_version(nodes[i], NULL, 0, 2);
+    if(!size) {
+      fprintf(stderr, "%s: Encoding node %d with version 2 failed\n",
+              program, i);
+      rc = 1;
+      continue;
+    }
+    if(i < 5 && size >= librdf_node_encode(nodes[i], NULL, 0)) {
+      fprintf(stderr, "%s: Version 2 encoding of node %d is not smaller\n",
+              program, i);
+      rc = 1;
+    }
+
+    buffer = LIBRDF_MALLOC(unsigned char*, size);
+    librdf_node_encode_version(nodes[i], buffer, size, 2);
+
+    if(!i && check_node(program, hp_uri_v2_header, buffer, 3))
+      rc = 1;
+
+    if(librdf_node_decode(world, NULL, buffer, size - 1)) {
+      fprintf(stderr, "%s: Decoding truncated node %d succeeded\n",
+              program, i);
+      rc = 1;
+    }
+
+    node2 = librdf_node_decode(world, &size2, buffer, size);
+    if(!node2 || size2 != size || !librdf_node_equals(nodes[i], node2)) {
+      fprintf(stderr, "%s: Decoding node %d with version 2 failed\n",
+              program, i);
+      rc = 1;
+    }
+    if(node2)
+      librdf_free_node(node2);
+
+    /* borrowed nodes are copied rather than shared */
+    if(librdf_node_decode_borrowed(world, &borrowed, NULL, buffer, size)) {
+      fprintf(stderr, "%s: Borrowed decoding of node %d failed\n",
+              program, i);
+      rc = 1;
+    } else {
+      node2 = librdf_new_node_from_node(&borrowed);
+      if(!node2 || node2 == &borrowed ||
+         !librdf_node_equals(nodes[i], node2)) {
+        fprintf(stderr, "%s: Copying borrowed node %d failed\n",
+                program, i);
+        rc = 1;
+      }
+      if(node2)
+        librdf_free_node(node2);
+      librdf_node_clear_borrowed(&borrowed);
+    }
+    LIBRDF_FREE(char*, buffer);
+  }
+
+  if(librdf_node_decode_borrowed(world, &borrowed, NULL,
+                                 (unsigned char*)hp_uri_encoded,
+                                 sizeof(hp_uri_encoded)) ||
+     !librdf_node_equals(nodes[0], &borrowed)) {
+    fprintf(stderr, "%s: Borrowed decoding of a version 1 node failed\n",
+            program);
+    rc = 1;
+  }
+  librdf_node_clear_borrowed(&borrowed);
+
+  for(i = 0; i < 6; i++)
+    librdf_free_node(nodes[i]);
+
+  return rc;
+}
+
+
+/* Check equal nodes are shared only while interning is on */
+static int
+test_node_interning(librdf_world* world, const char *program)
+{
+  librdf_uri* feature;
+  librdf_node* value;
+  librdf_node* nodes[4];
+  int rc=0;
+  int i;
+
+  feature=librdf_new_uri(world,
+                         (const unsigned char*)LIBRDF_WORLD_FEATURE_NODE_INTERNING);
+  value=librdf_new_node_from_typed_literal(world, (const unsigned char*)"1",
+                                           NULL, NULL);
+  if(librdf_world_set_feature(world, feature, value)) {
+    fprintf(stderr, "%s: Failed to turn on node interning\n", program);
+    rc=1;
+  }
+  librdf_free_node(value);
+
+  fprintf(stdout, "%s: Creating interned nodes\n", program);
+  nodes[0]=librdf_new_node_from_uri_string(world, (const unsigned char*)hp_string1);
+  nodes[1]=librdf_new_node_from_uri_string(world, (const unsigned char*)hp_string2);
+  nodes[2]=librdf_new_node_from_literal(world, (const unsigned char*)"hello", "en", 0);
+  nodes[3]=librdf_new_node_from_literal(world, (const unsigned char*)"hello", "fr", 0);
+  if(nodes[0] != nodes[1]) {
+    fprintf(stderr, "%s: Equal interned URI nodes are not shared\n", program);
+    rc=1;
+  }
+  if(nodes[2] == nodes[3] || librdf_node_equals(nodes[2], nodes[3])) {
+    fprintf(stderr, "%s: Literals with different languages are shared\n", program);
+    rc=1;
+  }
+
+  value=librdf_world_get_feature(world, feature);
+  if(!value ||
+     strcmp((const char*)librdf_node_get_literal_value(value), "1")) {
+    fprintf(stderr, "%s: Node interning feature is not 1\n", program);
+    rc=1;
+  }
+  if(value)
+    librdf_free_node(value);
+
+  /* nodes stay valid after interning is turned off */
+  value=librdf_new_node_from_typed_literal(world, (const unsigned char*)"0",
+                                           NULL, NULL);
+  librdf_world_set_feature(world, feature, value);
+  librdf_free_node(value);
+  librdf_free_uri(feature);
+
+  for(i=0; i < 4; i++)
+    librdf_free_node(nodes[i]);
+
+  return rc;
+}
+
+
 int
 main(int argc, char *argv[]) 
 {
@@ -1669,6 +2718,12 @@ main(int argc, char *argv[])
   librdf_free_node(node2);
   librdf_free_node(node);
 
+  if(test_node_encode_version(world, program))
+    return(1);
+
+  if(test_node_interning(world, program))
+    return(1);
+
   librdf_free_world(world);
 
   /* keep gcc -Wall happy */
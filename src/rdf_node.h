@@ -118,6 +118,8 @@ librdf_node* librdf_new_node_from_counted_blank_identifier(librdf_world* world,
 /* Create a new Node from an existing Node - CLONE */
 REDLAND_API
 librdf_node* librdf_new_node_from_node(librdf_node *node);
+REDLAND_API
+librdf_node* librdf_node_materialise(librdf_node *node);
 
 /* destructor */
 REDLAND_API
@@ -164,6 +166,8 @@ int librdf_node_is_blank(librdf_node* node);
 REDLAND_API
 size_t librdf_node_encode(librdf_node* node, unsigned char *buffer, size_t length);
 REDLAND_API
+size_t librdf_node_encode_version(librdf_node* node, unsigned char *buffer, size_t length, int version);
+REDLAND_API
 librdf_node* librdf_node_decode(librdf_world *world, size_t* size_p, unsigned char *buffer, size_t length);
 
 /* convert to a string */
@@ -80,6 +80,11 @@ struct librdf_node_s
 void librdf_init_node(librdf_world* world);
 void librdf_finish_node(librdf_world* world);
 
+u32 librdf_node_hash(librdf_node* node);
+void librdf_node_set_interning(librdf_world* world, int interning);
+int librdf_node_decode_borrowed(librdf_world *world, librdf_node *node, size_t *size_p, unsigned char *buffer, size_t length);
+void librdf_node_clear_borrowed(librdf_node *node);
+
 /* exported public in error but never usable */
 librdf_digest* librdf_node_get_digest(librdf_node* node);
 
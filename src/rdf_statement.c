@@ -73,6 +73,8 @@ librdf_new_statement(librdf_world *world)
  *
  * Copy constructor - create a new librdf_statement from an existing librdf_statement.
  * Creates a deep copy - changes to original statement nodes are not reflected in the copy.
+ * The nodes are copied with librdf_new_node_from_node() so borrowed
+ * nodes are never shared.
  * 
  * Return value: a new #librdf_statement with copy or NULL on failure
  **/
@@ -89,21 +91,29 @@ librdf_new_statement_from_statement(librdf_statement* statement)
   if(!statement)
     return NULL;
 
-  subject = raptor_term_copy(statement->subject);
-  if(statement->subject && !subject)
-    goto err;
+  if(statement->subject) {
+    subject = librdf_new_node_from_node(statement->subject);
+    if(!subject)
+      goto err;
+  }
 
-  predicate = raptor_term_copy(statement->predicate);
-  if(statement->predicate && !predicate)
-    goto err;
+  if(statement->predicate) {
+    predicate = librdf_new_node_from_node(statement->predicate);
+    if(!predicate)
+      goto err;
+  }
 
-  object = raptor_term_copy(statement->object);
-  if(statement->object && !object)
-    goto err;
+  if(statement->object) {
+    object = librdf_new_node_from_node(statement->object);
+    if(!object)
+      goto err;
+  }
 
-  graph = raptor_term_copy(statement->graph);
-  if(statement->graph && !graph)
-    goto err;
+  if(statement->graph) {
+    graph = librdf_new_node_from_node(statement->graph);
+    if(!graph)
+      goto err;
+  }
 
   return raptor_new_statement_from_nodes(statement->world, subject, predicate, object, graph);
 
@@ -101,6 +101,35 @@ librdf_statement_encode_parts2(librdf_world* world,
                                librdf_node* context_node,
                                unsigned char *buffer, size_t length,
                                librdf_statement_part fields)
+{
+  return librdf_statement_encode_parts_version(world, statement, context_node,
+                                               buffer, length, (int)fields, 1);
+}
+
+
+/*
+ * librdf_statement_encode_parts_version:
+ * @world: redland world object
+ * @statement: statement to serialise
+ * @context_node: #librdf_node context node (can be NULL)
+ * @buffer: the buffer to use
+ * @length: buffer size
+ * @fields: fields to encode
+ * @version: node encoding version
+ *
+ * INTERNAL - Serialise parts of a statement with a node encoding version
+ *
+ * As librdf_statement_encode_parts2() with the nodes written by
+ * librdf_node_encode_version().
+ *
+ * Return value: the number of bytes written or 0 on failure.
+ */
+size_t
+librdf_statement_encode_parts_version(librdf_world* world,
+                                      librdf_statement* statement, 
+                                      librdf_node* context_node,
+                                      unsigned char *buffer, size_t length,
+                                      int fields, int version)
 {
   size_t total_length=0;
   size_t node_len;
@@ -130,7 +159,8 @@ librdf_statement_encode_parts2(librdf_world* world,
     }
     total_length++;
 
-    node_len=librdf_node_encode(statement->subject, p, length);
+    node_len=librdf_node_encode_version(statement->subject, p, length,
+                                        version);
     if(!node_len)
       return 0;
     if(p) {
@@ -154,7 +184,8 @@ librdf_statement_encode_parts2(librdf_world* world,
     }
     total_length++;
 
-    node_len=librdf_node_encode(statement->predicate, p, length);
+    node_len=librdf_node_encode_version(statement->predicate, p, length,
+                                        version);
     if(!node_len)
       return 0;
     if(p) {
@@ -176,7 +207,8 @@ librdf_statement_encode_parts2(librdf_world* world,
     }
     total_length++;
 
-    node_len= librdf_node_encode(statement->object, p, length);
+    node_len= librdf_node_encode_version(statement->object, p, length,
+                                         version);
     if(!node_len)
       return 0;
     if(p) {
@@ -195,7 +227,8 @@ librdf_statement_encode_parts2(librdf_world* world,
     }
     total_length++;
 
-    node_len= librdf_node_encode(context_node, p, length);
+    node_len= librdf_node_encode_version(context_node, p, length,
+                                         version);
     if(!node_len)
       return 0;
 
@@ -36,6 +36,8 @@ extern "C" {
 void librdf_init_statement(librdf_world *world);
 void librdf_finish_statement(librdf_world *world);
 
+size_t librdf_statement_encode_parts_version(librdf_world* world, librdf_statement* statement, librdf_node* context_node, unsigned char *buffer, size_t length, int fields, int version);
+
 #ifdef __cplusplus
 }
 #endif
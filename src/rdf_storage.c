@@ -38,6 +38,9 @@
 #ifdef HAVE_STDLIB_H
 #include <stdlib.h>
 #endif
+#ifdef STANDALONE
+#include <time.h>
+#endif
 
 #ifdef MODULAR_LIBRDF
 #include <ltdl.h>
@@ -1989,6 +1992,1365 @@ librdf_storage_transaction_get_handle(librdf_storage* storage)
 int main(int argc, char *argv[]);
 
 
+#define TEST_NS "http://example.org/"
+
+/* subject, predicate, object URI suffixes; object "" is the literal "o2" */
+static const char* const test_triples[] = {
+  "s1", "p1", "o1",
+  "s1", "p2", "",
+  "s2", "p1", "o1",
+  NULL, NULL, NULL
+};
+
+/* find_statements patterns (NULL is a wildcard) and expected counts */
+static const struct {
+  const char *s;
+  const char *p;
+  const char *o;
+  int count;
+} test_patterns[] = {
+  { NULL, NULL, NULL, 3 },
+  { "s1", NULL, NULL, 2 },
+  { NULL, NULL, "o1", 2 },
+  { NULL, "p1", NULL, 2 },
+  { "s1", "p1", NULL, 1 },
+  { NULL, "p1", "o1", 2 },
+  { "s1", NULL, "",   1 },
+  { "s1", "p1", "o1", 1 },
+  { "s2", "p2", NULL, 0 },
+  { NULL, NULL, NULL, -1 }
+};
+
+
+static librdf_node*
+test_node(librdf_world* world, const char *name)
+{
+  char uri[64];
+
+  if(!name)
+    return NULL;
+
+  if(!*name)
+    return librdf_new_node_from_literal(world, (const unsigned char*)"o2",
+                                        NULL, 0);
+
+  sprintf(uri, "%s%s", TEST_NS, name);
+  return librdf_new_node_from_uri_string(world, (const unsigned char*)uri);
+}
+
+
+static int
+test_storage_find_statements(librdf_world* world, librdf_storage* storage,
+                             const char *program)
+{
+  int i;
+  int errors=0;
+
+  for(i=0; test_triples[i]; i+=3) {
+    librdf_statement* statement;
+    int rc;
+
+    statement=librdf_new_statement_from_nodes(world,
+                                              test_node(world, test_triples[i]),
+                                              test_node(world, test_triples[i+1]),
+                                              test_node(world, test_triples[i+2]));
+    rc=librdf_storage_add_statement(storage, statement);
+    librdf_free_statement(statement);
+    if(rc) {
+      /* only called for storages private to the test, so all writable */
+      fprintf(stderr, "%s: Failed to add statement %d\n", program, i / 3);
+      return 1;
+    }
+  }
+
+  for(i=0; test_patterns[i].count >= 0; i++) {
+    librdf_statement* statement;
+    librdf_stream* stream;
+    int count=0;
+
+    statement=librdf_new_statement_from_nodes(world,
+                                              test_node(world, test_patterns[i].s),
+                                              test_node(world, test_patterns[i].p),
+                                              test_node(world, test_patterns[i].o));
+    stream=librdf_storage_find_statements(storage, statement);
+    if(!stream) {
+      fprintf(stderr, "%s: Failed to find statements for pattern %d\n",
+              program, i);
+      errors++;
+      librdf_free_statement(statement);
+      continue;
+    }
+
+    while(!librdf_stream_end(stream)) {
+      librdf_statement* found=librdf_stream_get_object(stream);
+      if(!found || !librdf_statement_match(found, statement)) {
+        fprintf(stderr, "%s: Pattern %d returned a non-matching statement\n",
+                program, i);
+        errors++;
+        break;
+      }
+      count++;
+      librdf_stream_next(stream);
+    }
+    librdf_free_stream(stream);
+    librdf_free_statement(statement);
+
+    if(count != test_patterns[i].count) {
+      fprintf(stderr, "%s: Pattern %d returned %d statements, expected %d\n",
+              program, i, count, test_patterns[i].count);
+      errors++;
+    }
+  }
+
+  return errors;
+}
+
+
+static int
+test_storage_count_stream(librdf_stream* stream)
+{
+  int count=0;
+
+  if(!stream)
+    return -1;
+
+  for(; !librdf_stream_end(stream); librdf_stream_next(stream))
+    count++;
+  librdf_free_stream(stream);
+
+  return count;
+}
+
+
+/*
+ * Add the test triples in two contexts and check the context methods
+ * see each context separately.  Storages without contexts are skipped.
+ */
+static int
+test_storage_contexts(librdf_world* world, librdf_storage* storage,
+                      const char *program)
+{
+  librdf_uri* feature;
+  librdf_node* value;
+  librdf_node* contexts[2];
+  librdf_statement* statement;
+  librdf_iterator* iterator;
+  int supported;
+  int i;
+  int count;
+  int errors=0;
+
+  feature=librdf_new_uri(world, (const unsigned char*)LIBRDF_MODEL_FEATURE_CONTEXTS);
+  value=librdf_storage_get_feature(storage, feature);
+  librdf_free_uri(feature);
+  supported=(value &&
+             !strcmp((const char*)librdf_node_get_literal_value(value), "1"));
+  if(value)
+    librdf_free_node(value);
+  if(!supported)
+    return 0;
+
+  contexts[0]=test_node(world, "c1");
+  contexts[1]=test_node(world, "c2");
+
+  /* first two triples in c1, the rest in c2 */
+  for(i=0; test_triples[i]; i+=3) {
+    statement=librdf_new_statement_from_nodes(world,
+                                              test_node(world, test_triples[i]),
+                                              test_node(world, test_triples[i+1]),
+                                              test_node(world, test_triples[i+2]));
+    if(librdf_storage_context_add_statement(storage, contexts[(i < 6) ? 0 : 1],
+                                            statement)) {
+      fprintf(stderr, "%s: Failed to add statement %d to a context\n",
+              program, i / 3);
+      errors++;
+    }
+    librdf_free_statement(statement);
+  }
+
+  count=test_storage_count_stream(librdf_storage_context_as_stream(storage, contexts[0]));
+  if(count != 2) {
+    fprintf(stderr, "%s: Context c1 has %d statements, expected 2\n",
+            program, count);
+    errors++;
+  }
+
+  statement=librdf_new_statement_from_nodes(world, NULL,
+                                            test_node(world, "p1"), NULL);
+  count=test_storage_count_stream(librdf_storage_find_statements_in_context(storage, statement, contexts[1]));
+  librdf_free_statement(statement);
+  if(count != 1) {
+    fprintf(stderr, "%s: Found %d p1 statements in context c2, expected 1\n",
+            program, count);
+    errors++;
+  }
+
+  for(i=0; i < 2; i++) {
+    count=0;
+    iterator=librdf_storage_get_contexts(storage);
+    if(iterator) {
+      for(; !librdf_iterator_end(iterator); librdf_iterator_next(iterator))
+        count++;
+      librdf_free_iterator(iterator);
+    }
+    if(count != 2 - i) {
+      fprintf(stderr, "%s: Storage has %d contexts, expected %d\n",
+              program, count, 2 - i);
+      errors++;
+    }
+
+    if(i)
+      break;
+
+    /* then again without c1 */
+    for(count=0; count < 6; count+=3) {
+      statement=librdf_new_statement_from_nodes(world,
+                                                test_node(world, test_triples[count]),
+                                                test_node(world, test_triples[count+1]),
+                                                test_node(world, test_triples[count+2]));
+      librdf_storage_context_remove_statement(storage, contexts[0], statement);
+      librdf_free_statement(statement);
+    }
+  }
+
+  count=test_storage_count_stream(librdf_storage_context_as_stream(storage, contexts[0]));
+  if(count > 0) {
+    fprintf(stderr, "%s: Removed context c1 still has %d statements\n",
+            program, count);
+    errors++;
+  }
+
+  librdf_free_node(contexts[0]);
+  librdf_free_node(contexts[1]);
+
+  return errors;
+}
+
+
+static librdf_statement*
+test_triple_statement(librdf_world* world, int triple)
+{
+  return librdf_new_statement_from_nodes(world,
+                                         test_node(world, test_triples[triple * 3]),
+                                         test_node(world, test_triples[triple * 3 + 1]),
+                                         test_node(world, test_triples[triple * 3 + 2]));
+}
+
+
+/*
+ * Check @storage has @size statements which serialise as the test
+ * triples numbered in @expected, ended by -1.
+ */
+static int
+test_storage_serialised(librdf_world* world, librdf_storage* storage,
+                        const char *program, const char *step, int size,
+                        const int* expected)
+{
+  librdf_stream* stream;
+  int errors=0;
+  int i=0;
+
+  if(librdf_storage_size(storage) != size) {
+    fprintf(stderr, "%s: Memory storage %s has size %d, expected %d\n",
+            program, step, librdf_storage_size(storage), size);
+    errors++;
+  }
+
+  stream=librdf_storage_serialise(storage);
+  for(; stream && !librdf_stream_end(stream); librdf_stream_next(stream)) {
+    librdf_statement* statement;
+    int equal;
+
+    if(expected[i] < 0) {
+      i++;
+      break;
+    }
+
+    statement=test_triple_statement(world, expected[i]);
+    equal=librdf_statement_equals(statement, librdf_stream_get_object(stream));
+    librdf_free_statement(statement);
+    if(!equal)
+      break;
+    i++;
+  }
+  if(!stream || !librdf_stream_end(stream) || expected[i] >= 0) {
+    fprintf(stderr, "%s: Memory storage %s serialised out of order at %d\n",
+            program, step, i);
+    errors++;
+  }
+  if(stream)
+    librdf_free_stream(stream);
+
+  return errors;
+}
+
+
+/*
+ * Add a statement to a context of the memory storage twice, which
+ * stores it once, and also to another context, then remove it from
+ * each context in turn checking size, contains and the insertion order
+ * of serialisation after each step.
+ */
+static int
+test_storage_memory_contexts(librdf_world* world, const char *program)
+{
+  static const int added[] = { 0, 1, 2, 0, -1 };
+  static const int removed_c1[] = { 1, 2, 0, -1 };
+  static const int removed_c2[] = { 1, 2, -1 };
+  static const int readded[] = { 1, 2, 0, -1 };
+  librdf_storage* storage;
+  librdf_node* contexts[2];
+  librdf_statement* statement;
+  int count;
+  int errors=0;
+
+  storage=librdf_new_storage(world, "memory", NULL, "contexts='yes'");
+  if(!storage || librdf_storage_open(storage, NULL)) {
+    fprintf(stderr, "%s: Failed to open memory storage\n", program);
+    if(storage)
+      librdf_free_storage(storage);
+    return 1;
+  }
+
+  contexts[0]=test_node(world, "c1");
+  contexts[1]=test_node(world, "c2");
+  statement=test_triple_statement(world, 0);
+
+  /* triple 0 twice in c1 with triple 1, then triples 2 and 0 in c2 */
+  librdf_storage_context_add_statement(storage, contexts[0], statement);
+  librdf_free_statement(statement);
+  statement=test_triple_statement(world, 1);
+  librdf_storage_context_add_statement(storage, contexts[0], statement);
+  librdf_free_statement(statement);
+  statement=test_triple_statement(world, 0);
+  librdf_storage_context_add_statement(storage, contexts[0], statement);
+  librdf_free_statement(statement);
+  statement=test_triple_statement(world, 2);
+  librdf_storage_context_add_statement(storage, contexts[1], statement);
+  librdf_free_statement(statement);
+  statement=test_triple_statement(world, 0);
+  librdf_storage_context_add_statement(storage, contexts[1], statement);
+
+  errors+=test_storage_serialised(world, storage, program, "after adding",
+                                  4, added);
+  count=test_storage_count_stream(librdf_storage_context_as_stream(storage, contexts[0]));
+  if(count != 2) {
+    fprintf(stderr, "%s: Memory storage context c1 has %d statements, expected 2\n",
+            program, count);
+    errors++;
+  }
+
+  if(librdf_storage_context_remove_statement(storage, contexts[0], statement)) {
+    fprintf(stderr, "%s: Memory storage failed to remove from context c1\n",
+            program);
+    errors++;
+  }
+  if(!librdf_storage_context_remove_statement(storage, contexts[0], statement)) {
+    fprintf(stderr, "%s: Memory storage removed from context c1 twice\n",
+            program);
+    errors++;
+  }
+  if(!librdf_storage_contains_statement(storage, statement)) {
+    fprintf(stderr, "%s: Memory storage lost the statement in context c2\n",
+            program);
+    errors++;
+  }
+  errors+=test_storage_serialised(world, storage, program,
+                                  "after removing from c1", 3, removed_c1);
+  count=test_storage_count_stream(librdf_storage_context_as_stream(storage, contexts[0]));
+  if(count != 1) {
+    fprintf(stderr, "%s: Memory storage context c1 has %d statements, expected 1\n",
+            program, count);
+    errors++;
+  }
+
+  librdf_storage_context_remove_statement(storage, contexts[1], statement);
+  if(librdf_storage_contains_statement(storage, statement)) {
+    fprintf(stderr, "%s: Memory storage still contains a removed statement\n",
+            program);
+    errors++;
+  }
+  errors+=test_storage_serialised(world, storage, program,
+                                  "after removing from c2", 2, removed_c2);
+
+  librdf_storage_context_add_statement(storage, contexts[0], statement);
+  errors+=test_storage_serialised(world, storage, program, "after adding again",
+                                  3, readded);
+
+  librdf_free_statement(statement);
+  librdf_free_node(contexts[0]);
+  librdf_free_node(contexts[1]);
+  librdf_storage_close(storage);
+  librdf_free_storage(storage);
+
+  return errors;
+}
+
+/*
+ * Put borrowed target nodes from a hashes storage with borrow-nodes in
+ * a template statement that is copied and added to another storage,
+ * then move the iterator on and check the copies do not share them.
+ */
+static int
+test_storage_borrowed_nodes(librdf_world* world, const char *program)
+{
+  static const char* const objects[] = { "a", "b", NULL };
+  librdf_storage *storage, *copies;
+  librdf_node *subject, *predicate;
+  librdf_iterator* iterator;
+  librdf_statement* statement;
+  librdf_statement* copied[2];
+  librdf_statement template; /* on stack - not allocated */
+  int i;
+  int errors=0;
+
+  storage=librdf_new_storage(world, "hashes", "test-borrow",
+                             "hash-type='memory',write='yes',new='yes',borrow-nodes='yes'");
+  copies=librdf_new_storage(world, "memory", NULL, NULL);
+  if(!storage || !copies || librdf_storage_open(storage, NULL) ||
+     librdf_storage_open(copies, NULL)) {
+    fprintf(stderr, "%s: Failed to open storages for borrowed nodes\n",
+            program);
+    if(storage)
+      librdf_free_storage(storage);
+    if(copies)
+      librdf_free_storage(copies);
+    return 1;
+  }
+
+  subject=test_node(world, "s1");
+  predicate=test_node(world, "p3");
+  for(i=0; objects[i]; i++) {
+    statement=librdf_new_statement_from_nodes(world,
+                                              librdf_new_node_from_node(subject),
+                                              librdf_new_node_from_node(predicate),
+                                              librdf_new_node_from_literal(world, (const unsigned char*)objects[i], NULL, 0));
+    librdf_storage_add_statement(storage, statement);
+    librdf_free_statement(statement);
+  }
+
+  librdf_statement_init(world, &template);
+  template.subject=subject;
+  template.predicate=predicate;
+
+  iterator=librdf_storage_get_targets(storage, subject, predicate);
+  for(i=0; i < 2 && iterator && !librdf_iterator_end(iterator); i++) {
+    template.object=(librdf_node*)librdf_iterator_get_object(iterator);
+    copied[i]=librdf_new_statement_from_statement(&template);
+    librdf_storage_add_statement(copies, &template);
+    librdf_iterator_next(iterator);
+  }
+  if(iterator)
+    librdf_free_iterator(iterator);
+  if(i != 2) {
+    fprintf(stderr, "%s: Found %d borrowed targets, expected 2\n", program, i);
+    librdf_free_node(subject);
+    librdf_free_node(predicate);
+    librdf_free_storage(copies);
+    librdf_free_storage(storage);
+    return 1;
+  }
+
+  /* the iterator is gone, so copies sharing its nodes now differ */
+  for(i=0; i < 2; i++) {
+    const char* value;
+
+    value=(const char*)librdf_node_get_literal_value(librdf_statement_get_object(copied[i]));
+    if(!value || (strcmp(value, objects[0]) && strcmp(value, objects[1])) ||
+       !librdf_storage_contains_statement(copies, copied[i])) {
+      fprintf(stderr, "%s: Copy %d of a statement with a borrowed node changed\n",
+              program, i);
+      errors++;
+    }
+  }
+  if(librdf_statement_equals(copied[0], copied[1]) ||
+     librdf_storage_size(copies) != 2) {
+    fprintf(stderr, "%s: Copies of statements with borrowed nodes are shared\n",
+            program);
+    errors++;
+  }
+
+  librdf_free_statement(copied[0]);
+  librdf_free_statement(copied[1]);
+  librdf_free_node(subject);
+  librdf_free_node(predicate);
+  librdf_storage_close(copies);
+  librdf_free_storage(copies);
+  librdf_storage_close(storage);
+  librdf_free_storage(storage);
+
+  return errors;
+}
+
+#ifdef HAVE_MMAP_HASH
+/*
+ * Write a persistent hashes store with node encoding 2, with and
+ * without a node dictionary, then check reopening it without the
+ * option finds the stored statements and reopening it with another
+ * encoding or the other dictionary setting fails.
+ */
+static int
+test_storage_hashes_encoding(librdf_world* world, const char *program)
+{
+  static const char* const dictionary_options[] = { "no", "yes", NULL };
+  int test;
+  int errors=0;
+
+  for(test=0; dictionary_options[test]; test++) {
+    librdf_storage* storage;
+    librdf_statement* statement;
+    char options[128];
+    int reopen;
+    int i;
+
+    for(reopen=0; reopen < 4; reopen++) {
+      sprintf(options, "hash-type='mmap',dir='.',write='yes',new='%s',dictionary='%s'%s",
+              reopen ? "no" : "yes",
+              dictionary_options[(reopen == 3) ? !test : test],
+              (reopen == 1 || reopen == 3) ? "" :
+              (reopen ? ",node-encoding='1'" : ",node-encoding='2'"));
+      storage=librdf_new_storage(world, "hashes", "test-encoding", options);
+      if(!storage) {
+        fprintf(stderr, "%s: Failed to create hashes storage %s\n", program,
+                options);
+        errors++;
+        break;
+      }
+
+      if(librdf_storage_open(storage, NULL)) {
+        if(reopen < 2) {
+          fprintf(stderr, "%s: Failed to open hashes storage %s\n", program,
+                  options);
+          errors++;
+        }
+        librdf_free_storage(storage);
+        continue;
+      }
+
+      if(reopen >= 2) {
+        fprintf(stderr, "%s: Opened hashes storage %s with another %s\n",
+                program, options,
+                (reopen == 2) ? "node encoding" : "dictionary setting");
+        errors++;
+      } else if(!reopen) {
+        for(i=0; test_triples[i * 3]; i++) {
+          statement=test_triple_statement(world, i);
+          librdf_storage_add_statement(storage, statement);
+          librdf_free_statement(statement);
+        }
+      } else {
+        /* found, so not added again */
+        statement=test_triple_statement(world, 0);
+        if(!librdf_storage_contains_statement(storage, statement)) {
+          fprintf(stderr, "%s: Reopened hashes storage %s lost a statement\n",
+                  program, options);
+          errors++;
+        }
+        librdf_storage_add_statement(storage, statement);
+        librdf_free_statement(statement);
+        if(librdf_storage_size(storage) != 3) {
+          fprintf(stderr, "%s: Reopened hashes storage %s has size %d, expected 3\n",
+                  program, options, librdf_storage_size(storage));
+          errors++;
+        }
+      }
+
+      librdf_storage_close(storage);
+      librdf_free_storage(storage);
+    }
+  }
+
+  return errors;
+}
+#endif
+
+#ifdef STORAGE_TREES
+/* generated statement n of test_storage_trees_btree: subject n/20,
+ * predicate n%7 and object n%20 so every n gives a different triple */
+#define TEST_TREES_COUNT 20000
+#define TEST_TREES_SUBJECT(n) ((n) / 20)
+#define TEST_TREES_PREDICATE(n) ((n) % 7)
+#define TEST_TREES_OBJECT(n) ((n) % 20)
+/* statement numbers in an order unrelated to the index orders */
+#define TEST_TREES_SCRAMBLE(n) ((int)(((long)(n) * 7919) % TEST_TREES_COUNT))
+
+/* test_storage_trees_check patterns: parts are -1 for any, group is
+ * the part that results must have contiguous (0 s, 1 p, 2 o) or -1 */
+static const struct {
+  int s;
+  int p;
+  int o;
+  int group;
+} test_trees_patterns[] = {
+  { -1, -1, -1, 0 },
+  { 7, -1, -1, 1 },
+  { 999, -1, -1, 1 },
+  { -1, 3, -1, 0 },
+  { -1, -1, 5, -1 },
+  { 42, -1, 2, -1 },
+  { -1, 4, 11, 0 },
+  { 10, 3, -1, 2 },
+  { 11, 5, 9, -1 },
+  { -2, -2, -2, -2 }
+};
+
+
+static librdf_node*
+test_trees_node(librdf_world* world, char part, int number)
+{
+  char name[16];
+
+  if(number < 0)
+    return NULL;
+
+  sprintf(name, "%c%d", part, number);
+  return test_node(world, name);
+}
+
+
+static librdf_statement*
+test_trees_statement(librdf_world* world, int s, int p, int o)
+{
+  return librdf_new_statement_from_nodes(world,
+                                         test_trees_node(world, 's', s),
+                                         test_trees_node(world, 'p', p),
+                                         test_trees_node(world, 'o', o));
+}
+
+
+/* number of a node made by test_trees_node */
+static int
+test_trees_node_number(librdf_node* node)
+{
+  const char* uri=(const char*)librdf_uri_as_string(librdf_node_get_uri(node));
+
+  return atoi(uri + strlen(TEST_NS) + 1);
+}
+
+
+/*
+ * Check the size of @storage, whether it contains a sample of the
+ * statements that are and are not in @live, and the statements found
+ * for each of test_trees_patterns.  Index order is by node id so only
+ * the grouping of results is checked, not their order.
+ */
+static int
+test_storage_trees_check(librdf_world* world, librdf_storage* storage,
+                         const char *program, const char *options,
+                         const char* live, int count)
+{
+  int* seen;
+  int size=0;
+  int errors=0;
+  int i, n;
+
+  seen=(int*)calloc(TEST_TREES_COUNT, sizeof(int));
+  if(!seen)
+    return 1;
+
+  for(n=0; n < count; n++)
+    size+=live[n];
+  i=librdf_storage_size(storage);
+  if(i != size) {
+    fprintf(stderr, "%s: Trees %s has size %d, expected %d\n",
+            program, options, i, size);
+    errors++;
+  }
+
+  for(n=0; n < count; n+=97) {
+    librdf_statement* statement;
+
+    statement=test_trees_statement(world, TEST_TREES_SUBJECT(n),
+                                   TEST_TREES_PREDICATE(n),
+                                   TEST_TREES_OBJECT(n));
+    if(!librdf_storage_contains_statement(storage, statement) != !live[n]) {
+      fprintf(stderr, "%s: Trees %s contains statement %d is %d, expected %d\n",
+              program, options, n, !live[n], live[n]);
+      errors++;
+    }
+    librdf_free_statement(statement);
+  }
+
+  for(i=0; test_trees_patterns[i].group >= -1; i++) {
+    librdf_statement* statement;
+    librdf_stream* stream;
+    int expected=0;
+    int found=0;
+    int group=-1;
+
+    for(n=0; n < count; n++) {
+      if(live[n] &&
+         (test_trees_patterns[i].s < 0 ||
+          test_trees_patterns[i].s == TEST_TREES_SUBJECT(n)) &&
+         (test_trees_patterns[i].p < 0 ||
+          test_trees_patterns[i].p == TEST_TREES_PREDICATE(n)) &&
+         (test_trees_patterns[i].o < 0 ||
+          test_trees_patterns[i].o == TEST_TREES_OBJECT(n)))
+        expected++;
+    }
+
+    statement=test_trees_statement(world, test_trees_patterns[i].s,
+                                   test_trees_patterns[i].p,
+                                   test_trees_patterns[i].o);
+    stream=librdf_storage_find_statements(storage, statement);
+    for(; stream && !librdf_stream_end(stream); librdf_stream_next(stream)) {
+      librdf_statement* match=librdf_stream_get_object(stream);
+      librdf_node* part;
+      int number;
+
+      found++;
+      if(!librdf_statement_match(match, statement)) {
+        fprintf(stderr, "%s: Trees %s pattern %d returned a non-matching statement\n",
+                program, options, i);
+        errors++;
+        break;
+      }
+
+      if(test_trees_patterns[i].group < 0)
+        continue;
+
+      if(!test_trees_patterns[i].group)
+        part=librdf_statement_get_subject(match);
+      else if(test_trees_patterns[i].group == 1)
+        part=librdf_statement_get_predicate(match);
+      else
+        part=librdf_statement_get_object(match);
+      number=test_trees_node_number(part);
+      if(number == group)
+        continue;
+
+      /* a new group must not have been seen in this pattern before */
+      if(seen[number] == i + 1) {
+        fprintf(stderr, "%s: Trees %s pattern %d returned %c%d out of order\n",
+                program, options, i, "spo"[test_trees_patterns[i].group],
+                number);
+        errors++;
+        break;
+      }
+      seen[number]=i + 1;
+      group=number;
+    }
+    if(stream)
+      librdf_free_stream(stream);
+    librdf_free_statement(statement);
+
+    if(found != expected) {
+      fprintf(stderr, "%s: Trees %s pattern %d found %d statements, expected %d\n",
+              program, options, i, found, expected);
+      errors++;
+    }
+  }
+
+  free(seen);
+
+  return errors;
+}
+
+
+/*
+ * Check the trees indexes feature of @storage lists the orders in
+ * @expected.
+ */
+static int
+test_storage_trees_indexes(librdf_world* world, librdf_storage* storage,
+                           const char *program, const char *expected)
+{
+  librdf_uri* feature;
+  librdf_node* value;
+  const char* indexes=NULL;
+  int errors=0;
+
+  feature=librdf_new_uri(world, (const unsigned char*)"http://feature.librdf.org/storage-trees-indexes");
+  value=librdf_storage_get_feature(storage, feature);
+  librdf_free_uri(feature);
+  if(value)
+    indexes=(const char*)librdf_node_get_literal_value(value);
+
+  if(!indexes || strcmp(indexes, expected)) {
+    fprintf(stderr, "%s: Trees indexes are '%s', expected '%s'\n", program,
+            indexes ? indexes : "(none)", expected);
+    errors++;
+  }
+
+  if(value)
+    librdf_free_node(value);
+
+  return errors;
+}
+
+/* option sets of test_storage_trees_btree */
+static const char* const test_trees_btree_options[] = {
+  "index-type='btree'",
+  "index-type='btree',index-spo='yes'",
+  "index-type='btree',index-ops='yes'",
+  "index-type='btree',index-sop='yes',index-pso='yes'",
+  "index-type='btree',contexts='yes'",
+  NULL
+};
+
+
+/*
+ * Add enough statements to btree indexes to split leaves and branches
+ * many times, remove them in another order until the store is empty
+ * then add some back, checking the store after each step.
+ */
+static int
+test_storage_trees_btree(librdf_world* world, const char *program)
+{
+  librdf_storage* storage;
+  char* live;
+  int test;
+  int errors=0;
+
+  storage=librdf_new_storage(world, "trees", NULL,
+                             "index-type='unknown',contexts='yes'");
+  if(storage) {
+    fprintf(stderr, "%s: Trees accepted an unknown index-type\n", program);
+    librdf_free_storage(storage);
+    errors++;
+  }
+
+  live=(char*)calloc(TEST_TREES_COUNT, 1);
+  if(!live)
+    return errors + 1;
+
+  for(test=0; test_trees_btree_options[test]; test++) {
+    const char* options=test_trees_btree_options[test];
+    int step, n;
+    int removing;
+
+    storage=librdf_new_storage(world, "trees", NULL, options);
+    if(!storage) {
+      fprintf(stderr, "%s: Failed to create trees storage %s\n", program,
+              options);
+      errors++;
+      continue;
+    }
+
+    memset(live, 0, TEST_TREES_COUNT);
+    for(step=0; step < 4; step++) {
+      removing=(step == 1 || step == 2);
+      for(n=0; n < TEST_TREES_COUNT; n++) {
+        /* add all, remove half, remove the rest, add a tenth back;
+         * each in an order unrelated to the index orders */
+        int m=(int)(((long)n * ((step & 1) ? 4999 : 7919)) % TEST_TREES_COUNT);
+        librdf_statement* statement;
+        int rc;
+
+        if(step == 1 && n == TEST_TREES_COUNT / 2)
+          break;
+        if(step == 3 && n == TEST_TREES_COUNT / 10)
+          break;
+        if(live[m] == !removing)
+          continue;
+
+        statement=test_trees_statement(world, TEST_TREES_SUBJECT(m),
+                                       TEST_TREES_PREDICATE(m),
+                                       TEST_TREES_OBJECT(m));
+        if(removing)
+          rc=librdf_storage_remove_statement(storage, statement);
+        else
+          rc=librdf_storage_add_statement(storage, statement);
+        librdf_free_statement(statement);
+        if(rc) {
+          fprintf(stderr, "%s: Trees %s failed to %s statement %d\n",
+                  program, options, removing ? "remove" : "add", m);
+          errors++;
+        }
+        live[m]=!removing;
+      }
+
+      errors+=test_storage_trees_check(world, storage, program, options,
+                                       live, TEST_TREES_COUNT);
+    }
+
+    librdf_storage_close(storage);
+    librdf_free_storage(storage);
+  }
+
+  free(live);
+
+  return errors;
+}
+
+/* stream of generated test_trees_statement statements, in the order of
+ * their numbers which may repeat */
+typedef struct {
+  librdf_world* world;
+  const int* numbers;
+  int count;
+  int index;
+  librdf_statement* statement; /* current or NULL before it is got */
+} test_trees_stream_context;
+
+
+static int
+test_trees_stream_end(void* context)
+{
+  test_trees_stream_context* scontext=(test_trees_stream_context*)context;
+
+  return scontext->index >= scontext->count;
+}
+
+
+static int
+test_trees_stream_next(void* context)
+{
+  test_trees_stream_context* scontext=(test_trees_stream_context*)context;
+
+  if(scontext->statement) {
+    librdf_free_statement(scontext->statement);
+    scontext->statement=NULL;
+  }
+  scontext->index++;
+
+  return test_trees_stream_end(context);
+}
+
+
+static void*
+test_trees_stream_get(void* context, int flags)
+{
+  test_trees_stream_context* scontext=(test_trees_stream_context*)context;
+  int n;
+
+  if(flags != LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT ||
+     test_trees_stream_end(context))
+    return NULL;
+
+  if(!scontext->statement) {
+    n=scontext->numbers[scontext->index];
+    scontext->statement=test_trees_statement(scontext->world,
+                                             TEST_TREES_SUBJECT(n),
+                                             TEST_TREES_PREDICATE(n),
+                                             TEST_TREES_OBJECT(n));
+  }
+
+  return scontext->statement;
+}
+
+
+static void
+test_trees_stream_finished(void* context)
+{
+  test_trees_stream_context* scontext=(test_trees_stream_context*)context;
+
+  if(scontext->statement)
+    librdf_free_statement(scontext->statement);
+  free(scontext);
+}
+
+
+static librdf_stream*
+test_trees_stream(librdf_world* world, const int* numbers, int count)
+{
+  test_trees_stream_context* scontext;
+  librdf_stream* stream;
+
+  scontext=(test_trees_stream_context*)calloc(1, sizeof(*scontext));
+  if(!scontext)
+    return NULL;
+  scontext->world=world;
+  scontext->numbers=numbers;
+  scontext->count=count;
+
+  stream=librdf_new_stream(world, scontext, test_trees_stream_end,
+                           test_trees_stream_next, test_trees_stream_get,
+                           test_trees_stream_finished);
+  if(!stream)
+    free(scontext);
+
+  return stream;
+}
+
+
+/* option sets of test_storage_trees_load */
+static const char* const test_trees_load_options[] = {
+  "index-type='avl'",
+  "index-type='btree'",
+  "index-type='btree',index-ops='yes'",
+  "index-type='btree',contexts='yes'",
+  NULL
+};
+
+
+/*
+ * Add statements to trees stores with add_statements: first a batch
+ * larger than the indexes, which are rebuilt from it, then a smaller
+ * one that is inserted.  Both batches repeat statements within the
+ * batch and statements already in the store.
+ */
+static int
+test_storage_trees_load(librdf_world* world, const char *program)
+{
+  char* live;
+  int* numbers;
+  int test;
+  int errors=0;
+
+  live=(char*)calloc(TEST_TREES_COUNT, 1);
+  numbers=(int*)calloc(TEST_TREES_COUNT, sizeof(int));
+  if(!live || !numbers) {
+    if(live)
+      free(live);
+    return 1;
+  }
+
+  for(test=0; test_trees_load_options[test]; test++) {
+    const char* options=test_trees_load_options[test];
+    librdf_storage* storage;
+    librdf_stream* stream;
+    int step, n;
+
+    storage=librdf_new_storage(world, "trees", NULL, options);
+    if(!storage) {
+      fprintf(stderr, "%s: Failed to create trees storage %s\n", program,
+              options);
+      errors++;
+      continue;
+    }
+
+    memset(live, 0, TEST_TREES_COUNT);
+
+    /* 2000 one at a time */
+    for(n=0; n < 2000; n++) {
+      int m=TEST_TREES_SCRAMBLE(n);
+      librdf_statement* statement;
+
+      statement=test_trees_statement(world, TEST_TREES_SUBJECT(m),
+                                     TEST_TREES_PREDICATE(m),
+                                     TEST_TREES_OBJECT(m));
+      if(librdf_storage_add_statement(storage, statement)) {
+        fprintf(stderr, "%s: Trees %s failed to add statement %d\n",
+                program, options, m);
+        errors++;
+      }
+      librdf_free_statement(statement);
+      live[m]=1;
+    }
+
+    for(step=0; step < 2; step++) {
+      /* 3000 new statements twice with 1000 old ones, then 500 new
+       * twice with 100 old ones */
+      int first=step ? 5000 : 2000;
+      int last=step ? 5500 : 5000;
+      int count=0;
+
+      for(n=first; n < last; n++)
+        numbers[count++]=TEST_TREES_SCRAMBLE(n);
+      for(n=0; n < (last - first) / 3; n++)
+        numbers[count++]=TEST_TREES_SCRAMBLE(n);
+      for(n=last - 1; n >= first; n--)
+        numbers[count++]=TEST_TREES_SCRAMBLE(n);
+
+      for(n=0; n < count; n++)
+        live[numbers[n]]=1;
+
+      stream=test_trees_stream(world, numbers, count);
+      if(!stream || librdf_storage_add_statements(storage, stream)) {
+        fprintf(stderr, "%s: Trees %s failed to add %d statements at once\n",
+                program, options, count);
+        errors++;
+      }
+      if(stream)
+        librdf_free_stream(stream);
+
+      errors+=test_storage_trees_check(world, storage, program, options,
+                                       live, TEST_TREES_COUNT);
+    }
+
+    librdf_storage_close(storage);
+    librdf_free_storage(storage);
+  }
+
+  free(numbers);
+  free(live);
+
+  return errors;
+}
+#endif
+
+/* triples of arguments to librdf_new_storage for the benchmark */
+static const char* const bench_storages[] = {
+  "hashes", NULL, "hash-type='memory'",
+  "hashes", NULL, "hash-type='memory2'",
+  "trees", NULL, "index-type='avl'",
+  "trees", NULL, "index-type='btree'",
+#ifdef HAVE_BDB_HASH
+  "hashes", "bench", "hash-type='bdb',dir='.',write='yes',new='yes'",
+  "hashes", "bench", "hash-type='bdb',dir='.',write='yes',new='yes',bulk-read='no'",
+#endif
+  NULL, NULL, NULL
+};
+
+
+/* hashes made by the hashes storage, for removing the benchmark files */
+static const char* const bench_hash_names[] = {
+  "sp2o", "po2s", "so2p", "p2so", "s2po", "o2sp", "contexts", "n2id", "id2n",
+  NULL
+};
+
+
+/*
+ * Remove the files of benchmark storage @name, if it has any, with the
+ * Bloom filters saved next to them.
+ */
+static void
+bench_remove_files(const char *name)
+{
+  char file[128];
+  int i;
+
+  if(!name)
+    return;
+
+  for(i=0; bench_hash_names[i]; i++) {
+    sprintf(file, "%s-%s.db", name, bench_hash_names[i]);
+    remove(file);
+    sprintf(file, "%s-%s.bloom", name, bench_hash_names[i]);
+    remove(file);
+  }
+}
+
+
+static double
+bench_seconds(clock_t start)
+{
+  return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+
+/*
+ * Time get_targets over one subject and predicate with @count objects,
+ * which reads many values of one hash key.
+ */
+static int
+test_storage_bench_fanout(librdf_world* world, const char *program,
+                          librdf_storage* storage, int count)
+{
+  librdf_node *s, *p;
+  clock_t start;
+  double secs;
+  int n, pass;
+  long found=0;
+  const int passes=5;
+
+  s=librdf_new_node_from_uri_string(world, (const unsigned char*)TEST_NS "fanout");
+  p=librdf_new_node_from_uri_string(world, (const unsigned char*)TEST_NS "value");
+
+  for(n=0; n<count; n++) {
+    char buf[64];
+    librdf_statement* statement;
+
+    sprintf(buf, "fanout value %d", n);
+    statement=librdf_new_statement_from_nodes(world,
+                                              librdf_new_node_from_node(s),
+                                              librdf_new_node_from_node(p),
+                                              librdf_new_node_from_literal(world, (const unsigned char*)buf, NULL, 0));
+    librdf_storage_add_statement(storage, statement);
+    librdf_free_statement(statement);
+  }
+
+  start=clock();
+  for(pass=0; pass<passes; pass++) {
+    librdf_iterator* iterator=librdf_storage_get_targets(storage, s, p);
+
+    if(!iterator) {
+      fprintf(stderr, "%s: Failed to get fanout targets\n", program);
+      break;
+    }
+    while(!librdf_iterator_end(iterator)) {
+      if(librdf_iterator_get_object(iterator))
+        found++;
+      librdf_iterator_next(iterator);
+    }
+    librdf_free_iterator(iterator);
+  }
+  secs=bench_seconds(start);
+
+  fprintf(stdout, "%s: get_targets of %d objects %d times in %.3fs (%.0f/s)\n",
+          program, count, passes, secs, (secs > 0) ? found / secs : 0.0);
+
+  librdf_free_node(s);
+  librdf_free_node(p);
+
+  if(found != (long)count * passes) {
+    fprintf(stderr, "%s: Found %ld of %ld fanout targets\n", program,
+            found, (long)count * passes);
+    return 1;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Time loading @count statements from a stream into a new storage of
+ * each benchmark type, adding them one at a time and then all at once
+ * with librdf_storage_add_statements.
+ */
+static int
+test_storage_bench_load(librdf_world* world, const char *program, int count)
+{
+  librdf_storage* source;
+  int test, n;
+
+  source=librdf_new_storage(world, "memory", NULL, NULL);
+  if(!source) {
+    fprintf(stderr, "%s: Failed to create memory storage\n", program);
+    return 1;
+  }
+
+  for(n=0; n<count; n++) {
+    char buf[64];
+    librdf_node *s, *p, *o;
+    librdf_statement* statement;
+
+    /* subjects out of order so the load is not presorted */
+    sprintf(buf, "%ssubject/%ld", TEST_NS, ((long)n * 7919) % count / 10);
+    s=librdf_new_node_from_uri_string(world, (const unsigned char*)buf);
+    sprintf(buf, "%spredicate/%d", TEST_NS, n % 7);
+    p=librdf_new_node_from_uri_string(world, (const unsigned char*)buf);
+    sprintf(buf, "literal value %d", n);
+    o=librdf_new_node_from_literal(world, (const unsigned char*)buf, NULL, 0);
+    statement=librdf_new_statement_from_nodes(world, s, p, o);
+    librdf_storage_add_statement(source, statement);
+    librdf_free_statement(statement);
+  }
+
+  for(test=0; bench_storages[test]; test+=3) {
+    int bulk;
+
+    for(bulk=0; bulk<2; bulk++) {
+      librdf_storage* storage;
+      librdf_stream* stream;
+      clock_t start;
+      double secs;
+      int size;
+
+      storage=librdf_new_storage(world, bench_storages[test],
+                                 bench_storages[test+1],
+                                 bench_storages[test+2]);
+      if(!storage) {
+        fprintf(stderr, "%s: Failed to create storage %s %s\n", program,
+                bench_storages[test], bench_storages[test+2]);
+        bench_remove_files(bench_storages[test+1]);
+        librdf_free_storage(source);
+        return 1;
+      }
+
+      start=clock();
+      stream=librdf_storage_serialise(source);
+      if(bulk)
+        librdf_storage_add_statements(storage, stream);
+      else {
+        for(; !librdf_stream_end(stream); librdf_stream_next(stream))
+          librdf_storage_add_statement(storage, librdf_stream_get_object(stream));
+      }
+      librdf_free_stream(stream);
+      secs=bench_seconds(start);
+
+      size=librdf_storage_size(storage);
+      fprintf(stdout, "%s: %s %s: loaded %d statements %s in %.3fs (%.0f/s)\n",
+              program, bench_storages[test], bench_storages[test+2], count,
+              bulk ? "at once" : "one at a time", secs,
+              (secs > 0) ? count / secs : 0.0);
+      if(size >= 0 && size != count)
+        fprintf(stderr, "%s: Loaded storage has %d of %d statements\n",
+                program, size, count);
+
+      librdf_free_storage(storage);
+      bench_remove_files(bench_storages[test+1]);
+    }
+  }
+
+  librdf_free_storage(source);
+
+  return 0;
+}
+
+
+/*
+ * Time adding, finding and removing @count generated statements with
+ * 1 in 10 subjects and 1 in 7 predicates repeated, which is roughly the
+ * shape of real data, then get_targets over @count objects of one
+ * subject, then the load times of test_storage_bench_load.
+ * Run as: rdf_storage_test -b [count]
+ */
+static int
+test_storage_bench(librdf_world* world, const char *program, int count)
+{
+  int test;
+
+  for(test=0; bench_storages[test]; test+=3) {
+    librdf_storage* storage;
+    clock_t start;
+    double secs;
+    int pass, n;
+    int found=0;
+
+    storage=librdf_new_storage(world, bench_storages[test],
+                               bench_storages[test+1],
+                               bench_storages[test+2]);
+    if(!storage) {
+      fprintf(stderr, "%s: Failed to create storage %s %s\n", program,
+              bench_storages[test], bench_storages[test+2]);
+      bench_remove_files(bench_storages[test+1]);
+      return 1;
+    }
+
+    for(pass=0; pass<3; pass++) {
+      start=clock();
+
+      for(n=0; n<count; n++) {
+        char buf[64];
+        librdf_statement* statement;
+        librdf_node *s, *p, *o;
+
+        sprintf(buf, "%ssubject/%d", TEST_NS, n / 10);
+        s=librdf_new_node_from_uri_string(world, (const unsigned char*)buf);
+        sprintf(buf, "%spredicate/%d", TEST_NS, n % 7);
+        p=librdf_new_node_from_uri_string(world, (const unsigned char*)buf);
+        sprintf(buf, "literal value %d", n);
+        o=librdf_new_node_from_literal(world, (const unsigned char*)buf,
+                                       NULL, 0);
+        statement=librdf_new_statement_from_nodes(world, s, p, o);
+
+        if(pass == 0)
+          librdf_storage_add_statement(storage, statement);
+        else if(pass == 1)
+          found += librdf_storage_contains_statement(storage, statement);
+        else
+          librdf_storage_remove_statement(storage, statement);
+
+        librdf_free_statement(statement);
+      }
+
+      secs=bench_seconds(start);
+      fprintf(stdout, "%s: %s %s: %s %d statements in %.3fs (%.0f/s)\n",
+              program, bench_storages[test], bench_storages[test+2],
+              (pass == 0) ? "added" : ((pass == 1) ? "checked" : "removed"),
+              count, secs, (secs > 0) ? count / secs : 0.0);
+    }
+
+    if(found != count)
+      fprintf(stderr, "%s: Found %d of %d added statements\n", program,
+              found, count);
+
+    if(test_storage_bench_fanout(world, program, storage, count)) {
+      librdf_free_storage(storage);
+      bench_remove_files(bench_storages[test+1]);
+      return 1;
+    }
+
+    librdf_free_storage(storage);
+    bench_remove_files(bench_storages[test+1]);
+  }
+
+  return test_storage_bench_load(world, program, count);
+}
+
+
 int
 main(int argc, char *argv[]) 
 {
@@ -2004,8 +3366,14 @@ main(int argc, char *argv[])
 #else
 	"hashes", "test", "hash-type='memory',write='yes',new='yes',contexts='yes'",
 #endif
+	"hashes", "test-idx", "hash-type='memory',write='yes',new='yes',index-predicates='yes',index-subjects='yes',index-objects='yes'",
+	"hashes", "test-dict", "hash-type='memory',write='yes',new='yes',contexts='yes',dictionary='yes'",
+	"hashes", "test-enc2", "hash-type='memory',write='yes',new='yes',contexts='yes',node-encoding='2'",
     #ifdef STORAGE_TREES
 	    "trees", "test", "contexts='yes'",
+	    "trees", "test-btree", "index-type='btree',contexts='yes'",
+	    "trees", "test-build", "index-spo='yes',index-build='1',contexts='yes'",
+	    "trees", "test-build-btree", "index-type='btree',index-spo='yes',index-build='1',contexts='yes'",
     #endif
     #ifdef STORAGE_FILE
       "file", "file://../redland.rdf", NULL,
@@ -2028,10 +3396,20 @@ main(int argc, char *argv[])
 
   int test = 0;
   int ret  = 0;
+#ifdef STORAGE_TREES
+  int build;
+#endif
   
   world=librdf_new_world();
   librdf_world_open(world);
 
+  if(argc > 1 && !strcmp(argv[1], "-b")) {
+    ret=test_storage_bench(world, program,
+                           (argc > 2) ? atoi(argv[2]) : 100000);
+    librdf_free_world(world);
+    return ret;
+  }
+
   for ( ; storages[test] != NULL; test += 3) {
 
     fprintf(stdout, "%s: Creating storage %s\n", program, storages[test]);
@@ -2055,7 +3433,29 @@ main(int argc, char *argv[])
     }
 
 
-    /* Can do nothing here since need model and storage working */
+    /* Only modify storages that are private to this test */
+    if(!strcmp(storages[test], "memory") ||
+       !strcmp(storages[test], "hashes") ||
+       !strcmp(storages[test], "trees")) {
+#ifdef STORAGE_TREES
+      /* the first query wanting each missing index builds it */
+      build=(storages[test+1] && !strncmp(storages[test+1], "test-build", 10));
+      if(build)
+        ret += test_storage_trees_indexes(world, storage, program, "spo");
+#endif
+
+      fprintf(stdout, "%s: Finding statements\n", program);
+      ret += test_storage_find_statements(world, storage, program);
+
+#ifdef STORAGE_TREES
+      if(build)
+        ret += test_storage_trees_indexes(world, storage, program,
+                                          "spo sop ops pso");
+#endif
+
+      fprintf(stdout, "%s: Checking contexts\n", program);
+      ret += test_storage_contexts(world, storage, program);
+    }
 
     fprintf(stdout, "%s: Closing storage\n", program);
     librdf_storage_close(storage);
@@ -2064,7 +3464,25 @@ main(int argc, char *argv[])
     librdf_free_storage(storage);
 
   }
-  
+
+#ifdef HAVE_MMAP_HASH
+  fprintf(stdout, "%s: Checking hashes storage node encodings\n", program);
+  ret += test_storage_hashes_encoding(world, program);
+#endif
+
+  fprintf(stdout, "%s: Checking borrowed nodes\n", program);
+  ret += test_storage_borrowed_nodes(world, program);
+
+  fprintf(stdout, "%s: Checking memory storage contexts\n", program);
+  ret += test_storage_memory_contexts(world, program);
+
+#ifdef STORAGE_TREES
+  fprintf(stdout, "%s: Checking trees btree indexes\n", program);
+  ret += test_storage_trees_btree(world, program);
+
+  fprintf(stdout, "%s: Checking trees bulk loading\n", program);
+  ret += test_storage_trees_load(world, program);
+#endif
 
   librdf_free_world(world);
   
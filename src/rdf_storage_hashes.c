@@ -42,6 +42,7 @@
 
 #include <redland.h>
 #include <rdf_storage.h>
+#include <rdf_types.h>
 
 
 typedef struct 
@@ -65,13 +66,46 @@ static const librdf_hash_descriptor librdf_storage_hashes_descriptions[]= {
   {"p2so", 
    LIBRDF_STATEMENT_PREDICATE,
    LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_OBJECT},  /* For '(?, p, ?)' */
+  {"s2po",
+   LIBRDF_STATEMENT_SUBJECT,
+   LIBRDF_STATEMENT_PREDICATE|LIBRDF_STATEMENT_OBJECT},  /* For '(s, ?, ?)' */
+  {"o2sp",
+   LIBRDF_STATEMENT_OBJECT,
+   LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_PREDICATE},  /* For '(?, ?, o)' */
   {"contexts",
    0L, /* for contexts - do not touch when storing statements! */
    0L},
+  {"n2id",
+   0L, /* node dictionary: encoded node -> node ID */
+   0L},
+  {"id2n",
+   0L, /* node dictionary: node ID -> encoded node */
+   0L},
   {NULL,0L,0L}
 };
 
 
+/* Size of a node ID in the node dictionary.  IDs are stored big-endian
+ * so that ordered hashes keep them in allocation order.
+ */
+#define LIBRDF_STORAGE_HASHES_ID_SIZE 8
+
+/* Node IDs are reserved in blocks of this many so that the stored
+ * allocation counter need not be rewritten for every new node.
+ */
+#define LIBRDF_STORAGE_HASHES_ID_RESERVE 1024
+
+/* id2n hash key holding the first node ID not yet reserved */
+#define LIBRDF_STORAGE_HASHES_NEXT_ID_KEY "next-id"
+
+/* Number of statements add_statements encodes before writing them to
+ * the hashes with one batched call per hash, and the initial size of
+ * the buffer holding their encoded keys and values.
+ */
+#define LIBRDF_STORAGE_HASHES_BATCH_SIZE 256
+#define LIBRDF_STORAGE_HASHES_BATCH_BUFFER_SIZE 65536
+
+
 static const librdf_hash_descriptor*
 librdf_storage_get_hash_description_by_name(const char *name) 
 {
@@ -121,19 +155,60 @@ typedef struct
 
   int all_statements_hash_index;
 
+  /* If this is non-0, nodes are stored once in a node dictionary and
+   * the statement hashes hold tuples of fixed-width node IDs */
+  int dictionary;
+  int node2id_index;
+  int id2node_index;
+  u64 next_id;     /* next unused node ID */
+  u64 reserved_id; /* IDs below this are reserved in the id2n hash */
+
+  /* librdf_node_encode_version() version of nodes in keys and values */
+  int node_encoding;
+  /* non-0 if the node-encoding option was given */
+  int node_encoding_given;
+
+  /* If this is non-0, node iterators may return borrowed nodes */
+  int borrow_nodes;
+
   /* growing buffers used to en/decode keys/values */
   unsigned char *key_buffer;
   size_t key_buffer_len;
   unsigned char *value_buffer;
   size_t value_buffer_len;
+  unsigned char *node_buffer;
+  size_t node_buffer_len;
+  /* scratch buffer holding the encoded parts of one statement */
+  unsigned char *parts_buffer;
+  size_t parts_buffer_len;
+  /* buffer holding the keys and values of a batch of statements */
+  unsigned char *batch_buffer;
+  size_t batch_buffer_len;
 } librdf_storage_hashes_instance;
 
 
+/* Statement subject, predicate, object and context each encoded once
+ * into the instance parts_buffer; a length of 0 marks an absent part.
+ */
+typedef struct
+{
+  unsigned char *buffer;
+  size_t offset[4];
+  size_t len[4];
+  size_t total_len;
+} librdf_storage_hashes_parts;
+
+
 
 /* helper function for implementing init and clone methods */
 static int librdf_storage_hashes_register(librdf_storage *storage, const char *name, const librdf_hash_descriptor *source_desc);
 static int librdf_storage_hashes_init_common(librdf_storage* storage, const char *name, char *hash_type, char *db_dir, char *indexes, int mode, int is_writable, int is_new, librdf_hash* options);
 
+/* node dictionary */
+static int librdf_storage_hashes_dictionary_open(librdf_storage* storage);
+static int librdf_storage_hashes_stored_encoding(librdf_storage* storage);
+static int librdf_storage_hashes_stored_dictionary(librdf_storage* storage);
+
 
 /* prototypes for local functions */
 static int librdf_storage_hashes_init(librdf_storage* storage, const char *name, librdf_hash* options);
@@ -144,6 +219,7 @@ static int librdf_storage_hashes_close(librdf_storage* storage);
 static int librdf_storage_hashes_size(librdf_storage* storage);
 static int librdf_storage_hashes_add_statement(librdf_storage* storage, librdf_statement* statement);
 static int librdf_storage_hashes_add_statements(librdf_storage* storage, librdf_stream* statement_stream);
+static int librdf_storage_hashes_add_statements_one(librdf_storage* storage, librdf_stream* statement_stream);
 static int librdf_storage_hashes_remove_statement(librdf_storage* storage, librdf_statement* statement);
 static int librdf_storage_hashes_contains_statement(librdf_storage* storage, librdf_statement* statement);
 static librdf_stream* librdf_storage_hashes_serialise(librdf_storage* storage);
@@ -242,7 +318,11 @@ librdf_storage_hashes_init_common(librdf_storage* storage, const char *name,
   int i;
   int status=0;
   int index_predicates=0;
+  int index_subjects=0;
+  int index_objects=0;
   int index_contexts=0;
+  int dictionary=0;
+  int node_encoding;
   int hash_count=0;
   
   context = LIBRDF_CALLOC(librdf_storage_hashes_instance*, 1, sizeof(*context));
@@ -278,6 +358,40 @@ librdf_storage_hashes_init_common(librdf_storage* storage, const char *name,
   if(index_predicates)
     hash_count++;
 
+  if((index_subjects=librdf_hash_get_as_boolean(options, "index-subjects"))<0)
+    index_subjects=0; /* default is NO index on subjects */
+
+  if(index_subjects)
+    hash_count++;
+
+  if((index_objects=librdf_hash_get_as_boolean(options, "index-objects"))<0)
+    index_objects=0; /* default is NO index on objects */
+
+  if(index_objects)
+    hash_count++;
+
+  if((dictionary=librdf_hash_get_as_boolean(options, "dictionary"))<0)
+    dictionary=0; /* default is to store encoded nodes in every hash */
+  context->dictionary=dictionary;
+
+  /* default is to return nodes that can be kept */
+  context->borrow_nodes=(librdf_hash_get_as_boolean(options, "borrow-nodes") > 0);
+
+  if(dictionary)
+    hash_count+=2;
+
+  node_encoding=LIBRDF_GOOD_CAST(int, librdf_hash_get_as_long(options, "node-encoding"));
+  context->node_encoding_given=(node_encoding >= 0);
+  if(node_encoding < 0)
+    node_encoding=1; /* default is the encoding older stores were written with */
+  if(node_encoding != 1 && node_encoding != 2) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "Unknown node-encoding %d", node_encoding);
+    if(context->name)
+      LIBRDF_FREE(char*, context->name);
+    return 1;
+  }
+  context->node_encoding=node_encoding;
 
   /* Start allocating the arrays */
   context->hashes = LIBRDF_CALLOC(librdf_hash**,
@@ -321,9 +435,25 @@ librdf_storage_hashes_init_common(librdf_storage* storage, const char *name,
     status=librdf_storage_hashes_register(storage, name,
                                           librdf_storage_get_hash_description_by_name("p2so"));
 
+  if(index_subjects && !status)
+    status=librdf_storage_hashes_register(storage, name,
+                                          librdf_storage_get_hash_description_by_name("s2po"));
+
+  if(index_objects && !status)
+    status=librdf_storage_hashes_register(storage, name,
+                                          librdf_storage_get_hash_description_by_name("o2sp"));
+
   if(index_contexts && !status)
-    librdf_storage_hashes_register(storage, name,
-                                   librdf_storage_get_hash_description_by_name("contexts"));
+    status=librdf_storage_hashes_register(storage, name,
+                                          librdf_storage_get_hash_description_by_name("contexts"));
+
+  if(dictionary && !status) {
+    status=librdf_storage_hashes_register(storage, name,
+                                          librdf_storage_get_hash_description_by_name("n2id"));
+    if(!status)
+      status=librdf_storage_hashes_register(storage, name,
+                                            librdf_storage_get_hash_description_by_name("id2n"));
+  }
 
 
   /* find indexes for get targets, sources and arcs */
@@ -333,6 +463,9 @@ librdf_storage_hashes_init_common(librdf_storage* storage, const char *name,
   context->p2so_index= -1;
   /* and index for contexts (no key or value fields) */
   context->contexts_index= -1;
+  /* and the node dictionary */
+  context->node2id_index= -1;
+  context->id2node_index= -1;
 
   context->all_statements_hash_index= -1;
 
@@ -363,6 +496,10 @@ librdf_storage_hashes_init_common(librdf_storage* storage, const char *name,
     } else if(key_fields == LIBRDF_STATEMENT_PREDICATE &&
               value_fields == (LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_OBJECT)) {
       context->p2so_index=i;
+    } else if(!strcmp(context->hash_descriptions[i]->name, "n2id")) {
+      context->node2id_index=i;
+    } else if(!strcmp(context->hash_descriptions[i]->name, "id2n")) {
+      context->id2node_index=i;
     } else if(!key_fields || !value_fields) {
        context->contexts_index=i;
     }
@@ -461,6 +598,12 @@ librdf_storage_hashes_terminate(librdf_storage* storage)
     LIBRDF_FREE(data, context->key_buffer);
   if(context->value_buffer)
     LIBRDF_FREE(data, context->value_buffer);
+  if(context->node_buffer)
+    LIBRDF_FREE(data, context->node_buffer);
+  if(context->parts_buffer)
+    LIBRDF_FREE(data, context->parts_buffer);
+  if(context->batch_buffer)
+    LIBRDF_FREE(data, context->batch_buffer);
 
   if(context->name)
     LIBRDF_FREE(char*, context->name);
@@ -567,6 +710,43 @@ librdf_storage_hashes_open(librdf_storage* storage, librdf_model* model)
       break;
   }
 
+  /* Statement keys hold node IDs or full nodes, which cannot be read
+   * as each other, so the dictionary option must match the store */
+  if(!result) {
+    int dictionary=librdf_storage_hashes_stored_dictionary(storage);
+
+    if(dictionary >= 0 && dictionary != (context->dictionary != 0)) {
+      librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE,
+                 NULL, "Storage was written %s a node dictionary, open it with dictionary='%s'",
+                 dictionary ? "with" : "without", dictionary ? "yes" : "no");
+      librdf_storage_hashes_close(storage);
+      result=1;
+    }
+  }
+
+  if(!result && context->dictionary &&
+     librdf_storage_hashes_dictionary_open(storage)) {
+    librdf_storage_hashes_close(storage);
+    result=1;
+  }
+
+  /* Keys written with one encoding are not found with the other, so
+   * use the encoding of existing nodes unless told another one */
+  if(!result) {
+    int encoding=librdf_storage_hashes_stored_encoding(storage);
+
+    if(encoding && encoding != context->node_encoding) {
+      if(context->node_encoding_given) {
+        librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE,
+                   NULL, "Storage was written with node-encoding %d not %d",
+                   encoding, context->node_encoding);
+        librdf_storage_hashes_close(storage);
+        result=1;
+      } else
+        context->node_encoding=encoding;
+    }
+  }
+
   return result;
 }
 
@@ -624,225 +804,1001 @@ librdf_storage_hashes_grow_buffer(unsigned char **buffer, size_t *len,
 }
 
 
+/* node dictionary functions */
+
+static void
+librdf_storage_hashes_id_to_bytes(u64 id, unsigned char *buffer)
+{
+  int i;
+  
+  for(i=LIBRDF_STORAGE_HASHES_ID_SIZE-1; i>=0; i--) {
+    buffer[i]=(unsigned char)(id & 0xff);
+    id >>= 8;
+  }
+}
+
+
+static u64
+librdf_storage_hashes_bytes_to_id(const unsigned char *buffer)
+{
+  u64 id=0;
+  int i;
+  
+  for(i=0; i<LIBRDF_STORAGE_HASHES_ID_SIZE; i++)
+    id=(id << 8) | buffer[i];
+  return id;
+}
+
+
+/*
+ * librdf_storage_hashes_dictionary_get - Get the value of a dictionary key
+ * @storage: the storage
+ * @hash_index: n2id or id2n hash index
+ * @key: key to find
+ * @value: datum to point at the value
+ * @cursor_p: pointer to store the cursor that owns the value data
+ *
+ * On success the caller must free the returned cursor once finished
+ * with the value.
+ *
+ * Return value: 0 if found, >0 if not found, <0 on failure
+ **/
 static int
-librdf_storage_hashes_add_remove_statement(librdf_storage* storage, 
-                                           librdf_statement* statement,
-                                           librdf_node* context_node,
-                                           int is_addition)
+librdf_storage_hashes_dictionary_get(librdf_storage* storage, int hash_index,
+                                     librdf_hash_datum* key,
+                                     librdf_hash_datum* value,
+                                     librdf_hash_cursor** cursor_p)
 {
   librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
-  int i;
-  int status=0;
-  librdf_world* world = storage->world;
+  librdf_hash_cursor* cursor;
 
-#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
-  if(is_addition)
-    LIBRDF_DEBUG1("Adding statement: ");
-  else
-    LIBRDF_DEBUG1("Removing statement: ");
-  librdf_statement_print(statement, stderr);
-  fputc('\n', stderr);
-#endif  
+  cursor=librdf_new_hash_cursor(context->hashes[hash_index]);
+  if(!cursor)
+    return -1;
 
-  for(i=0; i<context->hash_count; i++) {
-    librdf_hash_datum hd_key, hd_value; /* on stack */
-    size_t key_len, value_len;
+  if(librdf_hash_cursor_set(cursor, key, value)) {
+    librdf_free_hash_cursor(cursor);
+    return 1;
+  }
 
-    /* ENCODE KEY */
+  *cursor_p=cursor;
+  return 0;
+}
 
-    librdf_statement_part fields=(librdf_statement_part)context->hash_descriptions[i]->key_fields;
-    if(!fields)
-      continue;
-    
-    key_len = librdf_statement_encode_parts2(world, statement, NULL, NULL, 0,
-                                             fields);
-    if(!key_len)
-      return 1;
-    if(librdf_storage_hashes_grow_buffer(&context->key_buffer, 
-                                         &context->key_buffer_len, key_len)) {
-      status=1;
-      break;
-    }
-       
-    if(!librdf_statement_encode_parts2(world, statement, NULL,
-                                       context->key_buffer,
-                                       context->key_buffer_len, fields)) {
-      status=1;
-      break;
-    }
 
-    
-    /* ENCODE VALUE */
-    
-    fields=(librdf_statement_part)context->hash_descriptions[i]->value_fields;
-    if(!fields)
-      continue;
-    
-    value_len=librdf_statement_encode_parts2(world, statement, context_node,
-                                             NULL, 0, fields);
-    if(!value_len) {
-      status=1;
-      break;
-    }
-    
-    if(librdf_storage_hashes_grow_buffer(&context->value_buffer, 
-                                         &context->value_buffer_len, value_len)) {
-      status=1;
-      break;
-    }
-       
-    if(!librdf_statement_encode_parts2(world, statement, context_node,
-                                       context->value_buffer,
-                                       context->value_buffer_len, fields)) {
-      status=1;
-      break;
-    }
+/*
+ * librdf_storage_hashes_dictionary_open - Read the node ID allocation state
+ * @storage: the storage
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_hashes_dictionary_open(librdf_storage* storage)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_hash_datum key, value; /* on stack */
+  librdf_hash_cursor* cursor=NULL;
+  int rc;
 
+  key.data=(char*)LIBRDF_STORAGE_HASHES_NEXT_ID_KEY;
+  key.size=strlen(LIBRDF_STORAGE_HASHES_NEXT_ID_KEY);
+  value.data=NULL;
 
-#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
-    LIBRDF_DEBUG4("Using %s hash key %d bytes -> value %d bytes\n", context->hash_descriptions[i]->name, key_len, value_len);
-#endif
+  rc=librdf_storage_hashes_dictionary_get(storage, context->id2node_index,
+                                          &key, &value, &cursor);
+  if(rc < 0)
+    return 1;
 
-    /* Finally, store / remove the sucker */
-    hd_key.data=context->key_buffer; hd_key.size=key_len;
-    hd_value.data=context->value_buffer; hd_value.size=value_len;
-    
-    if(is_addition)
-      status=librdf_hash_put(context->hashes[i], &hd_key, &hd_value);
-    else
-      status=librdf_hash_delete(context->hashes[i], &hd_key, &hd_value);
-    
-    if(status)
-      break;
+  /* ID 0 is never used */
+  context->next_id=1;
+  if(!rc) {
+    /* A crash between writing a new reservation and deleting the old
+     * one leaves both values; the largest one is the current one */
+    do {
+      if(value.size == LIBRDF_STORAGE_HASHES_ID_SIZE) {
+        u64 id=librdf_storage_hashes_bytes_to_id((unsigned char*)value.data);
+        if(id > context->next_id)
+          context->next_id=id;
+      }
+    } while(!librdf_hash_cursor_get_next_value(cursor, &key, &value));
+    librdf_free_hash_cursor(cursor);
   }
 
-  return status;
+  /* IDs reserved by an earlier open may have been handed out */
+  context->reserved_id=context->next_id;
+  
+  return 0;
 }
 
 
+/*
+ * librdf_storage_hashes_statement_hash - Find a statement index to read stored keys from
+ * @context: the storage hashes instance
+ *
+ * Return value: the hash of all statements, else any statement index, or <0 if none is open
+ **/
 static int
-librdf_storage_hashes_add_statement(librdf_storage* storage, librdf_statement* statement)
+librdf_storage_hashes_statement_hash(librdf_storage_hashes_instance* context)
 {
-  /* Do not add duplicate statements */
-  if(librdf_storage_hashes_contains_statement(storage, statement))
-    return 0;
+  int hash_index=context->all_statements_hash_index;
+  int i;
 
-  return librdf_storage_hashes_add_remove_statement(storage, statement, NULL, 1);
+  for(i=0; hash_index < 0 && i < context->hash_count; i++) {
+    if(context->hashes[i] && context->hash_descriptions[i] &&
+       context->hash_descriptions[i]->key_fields)
+      hash_index=i;
+  }
+
+  if(hash_index >= 0 && !context->hashes[hash_index])
+    hash_index= -1;
+
+  return hash_index;
 }
 
 
+/*
+ * librdf_storage_hashes_stored_dictionary - Find if existing statements use a node dictionary
+ * @storage: the storage
+ *
+ * Without a node dictionary statement keys start with the 'x' magic
+ * number and a part letter.  With one they start with a big-endian
+ * node ID, whose first byte is 0 for any ID that can be allocated.
+ *
+ * Return value: 1 with a node dictionary, 0 without, <0 if there are no statements stored
+ **/
 static int
-librdf_storage_hashes_add_statements(librdf_storage* storage,
-                                     librdf_stream* statement_stream)
+librdf_storage_hashes_stored_dictionary(librdf_storage* storage)
 {
-  int status=0;
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_hash_datum key, value; /* on stack */
+  librdf_hash_cursor* cursor;
+  int hash_index;
+  int dictionary= -1;
 
-  while(!librdf_stream_end(statement_stream)) {
-    librdf_statement* statement=librdf_stream_get_object(statement_stream);
+  hash_index=librdf_storage_hashes_statement_hash(context);
+  if(hash_index < 0)
+    return -1;
 
-    if(statement) {
-      status=librdf_storage_hashes_add_statement(storage, statement);
-    } else
-      status=1;
+  cursor=librdf_new_hash_cursor(context->hashes[hash_index]);
+  if(!cursor)
+    return -1;
 
-    if(status)
-      break;
+  key.data=NULL;
+  value.data=NULL;
+  if(!librdf_hash_cursor_get_first(cursor, &key, &value) && key.size) {
+    const unsigned char* data=(const unsigned char*)key.data;
 
-    librdf_stream_next(statement_stream);
+    dictionary=!(key.size > 1 && data[0] == 'x' &&
+                 (data[1] == 's' || data[1] == 'p' || data[1] == 'o'));
   }
+  librdf_free_hash_cursor(cursor);
 
-  return status;
+  return dictionary;
 }
 
 
+/*
+ * librdf_storage_hashes_stored_encoding - Find the node encoding of existing nodes
+ * @storage: the storage
+ *
+ * The first byte of an encoded node is a type letter in version 1
+ * and has the top bit set in version 2, so the first key of the node
+ * dictionary, or the first node of the first key of the hash of all
+ * statements (after the 'x' and part letter), tells which was used.
+ * Without a hash of all statements any statement index will do.
+ *
+ * Return value: 1 or 2, or 0 if there are no nodes stored
+ **/
 static int
-librdf_storage_hashes_remove_statement(librdf_storage* storage, librdf_statement* statement)
+librdf_storage_hashes_stored_encoding(librdf_storage* storage)
 {
-  return librdf_storage_hashes_add_remove_statement(storage, statement, NULL, 0);
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_hash_datum key, value; /* on stack */
+  librdf_hash_cursor* cursor;
+  int hash_index;
+  size_t offset;
+  int encoding=0;
+
+  if(context->dictionary) {
+    hash_index=context->node2id_index;
+    offset=0;
+  } else {
+    hash_index=librdf_storage_hashes_statement_hash(context);
+    offset=2;
+  }
+
+  if(hash_index < 0 || !context->hashes[hash_index]) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
+               "Cannot find the node encoding the storage was written with");
+    return 0;
+  }
+
+  cursor=librdf_new_hash_cursor(context->hashes[hash_index]);
+  if(!cursor)
+    return 0;
+
+  key.data=NULL;
+  value.data=NULL;
+  if(!librdf_hash_cursor_get_first(cursor, &key, &value) &&
+     key.size > offset)
+    encoding=(((unsigned char*)key.data)[offset] & 0x80) ? 2 : 1;
+  librdf_free_hash_cursor(cursor);
+
+  return encoding;
 }
 
 
+/*
+ * librdf_storage_hashes_new_id - Allocate a new node ID
+ * @storage: the storage
+ * @id: buffer to write the new ID to
+ *
+ * Return value: non 0 on failure
+ **/
 static int
-librdf_storage_hashes_contains_statement(librdf_storage* storage, librdf_statement* statement)
+librdf_storage_hashes_new_id(librdf_storage* storage, unsigned char *id)
 {
   librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
-  librdf_hash_datum hd_key, hd_value; /* on stack */
-  unsigned char *key_buffer, *value_buffer;
-  size_t key_len, value_len;
-  int hash_index=context->all_statements_hash_index;
-  librdf_statement_part fields;
-  int status;
-  librdf_world* world = storage->world;
-  
-  if(context->index_contexts) {
-    /* When we have contexts, we have to use find_statements for contains
-     * since a statement is encoded in KEY/VALUE and the VALUE may
-     * contain some context node.
-     */
-    librdf_stream *stream=librdf_storage_hashes_find_statements(storage, statement);
-    
-    if(!stream)
-      return 0;
-    /* librdf_stream_end returns 0 if have more, non-0 at end */
-    status=!librdf_stream_end(stream);
-    /* convert to 0 if at end (not found) and non-zero otherwise (found) */
-    librdf_free_stream(stream);
-    return status;
-  }
 
-  /* ENCODE KEY */
-  fields=(librdf_statement_part)context->hash_descriptions[hash_index]->key_fields;
-  key_len = librdf_statement_encode_parts2(world, statement, NULL,
-                                           NULL, 0, fields);
-  if(!key_len)
-    return 1;
-  key_buffer = LIBRDF_MALLOC(unsigned char*, key_len);
-  if(!key_buffer)
-    return 1;
-       
-  if(!librdf_statement_encode_parts2(world, statement, NULL,
-                                     key_buffer, key_len, fields)) {
-    LIBRDF_FREE(data, key_buffer);
-    return 1;
-  }
+  if(context->next_id >= context->reserved_id) {
+    librdf_hash* hash=context->hashes[context->id2node_index];
+    unsigned char reserved[LIBRDF_STORAGE_HASHES_ID_SIZE];
+    unsigned char old_reserved[LIBRDF_STORAGE_HASHES_ID_SIZE];
+    librdf_hash_datum key, value; /* on stack */
+
+    key.data=(char*)LIBRDF_STORAGE_HASHES_NEXT_ID_KEY;
+    key.size=strlen(LIBRDF_STORAGE_HASHES_NEXT_ID_KEY);
+    librdf_storage_hashes_id_to_bytes(context->next_id + LIBRDF_STORAGE_HASHES_ID_RESERVE,
+                                      reserved);
+    value.data=reserved;
+    value.size=LIBRDF_STORAGE_HASHES_ID_SIZE;
+
+    /* Write the new reservation before removing the old one so the
+     * stored value never goes backwards; dictionary_open() takes the
+     * largest value if both are left behind */
+    if(librdf_hash_put(hash, &key, &value))
+      return 1;
 
-  /* ENCODE VALUE */
-  fields=(librdf_statement_part)context->hash_descriptions[hash_index]->value_fields;
-  value_len = librdf_statement_encode_parts2(world, statement, NULL,
-                                             NULL, 0, fields);
-  if(!value_len) {
-    LIBRDF_FREE(data, key_buffer);
-    return 1;
-  }
-    
-  value_buffer = LIBRDF_MALLOC(unsigned char*, value_len);
-  if(!value_buffer) {
-    LIBRDF_FREE(data, key_buffer);
-    return 1;
-  }
+    if(context->reserved_id > 1) {
+      librdf_storage_hashes_id_to_bytes(context->reserved_id, old_reserved);
+      value.data=old_reserved;
+      librdf_hash_delete(hash, &key, &value);
+    }
 
-       
-  if(!librdf_statement_encode_parts2(world, statement, NULL,
-                                     value_buffer, value_len, fields)) {
-    LIBRDF_FREE(data, key_buffer);
-    LIBRDF_FREE(data, value_buffer);
-    return 1;
+    context->reserved_id=context->next_id + LIBRDF_STORAGE_HASHES_ID_RESERVE;
   }
 
-
-#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
-  LIBRDF_DEBUG4("Using %s hash key %d bytes -> value %d bytes\n", context->hash_descriptions[hash_index]->name, key_len, value_len);
-#endif
-
-  hd_key.data=key_buffer; hd_key.size=key_len;
-  hd_value.data=value_buffer; hd_value.size=value_len;
-  status=librdf_hash_exists(context->hashes[hash_index], &hd_key, &hd_value);
-  
-  LIBRDF_FREE(data, key_buffer);
-  LIBRDF_FREE(data, value_buffer);
-
-  /* DO NOT free statement, ownership was not passed in */
-  return status;
+  librdf_storage_hashes_id_to_bytes(context->next_id++, id);
+  return 0;
+}
+
+
+/*
+ * librdf_storage_hashes_node_to_id - Find or create the ID of a node
+ * @storage: the storage
+ * @node: the node
+ * @add: non 0 to add the node to the dictionary if missing
+ * @id: buffer to write the node ID to
+ *
+ * Dictionary entries are not reference counted, so a node keeps its
+ * ID after its last statement is removed and IDs are never reused.
+ *
+ * Return value: 0 on success, >0 if node has no ID and @add is 0, <0 on failure
+ **/
+static int
+librdf_storage_hashes_node_to_id(librdf_storage* storage, librdf_node* node,
+                                 int add, unsigned char *id)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_hash_datum key, value; /* on stack */
+  librdf_hash_cursor* cursor=NULL;
+  size_t len;
+  int rc;
+
+  len=librdf_node_encode_version(node, NULL, 0, context->node_encoding);
+  if(!len)
+    return -1;
+  if(librdf_storage_hashes_grow_buffer(&context->node_buffer,
+                                       &context->node_buffer_len, len))
+    return -1;
+  if(!librdf_node_encode_version(node, context->node_buffer, len,
+                                 context->node_encoding))
+    return -1;
+  
+  key.data=context->node_buffer;
+  key.size=len;
+  value.data=NULL;
+
+  rc=librdf_storage_hashes_dictionary_get(storage, context->node2id_index,
+                                          &key, &value, &cursor);
+  if(!rc) {
+    if(value.size == LIBRDF_STORAGE_HASHES_ID_SIZE)
+      memcpy(id, value.data, LIBRDF_STORAGE_HASHES_ID_SIZE);
+    else
+      rc= -1;
+    librdf_free_hash_cursor(cursor);
+    return rc;
+  }
+
+  if(rc < 0 || !add)
+    return rc;
+
+  if(librdf_storage_hashes_new_id(storage, id))
+    return -1;
+
+  value.data=id;
+  value.size=LIBRDF_STORAGE_HASHES_ID_SIZE;
+  if(librdf_hash_put(context->hashes[context->node2id_index], &key, &value))
+    return -1;
+
+  if(librdf_hash_put(context->hashes[context->id2node_index], &value, &key))
+    return -1;
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_hashes_id_to_node - Get the node for a node ID
+ * @storage: the storage
+ * @id: the node ID
+ *
+ * Return value: new #librdf_node or NULL on failure
+ **/
+static librdf_node*
+librdf_storage_hashes_id_to_node(librdf_storage* storage,
+                                 const unsigned char *id)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_hash_datum key, value; /* on stack */
+  librdf_hash_cursor* cursor=NULL;
+  librdf_node* node;
+
+  key.data=(void*)id;
+  key.size=LIBRDF_STORAGE_HASHES_ID_SIZE;
+  value.data=NULL;
+
+  if(librdf_storage_hashes_dictionary_get(storage, context->id2node_index,
+                                          &key, &value, &cursor))
+    return NULL;
+
+  node=librdf_node_decode(storage->world, NULL,
+                          (unsigned char*)value.data, value.size);
+  librdf_free_hash_cursor(cursor);
+
+  return node;
+}
+
+
+/*
+ * librdf_storage_hashes_encode_parts - Encode each statement part once
+ * @storage: the storage
+ * @statement: the statement
+ * @context_node: context node or NULL
+ * @add: non 0 to add missing nodes to the node dictionary
+ * @parts: where to record the encoded parts
+ *
+ * Encodes the subject, predicate, object and context into the storage
+ * scratch buffer so that every hash key and value can be assembled
+ * from them by concatenation with librdf_storage_hashes_join_parts().
+ * Each part is a statement part letter plus librdf_node_encode_version() bytes
+ * or, with a node dictionary, the 8-byte node ID.
+ *
+ * Return value: 0 on success, >0 if a node has no ID and @add is 0, <0 on failure
+ **/
+static int
+librdf_storage_hashes_encode_parts(librdf_storage* storage,
+                                   librdf_statement* statement,
+                                   librdf_node* context_node, int add,
+                                   librdf_storage_hashes_parts* parts)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  static const unsigned char tags[4]={'s', 'p', 'o', 'c'};
+  librdf_node* nodes[4];
+  size_t total_len=0;
+  int i;
+
+  nodes[0]=librdf_statement_get_subject(statement);
+  nodes[1]=librdf_statement_get_predicate(statement);
+  nodes[2]=librdf_statement_get_object(statement);
+  nodes[3]=context_node;
+
+  /* size pass */
+  for(i=0; i<4; i++) {
+    size_t len=0;
+
+    if(nodes[i]) {
+      if(context->dictionary)
+        len=LIBRDF_STORAGE_HASHES_ID_SIZE;
+      else {
+        len=librdf_node_encode_version(nodes[i], NULL, 0,
+                                       context->node_encoding);
+        if(!len)
+          return -1;
+        len++;
+      }
+    }
+    parts->offset[i]=total_len;
+    parts->len[i]=len;
+    total_len += len;
+  }
+  parts->total_len=total_len;
+
+  if(!total_len)
+    return 0;
+
+  if(librdf_storage_hashes_grow_buffer(&context->parts_buffer,
+                                       &context->parts_buffer_len, total_len))
+    return -1;
+  parts->buffer=context->parts_buffer;
+
+  /* fill pass */
+  for(i=0; i<4; i++) {
+    unsigned char *p=parts->buffer + parts->offset[i];
+
+    if(!parts->len[i])
+      continue;
+
+    if(context->dictionary) {
+      int rc=librdf_storage_hashes_node_to_id(storage, nodes[i], add, p);
+      if(rc)
+        return rc;
+    } else {
+      *p++=tags[i];
+      if(!librdf_node_encode_version(nodes[i], p, parts->len[i]-1,
+                                     context->node_encoding))
+        return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_hashes_join_parts - Assemble a hash key or value from encoded parts
+ * @context: the storage hashes instance
+ * @parts: parts from librdf_storage_hashes_encode_parts()
+ * @fields: the statement parts to use
+ * @with_context: non 0 to append the context part, if any
+ * @buffer: buffer of at least @parts total_len + 1 bytes
+ *
+ * Without a node dictionary the result is identical to
+ * librdf_statement_encode_parts_version() with the storage node encoding.
+ *
+ * Return value: number of bytes written
+ **/
+static size_t
+librdf_storage_hashes_join_parts(librdf_storage_hashes_instance* context,
+                                 librdf_storage_hashes_parts* parts,
+                                 int fields, int with_context,
+                                 unsigned char *buffer)
+{
+  static const int part_fields[3]={
+    LIBRDF_STATEMENT_SUBJECT,
+    LIBRDF_STATEMENT_PREDICATE,
+    LIBRDF_STATEMENT_OBJECT
+  };
+  size_t len=0;
+  int i;
+
+  /* magic number 'x' as written by librdf_statement_encode_parts2() */
+  if(!context->dictionary)
+    buffer[len++]='x';
+
+  for(i=0; i<4; i++) {
+    if(!parts->len[i])
+      continue;
+    if(i < 3 ? !(fields & part_fields[i]) : !with_context)
+      continue;
+    memcpy(buffer+len, parts->buffer + parts->offset[i], parts->len[i]);
+    len += parts->len[i];
+  }
+
+  return len;
+}
+
+
+/*
+ * librdf_storage_hashes_encode - Encode statement parts for a hash lookup
+ * @storage: the storage
+ * @statement: the statement
+ * @context_node: context node or NULL
+ * @fields: the statement parts to encode
+ * @buffer: pointer to growing buffer
+ * @buffer_len: pointer to size of growing buffer
+ * @len_p: pointer to store the encoded length
+ *
+ * Encodes as node IDs when the storage uses a node dictionary, in which
+ * case nodes are never added to the dictionary.
+ *
+ * Return value: 0 on success, >0 if a node is unknown, <0 on failure
+ **/
+static int
+librdf_storage_hashes_encode(librdf_storage* storage,
+                             librdf_statement* statement,
+                             librdf_node* context_node, int fields,
+                             unsigned char **buffer, size_t *buffer_len,
+                             size_t *len_p)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_storage_hashes_parts parts;
+  int rc;
+
+  rc=librdf_storage_hashes_encode_parts(storage, statement, context_node, 0,
+                                        &parts);
+  if(rc)
+    return rc;
+
+  if(librdf_storage_hashes_grow_buffer(buffer, buffer_len,
+                                       parts.total_len + 1))
+    return -1;
+
+  *len_p=librdf_storage_hashes_join_parts(context, &parts, fields,
+                                          (context_node != NULL), *buffer);
+  return 0;
+}
+
+
+/*
+ * librdf_storage_hashes_decode - Decode a hash key or value into statement parts
+ * @storage: the storage
+ * @statement: the statement to decode into
+ * @context_node: pointer to store a context node or NULL
+ * @fields: the statement parts held (only used with a node dictionary)
+ * @data: the key or value data
+ * @size: the key or value size
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_hashes_decode(librdf_storage* storage,
+                             librdf_statement* statement,
+                             librdf_node** context_node, int fields,
+                             unsigned char *data, size_t size)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_node* node;
+
+  if(!context->dictionary)
+    return !librdf_statement_decode2(storage->world, statement, context_node,
+                                     data, size);
+
+  if(fields & LIBRDF_STATEMENT_SUBJECT) {
+    if(size < LIBRDF_STORAGE_HASHES_ID_SIZE ||
+       !(node=librdf_storage_hashes_id_to_node(storage, data)))
+      return 1;
+    librdf_statement_set_subject(statement, node);
+    data += LIBRDF_STORAGE_HASHES_ID_SIZE;
+    size -= LIBRDF_STORAGE_HASHES_ID_SIZE;
+  }
+  if(fields & LIBRDF_STATEMENT_PREDICATE) {
+    if(size < LIBRDF_STORAGE_HASHES_ID_SIZE ||
+       !(node=librdf_storage_hashes_id_to_node(storage, data)))
+      return 1;
+    librdf_statement_set_predicate(statement, node);
+    data += LIBRDF_STORAGE_HASHES_ID_SIZE;
+    size -= LIBRDF_STORAGE_HASHES_ID_SIZE;
+  }
+  if(fields & LIBRDF_STATEMENT_OBJECT) {
+    if(size < LIBRDF_STORAGE_HASHES_ID_SIZE ||
+       !(node=librdf_storage_hashes_id_to_node(storage, data)))
+      return 1;
+    librdf_statement_set_object(statement, node);
+    data += LIBRDF_STORAGE_HASHES_ID_SIZE;
+    size -= LIBRDF_STORAGE_HASHES_ID_SIZE;
+  }
+
+  /* any remaining ID is the context */
+  if(size >= LIBRDF_STORAGE_HASHES_ID_SIZE && context_node) {
+    if(!(node=librdf_storage_hashes_id_to_node(storage, data)))
+      return 1;
+    *context_node=node;
+  }
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_hashes_decode_borrowed - Decode the node in a hash value without copying it
+ * @storage: the storage
+ * @node: the node to fill in
+ * @data: the value data
+ * @size: the value size
+ *
+ * The value must hold a single statement part, optionally followed
+ * by a context, and be stored without a node dictionary.  @node
+ * points into @data; see librdf_node_decode_borrowed().
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_hashes_decode_borrowed(librdf_storage* storage,
+                                      librdf_node* node,
+                                      unsigned char *data, size_t size)
+{
+  /* magic number 'x' then the statement part letter */
+  if(size < 3 || data[0] != 'x')
+    return 1;
+
+  return librdf_node_decode_borrowed(storage->world, node, NULL,
+                                     data+2, size-2);
+}
+
+
+static int
+librdf_storage_hashes_add_remove_statement(librdf_storage* storage, 
+                                           librdf_statement* statement,
+                                           librdf_node* context_node,
+                                           int is_addition)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_storage_hashes_parts parts;
+  int i;
+  int status=0;
+
+#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
+  if(is_addition)
+    LIBRDF_DEBUG1("Adding statement: ");
+  else
+    LIBRDF_DEBUG1("Removing statement: ");
+  librdf_statement_print(statement, stderr);
+  fputc('\n', stderr);
+#endif  
+
+  /* Encode the nodes once; every key and value is built from them.
+   * With a node dictionary an unknown node means nothing to remove.
+   */
+  if(librdf_storage_hashes_encode_parts(storage, statement, context_node,
+                                        is_addition, &parts))
+    return 1;
+
+  if(librdf_storage_hashes_grow_buffer(&context->key_buffer,
+                                       &context->key_buffer_len,
+                                       parts.total_len + 1) ||
+     librdf_storage_hashes_grow_buffer(&context->value_buffer,
+                                       &context->value_buffer_len,
+                                       parts.total_len + 1))
+    return 1;
+
+  for(i=0; i<context->hash_count; i++) {
+    librdf_hash_datum hd_key, hd_value; /* on stack */
+    size_t key_len, value_len;
+    int key_fields=context->hash_descriptions[i]->key_fields;
+    int value_fields=context->hash_descriptions[i]->value_fields;
+
+    /* skip the contexts hash and node dictionary */
+    if(!key_fields || !value_fields)
+      continue;
+    
+    key_len=librdf_storage_hashes_join_parts(context, &parts, key_fields, 0,
+                                             context->key_buffer);
+    value_len=librdf_storage_hashes_join_parts(context, &parts, value_fields,
+                                               1, context->value_buffer);
+
+#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
+    LIBRDF_DEBUG4("Using %s hash key %d bytes -> value %d bytes\n", context->hash_descriptions[i]->name, key_len, value_len);
+#endif
+
+    /* Finally, store / remove the sucker */
+    hd_key.data=context->key_buffer; hd_key.size=key_len;
+    hd_value.data=context->value_buffer; hd_value.size=value_len;
+    
+    if(is_addition)
+      status=librdf_hash_put(context->hashes[i], &hd_key, &hd_value);
+    else
+      status=librdf_hash_delete(context->hashes[i], &hd_key, &hd_value);
+    
+    if(status)
+      break;
+  }
+
+  return status;
+}
+
+
+static int
+librdf_storage_hashes_add_statement(librdf_storage* storage, librdf_statement* statement)
+{
+  /* Do not add duplicate statements */
+  if(librdf_storage_hashes_contains_statement(storage, statement))
+    return 0;
+
+  return librdf_storage_hashes_add_remove_statement(storage, statement, NULL, 1);
+}
+
+
+/*
+ * A batch of statements being added: the keys and values of up to
+ * LIBRDF_STORAGE_HASHES_BATCH_SIZE statements for each hash, held in
+ * the storage batch buffer.  The entries for hash i start at
+ * i * LIBRDF_STORAGE_HASHES_BATCH_SIZE.
+ */
+typedef struct {
+  librdf_hash_datum *keys;
+  librdf_hash_datum *values;
+  int *results;
+  int count;
+} librdf_storage_hashes_batch;
+
+
+/*
+ * librdf_storage_hashes_add_batch - Write a batch of statements to the hashes
+ * @storage: the storage
+ * @batch: the batch
+ *
+ * Statements already in the storage, or repeated earlier in the batch,
+ * are dropped and the rest stored with one librdf_hash_put_many() call
+ * per hash.  The batch is emptied.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_hashes_add_batch(librdf_storage* storage,
+                                librdf_storage_hashes_batch* batch)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  int slots[LIBRDF_STORAGE_HASHES_BATCH_SIZE << 1];
+  librdf_hash_datum *all_keys, *all_values;
+  int hash_index=context->all_statements_hash_index;
+  int count=batch->count;
+  int i, j, n;
+
+  batch->count=0;
+  if(!count)
+    return 0;
+
+  all_keys=batch->keys + hash_index * LIBRDF_STORAGE_HASHES_BATCH_SIZE;
+  all_values=batch->values + hash_index * LIBRDF_STORAGE_HASHES_BATCH_SIZE;
+
+  /* Do not add duplicate statements */
+  if(librdf_hash_exists_many(context->hashes[hash_index], all_keys, all_values,
+                             count, batch->results))
+    return 1;
+
+  /* nor ones repeated within the batch */
+  for(i=0; i < (LIBRDF_STORAGE_HASHES_BATCH_SIZE << 1); i++)
+    slots[i]= -1;
+  for(j=0; j < count; j++) {
+    u32 key_hash, value_hash;
+
+    if(batch->results[j])
+      continue;
+
+    LIBRDF_HASH_KEY_HASH(key_hash, all_keys[j].data, all_keys[j].size);
+    LIBRDF_HASH_KEY_HASH(value_hash, all_values[j].data, all_values[j].size);
+    i=(int)((key_hash ^ (value_hash * 31)) & ((LIBRDF_STORAGE_HASHES_BATCH_SIZE << 1) - 1));
+    for(; slots[i] >= 0; i=(i + 1) & ((LIBRDF_STORAGE_HASHES_BATCH_SIZE << 1) - 1)) {
+      n=slots[i];
+      if(all_keys[n].size == all_keys[j].size &&
+         all_values[n].size == all_values[j].size &&
+         !memcmp(all_keys[n].data, all_keys[j].data, all_keys[j].size) &&
+         !memcmp(all_values[n].data, all_values[j].data, all_values[j].size)) {
+        batch->results[j]=1;
+        break;
+      }
+    }
+    if(!batch->results[j])
+      slots[i]=j;
+  }
+
+  for(i=0; i < context->hash_count; i++) {
+    librdf_hash_datum *keys, *values;
+
+    /* skip the contexts hash and node dictionary */
+    if(!context->hash_descriptions[i]->key_fields ||
+       !context->hash_descriptions[i]->value_fields)
+      continue;
+
+    keys=batch->keys + i * LIBRDF_STORAGE_HASHES_BATCH_SIZE;
+    values=batch->values + i * LIBRDF_STORAGE_HASHES_BATCH_SIZE;
+
+    for(j=0, n=0; j < count; j++) {
+      if(batch->results[j])
+        continue;
+      keys[n]=keys[j];
+      values[n]=values[j];
+      n++;
+    }
+
+    if(librdf_hash_put_many(context->hashes[i], keys, values, n))
+      return 1;
+  }
+
+  return 0;
+}
+
+
+static int
+librdf_storage_hashes_add_statements(librdf_storage* storage,
+                                     librdf_stream* statement_stream)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_storage_hashes_batch batch;
+  size_t size;
+  size_t used=0;
+  int status=0;
+
+  /* with contexts, duplicates can only be found by find_statements */
+  if(context->index_contexts)
+    return librdf_storage_hashes_add_statements_one(storage, statement_stream);
+
+  size=context->hash_count * LIBRDF_STORAGE_HASHES_BATCH_SIZE;
+  batch.keys=LIBRDF_CALLOC(librdf_hash_datum*, size, sizeof(librdf_hash_datum));
+  batch.values=LIBRDF_CALLOC(librdf_hash_datum*, size, sizeof(librdf_hash_datum));
+  batch.results=LIBRDF_CALLOC(int*, LIBRDF_STORAGE_HASHES_BATCH_SIZE, sizeof(int));
+  batch.count=0;
+  if(!batch.keys || !batch.values || !batch.results) {
+    status=1;
+    goto tidy;
+  }
+
+  while(!librdf_stream_end(statement_stream)) {
+    librdf_statement* statement=librdf_stream_get_object(statement_stream);
+    librdf_storage_hashes_parts parts;
+    int i;
+
+    if(!statement ||
+       librdf_storage_hashes_encode_parts(storage, statement, NULL, 1, &parts)) {
+      status=1;
+      break;
+    }
+
+    /* room for a key and value of every hash */
+    size=context->hash_count * 2 * (parts.total_len + 1);
+    if(used + size > context->batch_buffer_len) {
+      /* write out what is held before the buffer is reused */
+      if(librdf_storage_hashes_add_batch(storage, &batch)) {
+        status=1;
+        break;
+      }
+      used=0;
+
+      if(librdf_storage_hashes_grow_buffer(&context->batch_buffer,
+                                           &context->batch_buffer_len,
+                                           size > LIBRDF_STORAGE_HASHES_BATCH_BUFFER_SIZE ? size : LIBRDF_STORAGE_HASHES_BATCH_BUFFER_SIZE)) {
+        status=1;
+        break;
+      }
+    }
+
+    for(i=0; i < context->hash_count; i++) {
+      int key_fields=context->hash_descriptions[i]->key_fields;
+      int value_fields=context->hash_descriptions[i]->value_fields;
+      librdf_hash_datum *key, *value;
+
+      if(!key_fields || !value_fields)
+        continue;
+
+      key=&batch.keys[i * LIBRDF_STORAGE_HASHES_BATCH_SIZE + batch.count];
+      value=&batch.values[i * LIBRDF_STORAGE_HASHES_BATCH_SIZE + batch.count];
+
+      key->data=context->batch_buffer + used;
+      key->size=librdf_storage_hashes_join_parts(context, &parts, key_fields,
+                                                 0, context->batch_buffer + used);
+      used += key->size;
+
+      value->data=context->batch_buffer + used;
+      value->size=librdf_storage_hashes_join_parts(context, &parts, value_fields,
+                                                   1, context->batch_buffer + used);
+      used += value->size;
+    }
+
+    if(++batch.count == LIBRDF_STORAGE_HASHES_BATCH_SIZE) {
+      if(librdf_storage_hashes_add_batch(storage, &batch)) {
+        status=1;
+        break;
+      }
+      used=0;
+    }
+
+    librdf_stream_next(statement_stream);
+  }
+
+  if(!status)
+    status=librdf_storage_hashes_add_batch(storage, &batch);
+
+  tidy:
+  if(batch.keys)
+    LIBRDF_FREE(librdf_hash_datum, batch.keys);
+  if(batch.values)
+    LIBRDF_FREE(librdf_hash_datum, batch.values);
+  if(batch.results)
+    LIBRDF_FREE(int, batch.results);
+
+  return status;
+}
+
+
+static int
+librdf_storage_hashes_add_statements_one(librdf_storage* storage,
+                                         librdf_stream* statement_stream)
+{
+  int status=0;
+
+  while(!librdf_stream_end(statement_stream)) {
+    librdf_statement* statement=librdf_stream_get_object(statement_stream);
+
+    if(statement) {
+      status=librdf_storage_hashes_add_statement(storage, statement);
+    } else
+      status=1;
+
+    if(status)
+      break;
+
+    librdf_stream_next(statement_stream);
+  }
+
+  return status;
+}
+
+
+static int
+librdf_storage_hashes_remove_statement(librdf_storage* storage, librdf_statement* statement)
+{
+  return librdf_storage_hashes_add_remove_statement(storage, statement, NULL, 0);
+}
+
+
+static int
+librdf_storage_hashes_contains_statement(librdf_storage* storage, librdf_statement* statement)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_hash_datum hd_key, hd_value; /* on stack */
+  librdf_storage_hashes_parts parts;
+  size_t key_len, value_len;
+  int hash_index=context->all_statements_hash_index;
+  int status;
+  
+  if(context->index_contexts) {
+    /* When we have contexts, we have to use find_statements for contains
+     * since a statement is encoded in KEY/VALUE and the VALUE may
+     * contain some context node.
+     */
+    librdf_stream *stream=librdf_storage_hashes_find_statements(storage, statement);
+    
+    if(!stream)
+      return 0;
+    /* librdf_stream_end returns 0 if have more, non-0 at end */
+    status=!librdf_stream_end(stream);
+    /* convert to 0 if at end (not found) and non-zero otherwise (found) */
+    librdf_free_stream(stream);
+    return status;
+  }
+
+  status=librdf_storage_hashes_encode_parts(storage, statement, NULL, 0,
+                                            &parts);
+  /* a node that is not in the dictionary cannot be in any statement */
+  if(status)
+    return (status < 0);
+
+  if(librdf_storage_hashes_grow_buffer(&context->key_buffer,
+                                       &context->key_buffer_len,
+                                       parts.total_len + 1) ||
+     librdf_storage_hashes_grow_buffer(&context->value_buffer,
+                                       &context->value_buffer_len,
+                                       parts.total_len + 1))
+    return 1;
+
+  key_len=librdf_storage_hashes_join_parts(context, &parts,
+                                           context->hash_descriptions[hash_index]->key_fields,
+                                           0, context->key_buffer);
+  value_len=librdf_storage_hashes_join_parts(context, &parts,
+                                             context->hash_descriptions[hash_index]->value_fields,
+                                             0, context->value_buffer);
+
+#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
+  LIBRDF_DEBUG4("Using %s hash key %d bytes -> value %d bytes\n", context->hash_descriptions[hash_index]->name, key_len, value_len);
+#endif
+
+  hd_key.data=context->key_buffer; hd_key.size=key_len;
+  hd_value.data=context->value_buffer; hd_value.size=value_len;
+  status=librdf_hash_exists(context->hashes[hash_index], &hd_key, &hd_value);
+
+  /* DO NOT free statement, ownership was not passed in */
+  return status;
 }
 
 
@@ -854,22 +1810,33 @@ typedef struct {
   librdf_iterator* iterator;
   librdf_hash_datum *key;
   librdf_hash_datum *value;
-  librdf_node *search_node;
-  librdf_statement current; /* static, shared when search_node not used */
+  librdf_statement current; /* static, shared statement */
   int index_contexts; /* true if this storage indexes contexts */
   librdf_node *context_node;
   int current_is_ok; /* true when current statement and context_node fresh */
 } librdf_storage_hashes_serialise_stream_context;
 
 
+/*
+ * librdf_storage_hashes_serialise_common - Create a stream of statements from an index
+ * @storage: the storage hashes object
+ * @hash_index: the index of the hash to use
+ * @statement: statement with the key prefix parts or NULL for all statements
+ * @prefix_fields: leading key parts of @statement to restrict keys to
+ *
+ * Return value: a new #librdf_stream or NULL on failure
+ **/
 static librdf_stream*
 librdf_storage_hashes_serialise_common(librdf_storage* storage, int hash_index,
-                                       librdf_node* search_node, int want)
+                                       librdf_statement* statement,
+                                       int prefix_fields)
 {
   librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
   librdf_storage_hashes_serialise_stream_context *scontext;
   librdf_hash *hash;
   librdf_stream *stream;
+  librdf_hash_datum prefix; /* on stack */
+  int rc;
   
   scontext = LIBRDF_CALLOC(librdf_storage_hashes_serialise_stream_context*,
                            1, sizeof(*scontext));
@@ -877,6 +1844,7 @@ librdf_storage_hashes_serialise_common(librdf_storage* storage, int hash_index,
     return NULL;
 
   scontext->hash_context=context;
+  scontext->index=hash_index;
 
   librdf_statement_init(storage->world, &scontext->current);
 
@@ -895,17 +1863,22 @@ librdf_storage_hashes_serialise_common(librdf_storage* storage, int hash_index,
   /* scurrent->current_is_ok=0; */
   scontext->index_contexts=context->index_contexts;
   
-  if(search_node) {
-    scontext->search_node=search_node;
-    scontext->iterator=librdf_storage_hashes_node_iterator_create(storage,
-                                                                  search_node,
-                                                                  NULL,
-                                                                  hash_index,
-                                                                  want);
-  } else {
+  if(statement) {
+    /* scan only the keys starting with the encoded prefix parts */
+    rc=librdf_storage_hashes_encode(storage, statement, NULL, prefix_fields,
+                                    &context->key_buffer,
+                                    &context->key_buffer_len, &prefix.size);
+    if(rc) {
+      librdf_storage_hashes_serialise_finished((void*)scontext);
+      /* a node that is not in the dictionary cannot match anything */
+      return (rc > 0) ? librdf_new_empty_stream(storage->world) : NULL;
+    }
+    prefix.data=context->key_buffer;
+    scontext->iterator=librdf_hash_get_prefix(hash, &prefix,
+                                              scontext->key, scontext->value);
+  } else
     scontext->iterator=librdf_hash_get_all(hash,
                                            scontext->key, scontext->value);
-  }
   if(!scontext->iterator) {
     librdf_storage_hashes_serialise_finished((void*)scontext);
     return librdf_new_empty_stream(storage->world);
@@ -963,26 +1936,12 @@ static void*
 librdf_storage_hashes_serialise_get_statement(void* context, int flags)
 {
   librdf_storage_hashes_serialise_stream_context* scontext=(librdf_storage_hashes_serialise_stream_context*)context;
+  librdf_hash_descriptor* desc;
   librdf_hash_datum* hd;
   librdf_node** cnp=NULL;
-  librdf_world* world;
-  
-  world = scontext->storage->world;
   
-  if(scontext->search_node) {
-    switch(flags) {
-      case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
-        return librdf_iterator_get_object(scontext->iterator);
-      case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
-        return librdf_iterator_get_context(scontext->iterator);
-      default:
-        librdf_log(scontext->iterator->world,
-                   0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
-                   "Unimplemented flags %d seen", flags);
-        return NULL;
-    }
-  }
-    
+  desc=scontext->hash_context->hash_descriptions[scontext->index];
+
   switch(flags) {
     case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
     case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
@@ -1007,16 +1966,18 @@ librdf_storage_hashes_serialise_get_statement(void* context, int flags)
       hd=(librdf_hash_datum*)librdf_iterator_get_key(scontext->iterator);
       
       /* decode key content */
-      if(!librdf_statement_decode2(world, &scontext->current, NULL,
-                                   (unsigned char*)hd->data, hd->size)) {
+      if(librdf_storage_hashes_decode(scontext->storage, &scontext->current,
+                                      NULL, desc->key_fields,
+                                      (unsigned char*)hd->data, hd->size)) {
         return NULL;
       }
       
       hd=(librdf_hash_datum*)librdf_iterator_get_value(scontext->iterator);
       
       /* decode value content and optional context */
-      if(!librdf_statement_decode2(world, &scontext->current, cnp,
-                                   (unsigned char*)hd->data, hd->size)) {
+      if(librdf_storage_hashes_decode(scontext->storage, &scontext->current,
+                                      cnp, desc->value_fields,
+                                      (unsigned char*)hd->data, hd->size)) {
         return NULL;
       }
 
@@ -1065,6 +2026,320 @@ librdf_storage_hashes_serialise_finished(void* context)
 }
 
 
+typedef struct {
+  librdf_storage *storage;
+  librdf_iterator* iterator; /* owned iterator over the values of one key */
+  librdf_hash_datum key;
+  librdf_hash_datum value;
+  unsigned char *key_buffer; /* owned encoded key */
+  librdf_statement search;   /* key parts, copied into every answer */
+  librdf_statement current;  /* static, shared statement */
+  int value_fields;          /* parts of the statement in each value */
+  int index_contexts; /* true if this storage indexes contexts */
+  librdf_node *context_node;
+  int current_is_ok; /* true when current statement and context_node fresh */
+} librdf_storage_hashes_find_stream_context;
+
+
+static int
+librdf_storage_hashes_find_end_of_stream(void* context)
+{
+  librdf_storage_hashes_find_stream_context* scontext=(librdf_storage_hashes_find_stream_context*)context;
+
+  return librdf_iterator_end(scontext->iterator);
+}
+
+
+static int
+librdf_storage_hashes_find_next_statement(void* context)
+{
+  librdf_storage_hashes_find_stream_context* scontext=(librdf_storage_hashes_find_stream_context*)context;
+
+  scontext->current_is_ok=0;
+  return librdf_iterator_next(scontext->iterator);
+}
+
+
+static void*
+librdf_storage_hashes_find_get_statement(void* context, int flags)
+{
+  librdf_storage_hashes_find_stream_context* scontext=(librdf_storage_hashes_find_stream_context*)context;
+  librdf_hash_datum* hd;
+  librdf_node** cnp=NULL;
+  librdf_node* node;
+  
+  switch(flags) {
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+    case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
+
+      if(scontext->current_is_ok) {
+        if(flags==LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT)
+          return &scontext->current;
+        else
+          return scontext->context_node;
+      }
+      
+      /* current stuff is out of date - get new cached answers */
+      if(scontext->index_contexts) {
+        if(scontext->context_node)
+          librdf_free_node(scontext->context_node);
+        scontext->context_node=NULL;
+        cnp=&scontext->context_node;
+      }
+      
+      librdf_statement_clear(&scontext->current);
+      
+      /* the key parts are the same for every answer; take them from
+       * the search pattern rather than decoding the key each time */
+      if((node=librdf_statement_get_subject(&scontext->search)))
+        librdf_statement_set_subject(&scontext->current,
+                                     librdf_new_node_from_node(node));
+      if((node=librdf_statement_get_predicate(&scontext->search)))
+        librdf_statement_set_predicate(&scontext->current,
+                                       librdf_new_node_from_node(node));
+      if((node=librdf_statement_get_object(&scontext->search)))
+        librdf_statement_set_object(&scontext->current,
+                                    librdf_new_node_from_node(node));
+      
+      hd=(librdf_hash_datum*)librdf_iterator_get_value(scontext->iterator);
+      
+      /* decode value content and optional context */
+      if(librdf_storage_hashes_decode(scontext->storage, &scontext->current,
+                                      cnp, scontext->value_fields,
+                                      (unsigned char*)hd->data, hd->size)) {
+        return NULL;
+      }
+
+      scontext->current_is_ok=1;
+
+      if(flags==LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT)
+        return &scontext->current;
+      else
+        return scontext->context_node;
+        
+    default:
+      librdf_log(scontext->iterator->world,
+                 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "Unimplemented flags %d seen", flags);
+      return NULL;
+  }
+}
+
+
+static void
+librdf_storage_hashes_find_finished(void* context)
+{
+  librdf_storage_hashes_find_stream_context* scontext=(librdf_storage_hashes_find_stream_context*)context;
+
+  if(scontext->iterator)
+    librdf_free_iterator(scontext->iterator);
+
+  if(scontext->context_node)
+    librdf_free_node(scontext->context_node);
+
+  if(scontext->key_buffer)
+    LIBRDF_FREE(data, scontext->key_buffer);
+
+  librdf_statement_clear(&scontext->search);
+  librdf_statement_clear(&scontext->current);
+
+  if(scontext->storage)
+    librdf_storage_remove_reference(scontext->storage);
+
+  LIBRDF_FREE(librdf_storage_hashes_find_stream_context, scontext);
+}
+
+
+/*
+ * librdf_storage_hashes_find_common - Create a stream of statements from one key of an index
+ * @storage: the storage hashes object
+ * @hash_index: the index of the hash to use
+ * @statement: the statement pattern; the key fields of the hash must be set
+ *
+ * Return value: a new #librdf_stream or NULL on failure
+ **/
+static librdf_stream*
+librdf_storage_hashes_find_common(librdf_storage* storage, int hash_index,
+                                  librdf_statement* statement)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_storage_hashes_find_stream_context *scontext;
+  librdf_statement_part fields;
+  librdf_stream *stream;
+  librdf_world* world = storage->world;
+  size_t key_buffer_len=0;
+  int rc;
+  
+  scontext = LIBRDF_CALLOC(librdf_storage_hashes_find_stream_context*,
+                           1, sizeof(*scontext));
+  if(!scontext)
+    return NULL;
+
+  librdf_statement_init(world, &scontext->search);
+  librdf_statement_init(world, &scontext->current);
+
+  scontext->index_contexts=context->index_contexts;
+  scontext->value_fields=context->hash_descriptions[hash_index]->value_fields;
+
+  /* after this point the finished method is called on errors
+   * so must bump the reference count
+   */
+  scontext->storage=storage;
+  librdf_storage_add_reference(scontext->storage);
+
+  /* copy only the parts of the pattern that make up the key */
+  fields=(librdf_statement_part)context->hash_descriptions[hash_index]->key_fields;
+  if(fields & LIBRDF_STATEMENT_SUBJECT)
+    librdf_statement_set_subject(&scontext->search,
+                                 librdf_new_node_from_node(librdf_statement_get_subject(statement)));
+  if(fields & LIBRDF_STATEMENT_PREDICATE)
+    librdf_statement_set_predicate(&scontext->search,
+                                   librdf_new_node_from_node(librdf_statement_get_predicate(statement)));
+  if(fields & LIBRDF_STATEMENT_OBJECT)
+    librdf_statement_set_object(&scontext->search,
+                                librdf_new_node_from_node(librdf_statement_get_object(statement)));
+
+  /* ENCODE KEY */
+  rc=librdf_storage_hashes_encode(storage, &scontext->search, NULL, fields,
+                                  &scontext->key_buffer, &key_buffer_len,
+                                  &scontext->key.size);
+  if(rc) {
+    librdf_storage_hashes_find_finished(scontext);
+    /* a node that is not in the dictionary cannot match anything */
+    return (rc > 0) ? librdf_new_empty_stream(world) : NULL;
+  }
+  scontext->key.data=scontext->key_buffer;
+
+  scontext->iterator=librdf_hash_get_all(context->hashes[hash_index],
+                                         &scontext->key, &scontext->value);
+  if(!scontext->iterator) {
+    librdf_storage_hashes_find_finished(scontext);
+    return librdf_new_empty_stream(world);
+  }
+
+  stream=librdf_new_stream(world,
+                           (void*)scontext,
+                           &librdf_storage_hashes_find_end_of_stream,
+                           &librdf_storage_hashes_find_next_statement,
+                           &librdf_storage_hashes_find_get_statement,
+                           &librdf_storage_hashes_find_finished);
+  if(!stream) {
+    librdf_storage_hashes_find_finished((void*)scontext);
+    return NULL;
+  }
+  
+  return stream;  
+}
+
+
+/*
+ * librdf_storage_hashes_find_index - Pick the best index for a statement pattern
+ * @context: the storage hashes instance
+ * @fields: the statement parts that are bound in the pattern
+ *
+ * Finds the statement index whose key uses as many of the bound parts
+ * as possible, and no unbound ones.
+ *
+ * Return value: index of hash or <0 if no index can answer the pattern
+ **/
+static int
+librdf_storage_hashes_find_index(librdf_storage_hashes_instance* context,
+                                 int fields)
+{
+  int i;
+  int best_index= -1;
+  int best_count=0;
+  
+  for(i=0; i<context->hash_count; i++) {
+    int key_fields;
+    int count=0;
+    
+    if(!context->hash_descriptions[i])
+      continue;
+
+    key_fields=context->hash_descriptions[i]->key_fields;
+    /* skip the contexts hash and indexes needing unbound parts */
+    if(!key_fields || !context->hash_descriptions[i]->value_fields ||
+       (key_fields & ~fields))
+      continue;
+
+    if(key_fields & LIBRDF_STATEMENT_SUBJECT)
+      count++;
+    if(key_fields & LIBRDF_STATEMENT_PREDICATE)
+      count++;
+    if(key_fields & LIBRDF_STATEMENT_OBJECT)
+      count++;
+
+    if(count > best_count) {
+      best_index=i;
+      best_count=count;
+    }
+  }
+
+  return best_index;
+}
+
+
+/*
+ * librdf_storage_hashes_find_prefix_index - Pick an ordered index to prefix scan for a pattern
+ * @context: the storage hashes instance
+ * @fields: the statement parts that are bound in the pattern
+ * @prefix_fields_p: pointer to store the key parts making up the prefix
+ *
+ * Keys are the encoded parts in subject, predicate, object order so
+ * the bound parts at the start of a key select a contiguous range of
+ * an ordered hash.  Finds the ordered index with the longest such
+ * prefix.
+ *
+ * Return value: index of hash or <0 if no index has a bound prefix
+ **/
+static int
+librdf_storage_hashes_find_prefix_index(librdf_storage_hashes_instance* context,
+                                        int fields, int *prefix_fields_p)
+{
+  static const int part_fields[3]={
+    LIBRDF_STATEMENT_SUBJECT,
+    LIBRDF_STATEMENT_PREDICATE,
+    LIBRDF_STATEMENT_OBJECT
+  };
+  int i;
+  int best_index= -1;
+  int best_count=0;
+  
+  for(i=0; i<context->hash_count; i++) {
+    int key_fields;
+    int prefix_fields=0;
+    int count=0;
+    int j;
+    
+    if(!context->hash_descriptions[i] ||
+       !librdf_hash_has_set_range(context->hashes[i]))
+      continue;
+
+    key_fields=context->hash_descriptions[i]->key_fields;
+    if(!key_fields || !context->hash_descriptions[i]->value_fields)
+      continue;
+
+    for(j=0; j<3; j++) {
+      if(!(key_fields & part_fields[j]))
+        continue;
+      if(!(fields & part_fields[j]))
+        break;
+      prefix_fields |= part_fields[j];
+      count++;
+    }
+
+    if(count > best_count) {
+      best_index=i;
+      best_count=count;
+      *prefix_fields_p=prefix_fields;
+    }
+  }
+
+  return best_index;
+}
+
+
 /**
  * librdf_storage_hashes_find_statements:
  * @storage: the storage
@@ -1075,7 +2350,13 @@ librdf_storage_hashes_serialise_finished(void* context)
  * Return a stream of statements matching the given statement (or
  * all statements if NULL).  Parts (subject, predicate, object) of the
  * statement can be empty in which case any statement part will match that.
- * Uses #librdf_statement_match to do the matching.
+ *
+ * The bound parts are used to pick the index hash that covers most of
+ * them and only the values of the matching key are visited.  If no
+ * key is made only of bound parts, an ordered index whose keys start
+ * with bound parts is scanned over that key range instead.  Any
+ * remaining bound part is matched with #librdf_statement_match, as are
+ * all parts when no index applies.
  * 
  * Return value: a #librdf_stream or NULL on failure
  **/
@@ -1084,27 +2365,50 @@ librdf_storage_hashes_find_statements(librdf_storage* storage, librdf_statement*
 {
   librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
   librdf_stream* stream;
-
-  if(!librdf_statement_get_subject(statement) &&
-     librdf_statement_get_predicate(statement) &&
-     !librdf_statement_get_object(statement) &&
-     context->p2so_index >= 0) {
-    /* (? p ?) -> (s p o) wanted */
-    stream=librdf_storage_hashes_serialise_common(storage,
-                                                  context->p2so_index,
-                                                  librdf_statement_get_predicate(statement),
-                                                  LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_OBJECT);
+  int fields=0;
+  int hash_index= -1;
+
+  if(librdf_statement_get_subject(statement))
+    fields |= LIBRDF_STATEMENT_SUBJECT;
+  if(librdf_statement_get_predicate(statement))
+    fields |= LIBRDF_STATEMENT_PREDICATE;
+  if(librdf_statement_get_object(statement))
+    fields |= LIBRDF_STATEMENT_OBJECT;
+
+  if(!fields)
+    return librdf_storage_hashes_serialise(storage);
+
+  hash_index=librdf_storage_hashes_find_index(context, fields);
+  if(hash_index >= 0) {
+    stream=librdf_storage_hashes_find_common(storage, hash_index, statement);
+
+    /* all bound parts are in the key so every value is an answer */
+    if(context->hash_descriptions[hash_index]->key_fields == fields)
+      return stream;
   } else {
-    statement=librdf_new_statement_from_statement(statement);
-    if(!statement)
-      return NULL;
+    int prefix_fields=0;
+    
+    hash_index=librdf_storage_hashes_find_prefix_index(context, fields,
+                                                       &prefix_fields);
+    if(hash_index >= 0)
+      stream=librdf_storage_hashes_serialise_common(storage, hash_index,
+                                                    statement, prefix_fields);
+    else
+      stream=librdf_storage_hashes_serialise(storage);
+  }
+
+  if(!stream)
+    return NULL;
 
-    stream=librdf_storage_hashes_serialise(storage);
-    if(stream)
-      librdf_stream_add_map(stream, 
-                            &librdf_stream_statement_find_map,
-                            (librdf_stream_map_free_context_handler)&librdf_free_statement, (void*)statement);
+  statement=librdf_new_statement_from_statement(statement);
+  if(!statement) {
+    librdf_free_stream(stream);
+    return NULL;
   }
+
+  librdf_stream_add_map(stream, 
+                        &librdf_stream_statement_find_map,
+                        (librdf_stream_map_free_context_handler)&librdf_free_statement, (void*)statement);
   
   return stream;
 }
@@ -1115,6 +2419,7 @@ typedef struct {
   int hash_index;            /* index of hash in storage list of hashes */
   librdf_iterator* iterator; /* owned iterator over above hash */
   int want;                  /* part of decoded statement to return */
+  int value_fields;          /* parts of the statement in each value */
   librdf_statement statement; /* NOTE: stored here, never allocated */
   librdf_statement statement2; /* NOTE: stored here, never allocated */
   librdf_hash_datum key;
@@ -1122,6 +2427,8 @@ typedef struct {
   librdf_node *search_node;
   int index_contexts;
   librdf_node *context_node;
+  int borrow;                /* non 0 to return borrowed nodes */
+  librdf_node borrowed;      /* NOTE: stored here, never allocated */
 } librdf_storage_hashes_node_iterator_context;
 
 
@@ -1152,14 +2459,13 @@ librdf_storage_hashes_node_iterator_get_method(void* iterator, int flags)
   librdf_storage_hashes_node_iterator_context* context=(librdf_storage_hashes_node_iterator_context*)iterator;
   librdf_node* node;
   librdf_hash_datum* value;
-  librdf_world* world;
-  
-  world = context->storage->world;
   
   if(librdf_iterator_end(context->iterator))
     return NULL;
 
   if(flags == LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT) {
+    librdf_statement statement; /* on stack */
+    
     /* current stuff is out of date - get new cached answers */
     if(!context->index_contexts)
       return NULL;
@@ -1171,11 +2477,15 @@ librdf_storage_hashes_node_iterator_get_method(void* iterator, int flags)
     context->context_node=NULL;
       
     /* decode value content and optional context */
-    if(!librdf_statement_decode2(world, &context->statement,
-                                 &context->context_node,
-                                 (unsigned char*)value->data, value->size))
+    librdf_statement_init(context->storage->world, &statement);
+    if(librdf_storage_hashes_decode(context->storage, &statement,
+                                    &context->context_node,
+                                    context->value_fields,
+                                    (unsigned char*)value->data, value->size)) {
+      librdf_statement_clear(&statement);
       return NULL;
-    librdf_statement_clear(&context->statement);
+    }
+    librdf_statement_clear(&statement);
     
     return context->context_node;
   }
@@ -1190,6 +2500,22 @@ librdf_storage_hashes_node_iterator_get_method(void* iterator, int flags)
 
 
   /* get object */
+  if(context->borrow) {
+    librdf_node_clear_borrowed(&context->borrowed);
+
+    value=(librdf_hash_datum*)librdf_iterator_get_value(context->iterator);
+    if(!value)
+      return NULL;
+
+    if(librdf_storage_hashes_decode_borrowed(context->storage,
+                                             &context->borrowed,
+                                             (unsigned char*)value->data,
+                                             value->size))
+      return NULL;
+
+    return (void*)&context->borrowed;
+  }
+
   switch(context->want) {
     case LIBRDF_STATEMENT_SUBJECT: /* SOURCES (subjects) */
       if((node=librdf_statement_get_subject(&context->statement)))
@@ -1225,9 +2551,9 @@ librdf_storage_hashes_node_iterator_get_method(void* iterator, int flags)
   if(!value)
     return NULL;
 
-  if(!librdf_statement_decode2(world, &context->statement, NULL,
-                               (unsigned char*)value->data,
-                               value->size))
+  if(librdf_storage_hashes_decode(context->storage, &context->statement,
+                                  NULL, context->value_fields,
+                                  (unsigned char*)value->data, value->size))
     return NULL;
 
   switch(context->want) {
@@ -1283,6 +2609,8 @@ librdf_storage_hashes_node_iterator_finished(void* iterator)
   if((node=librdf_statement_get_predicate(&icontext->statement2)))
      librdf_free_node(node);
 
+  librdf_node_clear_borrowed(&icontext->borrowed);
+
   if(icontext->storage)
     librdf_storage_remove_reference(icontext->storage);
   
@@ -1311,9 +2639,10 @@ librdf_storage_hashes_node_iterator_create(librdf_storage* storage,
   librdf_storage_hashes_node_iterator_context* icontext;
   librdf_hash *hash;
   librdf_statement_part fields;
-  unsigned char *key_buffer;
+  unsigned char *key_buffer=NULL;
+  size_t key_buffer_len=0;
   librdf_iterator* iterator;
-  librdf_world* world = storage->world;
+  int rc;
   
   icontext = LIBRDF_CALLOC(librdf_storage_hashes_node_iterator_context*, 1,
                            sizeof(*icontext));
@@ -1324,6 +2653,13 @@ librdf_storage_hashes_node_iterator_create(librdf_storage* storage,
 
   icontext->hash_index=hash_index;
   icontext->want=want;
+  icontext->value_fields=scontext->hash_descriptions[hash_index]->value_fields;
+
+  /* with borrow-nodes, a value holding just the wanted node is
+   * returned without copying it, valid until the iterator moves on */
+  icontext->borrow=(scontext->borrow_nodes && !scontext->dictionary &&
+                    icontext->want == icontext->value_fields &&
+                    icontext->want != (LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_OBJECT));
 
   icontext->index_contexts=scontext->index_contexts;
 
@@ -1377,33 +2713,24 @@ librdf_storage_hashes_node_iterator_create(librdf_storage* storage,
   }
 
 
-  /* ENCODE KEY */
-  fields=(librdf_statement_part)scontext->hash_descriptions[hash_index]->key_fields;
-  icontext->key.size=librdf_statement_encode_parts2(world, &icontext->statement, NULL,
-                                                    NULL, 0, fields);
-  if(!icontext->key.size) {
-    LIBRDF_FREE(librdf_storage_hashes_node_iterator_context, icontext);
-    return NULL;
-  }
-  key_buffer = LIBRDF_MALLOC(unsigned char*, icontext->key.size);
-  if(!key_buffer) {
-    LIBRDF_FREE(librdf_storage_hashes_node_iterator_context, icontext);
-    return NULL;
-  }
-       
   /* after this point the finished method is called on errors
    * so must bump the reference count
    */
   librdf_storage_add_reference(icontext->storage);
 
-  if(!librdf_statement_encode_parts2(world, &icontext->statement, NULL,
-                                     key_buffer, icontext->key.size, fields)) {
-    LIBRDF_FREE(data, key_buffer);
+  /* ENCODE KEY */
+  fields=(librdf_statement_part)scontext->hash_descriptions[hash_index]->key_fields;
+  rc=librdf_storage_hashes_encode(storage, &icontext->statement, NULL, fields,
+                                  &key_buffer, &key_buffer_len,
+                                  &icontext->key.size);
+  if(rc) {
+    if(key_buffer)
+      LIBRDF_FREE(data, key_buffer);
     librdf_storage_hashes_node_iterator_finished(icontext);
-    return NULL;
+    /* a node that is not in the dictionary cannot match anything */
+    return (rc > 0) ? librdf_new_empty_iterator(storage->world) : NULL;
   }
 
-    
   icontext->key.data=key_buffer;
 
   icontext->iterator=librdf_hash_get_all(hash, &icontext->key, &icontext->value);
@@ -1489,15 +2816,24 @@ librdf_storage_hashes_context_add_statement(librdf_storage* storage,
                                                 statement, context_node, 1))
     return 1;
 
-  size = librdf_node_encode(context_node, NULL, 0);
+  size = librdf_node_encode_version(context_node, NULL, 0,
+                                    context->node_encoding);
   key.data = LIBRDF_MALLOC(char*, size);
-  key.size=librdf_node_encode(context_node, 
-                               (unsigned char*)key.data, size);
+  key.size=librdf_node_encode_version(context_node,
+                                      (unsigned char*)key.data, size,
+                                      context->node_encoding);
 
-  size = librdf_statement_encode2(world, statement, NULL, 0);
+  size = librdf_statement_encode_parts_version(world, statement, NULL,
+                                               NULL, 0,
+                                               LIBRDF_STATEMENT_ALL,
+                                               context->node_encoding);
 
   value.data = LIBRDF_MALLOC(char*, size);
-  value.size=librdf_statement_encode2(world, statement, (unsigned char*)value.data, size);
+  value.size=librdf_statement_encode_parts_version(world, statement, NULL,
+                                                   (unsigned char*)value.data,
+                                                   size,
+                                                   LIBRDF_STATEMENT_ALL,
+                                                   context->node_encoding);
 
   status=librdf_hash_put(context->hashes[context->contexts_index], &key, &value);
   LIBRDF_FREE(data, key.data);
@@ -1537,15 +2873,24 @@ librdf_storage_hashes_context_remove_statement(librdf_storage* storage,
                                                 statement, context_node, 0))
     return 1;
   
-  size = librdf_node_encode(context_node, NULL, 0);
+  size = librdf_node_encode_version(context_node, NULL, 0,
+                                    context->node_encoding);
   key.data = LIBRDF_MALLOC(char*, size);
-  key.size=librdf_node_encode(context_node,
-                               (unsigned char*)key.data, size);
+  key.size=librdf_node_encode_version(context_node,
+                                      (unsigned char*)key.data, size,
+                                      context->node_encoding);
 
-  size = librdf_statement_encode2(world, statement, NULL, 0);
+  size = librdf_statement_encode_parts_version(world, statement, NULL,
+                                               NULL, 0,
+                                               LIBRDF_STATEMENT_ALL,
+                                               context->node_encoding);
 
   value.data = LIBRDF_MALLOC(char*, size);
-  value.size=librdf_statement_encode2(world, statement, (unsigned char*)value.data, size);
+  value.size=librdf_statement_encode_parts_version(world, statement, NULL,
+                                                   (unsigned char*)value.data,
+                                                   size,
+                                                   LIBRDF_STATEMENT_ALL,
+                                                   context->node_encoding);
 
   status=librdf_hash_delete(context->hashes[context->contexts_index], &key, &value);
   LIBRDF_FREE(data, key.data);
@@ -1613,11 +2958,12 @@ librdf_storage_hashes_context_serialise(librdf_storage* storage,
   scontext->index_contexts=context->index_contexts;
   scontext->context_node=librdf_new_node_from_node(context_node);
 
-  size=librdf_node_encode(context_node, NULL, 0);
+  size=librdf_node_encode_version(context_node, NULL, 0,
+                                  context->node_encoding);
   scontext->key->data = scontext->context_node_data=LIBRDF_MALLOC(char*, size);
-  scontext->key->size=librdf_node_encode(context_node,
-                                         (unsigned char*)scontext->key->data,
-                                         size);
+  scontext->key->size=librdf_node_encode_version(context_node,
+                                                 (unsigned char*)scontext->key->data,
+                                                 size, context->node_encoding);
 
   scontext->iterator=librdf_hash_get_all(context->hashes[context->contexts_index], 
                                          scontext->key, scontext->value);
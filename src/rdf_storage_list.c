@@ -39,12 +39,30 @@
 #include <sys/types.h>
 
 #include <redland.h>
+#include <rdf_list_internal.h>
+
+
+/* These are stored in the list */
+typedef struct librdf_storage_list_node_s
+{
+  librdf_statement *statement;
+  librdf_node *context;
+
+  librdf_list_node* list_node; /* holding this in the list */
+  u32 hash; /* of the statement without the context */
+  struct librdf_storage_list_node_s* hash_next; /* in the same bucket */
+} librdf_storage_list_node;
 
 
 typedef struct
 {
   librdf_list* list;
 
+  /* Hash set of the list nodes by statement, so a statement can be
+   * found without walking the list.  The size is a power of 2. */
+  librdf_storage_list_node** buckets;
+  int buckets_size;
+
   /* If this is non-0, contexts are being used */
   int index_contexts;
   librdf_hash* contexts;
@@ -52,14 +70,6 @@ typedef struct
 } librdf_storage_list_instance;
 
 
-/* These are stored in the list */
-typedef struct
-{
-  librdf_statement *statement;
-  librdf_node *context;
-} librdf_storage_list_node;
-
-
 /* prototypes for local functions */
 static int librdf_storage_list_init(librdf_storage* storage, const char *name, librdf_hash* options);
 static int librdf_storage_list_open(librdf_storage* storage, librdf_model* model);
@@ -92,6 +102,11 @@ static void librdf_storage_list_context_serialise_finished(void* context);
 /* helper functions for contexts */
 static int librdf_storage_list_node_equals(librdf_storage_list_node *first, librdf_storage_list_node *second);
 
+/* statement hash set functions */
+static u32 librdf_storage_list_statement_hash(librdf_statement* statement);
+static librdf_storage_list_node* librdf_storage_list_find_node(librdf_storage_list_instance* context, librdf_statement* statement, librdf_node* context_node, int any_context);
+static int librdf_storage_list_add_node(librdf_storage* storage, librdf_node* context_node, librdf_statement* statement);
+
 static librdf_iterator* librdf_storage_list_get_contexts(librdf_storage* storage);
 
 /* get_context iterator functions */
@@ -163,6 +178,178 @@ librdf_storage_list_node_equals(librdf_storage_list_node *first,
 }
 
 
+static u32
+librdf_storage_list_statement_hash(librdf_statement* statement)
+{
+  u32 hash;
+
+  hash=librdf_node_hash(statement->subject);
+  hash=hash * 31 + librdf_node_hash(statement->predicate);
+  hash=hash * 31 + librdf_node_hash(statement->object);
+
+  return hash;
+}
+
+
+/*
+ * librdf_storage_list_find_node:
+ * @context: list storage instance
+ * @statement: statement to find
+ * @context_node: context of the statement or NULL
+ * @any_context: non 0 to find the statement in any context
+ *
+ * INTERNAL - Find the list node of a statement in the hash set
+ *
+ * Return value: list node or NULL if not found
+ */
+static librdf_storage_list_node*
+librdf_storage_list_find_node(librdf_storage_list_instance* context,
+                              librdf_statement* statement,
+                              librdf_node* context_node, int any_context)
+{
+  librdf_storage_list_node search_sln; /* on stack - not allocated */
+  librdf_storage_list_node* sln;
+  u32 hash;
+
+  if(!context->buckets)
+    return NULL;
+
+  search_sln.statement=statement;
+  search_sln.context=context_node;
+
+  hash=librdf_storage_list_statement_hash(statement);
+  for(sln=context->buckets[hash & (context->buckets_size - 1)]; sln;
+      sln=sln->hash_next) {
+    if(sln->hash != hash)
+      continue;
+
+    if(any_context) {
+      if(librdf_statement_equals(sln->statement, statement))
+        return sln;
+    } else if(librdf_storage_list_node_equals(sln, &search_sln))
+      return sln;
+  }
+
+  return NULL;
+}
+
+
+/* add a list node to the hash set, growing it to keep one node per bucket */
+static int
+librdf_storage_list_hash_add(librdf_storage_list_instance* context,
+                             librdf_storage_list_node* sln)
+{
+  librdf_storage_list_node** bucket;
+
+  if(librdf_list_size(context->list) > context->buckets_size) {
+    librdf_storage_list_node** buckets;
+    int size=context->buckets_size ? context->buckets_size * 2 : 64;
+    int i;
+
+    buckets=LIBRDF_CALLOC(librdf_storage_list_node**, size, sizeof(*buckets));
+    if(buckets) {
+      for(i=0; i < context->buckets_size; i++) {
+        librdf_storage_list_node* next;
+        librdf_storage_list_node* node;
+
+        for(node=context->buckets[i]; node; node=next) {
+          next=node->hash_next;
+          node->hash_next=buckets[node->hash & (size - 1)];
+          buckets[node->hash & (size - 1)]=node;
+        }
+      }
+      if(context->buckets)
+        LIBRDF_FREE(librdf_storage_list_node**, context->buckets);
+      context->buckets=buckets;
+      context->buckets_size=size;
+    } else if(!context->buckets)
+      return 1;
+    /* else carry on with longer chains */
+  }
+
+  bucket=&context->buckets[sln->hash & (context->buckets_size - 1)];
+  sln->hash_next=*bucket;
+  *bucket=sln;
+
+  return 0;
+}
+
+
+static void
+librdf_storage_list_hash_remove(librdf_storage_list_instance* context,
+                                librdf_storage_list_node* sln)
+{
+  librdf_storage_list_node** node_p;
+
+  for(node_p=&context->buckets[sln->hash & (context->buckets_size - 1)];
+      *node_p; node_p=&(*node_p)->hash_next) {
+    if(*node_p == sln) {
+      *node_p=sln->hash_next;
+      return;
+    }
+  }
+}
+
+
+/*
+ * librdf_storage_list_add_node:
+ * @storage: the storage
+ * @context_node: context of the statement or NULL
+ * @statement: statement to add
+ *
+ * INTERNAL - Add a copy of a statement to the end of the list and to
+ * the hash set
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_list_add_node(librdf_storage* storage,
+                             librdf_node* context_node,
+                             librdf_statement* statement)
+{
+  librdf_storage_list_instance* context=(librdf_storage_list_instance*)storage->instance;
+  librdf_storage_list_node* sln;
+
+  sln = LIBRDF_CALLOC(librdf_storage_list_node*, 1, sizeof(*sln));
+  if(!sln)
+    return 1;
+
+  /* copy shared statement */
+  sln->statement=librdf_new_statement_from_statement(statement);
+  if(!sln->statement) {
+    LIBRDF_FREE(librdf_storage_list_node, sln);
+    return 1;
+  }
+  if(context_node) {
+    sln->context=librdf_new_node_from_node(context_node);
+    if(!sln->context) {
+      librdf_free_statement(sln->statement);
+      LIBRDF_FREE(librdf_storage_list_node, sln);
+      return 1;
+    }
+  }
+  sln->hash=librdf_storage_list_statement_hash(statement);
+
+  if(librdf_list_add(context->list, sln))
+    goto failed;
+  sln->list_node=context->list->last;
+
+  if(librdf_storage_list_hash_add(context, sln)) {
+    librdf_list_remove_node(context->list, sln->list_node);
+    goto failed;
+  }
+
+  return 0;
+
+  failed:
+  if(sln->context)
+    librdf_free_node(sln->context);
+  librdf_free_statement(sln->statement);
+  LIBRDF_FREE(librdf_storage_list_node, sln);
+  return 1;
+}
+
+
 static int
 librdf_storage_list_open(librdf_storage* storage, librdf_model* model)
 {
@@ -182,9 +369,6 @@ librdf_storage_list_open(librdf_storage* storage, librdf_model* model)
     }
   }
 
-  librdf_list_set_equals(context->list, 
-                         (int (*)(void*, void*))&librdf_storage_list_node_equals);
-
   return 0;
 }
 
@@ -217,6 +401,12 @@ librdf_storage_list_close(librdf_storage* storage)
     context->list=NULL;
   }
 
+  if(context->buckets) {
+    LIBRDF_FREE(librdf_storage_list_node**, context->buckets);
+    context->buckets=NULL;
+    context->buckets_size=0;
+  }
+
   if(context->index_contexts) {
     if(context->contexts) {
       librdf_free_hash(context->contexts);
@@ -252,13 +442,11 @@ static int
 librdf_storage_list_add_statements(librdf_storage* storage,
                                    librdf_stream* statement_stream)
 {
-  librdf_storage_list_instance* context=(librdf_storage_list_instance*)storage->instance;
   int status=0;
 
   for(; !librdf_stream_end(statement_stream);
       librdf_stream_next(statement_stream)) {
     librdf_statement* statement=librdf_stream_get_object(statement_stream);
-    librdf_storage_list_node* sln;
 
     if(!statement) {
       status=1;
@@ -269,21 +457,9 @@ librdf_storage_list_add_statements(librdf_storage* storage,
     if(librdf_storage_list_contains_statement(storage, statement))
       continue;
 
-    sln = LIBRDF_MALLOC(librdf_storage_list_node*, sizeof(*sln));
-    if(!sln) {
-      status=1;
+    status=librdf_storage_list_add_node(storage, NULL, statement);
+    if(status)
       break;
-    }
-    
-    /* copy shared statement */
-    sln->statement=librdf_new_statement_from_statement(statement);
-    if(!sln->statement) {
-      LIBRDF_FREE(librdf_storage_list_node, sln);
-      status=1;
-      break;
-    }
-    sln->context=NULL;
-    librdf_list_add(context->list, sln);
   }
   
   return status;
@@ -301,28 +477,9 @@ static int
 librdf_storage_list_contains_statement(librdf_storage* storage, librdf_statement* statement)
 {
   librdf_storage_list_instance* context=(librdf_storage_list_instance*)storage->instance;
-  librdf_storage_list_node sln; /* STATIC */
-  sln.statement=statement;
-  sln.context=NULL;
-
-  if(context->index_contexts) {
-    /* When we have contexts, we have to use find_statements for contains
-     * since we do not know what context node may be stored for a statement
-     */
-    librdf_stream *stream=librdf_storage_list_find_statements(storage, statement);
-    int status;
-
-    if(!stream)
-      return 0;
-    /* librdf_stream_end returns 0 if have more, non-0 at end */
-    status=!librdf_stream_end(stream);
-    /* convert to 0 if at end (not found) and non-zero otherwise (found) */
-    librdf_free_stream(stream);
-    return status;
-  }
-  
 
-  return librdf_list_contains(context->list, &sln);
+  /* The statement may be stored with any context node */
+  return (librdf_storage_list_find_node(context, statement, NULL, 1) != NULL);
 }
 
 
@@ -485,7 +642,6 @@ librdf_storage_list_context_add_statement(librdf_storage* storage,
   librdf_storage_list_instance* context=(librdf_storage_list_instance*)storage->instance;
   librdf_hash_datum key, value; /* on stack - not allocated */
   size_t size;
-  librdf_storage_list_node* sln;
   int status;
   librdf_world* world;
 
@@ -497,34 +653,13 @@ librdf_storage_list_context_add_statement(librdf_storage* storage,
     return 1;
   }
   
-  /* Store statement + node in the storage_list */
-  sln = LIBRDF_MALLOC(librdf_storage_list_node*, sizeof(*sln));
-  if(!sln)
-    return 1;
+  /* Each statement is stored once per context */
+  if(librdf_storage_list_find_node(context, statement, context_node, 0))
+    return 0;
 
-  sln->statement=librdf_new_statement_from_statement(statement);
-  if(!sln->statement) {
-    LIBRDF_FREE(librdf_storage_list_node, sln);
-    return 1;
-  }
-  if(context->index_contexts && context_node) {
-    sln->context=librdf_new_node_from_node(context_node);
-    if(!sln->context) {
-      librdf_free_statement(sln->statement);
-      LIBRDF_FREE(librdf_storage_list_node, sln);
-      return 1;
-    }
-  } else
-    sln->context=NULL;
-  
-  status=librdf_list_add(context->list, sln);
-  if(status) {
-    if(context_node)
-      librdf_free_node(sln->context);
-    librdf_free_statement(sln->statement);
-    LIBRDF_FREE(librdf_storage_list_node, sln);
+  /* Store statement + node in the storage_list */
+  if(librdf_storage_list_add_node(storage, context_node, statement))
     return 1;
-  }
 
   if(!context->index_contexts || !context_node)
     return 0;
@@ -564,7 +699,6 @@ librdf_storage_list_context_remove_statement(librdf_storage* storage,
   librdf_storage_list_instance* context=(librdf_storage_list_instance*)storage->instance;
   librdf_hash_datum key, value; /* on stack - not allocated */
   librdf_storage_list_node* sln;
-  librdf_storage_list_node search_sln; /* on stack - not allocated */
   size_t size;
   int status;
   librdf_world* world;
@@ -577,14 +711,14 @@ librdf_storage_list_context_remove_statement(librdf_storage* storage,
     return 1;
   }
   
-  search_sln.statement=statement;
-  search_sln.context=context_node;
-
   /* Remove stored statement+context */
-  sln=(librdf_storage_list_node*)librdf_list_remove(context->list, &search_sln);
+  sln=librdf_storage_list_find_node(context, statement, context_node, 0);
   if(!sln)
     return 1;
 
+  librdf_storage_list_hash_remove(context, sln);
+  librdf_list_remove_node(context->list, sln->list_node);
+
   librdf_free_statement(sln->statement);
   if(sln->context)
     librdf_free_node(sln->context);
@@ -44,29 +44,121 @@
 
 #include <redland.h>
 
-/* Not yet fully implemented (namely iteration) */
-/*#define RDF_STORAGE_TREES_WITH_CONTEXTS 1*/
+
+/* Index orders; the part of the statement at each position of the
+ * index key is given by librdf_storage_trees_orders */
+typedef enum {
+  LIBRDF_STORAGE_TREES_SPO,
+  LIBRDF_STORAGE_TREES_SOP,
+  LIBRDF_STORAGE_TREES_OPS,
+  LIBRDF_STORAGE_TREES_PSO,
+  LIBRDF_STORAGE_TREES_ORDERS
+} librdf_storage_trees_order;
+
+/* Feature with the index orders built, such as "spo ops" */
+#define LIBRDF_STORAGE_TREES_FEATURE_INDEXES "http://feature.librdf.org/storage-trees-indexes"
+
+static const char* const librdf_storage_trees_order_names[LIBRDF_STORAGE_TREES_ORDERS] = {
+  "spo", "sop", "ops", "pso"
+};
+
+/* statement parts: 0 subject, 1 predicate, 2 object */
+static const int librdf_storage_trees_orders[LIBRDF_STORAGE_TREES_ORDERS][3] = {
+  { 0, 1, 2 }, /* spo */
+  { 0, 2, 1 }, /* sop */
+  { 2, 1, 0 }, /* ops */
+  { 1, 0, 2 }  /* pso */
+};
+
+
+/* B+tree over node id triples used with index-type='btree'.  Keys are
+ * compared as 3 unsigned ids in index order; id 0 is never used so a
+ * key padded with 0s sorts before every key with the same prefix.
+ * Leaves are chained for range scans and are not merged on deletion.
+ */
+#define LIBRDF_STORAGE_TREES_LEAF_KEYS 170
+#define LIBRDF_STORAGE_TREES_BRANCH_KEYS 127
+#define LIBRDF_STORAGE_TREES_BTREE_MAX_DEPTH 16
+/* keys per leaf and children per branch when bulk loading, leaving
+ * room for later insertions */
+#define LIBRDF_STORAGE_TREES_LEAF_FILL (LIBRDF_STORAGE_TREES_LEAF_KEYS - LIBRDF_STORAGE_TREES_LEAF_KEYS / 8)
+#define LIBRDF_STORAGE_TREES_BRANCH_FILL (LIBRDF_STORAGE_TREES_BRANCH_KEYS + 1 - (LIBRDF_STORAGE_TREES_BRANCH_KEYS + 1) / 8)
 
 typedef struct
 {
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
-  librdf_node* context;
-#endif
-  raptor_avltree* spo_tree; /* Always present */
-  raptor_avltree* sop_tree; /* Optional */
-  raptor_avltree* ops_tree; /* Optional */
-  raptor_avltree* pso_tree; /* Optional */
-} librdf_storage_trees_graph;
+  int is_leaf;
+  int count; /* keys in a leaf, children in a branch */
+} librdf_storage_trees_bnode;
+
+typedef struct librdf_storage_trees_leaf_s
+{
+  librdf_storage_trees_bnode header;
+  struct librdf_storage_trees_leaf_s* next;
+  u32 keys[LIBRDF_STORAGE_TREES_LEAF_KEYS][3];
+} librdf_storage_trees_leaf;
+
+typedef struct
+{
+  librdf_storage_trees_bnode header;
+  /* keys[i] is the smallest key under children[i+1] */
+  u32 keys[LIBRDF_STORAGE_TREES_BRANCH_KEYS][3];
+  librdf_storage_trees_bnode* children[LIBRDF_STORAGE_TREES_BRANCH_KEYS + 1];
+} librdf_storage_trees_branch;
+
+typedef struct
+{
+  librdf_storage_trees_bnode* root;
+  int size;
+} librdf_storage_trees_btree;
+
+/* position in a btree; leaf is NULL at the end */
+typedef struct
+{
+  librdf_storage_trees_leaf* leaf;
+  int index;
+  u32 prefix[3];
+  int prefix_length;
+} librdf_storage_trees_bcursor;
+
 
+/* Node with an id in the btree indexes */
 typedef struct
+{
+  librdf_node* node; /* NULL when the id is free */
+  u32 id;
+  int usage; /* statements using the node */
+  u32 next_free; /* next free id when node is NULL */
+} librdf_storage_trees_node_id;
+
+
+typedef struct
+{
+  librdf_node* context; /* NULL for statements without a context */
+  struct librdf_storage_trees_instance_s* instance;
+  /* Indexed by order.  The spo index is always present; with avltrees
+   * it owns the statements and the others have null deleters */
+  raptor_avltree* trees[LIBRDF_STORAGE_TREES_ORDERS];
+  librdf_storage_trees_btree* btrees[LIBRDF_STORAGE_TREES_ORDERS];
+} librdf_storage_trees_graph;
+
+typedef struct librdf_storage_trees_instance_s
 {
   librdf_storage_trees_graph* graph; /* Statements without a context */
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
-  raptor_avltree* contexts; /* Tree of librdf_storage_trees_graph */
-#endif
-  int index_sop;
-  int index_ops;
-  int index_pso;
+  raptor_avltree* contexts; /* Tree of librdf_storage_trees_graph or NULL */
+  int index[LIBRDF_STORAGE_TREES_ORDERS]; /* orders to index */
+
+  /* Full scans made for want of each index and the number after
+   * which the missing index is built, or 0 to never build it */
+  int scans[LIBRDF_STORAGE_TREES_ORDERS];
+  int index_build;
+
+  /* index-type='btree' */
+  int index_btree;
+  raptor_avltree* node_ids; /* librdf_storage_trees_node_id by node */
+  librdf_storage_trees_node_id** id_nodes; /* by id */
+  u32 id_nodes_size;
+  u32 id_nodes_count; /* ids 1..id_nodes_count have been used */
+  u32 free_id; /* first free id or 0 */
 } librdf_storage_trees_instance;
 
 /* prototypes for local functions */
@@ -76,18 +168,47 @@ static int librdf_storage_trees_close(librdf_storage* storage);
 static int librdf_storage_trees_size(librdf_storage* storage);
 static int librdf_storage_trees_add_statement(librdf_storage* storage, librdf_statement* statement);
 static int librdf_storage_trees_add_statements(librdf_storage* storage, librdf_stream* statement_stream);
+static int librdf_storage_trees_add_statements_internal(librdf_storage* storage, librdf_storage_trees_graph* graph, librdf_stream* statement_stream);
 static int librdf_storage_trees_remove_statement(librdf_storage* storage, librdf_statement* statement);
 static int librdf_storage_trees_remove_statement_internal(librdf_storage_trees_graph* graph, librdf_statement* statement);
 static int librdf_storage_trees_contains_statement(librdf_storage* storage, librdf_statement* statement);
 static librdf_stream* librdf_storage_trees_serialise(librdf_storage* storage);
 static librdf_stream* librdf_storage_trees_find_statements(librdf_storage* storage, librdf_statement* statement);
+static librdf_stream* librdf_storage_trees_find_statements_in_context(librdf_storage* storage, librdf_statement* statement, librdf_node* context_node);
 
 /* graph functions */
 static librdf_storage_trees_graph* librdf_storage_trees_graph_new(librdf_storage* storage, librdf_node* context);
 static void librdf_storage_trees_graph_free(void* data);
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
 static int librdf_storage_trees_graph_compare(const void* data1, const void* data2);
-#endif
+static int librdf_storage_trees_graph_size(librdf_storage_trees_graph* graph);
+static int librdf_storage_trees_graph_contains(librdf_storage_trees_graph* graph, librdf_statement* statement, const u32* ids);
+static int librdf_storage_trees_graph_add_index(librdf_storage_trees_graph* graph, int order);
+static int librdf_storage_trees_add_index(librdf_storage* storage, int order);
+static librdf_storage_trees_graph* librdf_storage_trees_find_graph(librdf_storage* storage, librdf_node* context_node);
+static librdf_storage_trees_graph* librdf_storage_trees_get_graph(librdf_storage* storage, librdf_node* context_node);
+
+/* node id functions */
+static u32 librdf_storage_trees_get_node_id(librdf_storage_trees_instance* context, librdf_node* node, int add);
+static void librdf_storage_trees_release_node_id(librdf_storage_trees_instance* context, u32 id);
+static int librdf_storage_trees_get_statement_ids(librdf_storage_trees_instance* context, librdf_statement* statement, u32* ids);
+static int librdf_storage_trees_add_statement_ids(librdf_storage_trees_instance* context, librdf_statement* statement, u32* ids);
+static void librdf_storage_trees_release_statement_ids(librdf_storage_trees_instance* context, const u32* ids);
+static void librdf_storage_trees_graph_unload(librdf_storage_trees_graph* graph, u32 (*keys)[3], int count);
+static int librdf_storage_trees_node_id_compare(const void* data1, const void* data2);
+
+/* btree functions */
+static librdf_storage_trees_btree* librdf_storage_trees_btree_new(void);
+static void librdf_storage_trees_btree_free(librdf_storage_trees_btree* btree);
+static int librdf_storage_trees_btree_add(librdf_storage_trees_btree* btree, const u32* key);
+static int librdf_storage_trees_btree_delete(librdf_storage_trees_btree* btree, const u32* key);
+static int librdf_storage_trees_btree_contains(librdf_storage_trees_btree* btree, const u32* key);
+static void librdf_storage_trees_bcursor_init(librdf_storage_trees_bcursor* cursor, librdf_storage_trees_btree* btree, const u32* prefix, int prefix_length);
+static void librdf_storage_trees_bcursor_next(librdf_storage_trees_bcursor* cursor);
+static void librdf_storage_trees_order_key(int order, const u32* ids, u32* key);
+static int librdf_storage_trees_key_compare(const u32* a, const u32* b);
+static int librdf_storage_trees_key_sort_compare(const void* data1, const void* data2);
+static librdf_storage_trees_btree* librdf_storage_trees_btree_build(u32 (*keys)[3], int count);
+static int librdf_storage_trees_btree_load(librdf_storage_trees_btree** btree_p, u32 (*keys)[3], int* count_p, librdf_storage_trees_instance* context);
 
 /* serialising implementing functions */
 static int librdf_storage_trees_serialise_end_of_stream(void* context);
@@ -96,11 +217,18 @@ static void* librdf_storage_trees_serialise_get_statement(void* context, int fla
 static void librdf_storage_trees_serialise_finished(void* context);
 
 /* context functions */
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
 static int librdf_storage_trees_context_add_statement(librdf_storage* storage, librdf_node* context_node, librdf_statement* statement);
+static int librdf_storage_trees_context_add_statements(librdf_storage* storage, librdf_node* context_node, librdf_stream* statement_stream);
 static int librdf_storage_trees_context_remove_statement(librdf_storage* storage, librdf_node* context_node, librdf_statement* statement);
+static int librdf_storage_trees_context_remove_statements(librdf_storage* storage, librdf_node* context_node);
 static librdf_stream* librdf_storage_trees_context_serialise(librdf_storage* storage, librdf_node* context_node);
-#endif
+static librdf_iterator* librdf_storage_trees_get_contexts(librdf_storage* storage);
+
+/* get_contexts implementing functions */
+static int librdf_storage_trees_get_contexts_is_end(void* iterator);
+static int librdf_storage_trees_get_contexts_next_method(void* iterator);
+static void* librdf_storage_trees_get_contexts_get_method(void* iterator, int flags);
+static void librdf_storage_trees_get_contexts_finished(void* iterator);
 
 /* statement tree functions */
 static int librdf_statement_compare_spo(const void* data1, const void* data2);
@@ -109,6 +237,13 @@ static int librdf_statement_compare_ops(const void* data1, const void* data2);
 static int librdf_statement_compare_pso(const void* data1, const void* data2);
 static void librdf_storage_trees_avl_free(void* data);
 
+static const raptor_data_compare_handler librdf_storage_trees_compares[LIBRDF_STORAGE_TREES_ORDERS] = {
+  librdf_statement_compare_spo,
+  librdf_statement_compare_sop,
+  librdf_statement_compare_ops,
+  librdf_statement_compare_pso
+};
+
 
 static void librdf_storage_trees_register_factory(librdf_storage_factory *factory);
 
@@ -122,48 +257,96 @@ librdf_storage_trees_init(librdf_storage* storage, const char *name,
   const int index_sop_option = librdf_hash_get_as_boolean(options, "index-sop") > 0;
   const int index_ops_option = librdf_hash_get_as_boolean(options, "index-ops") > 0;
   const int index_pso_option = librdf_hash_get_as_boolean(options, "index-pso") > 0;
+  char *index_type;
 
   librdf_storage_trees_instance* context;
 
   context = LIBRDF_CALLOC(librdf_storage_trees_instance*, 1, sizeof(*context));
-  if(!context) {
-    if(options)
-      librdf_free_hash(options);
-    return 1;
-  }
+  if(!context)
+    goto failed;
 
   librdf_storage_set_instance(storage, context);
 
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
+  /* Index structure: avltrees of statements (default) or btrees of
+   * node id triples */
+  index_type=options ? librdf_hash_get(options, "index-type") : NULL;
+  if(index_type) {
+    if(!strcmp(index_type, "btree"))
+      context->index_btree=1;
+    else if(strcmp(index_type, "avl")) {
+      librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE,
+                 NULL, "Unknown trees index-type '%s'", index_type);
+      LIBRDF_FREE(char*, index_type);
+      goto failed;
+    }
+    LIBRDF_FREE(char*, index_type);
+  }
+
   /* Support contexts if option given */
   if (librdf_hash_get_as_boolean(options, "contexts") > 0) {
-    context->contexts=librdf_new_avltree(librdf_storage_trees_graph_compare,
-      librdf_storage_trees_graph_free);
+    context->contexts=raptor_new_avltree(librdf_storage_trees_graph_compare,
+                                         librdf_storage_trees_graph_free,
+                                         /* flags */ 0);
+    if(!context->contexts)
+      goto failed;
   } else {
     context->contexts=NULL;
   }
-#endif
+
+  if(context->index_btree) {
+    context->node_ids=raptor_new_avltree(librdf_storage_trees_node_id_compare,
+                                         /* entries are owned by id_nodes */
+                                         NULL, /* flags */ 0);
+    if(!context->node_ids)
+      goto failed;
+  }
+
+  context->index[LIBRDF_STORAGE_TREES_SPO]=1;
 
   /* No indexing options given, index all by default */
   if (!index_spo_option && !index_sop_option && !index_ops_option && !index_pso_option) {
-    context->index_sop=1;
-    context->index_ops=1;
-    context->index_pso=1;
+    context->index[LIBRDF_STORAGE_TREES_SOP]=1;
+    context->index[LIBRDF_STORAGE_TREES_OPS]=1;
+    context->index[LIBRDF_STORAGE_TREES_PSO]=1;
   } else {
     /* spo is always indexed, option just exists so user can
      * specifically /only/ index spo */
-    context->index_sop=index_sop_option;
-    context->index_ops=index_ops_option;
-    context->index_pso=index_pso_option;
+    context->index[LIBRDF_STORAGE_TREES_SOP]=index_sop_option;
+    context->index[LIBRDF_STORAGE_TREES_OPS]=index_ops_option;
+    context->index[LIBRDF_STORAGE_TREES_PSO]=index_pso_option;
   }
-  
+
+  /* Build a missing index after this many full scans for want of it */
+  if(options) {
+    long index_build=librdf_hash_get_as_long(options, "index-build");
+    if(index_build > 0)
+      context->index_build=(int)index_build;
+  }
+
   context->graph = librdf_storage_trees_graph_new(storage, NULL);
-  
+  if(!context->graph)
+    goto failed;
+
   /* no more options, might as well free them now */
   if(options)
     librdf_free_hash(options);
 
   return 0;
+
+  failed:
+  /* nothing has been added yet so freeing the trees frees everything */
+  if(context) {
+    if(context->contexts)
+      raptor_free_avltree(context->contexts);
+    if(context->node_ids)
+      raptor_free_avltree(context->node_ids);
+    LIBRDF_FREE(librdf_storage_trees_instance, context);
+    librdf_storage_set_instance(storage, NULL);
+  }
+  if(options)
+    librdf_free_hash(options);
+
+  return 1;
 }
 
 
@@ -188,24 +371,45 @@ librdf_storage_trees_open(librdf_storage* storage, librdf_model* model)
  * @storage: the storage
  *
  * .
- * 
+ *
  * Close the storage, and free all content since there is no persistance.
- * 
+ *
  * Return value: non 0 on failure
  **/
 static int
 librdf_storage_trees_close(librdf_storage* storage)
 {
   librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
-  
-  librdf_storage_trees_graph_free(context->graph);
-  context->graph=NULL;
-  
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
-  librdf_free_avltree(context->contexts);
-  context->contexts=NULL;
-#endif
-  
+  u32 id;
+
+  /* all the node ids go below so the graphs need not release them */
+  if(context->node_ids) {
+    raptor_free_avltree(context->node_ids);
+    context->node_ids=NULL;
+  }
+
+  if(context->graph) {
+    librdf_storage_trees_graph_free(context->graph);
+    context->graph=NULL;
+  }
+
+  if(context->contexts) {
+    raptor_free_avltree(context->contexts);
+    context->contexts=NULL;
+  }
+
+  if(context->id_nodes) {
+    for(id=1; id <= context->id_nodes_count; id++) {
+      librdf_storage_trees_node_id* node_id=context->id_nodes[id];
+
+      if(node_id->node)
+        librdf_free_node(node_id->node);
+      LIBRDF_FREE(librdf_storage_trees_node_id, node_id);
+    }
+    LIBRDF_FREE(librdf_storage_trees_node_id**, context->id_nodes);
+    context->id_nodes=NULL;
+  }
+
   return 0;
 }
 
@@ -214,41 +418,98 @@ static int
 librdf_storage_trees_size(librdf_storage* storage)
 {
   librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  raptor_avltree_iterator* iterator;
+  int size;
+
+  size=librdf_storage_trees_graph_size(context->graph);
+
+  if(!context->contexts || !raptor_avltree_size(context->contexts))
+    return size;
+
+  iterator=raptor_new_avltree_iterator(context->contexts, NULL, NULL, 1);
+  if(!iterator)
+    return -1;
+
+  for(; !raptor_avltree_iterator_is_end(iterator);
+      raptor_avltree_iterator_next(iterator)) {
+    librdf_storage_trees_graph* graph;
+
+    graph=(librdf_storage_trees_graph*)raptor_avltree_iterator_get(iterator);
+    size += librdf_storage_trees_graph_size(graph);
+  }
+  raptor_free_avltree_iterator(iterator);
 
-  return raptor_avltree_size(context->graph->spo_tree);
+  return size;
 }
 
 
 static int
 librdf_storage_trees_add_statement_internal(librdf_storage* storage,
                                             librdf_storage_trees_graph* graph,
-                                            librdf_statement* statement) 
+                                            librdf_statement* statement)
 {
   librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
   int status = 0;
-  
+  int order;
+
+  if(context->index_btree) {
+    u32 ids[3];
+    u32 key[3];
+
+    if(librdf_storage_trees_add_statement_ids(context, statement, ids))
+      return -1;
+
+    status = librdf_storage_trees_btree_add(graph->btrees[LIBRDF_STORAGE_TREES_SPO], ids);
+    if(status) {
+      /* already exists or failure; either way the ids are not used */
+      librdf_storage_trees_release_statement_ids(context, ids);
+      return (status > 0) ? 0 : status;
+    }
+
+    for(order = LIBRDF_STORAGE_TREES_SPO + 1; order < LIBRDF_STORAGE_TREES_ORDERS; order++) {
+      if(graph->btrees[order]) {
+        librdf_storage_trees_order_key(order, ids, key);
+        if(librdf_storage_trees_btree_add(graph->btrees[order], key) < 0) {
+          /* keep the indexes the same: take it out of them all again */
+          librdf_storage_trees_graph_unload(graph, &ids, 1);
+          return -1;
+        }
+      }
+    }
+
+    return 0;
+  }
+
   /* copy statement (store single copy in all trees) */
   statement = librdf_new_statement_from_statement(statement);
-    
-  /* spo_tree owns statement */
-  status = raptor_avltree_add(graph->spo_tree, statement);
+  if(!statement)
+    return -1;
+
+  /* spo tree owns statement */
+  status = raptor_avltree_add(graph->trees[LIBRDF_STORAGE_TREES_SPO], statement);
   if (status > 0) /* item already exists; old item remains in tree */
     return 0;
   else if (status < 0) /* failure */
     return status;
-    
+
   /* others have null deleters */
-  /* (XXX: corrupt model if insertions fail) */
-
-  if (context->index_sop)
-    raptor_avltree_add(graph->sop_tree, statement);
-    
-  if (context->index_ops)
-    raptor_avltree_add(graph->ops_tree, statement);
-    
-  if (context->index_pso)
-    raptor_avltree_add(graph->pso_tree, statement);
-    
+  for(order = LIBRDF_STORAGE_TREES_SPO + 1; order < LIBRDF_STORAGE_TREES_ORDERS; order++) {
+    if(graph->trees[order] &&
+       raptor_avltree_add(graph->trees[order], statement) < 0)
+      break;
+  }
+
+  if(order < LIBRDF_STORAGE_TREES_ORDERS) {
+    /* keep the indexes the same: take it out of those it went into,
+     * the spo tree last since it frees the statement */
+    while(--order > LIBRDF_STORAGE_TREES_SPO) {
+      if(graph->trees[order])
+        raptor_avltree_delete(graph->trees[order], statement);
+    }
+    raptor_avltree_delete(graph->trees[LIBRDF_STORAGE_TREES_SPO], statement);
+    return -1;
+  }
+
   return status;
 }
 
@@ -260,13 +521,13 @@ librdf_storage_trees_add_statement_internal(librdf_storage* storage,
  * @statement: #librdf_statement statement to add
  *
  * Add a statement (with no context) to the storage.
- * 
+ *
  * Return value: non 0 on failure (negative if error, positive if statement
  * already exists).
  **/
 static int
 librdf_storage_trees_add_statement(librdf_storage* storage,
-                                   librdf_statement* statement) 
+                                   librdf_statement* statement)
 {
   librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
   return librdf_storage_trees_add_statement_internal(storage, context->graph, statement);
@@ -277,39 +538,184 @@ static int
 librdf_storage_trees_add_statements(librdf_storage* storage,
                                     librdf_stream* statement_stream)
 {
-  int status=0;
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  return librdf_storage_trees_add_statements_internal(storage, context->graph,
+                                                      statement_stream);
+}
+
+
+/*
+ * librdf_storage_trees_add_statements_internal:
+ * @storage: #librdf_storage object
+ * @graph: graph to add to
+ * @statement_stream: #librdf_stream of statements
+ *
+ * INTERNAL - Add a stream of statements to a graph
+ *
+ * With btree indexes the whole stream is read into node id keys which
+ * are sorted once per index order and loaded with
+ * librdf_storage_trees_btree_load.  Avltrees cannot be built from
+ * sorted input so the statements are added one at a time.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_trees_add_statements_internal(librdf_storage* storage,
+                                             librdf_storage_trees_graph* graph,
+                                             librdf_stream* statement_stream)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  u32 (*keys)[3] = NULL;
+  u32 (*order_keys)[3] = NULL;
+  int keys_size = 0;
+  int count = 0;
+  int status = 0;
+  int order;
+  int i;
 
   for(; !librdf_stream_end(statement_stream); librdf_stream_next(statement_stream)) {
     librdf_statement* statement=librdf_stream_get_object(statement_stream);
 
-    if (statement) {
-      status=librdf_storage_trees_add_statement(storage, statement);
-      if (status)
+    if(!statement) {
+      status = 1;
+      break;
+    }
+
+    if(!context->index_btree) {
+      status = librdf_storage_trees_add_statement_internal(storage, graph,
+                                                           statement);
+      if(status)
         break;
-    } else {
-      status=1;
+      continue;
+    }
+
+    if(count == keys_size) {
+      u32 (*new_keys)[3];
+      int size = keys_size ? keys_size * 2 : 1024;
+
+      new_keys = LIBRDF_CALLOC(u32(*)[3], size, sizeof(*new_keys));
+      if(!new_keys) {
+        status = -1;
+        break;
+      }
+      if(keys) {
+        memcpy(new_keys, keys, count * sizeof(*keys));
+        LIBRDF_FREE(u32(*)[3], keys);
+      }
+      keys = new_keys;
+      keys_size = size;
+    }
+
+    /* each key holds a use of its node ids until it is added */
+    if(librdf_storage_trees_add_statement_ids(context, statement, keys[count])) {
+      status = -1;
       break;
     }
+    count++;
   }
-  
+
+  if(!count) {
+    if(keys)
+      LIBRDF_FREE(u32(*)[3], keys);
+    return status;
+  }
+
+  qsort(keys, count, sizeof(*keys), librdf_storage_trees_key_sort_compare);
+
+  /* drop duplicates in the stream */
+  for(i = 1, keys_size = 1; i < count; i++) {
+    if(!librdf_storage_trees_key_compare(keys[keys_size - 1], keys[i]))
+      librdf_storage_trees_release_statement_ids(context, keys[i]);
+    else
+      memcpy(keys[keys_size++], keys[i], sizeof(*keys));
+  }
+  count = keys_size;
+
+  if(librdf_storage_trees_btree_load(&graph->btrees[LIBRDF_STORAGE_TREES_SPO],
+                                     keys, &count, context))
+    status = -1;
+
+  /* the keys now in the spo index are new to the others */
+  for(order = LIBRDF_STORAGE_TREES_SPO + 1; order < LIBRDF_STORAGE_TREES_ORDERS; order++) {
+    int order_count = count;
+
+    if(!graph->btrees[order] || !count)
+      continue;
+
+    if(!order_keys) {
+      order_keys = LIBRDF_CALLOC(u32(*)[3], count, sizeof(*order_keys));
+      if(!order_keys)
+        break;
+    }
+
+    for(i = 0; i < count; i++)
+      librdf_storage_trees_order_key(order, keys[i], order_keys[i]);
+    qsort(order_keys, count, sizeof(*order_keys),
+          librdf_storage_trees_key_sort_compare);
+
+    if(librdf_storage_trees_btree_load(&graph->btrees[order], order_keys,
+                                       &order_count, NULL))
+      break;
+  }
+
+  if(order < LIBRDF_STORAGE_TREES_ORDERS) {
+    /* keep the indexes the same: take the keys added to spo out of
+     * every index again */
+    librdf_storage_trees_graph_unload(graph, keys, count);
+    status = -1;
+  }
+
+  if(order_keys)
+    LIBRDF_FREE(u32(*)[3], order_keys);
+  LIBRDF_FREE(u32(*)[3], keys);
+
   return status;
 }
 
+
 static int
 librdf_storage_trees_remove_statement_internal(librdf_storage_trees_graph* graph,
-                                               librdf_statement* statement) 
+                                               librdf_statement* statement)
 {
-  if (graph->sop_tree)
-    raptor_avltree_delete(graph->sop_tree, statement);
+  librdf_storage_trees_instance* context=graph->instance;
+  void* removed;
+  int order;
+
+  if(context->index_btree) {
+    u32 ids[3];
+    u32 key[3];
+    int part;
+
+    if(librdf_storage_trees_get_statement_ids(context, statement, ids))
+      return 1;
+
+    if(!librdf_storage_trees_btree_delete(graph->btrees[LIBRDF_STORAGE_TREES_SPO], ids))
+      return 1;
+
+    for(order = LIBRDF_STORAGE_TREES_SPO + 1; order < LIBRDF_STORAGE_TREES_ORDERS; order++) {
+      if(graph->btrees[order]) {
+        librdf_storage_trees_order_key(order, ids, key);
+        librdf_storage_trees_btree_delete(graph->btrees[order], key);
+      }
+    }
 
-  if (graph->ops_tree)
-    raptor_avltree_delete(graph->ops_tree, statement);
+    for(part = 0; part < 3; part++)
+      librdf_storage_trees_release_node_id(context, ids[part]);
 
-  if (graph->pso_tree)
-    raptor_avltree_delete(graph->pso_tree, statement);
-  
-  raptor_avltree_delete(graph->spo_tree, statement);
-  
+    return 0;
+  }
+
+  for(order = LIBRDF_STORAGE_TREES_SPO + 1; order < LIBRDF_STORAGE_TREES_ORDERS; order++) {
+    if(graph->trees[order])
+      raptor_avltree_delete(graph->trees[order], statement);
+  }
+
+  /* spo tree owns the statements and tells if it was present */
+  removed = raptor_avltree_remove(graph->trees[LIBRDF_STORAGE_TREES_SPO], statement);
+  if(!removed)
+    return 1;
+
+  librdf_storage_trees_avl_free(removed);
   return 0;
 }
 
@@ -321,12 +727,12 @@ librdf_storage_trees_remove_statement_internal(librdf_storage_trees_graph* graph
  * @statement: #librdf_statement statement to remove
  *
  * Remove a statement (without context) from the storage.
- * 
+ *
  * Return value: non 0 on failure
  **/
 static int
-librdf_storage_trees_remove_statement(librdf_storage* storage, 
-                                      librdf_statement* statement) 
+librdf_storage_trees_remove_statement(librdf_storage* storage,
+                                      librdf_statement* statement)
 {
   librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
 
@@ -337,101 +743,275 @@ static int
 librdf_storage_trees_contains_statement(librdf_storage* storage, librdf_statement* statement)
 {
   librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  raptor_avltree_iterator* iterator;
+  u32 ids[3];
+  int found;
+
+  /* a node without an id is in no statement */
+  if(context->index_btree &&
+     librdf_storage_trees_get_statement_ids(context, statement, ids))
+    return 0;
+
+  found=librdf_storage_trees_graph_contains(context->graph, statement, ids);
+  if(found || !context->contexts || !raptor_avltree_size(context->contexts))
+    return found;
+
+  /* a statement in any context is in the storage */
+  iterator=raptor_new_avltree_iterator(context->contexts, NULL, NULL, 1);
+  if(!iterator)
+    return 0;
 
-  return (raptor_avltree_search(context->graph->spo_tree, statement) != NULL);
+  for(; !found && !raptor_avltree_iterator_is_end(iterator);
+      raptor_avltree_iterator_next(iterator)) {
+    librdf_storage_trees_graph* graph;
+
+    graph=(librdf_storage_trees_graph*)raptor_avltree_iterator_get(iterator);
+    found=librdf_storage_trees_graph_contains(graph, statement, ids);
+  }
+  raptor_free_avltree_iterator(iterator);
+
+  return found;
 }
 
 
 typedef struct {
   librdf_storage *storage;
-  raptor_avltree_iterator *avltree_iterator;
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
-  librdf_node *context_node;
-#endif
+  librdf_storage_trees_instance* instance;
+  librdf_statement *range; /* statement to match or NULL for all */
+  int filter; /* range must be checked on each statement of the graph */
+  int end; /* no more statements */
+  raptor_avltree_iterator *graphs_iterator; /* over graphs still to do */
+  librdf_node *context_node; /* of the current graph, shared */
+
+  /* avltree indexes */
+  raptor_avltree_iterator *avltree_iterator; /* over the current graph */
+
+  /* btree indexes */
+  u32 range_ids[3]; /* ids of the range parts or 0 for any */
+  int order; /* of the current btree */
+  librdf_storage_trees_bcursor bcursor;
+  librdf_statement statement; /* nodes are shared with id_nodes */
 } librdf_storage_trees_serialise_stream_context;
 
 
+/* start iterating over the statements of a graph in the range */
+/* index order best suited to finding @range */
+static int
+librdf_storage_trees_range_order(librdf_statement* range)
+{
+  /* ?s ?p ?o and s _ _ use spo */
+  if (!range || range->subject) {
+    /* s ?p o */
+    if (range && !range->predicate && range->object)
+      return LIBRDF_STORAGE_TREES_SOP;
+    return LIBRDF_STORAGE_TREES_SPO;
+  }
+
+  /* ?s _ o */
+  if (range->object)
+    return LIBRDF_STORAGE_TREES_OPS;
+
+  /* ?s p ?o */
+  return LIBRDF_STORAGE_TREES_PSO;
+}
+
+
+static void
+librdf_storage_trees_serialise_start_graph(librdf_storage_trees_serialise_stream_context* scontext,
+                                           librdf_storage_trees_graph* graph)
+{
+  librdf_storage_trees_instance* context=scontext->instance;
+  librdf_statement* range=scontext->range;
+  int order = librdf_storage_trees_range_order(range);
+  int filter = 0;
+
+  /* If filter is set, we're missing the required index.
+   * Iterate over the entire graph (or subject) and check each
+   * statement against the range.
+   * (With a fully indexed store, this will never happen) */
+  if(!(context->index_btree ? (void*)graph->btrees[order] :
+                              (void*)graph->trees[order])) {
+    order = LIBRDF_STORAGE_TREES_SPO;
+    filter = 1;
+  }
+
+  scontext->filter=filter;
+  scontext->context_node=graph->context;
+
+  if(context->index_btree) {
+    u32 prefix[3];
+    int length;
+
+    /* leading range parts in the index order */
+    librdf_storage_trees_order_key(order, scontext->range_ids, prefix);
+    for(length = 0; length < 3 && prefix[length]; length++)
+      ;
+
+    scontext->order=order;
+    librdf_storage_trees_bcursor_init(&scontext->bcursor, graph->btrees[order],
+                                      prefix, length);
+    scontext->end=(scontext->bcursor.leaf == NULL);
+    return;
+  }
+
+  scontext->avltree_iterator=raptor_new_avltree_iterator(graph->trees[order],
+                                                         range,
+                                                         /* range free */ NULL,
+                                                         1);
+  scontext->end=(!scontext->avltree_iterator ||
+                 raptor_avltree_iterator_is_end(scontext->avltree_iterator));
+}
+
+
+/* check the current statement of the current graph is in the range */
+static int
+librdf_storage_trees_serialise_matches(librdf_storage_trees_serialise_stream_context* scontext)
+{
+  if(!scontext->filter)
+    return 1;
+
+  if(scontext->instance->index_btree) {
+    const u32* key=scontext->bcursor.leaf->keys[scontext->bcursor.index];
+    int i;
+
+    for(i = 0; i < 3; i++) {
+      u32 id=scontext->range_ids[librdf_storage_trees_orders[scontext->order][i]];
+      if(id && key[i] != id)
+        return 0;
+    }
+    return 1;
+  }
+
+  return librdf_statement_match((librdf_statement*)raptor_avltree_iterator_get(scontext->avltree_iterator),
+                                scontext->range);
+}
+
+
+/* move to a statement in the range, going on to the next graphs when
+ * one is done; sets end when there are none left
+ */
+static void
+librdf_storage_trees_serialise_skip(librdf_storage_trees_serialise_stream_context* scontext)
+{
+  while(1) {
+    while(!scontext->end) {
+      if(librdf_storage_trees_serialise_matches(scontext))
+        return;
+
+      if(scontext->instance->index_btree) {
+        librdf_storage_trees_bcursor_next(&scontext->bcursor);
+        scontext->end=(scontext->bcursor.leaf == NULL);
+      } else
+        scontext->end=raptor_avltree_iterator_next(scontext->avltree_iterator);
+    }
+
+    if(scontext->avltree_iterator) {
+      raptor_free_avltree_iterator(scontext->avltree_iterator);
+      scontext->avltree_iterator=NULL;
+    }
+
+    if(!scontext->graphs_iterator)
+      return;
+
+    if(raptor_avltree_iterator_is_end(scontext->graphs_iterator)) {
+      raptor_free_avltree_iterator(scontext->graphs_iterator);
+      scontext->graphs_iterator=NULL;
+      return;
+    }
+
+    librdf_storage_trees_serialise_start_graph(scontext,
+      (librdf_storage_trees_graph*)raptor_avltree_iterator_get(scontext->graphs_iterator));
+    raptor_avltree_iterator_next(scontext->graphs_iterator);
+  }
+}
+
+
+/*
+ * librdf_storage_trees_serialise_range:
+ * @storage: the storage
+ * @graph: graph to return statements from
+ * @all_graphs: non 0 to go on to the statements in every context after @graph
+ * @range: statement to match (owned by the stream) or NULL for all
+ *
+ * INTERNAL - Return a stream of statements in the given graphs.
+ *
+ * Return value: a #librdf_stream or NULL on failure
+ */
 static librdf_stream*
-librdf_storage_trees_serialise_range(librdf_storage* storage, librdf_statement* range)
+librdf_storage_trees_serialise_range(librdf_storage* storage,
+                                     librdf_storage_trees_graph* graph,
+                                     int all_graphs,
+                                     librdf_statement* range)
 {
   librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
   librdf_storage_trees_serialise_stream_context* scontext;
   librdf_stream* stream;
-  int filter = 0;
-  
+  int empty = 0;
+
   scontext = LIBRDF_CALLOC(librdf_storage_trees_serialise_stream_context*, 1,
                            sizeof(*scontext));
-  if(!scontext)
+  if(!scontext) {
+    if(range)
+      librdf_free_statement(range);
     return NULL;
-    
-  scontext->avltree_iterator = NULL;
+  }
 
   /* ?s ?p ?o */
-  if (!range || (!range->subject && !range->predicate && !range->object)) {
-    scontext->avltree_iterator = raptor_new_avltree_iterator(context->graph->spo_tree,
-                                                             /* range */ NULL,
-                                                             /* range free */ NULL,
-                                                             1);
-    if (range) {
-      librdf_free_statement(range);
-      range=NULL;
+  if (range && !range->subject && !range->predicate && !range->object) {
+    librdf_free_statement(range);
+    range=NULL;
+  }
+  scontext->range=range;
+  scontext->instance=context;
+
+  /* count scans that must filter spo and build the index they lack
+   * once there have been enough of them; a failed build starts the
+   * count again so it is retried after as many more scans */
+  if(range && context->index_build) {
+    int order=librdf_storage_trees_range_order(range);
+
+    if(!context->index[order] &&
+       ++context->scans[order] >= context->index_build &&
+       librdf_storage_trees_add_index(storage, order))
+      context->scans[order]=0;
+  }
+
+  scontext->storage=storage;
+  librdf_storage_add_reference(scontext->storage);
+
+  if(context->index_btree) {
+    librdf_statement_init(storage->world, &scontext->statement);
+
+    if(range) {
+      librdf_node* parts[3];
+      int part;
+
+      parts[0]=range->subject;
+      parts[1]=range->predicate;
+      parts[2]=range->object;
+      for(part = 0; part < 3; part++) {
+        if(!parts[part])
+          continue;
+        /* no statement can match a node without an id */
+        scontext->range_ids[part]=librdf_storage_trees_get_node_id(context,
+                                                                   parts[part],
+                                                                   0);
+        if(!scontext->range_ids[part])
+          empty = 1;
+      }
     }
-  /* s ?p o */
-  } else if (range->subject && !range->predicate && range->object) {
-    if (context->index_sop)
-      scontext->avltree_iterator = raptor_new_avltree_iterator(context->graph->sop_tree,
-                                                               range, 
-                                                               librdf_storage_trees_avl_free,
-                                                               1);
-	else
-		filter=1;
-  /* s _ _ */
-  } else if (range->subject) {
-    scontext->avltree_iterator = raptor_new_avltree_iterator(context->graph->spo_tree,
-                                                             range,
-                                                             librdf_storage_trees_avl_free,
-                                                             1);
-  /* ?s _ o */
-  } else if (range->object) {
-    if (context->index_ops)
-      scontext->avltree_iterator = raptor_new_avltree_iterator(context->graph->ops_tree,
-                                                               range,
-                                                               librdf_storage_trees_avl_free,
-                                                               1);
-	else
-		filter=1;
-  /* ?s p ?o */
-  } else { /* range->predicate != NULL */
-    if (context->index_pso)
-      scontext->avltree_iterator = raptor_new_avltree_iterator(context->graph->pso_tree,
-                                                               range,
-                                                               librdf_storage_trees_avl_free,
-                                                               1);
-	else
-		filter=1;
-  }
-    
-  /* If filter is set, we're missing the required index.
-   * Iterate over the entire model and filter the stream.
-   * (With a fully indexed store, this will never happen) */
-  if (filter) {
-    scontext->avltree_iterator = raptor_new_avltree_iterator(context->graph->spo_tree,
-                                                     range,
-                                                     librdf_storage_trees_avl_free,
-                                                     1);
   }
 
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
-  scontext->context_node=NULL;
-#endif
+  if(empty)
+    scontext->end=1;
+  else {
+    if(all_graphs && context->contexts)
+      scontext->graphs_iterator=raptor_new_avltree_iterator(context->contexts,
+                                                            NULL, NULL, 1);
 
-  if(!scontext->avltree_iterator) {
-    LIBRDF_FREE(librdf_storage_trees_serialise_stream_context, scontext);
-    return librdf_new_empty_stream(storage->world);
+    librdf_storage_trees_serialise_start_graph(scontext, graph);
+    librdf_storage_trees_serialise_skip(scontext);
   }
-  
-  scontext->storage=storage;
-  librdf_storage_add_reference(scontext->storage);
 
   stream=librdf_new_stream(storage->world,
                            (void*)scontext,
@@ -439,28 +1019,22 @@ librdf_storage_trees_serialise_range(librdf_storage* storage, librdf_statement*
                            &librdf_storage_trees_serialise_next_statement,
                            &librdf_storage_trees_serialise_get_statement,
                            &librdf_storage_trees_serialise_finished);
-  
+
   if(!stream) {
     librdf_storage_trees_serialise_finished((void*)scontext);
     return NULL;
   }
 
-  if(filter) {
-    if(librdf_stream_add_map(stream, &librdf_stream_statement_find_map, NULL, (void*)range)) {
-      /* error - stream_add_map failed */
-      librdf_free_stream(stream);
-      stream=NULL;
-    }
-  }
-  
-  return stream;  
+  return stream;
 }
 
 
 static librdf_stream*
 librdf_storage_trees_serialise(librdf_storage* storage)
 {
-  return librdf_storage_trees_serialise_range(storage, NULL);
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+
+  return librdf_storage_trees_serialise_range(storage, context->graph, 1, NULL);
 }
 
 
@@ -469,7 +1043,7 @@ librdf_storage_trees_serialise_end_of_stream(void* context)
 {
   librdf_storage_trees_serialise_stream_context* scontext=(librdf_storage_trees_serialise_stream_context*)context;
 
-  return raptor_avltree_iterator_is_end(scontext->avltree_iterator);
+  return scontext->end;
 }
 
 static int
@@ -477,26 +1051,50 @@ librdf_storage_trees_serialise_next_statement(void* context)
 {
   librdf_storage_trees_serialise_stream_context* scontext=(librdf_storage_trees_serialise_stream_context*)context;
 
-  return raptor_avltree_iterator_next(scontext->avltree_iterator);
-}
+  if(scontext->end)
+    return 1;
+
+  if(scontext->instance->index_btree) {
+    librdf_storage_trees_bcursor_next(&scontext->bcursor);
+    scontext->end=(scontext->bcursor.leaf == NULL);
+  } else
+    scontext->end=raptor_avltree_iterator_next(scontext->avltree_iterator);
+  librdf_storage_trees_serialise_skip(scontext);
+
+  return scontext->end;
+}
 
 
 static void*
 librdf_storage_trees_serialise_get_statement(void* context, int flags)
 {
   librdf_storage_trees_serialise_stream_context* scontext=(librdf_storage_trees_serialise_stream_context*)context;
+  librdf_storage_trees_instance* instance=scontext->instance;
 
-  if(!scontext->avltree_iterator)
+  if(scontext->end)
     return NULL;
 
   switch(flags) {
     case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+      if(instance->index_btree) {
+        const u32* key=scontext->bcursor.leaf->keys[scontext->bcursor.index];
+        const int* parts=librdf_storage_trees_orders[scontext->order];
+        librdf_node* nodes[3];
+        int i;
+
+        for(i = 0; i < 3; i++)
+          nodes[parts[i]]=instance->id_nodes[key[i]]->node;
+
+        /* nodes are not owned by the statement; it is never cleared */
+        scontext->statement.subject=nodes[0];
+        scontext->statement.predicate=nodes[1];
+        scontext->statement.object=nodes[2];
+        return &scontext->statement;
+      }
       return (librdf_statement*)raptor_avltree_iterator_get(scontext->avltree_iterator);
 
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
     case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
       return scontext->context_node;
-#endif
 
     default:
       return NULL;
@@ -512,14 +1110,99 @@ librdf_storage_trees_serialise_finished(void* context)
   if(scontext->avltree_iterator)
     raptor_free_avltree_iterator(scontext->avltree_iterator);
 
+  if(scontext->graphs_iterator)
+    raptor_free_avltree_iterator(scontext->graphs_iterator);
+
+  if(scontext->range)
+    librdf_free_statement(scontext->range);
+
   if(scontext->storage)
     librdf_storage_remove_reference(scontext->storage);
-  
+
   LIBRDF_FREE(librdf_storage_trees_serialise_stream_context, scontext);
 }
 
 
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
+/* log and return non 0 if the storage was created without contexts */
+static int
+librdf_storage_trees_check_contexts(librdf_storage* storage)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+
+  if(!context->contexts) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
+               "Storage was created without context support");
+    return 1;
+  }
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_trees_find_graph:
+ * @storage: #librdf_storage object
+ * @context_node: #librdf_node context
+ *
+ * INTERNAL - Find the graph holding the statements in a context.
+ *
+ * Return value: shared graph or NULL if the context has no statements
+ */
+static librdf_storage_trees_graph*
+librdf_storage_trees_find_graph(librdf_storage* storage,
+                                librdf_node* context_node)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_graph key;
+
+  if(!context->contexts)
+    return NULL;
+
+  /* only the context is used by librdf_storage_trees_graph_compare */
+  memset(&key, 0, sizeof(key));
+  key.context=context_node;
+
+  return (librdf_storage_trees_graph*)raptor_avltree_search(context->contexts,
+                                                            &key);
+}
+
+
+/*
+ * librdf_storage_trees_get_graph:
+ * @storage: #librdf_storage object
+ * @context_node: context #librdf_node
+ *
+ * INTERNAL - Find the graph of a context, adding it if missing
+ *
+ * Return value: graph or NULL if contexts are disabled or on failure
+ */
+static librdf_storage_trees_graph*
+librdf_storage_trees_get_graph(librdf_storage* storage,
+                               librdf_node* context_node)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_graph* graph;
+
+  if(librdf_storage_trees_check_contexts(storage))
+    return NULL;
+
+  graph=librdf_storage_trees_find_graph(storage, context_node);
+  if(!graph) {
+    graph=librdf_storage_trees_graph_new(storage, context_node);
+    if(!graph)
+      return NULL;
+
+    /* contexts tree owns graph once added */
+    if(raptor_avltree_add(context->contexts, graph)) {
+      librdf_storage_trees_graph_free(graph);
+      return NULL;
+    }
+  }
+
+  return graph;
+}
+
+
 /**
  * librdf_storage_trees_context_add_statement:
  * @storage: #librdf_storage object
@@ -527,31 +1210,64 @@ librdf_storage_trees_serialise_finished(void* context)
  * @statement: #librdf_statement statement to add
  *
  * Add a statement to a storage context.
- * 
+ *
  * Return value: non 0 on failure
  **/
 static int
 librdf_storage_trees_context_add_statement(librdf_storage* storage,
                                            librdf_node* context_node,
-                                           librdf_statement* statement) 
+                                           librdf_statement* statement)
 {
-  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
-  
-  librdf_storage_trees_graph* key=librdf_storage_trees_graph_new(storage, context_node);
-  librdf_storage_trees_graph* graph=(librdf_storage_trees_graph*)
-    raptor_avltree_search(context->contexts, key);
-  
-  if(graph) {
-    librdf_storage_trees_graph_free(key);
-  } else {
-    raptor_avltree_add(context->contexts, key);
-    graph=key;
-  }
-    
+  librdf_storage_trees_graph* graph;
+
+  if(!context_node)
+    return librdf_storage_trees_add_statement(storage, statement);
+
+  graph=librdf_storage_trees_get_graph(storage, context_node);
+  if(!graph)
+    return 1;
+
   return librdf_storage_trees_add_statement_internal(storage, graph, statement);
 }
 
 
+/**
+ * librdf_storage_trees_context_add_statements:
+ * @storage: #librdf_storage object
+ * @context_node: #librdf_node object
+ * @statement_stream: #librdf_stream of statements to add
+ *
+ * Add statements to a storage context.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_trees_context_add_statements(librdf_storage* storage,
+                                            librdf_node* context_node,
+                                            librdf_stream* statement_stream)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_graph* graph;
+  int status;
+
+  if(!context_node)
+    return librdf_storage_trees_add_statements(storage, statement_stream);
+
+  graph=librdf_storage_trees_get_graph(storage, context_node);
+  if(!graph)
+    return 1;
+
+  status=librdf_storage_trees_add_statements_internal(storage, graph,
+                                                      statement_stream);
+
+  /* do not leave a context with nothing in it */
+  if(!librdf_storage_trees_graph_size(graph))
+    raptor_avltree_delete(context->contexts, graph);
+
+  return status;
+}
+
+
 /**
  * librdf_storage_trees_context_remove_statement:
  * @storage: #librdf_storage object
@@ -559,24 +1275,72 @@ librdf_storage_trees_context_add_statement(librdf_storage* storage,
  * @statement: #librdf_statement statement to remove
  *
  * Remove a statement from a storage context.
- * 
+ *
  * Return value: non 0 on failure
  **/
 static int
-librdf_storage_trees_context_remove_statement(librdf_storage* storage, 
+librdf_storage_trees_context_remove_statement(librdf_storage* storage,
                                               librdf_node* context_node,
-                                              librdf_statement* statement) 
+                                              librdf_statement* statement)
 {
   librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
-  librdf_storage_trees_graph* key=librdf_storage_trees_graph_new(storage, context_node);
-  librdf_storage_trees_graph* graph=(librdf_storage_trees_graph*)
-    raptor_avltree_search(context->contexts, &key);
-  librdf_storage_trees_graph_free(key);
-  if (graph) {
-    return librdf_storage_trees_remove_statement_internal(graph, statement);
-  } else {
-    return -1;
+  librdf_storage_trees_graph* graph;
+  int status;
+
+  if(!context_node)
+    return librdf_storage_trees_remove_statement(storage, statement);
+
+  if(librdf_storage_trees_check_contexts(storage))
+    return 1;
+
+  graph=librdf_storage_trees_find_graph(storage, context_node);
+  if(!graph)
+    return 1;
+
+  status=librdf_storage_trees_remove_statement_internal(graph, statement);
+
+  /* forget the context when it has no statements left */
+  if(!librdf_storage_trees_graph_size(graph))
+    raptor_avltree_delete(context->contexts, graph);
+
+  return status;
+}
+
+
+/**
+ * librdf_storage_trees_context_remove_statements:
+ * @storage: #librdf_storage object
+ * @context_node: #librdf_node object
+ *
+ * Remove all statements in a storage context.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_trees_context_remove_statements(librdf_storage* storage,
+                                               librdf_node* context_node)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_graph* graph;
+
+  if(!context_node) {
+    graph=librdf_storage_trees_graph_new(storage, NULL);
+    if(!graph)
+      return 1;
+
+    librdf_storage_trees_graph_free(context->graph);
+    context->graph=graph;
+    return 0;
   }
+
+  if(librdf_storage_trees_check_contexts(storage))
+    return 1;
+
+  graph=librdf_storage_trees_find_graph(storage, context_node);
+  if(graph)
+    raptor_avltree_delete(context->contexts, graph);
+
+  return 0;
 }
 
 
@@ -586,14 +1350,91 @@ librdf_storage_trees_context_remove_statement(librdf_storage* storage,
  * @context_node: #librdf_node object
  *
  * List all statements in a storage context.
- * 
- * Return value: #librdf_stream of statements or NULL on failure or context is empty
+ *
+ * Return value: #librdf_stream of statements or NULL on failure
  **/
 static librdf_stream*
 librdf_storage_trees_context_serialise(librdf_storage* storage,
-                                        librdf_node* context_node) 
+                                        librdf_node* context_node)
 {
-  return NULL;
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_graph* graph;
+
+  if(!context_node)
+    return librdf_storage_trees_serialise_range(storage, context->graph, 0,
+                                                NULL);
+
+  if(librdf_storage_trees_check_contexts(storage))
+    return NULL;
+
+  graph=librdf_storage_trees_find_graph(storage, context_node);
+  if(!graph)
+    return librdf_new_empty_stream(storage->world);
+
+  return librdf_storage_trees_serialise_range(storage, graph, 0, NULL);
+}
+
+
+typedef struct {
+  librdf_storage *storage;
+  raptor_avltree_iterator *avltree_iterator; /* over the contexts tree */
+} librdf_storage_trees_get_contexts_iterator_context;
+
+
+static int
+librdf_storage_trees_get_contexts_is_end(void* iterator)
+{
+  librdf_storage_trees_get_contexts_iterator_context* icontext=(librdf_storage_trees_get_contexts_iterator_context*)iterator;
+
+  return raptor_avltree_iterator_is_end(icontext->avltree_iterator);
+}
+
+
+static int
+librdf_storage_trees_get_contexts_next_method(void* iterator)
+{
+  librdf_storage_trees_get_contexts_iterator_context* icontext=(librdf_storage_trees_get_contexts_iterator_context*)iterator;
+
+  return raptor_avltree_iterator_next(icontext->avltree_iterator);
+}
+
+
+static void*
+librdf_storage_trees_get_contexts_get_method(void* iterator, int flags)
+{
+  librdf_storage_trees_get_contexts_iterator_context* icontext=(librdf_storage_trees_get_contexts_iterator_context*)iterator;
+  librdf_storage_trees_graph* graph;
+
+  switch(flags) {
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+      graph=(librdf_storage_trees_graph*)raptor_avltree_iterator_get(icontext->avltree_iterator);
+      return graph ? graph->context : NULL;
+
+    case LIBRDF_ITERATOR_GET_METHOD_GET_KEY:
+    case LIBRDF_ITERATOR_GET_METHOD_GET_VALUE:
+      return NULL;
+
+    default:
+      librdf_log(icontext->storage->world,
+                 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "Unknown iterator method flag %d", flags);
+      return NULL;
+  }
+}
+
+
+static void
+librdf_storage_trees_get_contexts_finished(void* iterator)
+{
+  librdf_storage_trees_get_contexts_iterator_context* icontext=(librdf_storage_trees_get_contexts_iterator_context*)iterator;
+
+  if(icontext->avltree_iterator)
+    raptor_free_avltree_iterator(icontext->avltree_iterator);
+
+  if(icontext->storage)
+    librdf_storage_remove_reference(icontext->storage);
+
+  LIBRDF_FREE(librdf_storage_trees_get_contexts_iterator_context, icontext);
 }
 
 
@@ -602,15 +1443,47 @@ librdf_storage_trees_context_serialise(librdf_storage* storage,
  * @storage: #librdf_storage object
  *
  * List all context nodes in a storage.
- * 
- * Return value: #librdf_iterator of context_nodes or NULL on failure or no contexts
+ *
+ * Return value: #librdf_iterator of context_nodes or NULL on failure
  **/
 static librdf_iterator*
-librdf_storage_trees_get_contexts(librdf_storage* storage) 
+librdf_storage_trees_get_contexts(librdf_storage* storage)
 {
-  return NULL;
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_get_contexts_iterator_context* icontext;
+  librdf_iterator* iterator;
+
+  if(librdf_storage_trees_check_contexts(storage))
+    return NULL;
+
+  if(!raptor_avltree_size(context->contexts))
+    return librdf_new_empty_iterator(storage->world);
+
+  icontext = LIBRDF_CALLOC(librdf_storage_trees_get_contexts_iterator_context*,
+                           1, sizeof(*icontext));
+  if(!icontext)
+    return NULL;
+
+  icontext->avltree_iterator=raptor_new_avltree_iterator(context->contexts,
+                                                         NULL, NULL, 1);
+  if(!icontext->avltree_iterator) {
+    librdf_storage_trees_get_contexts_finished(icontext);
+    return NULL;
+  }
+
+  icontext->storage=storage;
+  librdf_storage_add_reference(icontext->storage);
+
+  iterator=librdf_new_iterator(storage->world,
+                               (void*)icontext,
+                               &librdf_storage_trees_get_contexts_is_end,
+                               &librdf_storage_trees_get_contexts_next_method,
+                               &librdf_storage_trees_get_contexts_get_method,
+                               &librdf_storage_trees_get_contexts_finished);
+  if(!iterator)
+    librdf_storage_trees_get_contexts_finished(icontext);
+  return iterator;
 }
-#endif
 
 
 /**
@@ -619,26 +1492,67 @@ librdf_storage_trees_get_contexts(librdf_storage* storage)
  * @statement: the statement to match
  *
  * .
- * 
+ *
  * Return a stream of statements matching the given statement (or
- * all statements if NULL).  Parts (subject, predicate, object) of the
- * statement can be empty in which case any statement part will match that.
+ * all statements if NULL) in every context.  Parts (subject, predicate,
+ * object) of the statement can be empty in which case any statement part
+ * will match that.
  * Uses #librdf_statement_match to do the matching.
- * 
+ *
  * Return value: a #librdf_stream or NULL on failure
  **/
 static librdf_stream*
 librdf_storage_trees_find_statements(librdf_storage* storage, librdf_statement* statement)
 {
-  librdf_stream* stream;
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_statement* range=NULL;
+
+  if(statement) {
+    range=librdf_new_statement_from_statement(statement);
+    if(!range)
+      return NULL;
+  }
+
+  return librdf_storage_trees_serialise_range(storage, context->graph, 1,
+                                              range);
+}
+
+
+/**
+ * librdf_storage_trees_find_statements_in_context:
+ * @storage: the storage
+ * @statement: the statement to match
+ * @context_node: the context to search or NULL for all statements
+ *
+ * Find a graph of statements in a storage context with a pattern.
+ *
+ * Return value: a #librdf_stream or NULL on failure
+ **/
+static librdf_stream*
+librdf_storage_trees_find_statements_in_context(librdf_storage* storage,
+                                                librdf_statement* statement,
+                                                librdf_node* context_node)
+{
+  librdf_storage_trees_graph* graph;
+  librdf_statement* range=NULL;
+
+  if(!context_node)
+    return librdf_storage_trees_find_statements(storage, statement);
 
-  librdf_statement* range=librdf_new_statement_from_statement(statement);
-  if(!range)
+  if(librdf_storage_trees_check_contexts(storage))
     return NULL;
 
-  stream=librdf_storage_trees_serialise_range(storage, range);
+  graph=librdf_storage_trees_find_graph(storage, context_node);
+  if(!graph)
+    return librdf_new_empty_stream(storage->world);
 
-  return stream;
+  if(statement) {
+    range=librdf_new_statement_from_statement(statement);
+    if(!range)
+      return NULL;
+  }
+
+  return librdf_storage_trees_serialise_range(storage, graph, 0, range);
 }
 
 /* statement tree functions */
@@ -856,6 +1770,7 @@ librdf_storage_trees_avl_free(void* data)
 }
 
 
+
 /* graph functions */
 
 static librdf_storage_trees_graph*
@@ -863,98 +1778,1102 @@ librdf_storage_trees_graph_new(librdf_storage* storage, librdf_node* context_nod
 {
   librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
   librdf_storage_trees_graph* graph;
+  int order;
 
-  graph = LIBRDF_MALLOC(librdf_storage_trees_graph*, sizeof(*graph));
-  
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
+  graph = LIBRDF_CALLOC(librdf_storage_trees_graph*, 1, sizeof(*graph));
+  if(!graph)
+    return NULL;
+
+  graph->instance=context;
   graph->context=(context_node ? librdf_new_node_from_node(context_node) : NULL);
-#endif
 
-  /* Always create SPO index */
-  graph->spo_tree = raptor_new_avltree(librdf_statement_compare_spo,
-                                       librdf_storage_trees_avl_free,
-                                       /* flags */ 0);
-  if(!graph->spo_tree) {
-    LIBRDF_FREE(librdf_storage_trees_graph, graph);
-    return NULL;
+  /* SPO index is always created */
+  for(order = 0; order < LIBRDF_STORAGE_TREES_ORDERS; order++) {
+    if(!context->index[order])
+      continue;
+
+    if(context->index_btree) {
+      graph->btrees[order] = librdf_storage_trees_btree_new();
+      if(!graph->btrees[order])
+        break;
+    } else {
+      /* spo tree owns the statements */
+      graph->trees[order] = raptor_new_avltree(librdf_storage_trees_compares[order],
+                                               (order == LIBRDF_STORAGE_TREES_SPO) ?
+                                               librdf_storage_trees_avl_free : NULL,
+                                               /* flags */ 0);
+      if(!graph->trees[order])
+        break;
+    }
   }
-  
-  if(context->index_sop)
-    graph->sop_tree = raptor_new_avltree(librdf_statement_compare_sop, NULL,
-                                         /* flags */ 0);
-  else
-    graph->sop_tree=NULL;
 
-  if(context->index_ops)
-    graph->ops_tree = raptor_new_avltree(librdf_statement_compare_ops, NULL,
-                                         /* flags */ 0);
-  else
-    graph->ops_tree=NULL;
-  
-  if(context->index_pso)
-    graph->pso_tree = raptor_new_avltree(librdf_statement_compare_pso, NULL,
-                                         /* flags */ 0);
-  else
-    graph->pso_tree=NULL;
+  if(order < LIBRDF_STORAGE_TREES_ORDERS) {
+    librdf_storage_trees_graph_free(graph);
+    return NULL;
+  }
 
   return graph;
 }
 
 
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
+/*
+ * librdf_storage_trees_graph_add_index:
+ * @graph: graph
+ * @order: index order
+ *
+ * INTERNAL - Build a missing index of a graph from its spo index
+ *
+ * Return value: non 0 on failure
+ */
 static int
-librdf_storage_trees_graph_compare(const void* data1, const void* data2)
+librdf_storage_trees_graph_add_index(librdf_storage_trees_graph* graph,
+                                     int order)
 {
-  librdf_storage_trees_graph* a = (librdf_storage_trees_graph*)data1;
-  librdf_storage_trees_graph* b = (librdf_storage_trees_graph*)data2;
-  return librdf_storage_trees_node_compare(a->context, b->context);
-}
-#endif
+  raptor_avltree* tree;
+  raptor_avltree_iterator* iterator;
 
+  if(graph->instance->index_btree) {
+    librdf_storage_trees_btree* spo = graph->btrees[LIBRDF_STORAGE_TREES_SPO];
+    librdf_storage_trees_bcursor cursor;
+    u32 (*keys)[3];
+    int count = 0;
+
+    if(graph->btrees[order])
+      return 0;
+
+    keys = LIBRDF_CALLOC(u32(*)[3], spo->size + 1, sizeof(*keys));
+    if(!keys)
+      return 1;
+
+    for(librdf_storage_trees_bcursor_init(&cursor, spo, NULL, 0);
+        cursor.leaf;
+        librdf_storage_trees_bcursor_next(&cursor))
+      librdf_storage_trees_order_key(order, cursor.leaf->keys[cursor.index],
+                                     keys[count++]);
+    qsort(keys, count, sizeof(*keys), librdf_storage_trees_key_sort_compare);
+
+    graph->btrees[order] = librdf_storage_trees_btree_build(keys, count);
+    LIBRDF_FREE(u32(*)[3], keys);
+
+    return (graph->btrees[order] == NULL);
+  }
+
+  if(graph->trees[order])
+    return 0;
+
+  /* statements are owned by the spo tree */
+  tree = raptor_new_avltree(librdf_storage_trees_compares[order], NULL,
+                            /* flags */ 0);
+  if(!tree)
+    return 1;
+
+  iterator = raptor_new_avltree_iterator(graph->trees[LIBRDF_STORAGE_TREES_SPO],
+                                         NULL, NULL, 1);
+  if(iterator) {
+    do {
+      void* statement = raptor_avltree_iterator_get(iterator);
+
+      if(statement && raptor_avltree_add(tree, statement) < 0) {
+        raptor_free_avltree_iterator(iterator);
+        raptor_free_avltree(tree);
+        return 1;
+      }
+    } while(!raptor_avltree_iterator_next(iterator));
+    raptor_free_avltree_iterator(iterator);
+  }
+
+  graph->trees[order] = tree;
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_trees_add_index:
+ * @storage: #librdf_storage object
+ * @order: index order
+ *
+ * INTERNAL - Build a missing index of every graph
+ *
+ * Graphs added later get the index too.  On failure the graphs that
+ * did get it keep it and are used as usual.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_trees_add_index(librdf_storage* storage, int order)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  raptor_avltree_iterator* iterator;
+  int status;
+
+  status=librdf_storage_trees_graph_add_index(context->graph, order);
+
+  if(!status && context->contexts) {
+    iterator=raptor_new_avltree_iterator(context->contexts, NULL, NULL, 1);
+    if(iterator) {
+      do {
+        librdf_storage_trees_graph* graph;
+
+        graph=(librdf_storage_trees_graph*)raptor_avltree_iterator_get(iterator);
+        if(graph)
+          status=librdf_storage_trees_graph_add_index(graph, order);
+      } while(!status && !raptor_avltree_iterator_next(iterator));
+      raptor_free_avltree_iterator(iterator);
+    }
+  }
+
+  if(status) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
+               "Failed to build trees index %s",
+               librdf_storage_trees_order_names[order]);
+    return status;
+  }
+
+  context->index[order]=1;
+
+  return 0;
+}
+
+
+static int
+librdf_storage_trees_graph_compare(const void* data1, const void* data2)
+{
+  librdf_storage_trees_graph* a = (librdf_storage_trees_graph*)data1;
+  librdf_storage_trees_graph* b = (librdf_storage_trees_graph*)data2;
+  return librdf_storage_trees_node_compare(a->context, b->context);
+}
+
+
+static void
+librdf_storage_trees_graph_free(void* data)
+{
+  librdf_storage_trees_graph* graph = (librdf_storage_trees_graph*)data;
+  librdf_storage_trees_instance* context = graph->instance;
+  int order;
 
-static void
-librdf_storage_trees_graph_free(void* data)
-{
-  librdf_storage_trees_graph* graph = (librdf_storage_trees_graph*)data;
-  
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
   librdf_free_node(graph->context);
-#endif
-  
-  /* Extra index trees have null deleters (statements are shared) */
-  if (graph->sop_tree)
-    raptor_free_avltree(graph->sop_tree);
-  if (graph->ops_tree)
-    raptor_free_avltree(graph->ops_tree);
-  if (graph->pso_tree)
-    raptor_free_avltree(graph->pso_tree);
-
-  /* Free spo tree and statements */
-  raptor_free_avltree(graph->spo_tree);
-
-  graph->spo_tree = NULL;
-  graph->sop_tree = NULL;
-  graph->ops_tree = NULL;
-  graph->pso_tree = NULL;
+
+  /* the nodes of the statements are no longer used by this graph;
+   * not needed when all the ids are being freed by close */
+  if(graph->btrees[LIBRDF_STORAGE_TREES_SPO] && context->node_ids) {
+    librdf_storage_trees_bcursor cursor;
+
+    librdf_storage_trees_bcursor_init(&cursor,
+                                      graph->btrees[LIBRDF_STORAGE_TREES_SPO],
+                                      NULL, 0);
+    for(; cursor.leaf; librdf_storage_trees_bcursor_next(&cursor)) {
+      const u32* key = cursor.leaf->keys[cursor.index];
+
+      librdf_storage_trees_release_node_id(context, key[0]);
+      librdf_storage_trees_release_node_id(context, key[1]);
+      librdf_storage_trees_release_node_id(context, key[2]);
+    }
+  }
+
+  /* Extra index trees have null deleters (statements are shared) so
+   * free the spo tree and statements last */
+  for(order = LIBRDF_STORAGE_TREES_ORDERS - 1; order >= 0; order--) {
+    if(graph->trees[order])
+      raptor_free_avltree(graph->trees[order]);
+    if(graph->btrees[order])
+      librdf_storage_trees_btree_free(graph->btrees[order]);
+  }
 
   LIBRDF_FREE(librdf_storage_trees_graph, graph);
 }
 
 
+static int
+librdf_storage_trees_graph_size(librdf_storage_trees_graph* graph)
+{
+  if(graph->btrees[LIBRDF_STORAGE_TREES_SPO])
+    return graph->btrees[LIBRDF_STORAGE_TREES_SPO]->size;
+
+  return raptor_avltree_size(graph->trees[LIBRDF_STORAGE_TREES_SPO]);
+}
+
+
+/* @ids are those of @statement with btree indexes */
+static int
+librdf_storage_trees_graph_contains(librdf_storage_trees_graph* graph,
+                                    librdf_statement* statement,
+                                    const u32* ids)
+{
+  if(graph->btrees[LIBRDF_STORAGE_TREES_SPO])
+    return librdf_storage_trees_btree_contains(graph->btrees[LIBRDF_STORAGE_TREES_SPO],
+                                               ids);
+
+  return (raptor_avltree_search(graph->trees[LIBRDF_STORAGE_TREES_SPO],
+                                statement) != NULL);
+}
+
+
+/* node id functions */
+
+static int
+librdf_storage_trees_node_id_compare(const void* data1, const void* data2)
+{
+  librdf_storage_trees_node_id* a = (librdf_storage_trees_node_id*)data1;
+  librdf_storage_trees_node_id* b = (librdf_storage_trees_node_id*)data2;
+  return librdf_storage_trees_node_compare(a->node, b->node);
+}
+
+
+/*
+ * librdf_storage_trees_get_node_id:
+ * @context: storage instance
+ * @node: node
+ * @add: non 0 to give the node an id if it has none and count a use of it
+ *
+ * INTERNAL - Get the id of a node in the btree indexes.
+ *
+ * Each use added must be released with librdf_storage_trees_release_node_id.
+ *
+ * Return value: id or 0 if the node has no id or on failure
+ */
+static u32
+librdf_storage_trees_get_node_id(librdf_storage_trees_instance* context,
+                                 librdf_node* node, int add)
+{
+  librdf_storage_trees_node_id key;
+  librdf_storage_trees_node_id* node_id;
+  u32 id;
+
+  key.node = node;
+  node_id = (librdf_storage_trees_node_id*)raptor_avltree_search(context->node_ids,
+                                                                 &key);
+  if(node_id) {
+    if(add)
+      node_id->usage++;
+    return node_id->id;
+  }
+
+  if(!add)
+    return 0;
+
+  if(context->free_id) {
+    id = context->free_id;
+    node_id = context->id_nodes[id];
+    context->free_id = node_id->next_free;
+  } else {
+    if(context->id_nodes_count + 1 >= context->id_nodes_size) {
+      librdf_storage_trees_node_id** id_nodes;
+      u32 size = context->id_nodes_size ? context->id_nodes_size * 2 : 1024;
+
+      if(size <= context->id_nodes_size)
+        return 0;
+
+      id_nodes = LIBRDF_CALLOC(librdf_storage_trees_node_id**, size,
+                               sizeof(*id_nodes));
+      if(!id_nodes)
+        return 0;
+      if(context->id_nodes) {
+        memcpy(id_nodes, context->id_nodes,
+               context->id_nodes_size * sizeof(*id_nodes));
+        LIBRDF_FREE(librdf_storage_trees_node_id**, context->id_nodes);
+      }
+      context->id_nodes = id_nodes;
+      context->id_nodes_size = size;
+    }
+
+    node_id = LIBRDF_CALLOC(librdf_storage_trees_node_id*, 1, sizeof(*node_id));
+    if(!node_id)
+      return 0;
+
+    id = ++context->id_nodes_count;
+    node_id->id = id;
+    context->id_nodes[id] = node_id;
+  }
+
+  node_id->usage = 1;
+  node_id->node = librdf_new_node_from_node(node);
+  if(!node_id->node || raptor_avltree_add(context->node_ids, node_id)) {
+    if(node_id->node) {
+      librdf_free_node(node_id->node);
+      node_id->node = NULL;
+    }
+    node_id->next_free = context->free_id;
+    context->free_id = id;
+    return 0;
+  }
+
+  return id;
+}
+
+
+static void
+librdf_storage_trees_release_node_id(librdf_storage_trees_instance* context,
+                                     u32 id)
+{
+  librdf_storage_trees_node_id* node_id = context->id_nodes[id];
+
+  if(--node_id->usage)
+    return;
+
+  raptor_avltree_delete(context->node_ids, node_id);
+  librdf_free_node(node_id->node);
+  node_id->node = NULL;
+
+  node_id->next_free = context->free_id;
+  context->free_id = id;
+}
+
+
+/* Get the ids of the parts of a complete statement in spo order.
+ * Returns non 0 if a part is missing or has no id */
+static int
+librdf_storage_trees_get_statement_ids(librdf_storage_trees_instance* context,
+                                       librdf_statement* statement, u32* ids)
+{
+  if(!statement->subject || !statement->predicate || !statement->object)
+    return 1;
+
+  ids[0] = librdf_storage_trees_get_node_id(context, statement->subject, 0);
+  ids[1] = librdf_storage_trees_get_node_id(context, statement->predicate, 0);
+  ids[2] = librdf_storage_trees_get_node_id(context, statement->object, 0);
+
+  return (!ids[0] || !ids[1] || !ids[2]);
+}
+
+
+/* Get the ids of the parts of a complete statement in spo order,
+ * giving ids to new nodes and counting a use of each.
+ * Returns non 0 if a part is missing or on failure */
+static int
+librdf_storage_trees_add_statement_ids(librdf_storage_trees_instance* context,
+                                       librdf_statement* statement, u32* ids)
+{
+  int part;
+
+  if(!statement->subject || !statement->predicate || !statement->object)
+    return 1;
+
+  for(part = 0; part < 3; part++) {
+    ids[part] = librdf_storage_trees_get_node_id(context,
+      (part == 0) ? statement->subject :
+      ((part == 1) ? statement->predicate : statement->object), 1);
+    if(!ids[part]) {
+      while(part--)
+        librdf_storage_trees_release_node_id(context, ids[part]);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+/* release the uses of spo @ids from librdf_storage_trees_add_statement_ids */
+static void
+librdf_storage_trees_release_statement_ids(librdf_storage_trees_instance* context,
+                                           const u32* ids)
+{
+  librdf_storage_trees_release_node_id(context, ids[0]);
+  librdf_storage_trees_release_node_id(context, ids[1]);
+  librdf_storage_trees_release_node_id(context, ids[2]);
+}
+
+
+/*
+ * librdf_storage_trees_graph_unload:
+ * @graph: graph with btree indexes
+ * @keys: spo keys just added to the spo index of @graph
+ * @count: number of @keys
+ *
+ * INTERNAL - Undo adding statements whose other indexes failed
+ *
+ * The keys are deleted from every index of the graph, whichever they
+ * had been added to, and their node id uses released.
+ */
+static void
+librdf_storage_trees_graph_unload(librdf_storage_trees_graph* graph,
+                                  u32 (*keys)[3], int count)
+{
+  u32 key[3];
+  int order;
+  int i;
+
+  for(i = 0; i < count; i++) {
+    for(order = 0; order < LIBRDF_STORAGE_TREES_ORDERS; order++) {
+      if(graph->btrees[order]) {
+        librdf_storage_trees_order_key(order, keys[i], key);
+        librdf_storage_trees_btree_delete(graph->btrees[order], key);
+      }
+    }
+    librdf_storage_trees_release_statement_ids(graph->instance, keys[i]);
+  }
+}
+
+
+/* reorder spo @ids into a key of the index @order */
+static void
+librdf_storage_trees_order_key(int order, const u32* ids, u32* key)
+{
+  key[0] = ids[librdf_storage_trees_orders[order][0]];
+  key[1] = ids[librdf_storage_trees_orders[order][1]];
+  key[2] = ids[librdf_storage_trees_orders[order][2]];
+}
+
+
+/* btree functions */
+
+static int
+librdf_storage_trees_key_compare(const u32* a, const u32* b)
+{
+  int i;
+
+  for(i = 0; i < 3; i++) {
+    if(a[i] != b[i])
+      return (a[i] < b[i]) ? -1 : 1;
+  }
+
+  return 0;
+}
+
+
+/* qsort comparison of keys */
+static int
+librdf_storage_trees_key_sort_compare(const void* data1, const void* data2)
+{
+  return librdf_storage_trees_key_compare((const u32*)data1,
+                                          (const u32*)data2);
+}
+
+
+/* first position in a leaf with a key not less than @key */
+static int
+librdf_storage_trees_leaf_search(librdf_storage_trees_leaf* leaf,
+                                 const u32* key)
+{
+  int low = 0;
+  int high = leaf->header.count;
+
+  while(low < high) {
+    int middle = (low + high) / 2;
+
+    if(librdf_storage_trees_key_compare(leaf->keys[middle], key) < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  return low;
+}
+
+
+/* child of a branch where @key belongs */
+static int
+librdf_storage_trees_branch_search(librdf_storage_trees_branch* branch,
+                                   const u32* key)
+{
+  int low = 0;
+  int high = branch->header.count - 1;
+
+  while(low < high) {
+    int middle = (low + high) / 2;
+
+    if(librdf_storage_trees_key_compare(branch->keys[middle], key) <= 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  return low;
+}
+
+
+static librdf_storage_trees_btree*
+librdf_storage_trees_btree_new(void)
+{
+  librdf_storage_trees_btree* btree;
+  librdf_storage_trees_leaf* leaf;
+
+  btree = LIBRDF_CALLOC(librdf_storage_trees_btree*, 1, sizeof(*btree));
+  if(!btree)
+    return NULL;
+
+  leaf = LIBRDF_CALLOC(librdf_storage_trees_leaf*, 1, sizeof(*leaf));
+  if(!leaf) {
+    LIBRDF_FREE(librdf_storage_trees_btree, btree);
+    return NULL;
+  }
+  leaf->header.is_leaf = 1;
+  btree->root = &leaf->header;
+
+  return btree;
+}
+
+
+/* free a btree node and those under it except @keep */
+static void
+librdf_storage_trees_bnode_free(librdf_storage_trees_bnode* node,
+                                librdf_storage_trees_bnode* keep)
+{
+  if(node == keep)
+    return;
+
+  if(!node->is_leaf) {
+    librdf_storage_trees_branch* branch = (librdf_storage_trees_branch*)node;
+    int i;
+
+    for(i = 0; i < node->count; i++)
+      librdf_storage_trees_bnode_free(branch->children[i], keep);
+    LIBRDF_FREE(librdf_storage_trees_branch, branch);
+  } else
+    LIBRDF_FREE(librdf_storage_trees_leaf, node);
+}
+
+
+static void
+librdf_storage_trees_btree_free(librdf_storage_trees_btree* btree)
+{
+  librdf_storage_trees_bnode_free(btree->root, NULL);
+  LIBRDF_FREE(librdf_storage_trees_btree, btree);
+}
+
+
+/* Find the leaf where @key belongs, recording the branches on the way
+ * in @path and the child taken from each in @slots. */
+static librdf_storage_trees_leaf*
+librdf_storage_trees_btree_find_leaf(librdf_storage_trees_btree* btree,
+                                     const u32* key,
+                                     librdf_storage_trees_branch** path,
+                                     int* slots, int* depth_p)
+{
+  librdf_storage_trees_bnode* node = btree->root;
+  int depth = 0;
+
+  while(!node->is_leaf) {
+    librdf_storage_trees_branch* branch = (librdf_storage_trees_branch*)node;
+    int slot = librdf_storage_trees_branch_search(branch, key);
+
+    if(path) {
+      path[depth] = branch;
+      slots[depth] = slot;
+    }
+    depth++;
+    node = branch->children[slot];
+  }
+
+  if(depth_p)
+    *depth_p = depth;
+
+  return (librdf_storage_trees_leaf*)node;
+}
+
+
+static void
+librdf_storage_trees_leaf_insert(librdf_storage_trees_leaf* leaf,
+                                 int position, const u32* key)
+{
+  memmove(leaf->keys[position + 1], leaf->keys[position],
+          (leaf->header.count - position) * sizeof(leaf->keys[0]));
+  memcpy(leaf->keys[position], key, sizeof(leaf->keys[0]));
+  leaf->header.count++;
+}
+
+
+/*
+ * librdf_storage_trees_btree_add:
+ * @btree: btree
+ * @key: key to add
+ *
+ * INTERNAL - Add a key to a btree
+ *
+ * Return value: 0 if added, >0 if already present, <0 on failure
+ */
+static int
+librdf_storage_trees_btree_add(librdf_storage_trees_btree* btree,
+                               const u32* key)
+{
+  librdf_storage_trees_branch* path[LIBRDF_STORAGE_TREES_BTREE_MAX_DEPTH];
+  int slots[LIBRDF_STORAGE_TREES_BTREE_MAX_DEPTH];
+  librdf_storage_trees_bnode* spares[LIBRDF_STORAGE_TREES_BTREE_MAX_DEPTH + 2];
+  librdf_storage_trees_leaf* leaf;
+  librdf_storage_trees_leaf* right;
+  librdf_storage_trees_branch* branch;
+  librdf_storage_trees_bnode* child;
+  u32 separator[3];
+  int depth;
+  int position;
+  int needed;
+  int used;
+  int i;
+
+  /* the depth grows by one each time the keys increase 64 fold so
+   * LIBRDF_STORAGE_TREES_BTREE_MAX_DEPTH is never reached */
+  leaf = librdf_storage_trees_btree_find_leaf(btree, key, path, slots, &depth);
+
+  position = librdf_storage_trees_leaf_search(leaf, key);
+  if(position < leaf->header.count &&
+     !librdf_storage_trees_key_compare(leaf->keys[position], key))
+    return 1;
+
+  if(leaf->header.count < LIBRDF_STORAGE_TREES_LEAF_KEYS) {
+    librdf_storage_trees_leaf_insert(leaf, position, key);
+    btree->size++;
+    return 0;
+  }
+
+  /* Allocate every node the splits need before changing the tree: the
+   * new leaf, one branch per full parent and maybe a new root */
+  needed = 1;
+  for(i = depth - 1;
+      i >= 0 && path[i]->header.count == LIBRDF_STORAGE_TREES_BRANCH_KEYS + 1;
+      i--)
+    needed++;
+  if(i < 0)
+    needed++;
+
+  for(used = 0; used < needed; used++) {
+    if(!used)
+      spares[used] = (librdf_storage_trees_bnode*)LIBRDF_CALLOC(librdf_storage_trees_leaf*, 1, sizeof(librdf_storage_trees_leaf));
+    else
+      spares[used] = (librdf_storage_trees_bnode*)LIBRDF_CALLOC(librdf_storage_trees_branch*, 1, sizeof(librdf_storage_trees_branch));
+    if(!spares[used]) {
+      while(used--)
+        LIBRDF_FREE(librdf_storage_trees_bnode, spares[used]);
+      return -1;
+    }
+  }
+
+  /* split the leaf, moving the upper half to a new leaf */
+  right = (librdf_storage_trees_leaf*)spares[0];
+  right->header.is_leaf = 1;
+  right->header.count = LIBRDF_STORAGE_TREES_LEAF_KEYS / 2;
+  leaf->header.count -= right->header.count;
+  memcpy(right->keys, leaf->keys[leaf->header.count],
+         right->header.count * sizeof(leaf->keys[0]));
+  right->next = leaf->next;
+  leaf->next = right;
+
+  if(position > leaf->header.count)
+    librdf_storage_trees_leaf_insert(right, position - leaf->header.count, key);
+  else
+    librdf_storage_trees_leaf_insert(leaf, position, key);
+  btree->size++;
+
+  memcpy(separator, right->keys[0], sizeof(separator));
+  child = &right->header;
+  used = 1;
+
+  /* add the new node to each parent, splitting full ones */
+  while(depth > 0) {
+    u32 keys[LIBRDF_STORAGE_TREES_BRANCH_KEYS + 1][3];
+    librdf_storage_trees_bnode* children[LIBRDF_STORAGE_TREES_BRANCH_KEYS + 2];
+    librdf_storage_trees_branch* new_branch;
+    int slot;
+    int count;
+    int left;
+
+    depth--;
+    branch = path[depth];
+    slot = slots[depth];
+    count = branch->header.count;
+
+    if(count < LIBRDF_STORAGE_TREES_BRANCH_KEYS + 1) {
+      memmove(branch->keys[slot + 1], branch->keys[slot],
+              (count - 1 - slot) * sizeof(branch->keys[0]));
+      memcpy(branch->keys[slot], separator, sizeof(separator));
+      memmove(&branch->children[slot + 2], &branch->children[slot + 1],
+              (count - 1 - slot) * sizeof(branch->children[0]));
+      branch->children[slot + 1] = child;
+      branch->header.count++;
+      return 0;
+    }
+
+    /* all count + 1 children in order, then split them in half */
+    memcpy(keys, branch->keys, slot * sizeof(keys[0]));
+    memcpy(keys[slot], separator, sizeof(separator));
+    memcpy(keys[slot + 1], branch->keys[slot],
+           (count - 1 - slot) * sizeof(keys[0]));
+    memcpy(children, branch->children, (slot + 1) * sizeof(children[0]));
+    children[slot + 1] = child;
+    memcpy(&children[slot + 2], &branch->children[slot + 1],
+           (count - 1 - slot) * sizeof(children[0]));
+
+    left = (count + 1) / 2;
+    new_branch = (librdf_storage_trees_branch*)spares[used++];
+    new_branch->header.count = count + 1 - left;
+    memcpy(new_branch->keys, keys[left], (count - left) * sizeof(keys[0]));
+    memcpy(new_branch->children, &children[left],
+           new_branch->header.count * sizeof(children[0]));
+
+    branch->header.count = left;
+    memcpy(branch->keys, keys, (left - 1) * sizeof(keys[0]));
+    memcpy(branch->children, children, left * sizeof(children[0]));
+
+    memcpy(separator, keys[left - 1], sizeof(separator));
+    child = &new_branch->header;
+  }
+
+  /* the root was split */
+  branch = (librdf_storage_trees_branch*)spares[used];
+  branch->header.count = 2;
+  branch->children[0] = btree->root;
+  branch->children[1] = child;
+  memcpy(branch->keys[0], separator, sizeof(separator));
+  btree->root = &branch->header;
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_trees_btree_delete:
+ * @btree: btree
+ * @key: key to delete
+ *
+ * INTERNAL - Delete a key from a btree
+ *
+ * Return value: non 0 if the key was deleted
+ */
+static int
+librdf_storage_trees_btree_delete(librdf_storage_trees_btree* btree,
+                                  const u32* key)
+{
+  librdf_storage_trees_leaf* leaf;
+  int position;
+
+  leaf = librdf_storage_trees_btree_find_leaf(btree, key, NULL, NULL, NULL);
+
+  position = librdf_storage_trees_leaf_search(leaf, key);
+  if(position == leaf->header.count ||
+     librdf_storage_trees_key_compare(leaf->keys[position], key))
+    return 0;
+
+  leaf->header.count--;
+  memmove(leaf->keys[position], leaf->keys[position + 1],
+          (leaf->header.count - position) * sizeof(leaf->keys[0]));
+  btree->size--;
+
+  /* empty leaves are only given back when the tree is empty */
+  if(!btree->size && !btree->root->is_leaf) {
+    librdf_storage_trees_bnode_free(btree->root, &leaf->header);
+    leaf->next = NULL;
+    btree->root = &leaf->header;
+  }
+
+  return 1;
+}
+
+
+static int
+librdf_storage_trees_btree_contains(librdf_storage_trees_btree* btree,
+                                    const u32* key)
+{
+  librdf_storage_trees_leaf* leaf;
+  int position;
+
+  leaf = librdf_storage_trees_btree_find_leaf(btree, key, NULL, NULL, NULL);
+  position = librdf_storage_trees_leaf_search(leaf, key);
+
+  return (position < leaf->header.count &&
+          !librdf_storage_trees_key_compare(leaf->keys[position], key));
+}
+
+
+/* move a cursor off the end of a leaf and check it is in the prefix */
+static void
+librdf_storage_trees_bcursor_check(librdf_storage_trees_bcursor* cursor)
+{
+  int i;
+
+  while(cursor->leaf && cursor->index >= cursor->leaf->header.count) {
+    cursor->leaf = cursor->leaf->next;
+    cursor->index = 0;
+  }
+
+  if(!cursor->leaf)
+    return;
+
+  for(i = 0; i < cursor->prefix_length; i++) {
+    if(cursor->leaf->keys[cursor->index][i] != cursor->prefix[i]) {
+      cursor->leaf = NULL;
+      return;
+    }
+  }
+}
+
+
+/*
+ * librdf_storage_trees_bcursor_init:
+ * @cursor: cursor
+ * @btree: btree
+ * @prefix: leading parts of the keys to return or NULL
+ * @prefix_length: number of parts in @prefix
+ *
+ * INTERNAL - Start a cursor at the first key of a btree with a prefix
+ */
+static void
+librdf_storage_trees_bcursor_init(librdf_storage_trees_bcursor* cursor,
+                                  librdf_storage_trees_btree* btree,
+                                  const u32* prefix, int prefix_length)
+{
+  u32 key[3] = { 0, 0, 0 };
+  int i;
+
+  for(i = 0; i < prefix_length; i++)
+    key[i] = prefix[i];
+  memcpy(cursor->prefix, key, sizeof(key));
+  cursor->prefix_length = prefix_length;
+
+  cursor->leaf = librdf_storage_trees_btree_find_leaf(btree, key,
+                                                      NULL, NULL, NULL);
+  cursor->index = librdf_storage_trees_leaf_search(cursor->leaf, key);
+  librdf_storage_trees_bcursor_check(cursor);
+}
+
+
+static void
+librdf_storage_trees_bcursor_next(librdf_storage_trees_bcursor* cursor)
+{
+  cursor->index++;
+  librdf_storage_trees_bcursor_check(cursor);
+}
+
+
+/*
+ * librdf_storage_trees_btree_build:
+ * @keys: sorted keys with no duplicates
+ * @count: number of @keys
+ *
+ * INTERNAL - Build a btree from sorted keys
+ *
+ * The leaves are filled in order and each level of branches is built
+ * over the one below, so no node is ever split.
+ *
+ * Return value: new btree or NULL on failure
+ */
+static librdf_storage_trees_btree*
+librdf_storage_trees_btree_build(u32 (*keys)[3], int count)
+{
+  librdf_storage_trees_btree* btree;
+  librdf_storage_trees_bnode** nodes; /* nodes of the level being built */
+  u32 (*first_keys)[3]; /* smallest key under each node */
+  librdf_storage_trees_leaf* previous = NULL;
+  int size = count / LIBRDF_STORAGE_TREES_LEAF_FILL + 1;
+  int nodes_count = 0;
+  int parents = 0;
+  int start = 0;
+  int i;
+
+  nodes = LIBRDF_CALLOC(librdf_storage_trees_bnode**, size, sizeof(*nodes));
+  first_keys = LIBRDF_CALLOC(u32(*)[3], size, sizeof(*first_keys));
+  btree = librdf_storage_trees_btree_new();
+  if(!nodes || !first_keys || !btree) {
+    if(btree)
+      librdf_storage_trees_btree_free(btree);
+    btree = NULL;
+    goto tidy;
+  }
+
+  /* the empty root leaf becomes the first leaf */
+  for(i = 0; i < count; i += LIBRDF_STORAGE_TREES_LEAF_FILL) {
+    librdf_storage_trees_leaf* leaf;
+    int n = count - i;
+
+    if(n > LIBRDF_STORAGE_TREES_LEAF_FILL)
+      n = LIBRDF_STORAGE_TREES_LEAF_FILL;
+
+    if(!previous)
+      leaf = (librdf_storage_trees_leaf*)btree->root;
+    else {
+      leaf = LIBRDF_CALLOC(librdf_storage_trees_leaf*, 1, sizeof(*leaf));
+      if(!leaf)
+        goto failed;
+      leaf->header.is_leaf = 1;
+      previous->next = leaf;
+    }
+
+    memcpy(leaf->keys, keys[i], n * sizeof(*keys));
+    leaf->header.count = n;
+    memcpy(first_keys[nodes_count], keys[i], sizeof(*keys));
+    nodes[nodes_count++] = &leaf->header;
+    previous = leaf;
+  }
+
+  /* parents replace their children at the front of nodes */
+  while(nodes_count > 1) {
+    for(parents = 0, start = 0; start < nodes_count; parents++) {
+      librdf_storage_trees_branch* branch;
+      int n = nodes_count - start;
+
+      if(n > LIBRDF_STORAGE_TREES_BRANCH_FILL)
+        n = LIBRDF_STORAGE_TREES_BRANCH_FILL;
+
+      branch = LIBRDF_CALLOC(librdf_storage_trees_branch*, 1, sizeof(*branch));
+      if(!branch)
+        goto failed;
+
+      for(i = 0; i < n; i++) {
+        branch->children[i] = nodes[start + i];
+        if(i)
+          memcpy(branch->keys[i - 1], first_keys[start + i], sizeof(*keys));
+      }
+      branch->header.count = n;
+
+      memmove(first_keys[parents], first_keys[start], sizeof(*keys));
+      nodes[parents] = &branch->header;
+      start += n;
+    }
+    nodes_count = parents;
+    parents = 0;
+    start = 0;
+  }
+
+  if(nodes_count)
+    btree->root = nodes[0];
+  btree->size = count;
+  goto tidy;
+
+  failed:
+  /* the new parents and the children not yet under one */
+  for(i = 0; i < parents; i++)
+    librdf_storage_trees_bnode_free(nodes[i], NULL);
+  for(i = start; i < nodes_count; i++)
+    librdf_storage_trees_bnode_free(nodes[i], NULL);
+  LIBRDF_FREE(librdf_storage_trees_btree, btree);
+  btree = NULL;
+
+  tidy:
+  if(nodes)
+    LIBRDF_FREE(librdf_storage_trees_bnode**, nodes);
+  if(first_keys)
+    LIBRDF_FREE(u32(*)[3], first_keys);
+
+  return btree;
+}
+
+
+/*
+ * librdf_storage_trees_btree_load:
+ * @btree_p: pointer to btree
+ * @keys: sorted keys with no duplicates
+ * @count_p: pointer to number of @keys
+ * @context: instance to release the node ids of keys not added or NULL
+ *
+ * INTERNAL - Add sorted keys to a btree
+ *
+ * When there are at least as many keys as the btree holds, it is
+ * rebuilt from a merge of both with librdf_storage_trees_btree_build,
+ * otherwise the keys are inserted in order.  Keys that were not added
+ * are removed from @keys and *@count_p is set to the number remaining.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_trees_btree_load(librdf_storage_trees_btree** btree_p,
+                                u32 (*keys)[3], int* count_p,
+                                librdf_storage_trees_instance* context)
+{
+  librdf_storage_trees_btree* btree = *btree_p;
+  int count = *count_p;
+  int added = 0;
+  int i;
+
+  if(count >= btree->size) {
+    librdf_storage_trees_btree* new_btree;
+    librdf_storage_trees_bcursor cursor;
+    u32 (*merged)[3];
+    int merged_count = 0;
+
+    merged = LIBRDF_CALLOC(u32(*)[3], btree->size + count + 1, sizeof(*merged));
+    if(!merged)
+      goto failed;
+
+    librdf_storage_trees_bcursor_init(&cursor, btree, NULL, 0);
+    i = 0;
+    while(cursor.leaf || i < count) {
+      int compare;
+
+      if(!cursor.leaf)
+        compare = 1;
+      else if(i == count)
+        compare = -1;
+      else
+        compare = librdf_storage_trees_key_compare(cursor.leaf->keys[cursor.index],
+                                                   keys[i]);
+
+      if(compare <= 0) {
+        memcpy(merged[merged_count++], cursor.leaf->keys[cursor.index],
+               sizeof(*keys));
+        librdf_storage_trees_bcursor_next(&cursor);
+        if(compare)
+          continue;
+
+        /* already present */
+        if(context)
+          librdf_storage_trees_release_statement_ids(context, keys[i]);
+      } else {
+        memcpy(merged[merged_count++], keys[i], sizeof(*keys));
+        memmove(keys[added++], keys[i], sizeof(*keys));
+      }
+      i++;
+    }
+
+    new_btree = librdf_storage_trees_btree_build(merged, merged_count);
+    LIBRDF_FREE(u32(*)[3], merged);
+    if(!new_btree) {
+      count = added;
+      added = 0;
+      goto failed;
+    }
+
+    librdf_storage_trees_btree_free(btree);
+    *btree_p = new_btree;
+    *count_p = added;
+    return 0;
+  }
+
+  for(i = 0; i < count; i++) {
+    int status = librdf_storage_trees_btree_add(btree, keys[i]);
+
+    if(status < 0)
+      break;
+
+    if(status > 0) {
+      if(context)
+        librdf_storage_trees_release_statement_ids(context, keys[i]);
+    } else
+      memmove(keys[added++], keys[i], sizeof(*keys));
+  }
+
+  if(i == count) {
+    *count_p = added;
+    return 0;
+  }
+
+  /* keys from i onwards were not added */
+  memmove(keys[added], keys[i], (count - i) * sizeof(*keys));
+  count = added + count - i;
+
+  failed:
+  /* keys from added onwards were not added */
+  if(context) {
+    for(i = added; i < count; i++)
+      librdf_storage_trees_release_statement_ids(context, keys[i]);
+  }
+  *count_p = added;
+
+  return 1;
+}
+
+
 /**
  * librdf_storage_trees_get_feature:
  * @storage: #librdf_storage object
  * @feature: #librdf_uri feature property
  *
  * Get the value of a storage feature.
- * 
+ *
  * Return value: #librdf_node feature value or NULL if no such feature
  * exists or the value is empty.
  **/
 static librdf_node*
 librdf_storage_trees_get_feature(librdf_storage* storage, librdf_uri* feature)
 {
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
   librdf_storage_trees_instance* scontext=(librdf_storage_trees_instance*)storage->instance;
   unsigned char *uri_string;
 
@@ -972,7 +2891,23 @@ librdf_storage_trees_get_feature(librdf_storage* storage, librdf_uri* feature)
     return librdf_new_node_from_typed_literal(storage->world, 
                                               value, NULL, NULL);
   }
-#endif
+
+  if(!strcmp((const char*)uri_string, LIBRDF_STORAGE_TREES_FEATURE_INDEXES)) {
+    char value[16];
+    int order;
+
+    value[0]='\0';
+    for(order = 0; order < LIBRDF_STORAGE_TREES_ORDERS; order++) {
+      if(!scontext->index[order])
+        continue;
+      if(value[0])
+        strcat(value, " ");
+      strcat(value, librdf_storage_trees_order_names[order]);
+    }
+    return librdf_new_node_from_typed_literal(storage->world,
+                                              (const unsigned char*)value,
+                                              NULL, NULL);
+  }
 
   return NULL;
 }
@@ -1008,17 +2943,14 @@ librdf_storage_trees_register_factory(librdf_storage_factory *factory)
   factory->find_arcs                = NULL;
   factory->find_targets             = NULL;
 
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
+  factory->find_statements_in_context = librdf_storage_trees_find_statements_in_context;
+
   factory->context_add_statement    = librdf_storage_trees_context_add_statement;
+  factory->context_add_statements   = librdf_storage_trees_context_add_statements;
   factory->context_remove_statement = librdf_storage_trees_context_remove_statement;
+  factory->context_remove_statements = librdf_storage_trees_context_remove_statements;
   factory->context_serialise        = librdf_storage_trees_context_serialise;
   factory->get_contexts             = librdf_storage_trees_get_contexts;
-#else
-  factory->context_add_statement    = NULL;
-  factory->context_remove_statement = NULL;
-  factory->context_serialise        = NULL;
-  factory->get_contexts             = NULL;
-#endif
 
   factory->sync                     = NULL;
   factory->get_feature              = librdf_storage_trees_get_feature;
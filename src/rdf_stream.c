@@ -402,6 +402,7 @@ typedef struct {
   librdf_iterator *iterator;
   librdf_statement *current; /* shared statement */
   librdf_statement_part field;
+  librdf_node *node; /* reference to the node in current */
 } librdf_stream_from_node_iterator_stream_context;
 
 
@@ -490,10 +491,17 @@ librdf_stream_from_node_iterator_get_statement(void* context, int flags)
       if(!(node=(librdf_node*)librdf_iterator_get_object(scontext->iterator)))
         return NULL;
 
-      /* The node object above is shared, no need to free it before
-       * assigning to the statement, which is also shared, and
-       * return to the user.
+      /* The statement is shared with the user who may copy it, so it
+       * holds its own reference to the node rather than one that the
+       * iterator may only have borrowed.
        */
+      node=librdf_new_node_from_node(node);
+      if(!node)
+        return NULL;
+      if(scontext->node)
+        librdf_free_node(scontext->node);
+      scontext->node=node;
+
       switch(scontext->field) {
         case LIBRDF_STATEMENT_SUBJECT:
           librdf_statement_set_subject(scontext->current, node);
@@ -557,6 +565,9 @@ librdf_stream_from_node_iterator_finished(void* context)
     librdf_free_statement(scontext->current);
   }
 
+  if(scontext->node)
+    librdf_free_node(scontext->node);
+
   LIBRDF_FREE(librdf_stream_from_node_iterator_stream_context, scontext);
 }
 
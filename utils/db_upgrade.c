@@ -47,9 +47,17 @@ main(int argc, char *argv[])
   char *name;
   char *new_name;
   int count;
+  int node_encoding=1;
+  char new_options[128];
 
-  if(argc < 2 || argc >3) {
-    fprintf(stderr, "USAGE: %s: <Redland BDB name> [new DB name]\n", program);
+  if(argc > 2 && !strcmp(argv[1], "-e")) {
+    node_encoding=atoi(argv[2]);
+    argv+=2;
+    argc-=2;
+  }
+
+  if(argc < 2 || argc >3 || (node_encoding != 1 && node_encoding != 2)) {
+    fprintf(stderr, "USAGE: %s: [-e 1|2] <Redland BDB name> [new DB name]\n", program);
     return(1);
   }
 
@@ -66,7 +74,8 @@ main(int argc, char *argv[])
     new_name=argv[2];
   }
   
-  fprintf(stderr, "%s: Upgrading DB '%s' to '%s'\n", program, name, new_name);
+  fprintf(stderr, "%s: Upgrading DB '%s' to '%s' with node encoding %d\n",
+          program, name, new_name, node_encoding);
 
   world=librdf_new_world();
   librdf_world_open(world);
@@ -78,9 +87,11 @@ main(int argc, char *argv[])
     return(1);
   }
 
-  new_storage=librdf_new_storage(world, "hashes", new_name,
-                                 "hash-type='bdb',dir='.',write='yes',new='yes'");
-  if(!storage) {
+  sprintf(new_options,
+          "hash-type='bdb',dir='.',write='yes',new='yes',node-encoding='%d'",
+          node_encoding);
+  new_storage=librdf_new_storage(world, "hashes", new_name, new_options);
+  if(!new_storage) {
     fprintf(stderr, "%s: Failed to create new storage '%s'\n", program, new_name);
     return(1);
   }